@@ -16,12 +16,39 @@
 //
 
 
+///
+/// Lower *cost to newCost, if that is lower, as one atomic operation, and return
+/// the cost it replaced.  Costs are never negative, and non-negative floats
+/// order the same way as their bit patterns read as ints, so the integer
+/// atomic_min gives the float minimum directly, without a compare-and-swap loop.
+///
+float atomicMinCost(volatile __global float *cost, float newCost)
+{
+    return as_float(atomic_min((volatile __global int *) cost, as_int(newCost)));
+}
+
+///
+/// Read *cost atomically, as an atomic_min that leaves it unchanged.  A plain load
+/// in the launch that lowers the cost may return a stale value cached by another
+/// work-group, while an atomic returns the latest one.
+///
+float atomicReadCost(volatile __global float *cost)
+{
+    return as_float(atomic_min((volatile __global int *) cost, INT_MAX));
+}
+
 ///
 /// This is part 1 of the Kernel from Algorithm 4 in the paper
 ///
+/// Each active work-item also adds the number of edges it relaxes to
+/// relaxationCount, so that the host can report the work done per query.
+/// updatingCostArray is lowered with atomicMinCost(): when several work-items
+/// lower the same vertex at once, a plain read-compare-write could leave the
+/// higher of their costs, losing the other for good.
+///
 __kernel  void OCL_SSSP_KERNEL1(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
                                __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
-                               int vertexCount, int edgeCount )
+                               int vertexCount, int edgeCount, __global uint *relaxationCount )
 {
     // access thread id
     int tid = get_global_id(0);
@@ -40,6 +67,7 @@ __kernel  void OCL_SSSP_KERNEL1(__global int *vertexArray, __global int *edgeArr
         {
             edgeEnd = edgeCount;
         }
+        atomic_add(relaxationCount, (uint) (edgeEnd - edgeStart));
 
         for(int edge = edgeStart; edge < edgeEnd; edge++)
         {
@@ -49,9 +77,10 @@ __kernel  void OCL_SSSP_KERNEL1(__global int *vertexArray, __global int *edgeArr
             //  found that the correct thing to do was weightArray[edge].  I think
             //  this was a typo in the paper.  Either that, or I misunderstood
             //  the data structure.
-            if (updatingCostArray[nid] > (costArray[tid] + weightArray[edge]))
+            float cost = costArray[tid] + weightArray[edge];
+            if (updatingCostArray[nid] > cost)
             {
-                updatingCostArray[nid] = (costArray[tid] + weightArray[edge]);
+                atomicMinCost(&updatingCostArray[nid], cost);
             }
         }
     }
@@ -60,9 +89,13 @@ __kernel  void OCL_SSSP_KERNEL1(__global int *vertexArray, __global int *edgeArr
 ///
 /// This is part 2 of the Kernel from Algorithm 5 in the paper.
 ///
+/// Any work-item that lowers a cost stamps lastChangeIteration with the number of
+/// this iteration.  Every writer stores the same value, so no atomics are needed,
+/// and the host can tell whether the mask is empty by reading this one int.
+///
 __kernel  void OCL_SSSP_KERNEL2(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
                                 __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
-                                int vertexCount)
+                                int vertexCount, __global int *lastChangeIteration, int iteration)
 {
     // access thread id
     int tid = get_global_id(0);
@@ -72,17 +105,146 @@ __kernel  void OCL_SSSP_KERNEL2(__global int *vertexArray, __global int *edgeArr
     {
         costArray[tid] = updatingCostArray[tid];
         maskArray[tid] = 1;
+        *lastChangeIteration = iteration;
     }
 
     updatingCostArray[tid] = costArray[tid];
 }
 
 
+///
+/// KERNEL1 and KERNEL2 fused into one kernel per iteration.  Because
+/// atomicMinCost() loses no update, work-items can lower costArray directly,
+/// and there is no need for updatingCostArray or for a second pass to commit it.
+/// A vertex whose cost drops is masked again: it is relaxed later in the same
+/// iteration if its work-item has not run yet, or in the next one otherwise.
+/// Convergence is flagged through lastChangeIteration as in KERNEL2.
+///
+__kernel  void OCL_SSSP_FUSED(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                              __global int *maskArray, __global float *costArray, int vertexCount, int edgeCount,
+                              __global int *lastChangeIteration, int iteration, __global uint *relaxationCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if ( maskArray[tid] != 0 )
+    {
+        // Unmask before reading the cost, so that any later drop masks it again
+        atomic_xchg(&maskArray[tid], 0);
+        float vertexCost = atomicReadCost(&costArray[tid]);
+
+        int edgeStart = vertexArray[tid];
+        int edgeEnd;
+        if (tid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[tid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+        atomic_add(relaxationCount, (uint) (edgeEnd - edgeStart));
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            float cost = vertexCost + weightArray[edge];
+
+            if (costArray[nid] > cost && atomicMinCost(&costArray[nid], cost) > cost)
+            {
+                atomic_xchg(&maskArray[nid], 1);
+                *lastChangeIteration = iteration;
+            }
+        }
+    }
+}
+
+///
+/// Batched variant of OCL_SSSP_FUSED: several sources at once on a 2D range, of
+/// vertices by active batch slots.  Each slot holds one source's mask and costs,
+/// source-major, at slot * vertexCount in maskArray and costArray.  activeSlots
+/// lists the slots still converging, so dimension 1 covers only those, and each
+/// slot stamps its own entry of lastChangeIteration so that it converges
+/// independently of the others.
+///
+__kernel  void OCL_SSSP_BATCH_FUSED(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                    __global int *maskArray, __global float *costArray, int vertexCount, int edgeCount,
+                                    __global int *activeSlots, __global int *lastChangeIteration, int iteration,
+                                    __global uint *relaxationCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+    int slot = activeSlots[get_global_id(1)];
+    int base = slot * vertexCount;
+
+    if ( tid < vertexCount && maskArray[base + tid] != 0 )
+    {
+        // Unmask before reading the cost, so that any later drop masks it again
+        atomic_xchg(&maskArray[base + tid], 0);
+        float vertexCost = atomicReadCost(&costArray[base + tid]);
+
+        int edgeStart = vertexArray[tid];
+        int edgeEnd;
+        if (tid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[tid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+        atomic_add(relaxationCount, (uint) (edgeEnd - edgeStart));
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = base + edgeArray[edge];
+            float cost = vertexCost + weightArray[edge];
+
+            if (costArray[nid] > cost && atomicMinCost(&costArray[nid], cost) > cost)
+            {
+                atomic_xchg(&maskArray[nid], 1);
+                lastChangeIteration[slot] = iteration;
+            }
+        }
+    }
+}
+
+///
+/// Start newSlots[n] over from sourceVertices[n], on a 2D range of vertices by
+/// new slots.  A slot's stamp is set to the current iteration, so that it counts
+/// as changed until an iteration after it finds nothing to relax.
+///
+__kernel void initializeBatchSlots( __global int *maskArray, __global float *costArray, int vertexCount,
+                                    __global int *newSlots, __global int *sourceVertices,
+                                    __global int *lastChangeIteration, int iteration )
+{
+    // access thread id
+    int tid = get_global_id(0);
+    int slot = newSlots[get_global_id(1)];
+    int base = slot * vertexCount;
+
+    if (tid < vertexCount)
+    {
+        if (sourceVertices[get_global_id(1)] == tid)
+        {
+            maskArray[base + tid] = 1;
+            costArray[base + tid] = 0.0;
+            lastChangeIteration[slot] = iteration;
+        }
+        else
+        {
+            maskArray[base + tid] = 0;
+            costArray[base + tid] = FLT_MAX;
+        }
+    }
+}
+
 ///
 /// Kernel to initialize buffers
 ///
 __kernel void initializeBuffers( __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
-                                 int sourceVertex, int vertexCount )
+                                 int sourceVertex, int vertexCount, __global int *lastChangeIteration,
+                                 __global uint *relaxationCount )
 {
     // access thread id
     int tid = get_global_id(0);
@@ -93,6 +255,8 @@ __kernel void initializeBuffers( __global int *maskArray, __global float *costAr
         maskArray[tid] = 1;
         costArray[tid] = 0.0;
         updatingCostArray[tid] = 0.0;
+        *lastChangeIteration = 0;
+        *relaxationCount = 0;
     }
     else
     {
@@ -103,3 +267,332 @@ __kernel void initializeBuffers( __global int *maskArray, __global float *costAr
 
 }
 
+///
+/// Frontier (worklist) variant.  Instead of one work-item per vertex, each
+/// iteration runs one work-item per vertex in a compacted frontier queue:
+///
+///   1. OCL_SSSP_FRONTIER_RELAX relaxes the edges of each frontier vertex.  A
+///      neighbour whose cost it lowers is claimed for the next frontier through
+///      maskArray, so that each vertex is queued at most once.  The claimed
+///      neighbour is noted in claimedArray at the edge's index, and the number
+///      claimed in claimCountArray.
+///   2. scanBlocks and addBlockOffsets turn the claim counts into offsets (an
+///      exclusive prefix sum), and give the size of the next frontier.
+///   3. OCL_SSSP_FRONTIER_COMPACT writes the claimed vertices at those offsets.
+///   4. OCL_SSSP_FRONTIER_UPDATE moves the lowered costs of the next frontier's
+///      vertices from updatingCostArray into costArray, and releases their claims.
+///
+/// So an iteration costs time in proportion to the frontier and its edges,
+/// rather than to the whole graph.
+///
+__kernel void OCL_SSSP_FRONTIER_RELAX(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                      __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
+                                      int vertexCount, int edgeCount, __global int *frontier, int frontierCount,
+                                      __global int *claimedArray, __global int *claimCountArray,
+                                      __global uint *relaxationCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < frontierCount)
+    {
+        int vid = frontier[tid];
+        int claimed = 0;
+
+        int edgeStart = vertexArray[vid];
+        int edgeEnd;
+        if (vid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[vid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+        atomic_add(relaxationCount, (uint) (edgeEnd - edgeStart));
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            int claim = -1;
+
+            float cost = costArray[vid] + weightArray[edge];
+            if (updatingCostArray[nid] > cost && atomicMinCost(&updatingCostArray[nid], cost) > cost)
+            {
+                // The first work-item to lower a vertex's cost in this iteration queues it.
+                if (atomic_xchg(&maskArray[nid], 1) == 0)
+                {
+                    claim = nid;
+                    claimed++;
+                }
+            }
+            claimedArray[edge] = claim;
+        }
+        claimCountArray[tid] = claimed;
+    }
+}
+
+__kernel void OCL_SSSP_FRONTIER_COMPACT(__global int *vertexArray, int vertexCount, int edgeCount,
+                                        __global int *frontier, int frontierCount, __global int *claimedArray,
+                                        __global int *claimOffsetArray, __global int *nextFrontier)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < frontierCount)
+    {
+        int vid = frontier[tid];
+        int out = claimOffsetArray[tid];
+
+        int edgeStart = vertexArray[vid];
+        int edgeEnd;
+        if (vid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[vid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            if (claimedArray[edge] >= 0)
+            {
+                nextFrontier[out++] = claimedArray[edge];
+            }
+        }
+    }
+}
+
+__kernel void OCL_SSSP_FRONTIER_UPDATE(__global int *maskArray, __global float *costArray, __global float *updatingCostArray,
+                                       __global int *frontier, int frontierCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < frontierCount)
+    {
+        int vid = frontier[tid];
+        costArray[vid] = updatingCostArray[vid];
+        maskArray[vid] = 0;
+    }
+}
+
+///
+/// Delta-stepping variant.  Vertices are taken in buckets of cost delta wide,
+/// lowest bucket first, so that a vertex is rarely relaxed before its cost is
+/// close to final.  It uses the frontier kernels' claims, prefix scan and
+/// OCL_SSSP_FRONTIER_UPDATE, with two queues:
+///
+///   - the near queue holds the claimed vertices of the current bucket, those
+///     whose cost is below bucketEnd, and is relaxed until it empties;
+///   - the far pile holds every other claimed vertex.  A vertex stays claimed
+///     while it waits there, so it is never in the pile twice, and lowering its
+///     cost again only updates updatingCostArray.
+///
+/// Each relax pass counts its near claims in the first frontierCount elements
+/// of claimCountArray and its far claims in the next frontierCount, so that one
+/// scan of both gives the offsets for both queues, and the number of near
+/// claims is the offset at frontierCount.  When the near queue is empty, the
+/// host moves bucketEnd past farMinCost, the lowest cost seen entering the far
+/// pile, and OCL_SSSP_DELTA_SPLIT_COUNT and OCL_SSSP_DELTA_SPLIT move the far
+/// vertices now below it into the near queue.
+///
+/// farMinCost holds the bits of a float, lowered with atomic_min for the same
+/// reason as in atomicMinCost().
+///
+__kernel void OCL_SSSP_DELTA_RELAX(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                   __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
+                                   int vertexCount, int edgeCount, __global int *frontier, int frontierCount,
+                                   float bucketEnd, __global int *claimedArray, __global int *claimCountArray,
+                                   __global int *farMinCost, __global uint *relaxationCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < frontierCount)
+    {
+        int vid = frontier[tid];
+        int nearClaimed = 0;
+        int farClaimed = 0;
+
+        int edgeStart = vertexArray[vid];
+        int edgeEnd;
+        if (vid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[vid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+        atomic_add(relaxationCount, (uint) (edgeEnd - edgeStart));
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            float cost = costArray[vid] + weightArray[edge];
+            int claim = -1;
+
+            if (updatingCostArray[nid] > cost && atomicMinCost(&updatingCostArray[nid], cost) > cost)
+            {
+                // Near claims are noted as the vertex, far claims as -2 - vertex.
+                if (atomic_xchg(&maskArray[nid], 1) == 0)
+                {
+                    if (cost < bucketEnd)
+                    {
+                        claim = nid;
+                        nearClaimed++;
+                    }
+                    else
+                    {
+                        claim = -2 - nid;
+                        farClaimed++;
+                        atomic_min(farMinCost, as_int(cost));
+                    }
+                }
+            }
+            claimedArray[edge] = claim;
+        }
+        claimCountArray[tid] = nearClaimed;
+        claimCountArray[frontierCount + tid] = farClaimed;
+    }
+}
+
+__kernel void OCL_SSSP_DELTA_COMPACT(__global int *vertexArray, int vertexCount, int edgeCount,
+                                     __global int *frontier, int frontierCount, __global int *claimedArray,
+                                     __global int *claimOffsetArray, __global int *nextFrontier,
+                                     __global int *farPile, int farCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < frontierCount)
+    {
+        int vid = frontier[tid];
+        int nearOut = claimOffsetArray[tid];
+        int farOut = farCount + claimOffsetArray[frontierCount + tid] - claimOffsetArray[frontierCount];
+
+        int edgeStart = vertexArray[vid];
+        int edgeEnd;
+        if (vid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[vid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int claim = claimedArray[edge];
+            if (claim >= 0)
+            {
+                nextFrontier[nearOut++] = claim;
+            }
+            else if (claim < -1)
+            {
+                farPile[farOut++] = -2 - claim;
+            }
+        }
+    }
+}
+
+///
+/// Count the far vertices below and above the new bucketEnd, laid out like the
+/// claim counts of OCL_SSSP_DELTA_RELAX, and take the lowest cost of those that
+/// stay in the far pile.
+///
+__kernel void OCL_SSSP_DELTA_SPLIT_COUNT(__global float *updatingCostArray, __global int *farPile, int farCount,
+                                         float bucketEnd, __global int *splitCountArray, __global int *farMinCost)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < farCount)
+    {
+        float cost = updatingCostArray[farPile[tid]];
+        int isNear = (cost < bucketEnd) ? 1 : 0;
+
+        splitCountArray[tid] = isNear;
+        splitCountArray[farCount + tid] = 1 - isNear;
+        if (!isNear)
+        {
+            atomic_min(farMinCost, as_int(cost));
+        }
+    }
+}
+
+__kernel void OCL_SSSP_DELTA_SPLIT(__global float *updatingCostArray, __global int *farPile, int farCount,
+                                   float bucketEnd, __global int *splitOffsetArray, __global int *nextFrontier,
+                                   __global int *nextFarPile)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < farCount)
+    {
+        int vid = farPile[tid];
+
+        if (updatingCostArray[vid] < bucketEnd)
+        {
+            nextFrontier[splitOffsetArray[tid]] = vid;
+        }
+        else
+        {
+            nextFarPile[splitOffsetArray[farCount + tid] - splitOffsetArray[farCount]] = vid;
+        }
+    }
+}
+
+///
+/// Exclusive prefix sum of count values, one block of get_local_size(0) values
+/// per work group.  The total of each block goes to blockSums, so that a scan of
+/// blockSums followed by addBlockOffsets completes the scan of the whole array.
+/// input and output may be the same buffer.  The work group size must be a
+/// power of 2, and scratch must hold one int per work-item.
+///
+__kernel void scanBlocks(__global int *input, __global int *output, __global int *blockSums,
+                         __local int *scratch, int count)
+{
+    int gid = get_global_id(0);
+    int lid = get_local_id(0);
+    int size = get_local_size(0);
+    int value = (gid < count) ? input[gid] : 0;
+
+    scratch[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int offset = 1; offset < size; offset *= 2)
+    {
+        int addend = (lid >= offset) ? scratch[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        scratch[lid] += addend;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (gid < count)
+    {
+        output[gid] = scratch[lid] - value;
+    }
+    if (lid == size - 1)
+    {
+        blockSums[get_group_id(0)] = scratch[lid];
+    }
+}
+
+///
+/// Add the scanned block totals back into each block of a scan.  Must be launched
+/// with the same work group size as the scanBlocks pass that produced the blocks.
+///
+__kernel void addBlockOffsets(__global int *data, __global int *blockOffsets, int count)
+{
+    int gid = get_global_id(0);
+
+    if (gid < count)
+    {
+        data[gid] += blockOffsets[get_group_id(0)];
+    }
+}
@@ -31,6 +31,8 @@
 #include <boost/program_options.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <stdio.h>
+#include <math.h>
+#include <algorithm>
 #include "oclDijkstraKernel.h"
 
 
@@ -68,13 +70,52 @@ void generateRandomGraph(GraphData *graph, int numVertices, int neighborsPerVert
     }
 }
 
+///
+//  Generate a road-like graph: a square grid, with each vertex joined to its
+//  neighbours above, below, left and right.  Shortest path searches on it move
+//  through the graph as a narrow wavefront, as they do on real road networks.
+//
+void generateGridGraph(GraphData *graph, int numVertices)
+{
+    int width = 1;
+    while ((width + 1) * (width + 1) <= numVertices)
+    {
+        width++;
+    }
+
+    graph->vertexCount = numVertices;
+    graph->vertexArray = (int*) malloc(graph->vertexCount * sizeof(int));
+    graph->edgeArray = (int*)malloc(graph->vertexCount * 4 * sizeof(int));
+    graph->weightArray = (float*)malloc(graph->vertexCount * 4 * sizeof(float));
+
+    int edge = 0;
+    for(int i = 0; i < graph->vertexCount; i++)
+    {
+        int col = i % width;
+        int neighbors[4] = { i - width, i + width, (col > 0) ? i - 1 : -1, (col + 1 < width) ? i + 1 : -1 };
+
+        graph->vertexArray[i] = edge;
+        for (int n = 0; n < 4; n++)
+        {
+            if (neighbors[n] >= 0 && neighbors[n] < graph->vertexCount)
+            {
+                graph->edgeArray[edge] = neighbors[n];
+                graph->weightArray[edge] = (float)(1 + rand() % 1000) / 1000.0f;
+                edge++;
+            }
+        }
+    }
+    graph->edgeCount = edge;
+}
+
 ///
 //  Parse command line arguments
 //
 void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
-                          bool &doMultiGPU, bool &doCPUGPU, bool &doRef,
-                          int *sourceVerts,
-                          int *generateVerts, int *generateEdgesPerVert)
+                          bool &doMultiGPU, bool &doCPUGPU, bool &doCPUSub, bool &doRef,
+                          bool &doQueries, bool &doFused, bool &doFrontier, bool &doDeltaStepping,
+                          bool &doBatched, bool &doCompare, bool &doGrid, float *delta, int *batchSize,
+                          int *sourceVerts, int *generateVerts, int *generateEdgesPerVert)
 {
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -83,7 +124,17 @@ void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
         ("gpu",     "Run single GPU version of algorithm")
         ("multigpu","Run multi GPU version of algorithm")
         ("cpugpu",  "Run multi GPU+CPU version of algorithm")
+        ("cpusub",  "Run CPU version of algorithm on sub-devices sharing the sources")
         ("ref",     "Run reference version of algorithm")
+        ("queries", "Run single GPU version as one query per source on a persistent engine")
+        ("fused",   "Relax and update in one kernel launch per iteration, with atomic cost minimums")
+        ("frontier","Relax only a compacted frontier of changed vertices each iteration")
+        ("delta-stepping", "Relax the frontier in buckets of cost delta wide, and check each source against the reference")
+        ("batched", "Run the fused sweep for a batch of sources per kernel launch")
+        ("compare", "Time single GPU queries with the mask sweep, fused sweep, frontier, delta-stepping and batched kernels")
+        ("grid",    "Generate a road-like grid graph instead of a random graph")
+        ("delta",   po::value<float>(), "Bucket width for delta-stepping (default: picked from the graph)")
+        ("batch",   po::value<int>(), "Number of sources in a batch (default: picked from the device and graph)")
         ("sources", po::value<int>(), "Number of source vertices to search from (default: 100)")
         ("verts",   po::value<int>(), "Number of vertices in randomly generated graph (default: 100000)")
         ("edges",   po::value<int>(), "Number of edges per vertex in randomly generated graph (default: 10)");
@@ -119,9 +170,59 @@ void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
         doCPUGPU = true;
     }
 
+    if (vm.count("cpusub"))
+    {
+        doCPUSub = true;
+    }
+
     if (vm.count("ref"))
     {
         doRef = true;
+    }
+
+    if (vm.count("queries"))
+    {
+        doQueries = true;
+    }
+
+    if (vm.count("fused"))
+    {
+        doFused = true;
+    }
+
+    if (vm.count("frontier"))
+    {
+        doFrontier = true;
+    }
+
+    if (vm.count("delta-stepping"))
+    {
+        doDeltaStepping = true;
+    }
+
+    if (vm.count("batched"))
+    {
+        doBatched = true;
+    }
+
+    if (vm.count("compare"))
+    {
+        doCompare = true;
+    }
+
+    if (vm.count("grid"))
+    {
+        doGrid = true;
+    }
+
+    if (vm.count("delta"))
+    {
+        *delta = vm["delta"].as<float>();
+    }
+
+    if (vm.count("batch"))
+    {
+        *batchSize = vm["batch"].as<int>();
     }
 
     if (vm.count("sources"))
@@ -211,14 +312,25 @@ int main(int argc, char **argv)
     bool doGPU = false;
     bool doMultiGPU = false;
     bool doCPUGPU = false;
+    bool doCPUSub = false;
     bool doRef = false;
+    bool doQueries = false;
+    bool doFused = false;
+    bool doFrontier = false;
+    bool doDeltaStepping = false;
+    bool doBatched = false;
+    bool doCompare = false;
+    bool doGrid = false;
+    float delta = 0.0f;
+    int batchSize = 0;
     int numSources = 100;
     int generateVerts = 100000;
     int generateEdgesPerVert = 10;
 
     parseCommandLineArgs(argc, argv, doCPU, doGPU,
-                         doMultiGPU, doCPUGPU, doRef,
-                         &numSources, &generateVerts, &generateEdgesPerVert);
+                         doMultiGPU, doCPUGPU, doCPUSub, doRef,
+                         doQueries, doFused, doFrontier, doDeltaStepping,
+                         doBatched, doCompare, doGrid, &delta, &batchSize, &numSources, &generateVerts, &generateEdgesPerVert);
 
     cl_platform_id platform;
     cl_context gpuContext;
@@ -253,7 +365,14 @@ int main(int argc, char **argv)
 
     // Allocate memory for arrays
     GraphData graph;
-    generateRandomGraph(&graph, generateVerts, generateEdgesPerVert);
+    if (doGrid)
+    {
+        generateGridGraph(&graph, generateVerts);
+    }
+    else
+    {
+        generateRandomGraph(&graph, generateVerts, generateEdgesPerVert);
+    }
 
     printf("Vertex Count: %d\n", graph.vertexCount);
     printf("Edge Count: %d\n", graph.edgeCount);
@@ -272,6 +391,27 @@ int main(int argc, char **argv)
     float *results = (float*) malloc(sizeof(float) * sourceVertices.size() * graph.vertexCount);
 
 
+    SSSPAlgorithm algorithm = SSSP_MASK_SWEEP;
+    if (doDeltaStepping)
+    {
+        algorithm = SSSP_DELTA_STEPPING;
+    }
+    else if (doFrontier)
+    {
+        algorithm = SSSP_FRONTIER;
+    }
+    else if (doBatched)
+    {
+        algorithm = SSSP_BATCHED_SWEEP;
+    }
+    else if (doFused)
+    {
+        algorithm = SSSP_FUSED_SWEEP;
+    }
+    setDijkstraAlgorithm(algorithm);
+    setDijkstraDelta(delta);
+    setDijkstraBatchSize(batchSize);
+
     // Run Dijkstra's algorithm
     pt::ptime startTimeCPU = pt::microsec_clock::local_time();
     if (doCPU)
@@ -306,6 +446,14 @@ int main(int argc, char **argv)
     }
     pt::time_duration timeGPUCPU = pt::microsec_clock::local_time() - startTimeGPUCPU;
 
+    pt::ptime startTimeCPUSub = pt::microsec_clock::local_time();
+    if (doCPUSub)
+    {
+        runDijkstraCPUSubDevices(cpuContext, &graph, sourceVertArray,
+                                 results, sourceVertices.size() );
+    }
+    pt::time_duration timeCPUSub = pt::microsec_clock::local_time() - startTimeCPUSub;
+
     pt::ptime startTimeRef = pt::microsec_clock::local_time();
     if (doRef)
     {
@@ -314,6 +462,67 @@ int main(int argc, char **argv)
     }
     pt::time_duration timeRef = pt::microsec_clock::local_time() - startTimeRef;
 
+    // Answer each source as a separate query, as a server would, with the program
+    // built and the graph loaded only once
+    pt::time_duration timeEngineSetup;
+    pt::time_duration timeQueries;
+    if (doQueries)
+    {
+        pt::ptime startTimeEngine = pt::microsec_clock::local_time();
+        DijkstraEngine *engine = createDijkstraEngine(gpuContext, getMaxFlopsDev(gpuContext), &graph, algorithm);
+        timeEngineSetup = pt::microsec_clock::local_time() - startTimeEngine;
+        if (engine != NULL)
+        {
+            pt::ptime startTimeQueries = pt::microsec_clock::local_time();
+            for (size_t i = 0; i < sourceVertices.size(); i++)
+            {
+                runDijkstraQuery(engine, &sourceVertArray[i], &results[i * graph.vertexCount], 1);
+            }
+            timeQueries = pt::microsec_clock::local_time() - startTimeQueries;
+            releaseDijkstraEngine(engine);
+        }
+    }
+
+    // Check delta-stepping against the reference one source at a time, noting the
+    // wall time and the relaxations each source took
+    std::vector<float> deltaTimes;
+    std::vector<long> deltaRelaxations;
+    std::vector<float> deltaDifferences;
+    if (doDeltaStepping)
+    {
+        DijkstraEngine *engine = createDijkstraEngine(gpuContext, getMaxFlopsDev(gpuContext), &graph, SSSP_DELTA_STEPPING);
+        if (engine == NULL)
+        {
+            return 1;
+        }
+        float *deltaResult = (float*) malloc(sizeof(float) * graph.vertexCount);
+        float *refResult = (float*) malloc(sizeof(float) * graph.vertexCount);
+        for (size_t i = 0; i < sourceVertices.size(); i++)
+        {
+            long relaxationsBefore = getDijkstraRelaxations(engine);
+            pt::ptime startTimeSource = pt::microsec_clock::local_time();
+            runDijkstraQuery(engine, &sourceVertArray[i], deltaResult, 1);
+            pt::time_duration timeSource = pt::microsec_clock::local_time() - startTimeSource;
+
+            runDijkstraRef(&graph, &sourceVertArray[i], refResult, 1);
+            float difference = 0.0f;
+            for (int v = 0; v < graph.vertexCount; v++)
+            {
+                if (deltaResult[v] != refResult[v])
+                {
+                    difference = std::max(difference, fabsf(deltaResult[v] - refResult[v]));
+                }
+            }
+
+            deltaTimes.push_back((float)timeSource.total_microseconds() / 1000.0f);
+            deltaRelaxations.push_back(getDijkstraRelaxations(engine) - relaxationsBefore);
+            deltaDifferences.push_back(difference);
+        }
+        free(deltaResult);
+        free(refResult);
+        releaseDijkstraEngine(engine);
+    }
+
 
     if (doCPU)
     {
@@ -335,11 +544,102 @@ int main(int argc, char **argv)
         printf("\nrunDijkstra - Multi GPU and CPU Time: %f s\n", (float)timeGPUCPU.total_milliseconds() / 1000.0f);
     }
 
+    if (doCPUSub)
+    {
+        printf("\nrunDijkstra - CPU Sub-devices Time:   %f s\n", (float)timeCPUSub.total_milliseconds() / 1000.0f);
+    }
+
     if (doRef)
     {
         printf("\nrunDijkstra - Reference (CPU):        %f s\n", (float)timeRef.total_milliseconds() / 1000.0f);
     }
 
+    // Time the same queries with each algorithm, and check that they agree with
+    // the mask sweep
+    const int numCompare = 5;
+    SSSPAlgorithm compareAlgorithms[numCompare] = { SSSP_MASK_SWEEP, SSSP_FUSED_SWEEP, SSSP_FRONTIER, SSSP_DELTA_STEPPING,
+                                                    SSSP_BATCHED_SWEEP };
+    pt::time_duration timeCompare[numCompare];
+    long iterationsCompare[numCompare];
+    long relaxationsCompare[numCompare];
+    float maxDifference[numCompare] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    if (doCompare)
+    {
+        float *compareResults[numCompare];
+        for (int a = 0; a < numCompare; a++)
+        {
+            compareResults[a] = (float*) malloc(sizeof(float) * sourceVertices.size() * graph.vertexCount);
+            DijkstraEngine *engine = createDijkstraEngine(gpuContext, getMaxFlopsDev(gpuContext), &graph, compareAlgorithms[a]);
+            if (engine == NULL)
+            {
+                return 1;
+            }
+            pt::ptime startTimeCompare = pt::microsec_clock::local_time();
+            runDijkstraQuery(engine, sourceVertArray, compareResults[a], sourceVertices.size());
+            timeCompare[a] = pt::microsec_clock::local_time() - startTimeCompare;
+            iterationsCompare[a] = getDijkstraIterations(engine);
+            relaxationsCompare[a] = getDijkstraRelaxations(engine);
+            releaseDijkstraEngine(engine);
+        }
+        for (int a = 1; a < numCompare; a++)
+        {
+            for (size_t i = 0; i < sourceVertices.size() * graph.vertexCount; i++)
+            {
+                if (compareResults[0][i] != compareResults[a][i])
+                {
+                    maxDifference[a] = std::max(maxDifference[a], fabsf(compareResults[0][i] - compareResults[a][i]));
+                }
+            }
+        }
+        for (int a = 0; a < numCompare; a++)
+        {
+            free(compareResults[a]);
+        }
+    }
+
+    if (doQueries)
+    {
+        printf("\nrunDijkstraQuery - Engine setup:      %f s\n", (float)timeEngineSetup.total_milliseconds() / 1000.0f);
+        printf("runDijkstraQuery - Per query:         %f ms\n",
+               (float)timeQueries.total_microseconds() / 1000.0f / (float)sourceVertices.size());
+    }
+
+    if (doDeltaStepping)
+    {
+        float totalTime = 0.0f;
+        long totalRelaxations = 0;
+        float worstDifference = 0.0f;
+        printf("\n");
+        for (size_t i = 0; i < sourceVertices.size(); i++)
+        {
+            printf("Delta-stepping - Source %8d:      %f ms, %ld relaxations, max difference %g\n",
+                   sourceVertArray[i], deltaTimes[i], deltaRelaxations[i], deltaDifferences[i]);
+            totalTime += deltaTimes[i];
+            totalRelaxations += deltaRelaxations[i];
+            worstDifference = std::max(worstDifference, deltaDifferences[i]);
+        }
+        printf("Delta-stepping - Per source:          %f ms, %ld relaxations (%.2f per edge)\n",
+               totalTime / (float)sourceVertices.size(), totalRelaxations / (long)sourceVertices.size(),
+               (double)totalRelaxations / (double)sourceVertices.size() / (double)std::max(graph.edgeCount, 1));
+        printf("Delta-stepping - Reference check:     %s\n", (worstDifference == 0.0f) ? "PASSED" : "FAILED");
+    }
+
+    if (doCompare)
+    {
+        const char *compareNames[numCompare] = { "Mask sweep:    ", "Fused sweep:   ", "Frontier:      ", "Delta-stepping:",
+                                                "Batched sweep: " };
+        float sweepTime = (float)timeCompare[0].total_microseconds() / 1000.0f / (float)sourceVertices.size();
+        printf("\n");
+        for (int a = 0; a < numCompare; a++)
+        {
+            float compareTime = (float)timeCompare[a].total_microseconds() / 1000.0f / (float)sourceVertices.size();
+            printf("runDijkstraQuery - %s   %f ms per query (%.2fx), %.1f iterations and %ld relaxations per query, max difference %g\n",
+                   compareNames[a], compareTime, sweepTime / compareTime,
+                   (double)iterationsCompare[a] / (double)sourceVertices.size(),
+                   relaxationsCompare[a] / (long)sourceVertices.size(), maxDifference[a]);
+        }
+    }
+
     free(sourceVertArray);
     free(results);
 
@@ -25,6 +25,8 @@
 //  Children's Hospital Boston
 //
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
@@ -42,7 +44,14 @@
 ///
 //  Macro Options
 //
-#define NUM_ASYNCHRONOUS_ITERATIONS 10  // Number of async loop iterations before attempting to read results back
+#define NUM_ASYNCHRONOUS_ITERATIONS 10  // Number of async loop iterations before the first convergence check of the first query
+#define MAX_ASYNCHRONOUS_ITERATIONS 64  // Upper bound on the number of async loop iterations between checks
+#define MAX_SCAN_WORK_GROUP_SIZE    256 // Work group size of the frontier prefix scan (lowered to fit the device)
+#define MAX_SCAN_LEVELS             32  // Enough levels of block sums for any int count with blocks of 2 or more
+#define MAX_BATCH_SOURCES           64  // Upper bound on the sources a batched engine converges at once
+#define BATCH_WAVES_PER_DEVICE      4   // Default batch size aims for this many full-device waves of work-items
+#define SOURCE_QUEUE_SHARE          4   // A device takes 1 / (SOURCE_QUEUE_SHARE * devices) of the waiting sources at a time
+#define CPU_SUB_DEVICE_UNITS        2   // Smallest CPU sub-device, in compute units, when several share the sources
 
 ///
 //  Function prototypes
@@ -68,9 +77,34 @@ using namespace std;
 //  Types
 //
 
+// The sources still waiting in the multi-device implementations.  Instead of
+// being handed a fixed chunk up front, each device takes the next few sources
+// whenever it is idle, so a faster device simply ends up computing more of them.
+typedef struct
+{
+    // Guards nextResult
+    pthread_mutex_t mutex;
+
+    // Source vertex indices to process
+    int *sourceVertices;
+
+    // Results of processing
+    float *outResultCosts;
+
+    // Number of results
+    int numResults;
+
+    // First result not yet taken by a device
+    int nextResult;
+
+    // Number of devices taking sources from the queue
+    int deviceCount;
+
+} SourceQueue;
+
 // This structure is used in the multi-GPU implementation of the algorithm.
-// This structure defines the workload for each GPU.  The code chunks up
-// the work on a per-GPU basis.
+// This structure defines the device that each thread runs on, and the queue
+// it takes its sources from.
 typedef struct
 {
     // Context
@@ -82,24 +116,113 @@ typedef struct
     // Pointer to graph data
     GraphData *graph;
 
-    // Source vertex indices to process
-    int *sourceVertices;
-
-    // End vertex indices to process
-    int *endVertices;
+    // Sources shared with the other devices
+    SourceQueue *queue;
 
-    // Results of processing
-    float *outResultCosts;
-
-    // Number of results
+    // Number of results this device computed
     int numResults;
 
 } DevicePlan;
 
+// A Dijkstra engine holds everything that depends only on the device and the
+// graph, so that it is set up once and then answers any number of queries.
+struct DijkstraEngine
+{
+    // Context and device the engine runs on
+    cl_context context;
+    cl_device_id deviceId;
+
+    // Graph the engine answers queries on
+    GraphData *graph;
+
+    // Which kernels run each iteration
+    SSSPAlgorithm algorithm;
+
+    // Command queue, program and kernels
+    cl_command_queue commandQueue;
+    cl_program program;
+    cl_kernel initializeBuffersKernel;
+    cl_kernel ssspKernel1;
+    cl_kernel ssspKernel2;
+
+    // SSSP_FUSED_SWEEP only: OCL_SSSP_FUSED, in place of ssspKernel1/2
+    cl_kernel ssspFusedKernel;
+
+    // Graph buffers, and the mask and cost buffers reinitialized by each query
+    cl_mem vertexArrayDevice;
+    cl_mem edgeArrayDevice;
+    cl_mem weightArrayDevice;
+    cl_mem maskArrayDevice;
+    cl_mem costArrayDevice;
+    cl_mem updatingCostArrayDevice;
+
+    // Number of the last iteration that lowered any cost (the convergence flag)
+    cl_mem lastChangeIterationDevice;
+
+    // Number of edge relaxations done by the current query
+    cl_mem relaxationCountDevice;
+
+    // SSSP_FRONTIER and SSSP_DELTA_STEPPING: kernels, the current and next
+    // frontier queues, the claims made while relaxing, and one buffer of block
+    // sums per scan level
+    cl_kernel frontierRelaxKernel;
+    cl_kernel frontierCompactKernel;
+    cl_kernel frontierUpdateKernel;
+    cl_kernel scanBlocksKernel;
+    cl_kernel addBlockOffsetsKernel;
+    cl_mem frontierDevice[2];
+    cl_mem claimedArrayDevice;
+    cl_mem claimCountArrayDevice;
+    cl_mem claimOffsetArrayDevice;
+    cl_mem scanLevelDevice[MAX_SCAN_LEVELS];
+    int scanLevels;
+    size_t scanWorkGroupSize;
+
+    // SSSP_DELTA_STEPPING only: bucket width, kernels, the current and next far
+    // piles, and the lowest cost that has entered the far pile (as int bits)
+    float delta;
+    cl_kernel deltaRelaxKernel;
+    cl_kernel deltaCompactKernel;
+    cl_kernel deltaSplitCountKernel;
+    cl_kernel deltaSplitKernel;
+    cl_mem farDevice[2];
+    cl_mem farMinCostDevice;
+
+    // SSSP_BATCHED_SWEEP only: number of slots, kernels, the masks and costs of
+    // every slot (source-major), the lists of active and newly started slots,
+    // and each slot's last change iteration
+    int batchSize;
+    cl_kernel batchFusedKernel;
+    cl_kernel initializeBatchSlotsKernel;
+    cl_mem batchMaskArrayDevice;
+    cl_mem batchCostArrayDevice;
+    cl_mem activeSlotsDevice;
+    cl_mem newSlotsDevice;
+    cl_mem newSourcesDevice;
+    cl_mem batchLastChangeIterationDevice;
+
+    // 1D range covering every vertex
+    size_t maxWorkGroupSize;
+    size_t localWorkSize;
+    size_t globalWorkSize;
+
+    // Iterations the queries so far have needed to converge (a running average),
+    // which sets when the first convergence check of the next query is made
+    int expectedIterations;
+
+    // Totals over all queries, for reporting
+    long totalIterations;
+    long totalChecks;
+    long totalRelaxations;
+};
+
 ///
 //  Globals
 //
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+SSSPAlgorithm defaultAlgorithm = SSSP_MASK_SWEEP;
+float defaultDelta = 0.0f;
+int defaultBatchSize = 0;
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -111,7 +234,7 @@ pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 /// Load and build an OpenCL program from source file
 /// \param gpuContext GPU context on which to load and build the program
 /// \param fileName File name of source file that holds the kernels
-/// \return Handle to the program
+/// \return Handle to the program, or NULL if it could not be loaded or built
 ///
 cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
 {
@@ -125,6 +248,7 @@ cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
     if (!kernelFile.is_open())
     {
         std::cerr << "Failed to open file for reading: " << fileName << std::endl;
+        pthread_mutex_unlock(&mutex);
         return NULL;
     }
 
@@ -148,7 +272,9 @@ cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
                               sizeof(cBuildLog), cBuildLog, NULL );
 
         cerr << cBuildLog << endl;
-        checkError(errNum, CL_SUCCESS);
+        clReleaseProgram(program);
+        pthread_mutex_unlock(&mutex);
+        return NULL;
     }
 
     pthread_mutex_unlock(&mutex);
@@ -214,28 +340,956 @@ void allocateOCLBuffers(cl_context gpuContext, cl_command_queue commandQueue, Gr
 }
 
 ///
-/// Initialize OpenCL buffers for single run of Dijkstra
+/// Initialize OpenCL buffers for single run of Dijkstra
+///
+void initializeOCLBuffers(cl_command_queue commandQueue, cl_kernel initializeKernel, GraphData *graph,
+                          size_t maxWorkGroupSize)
+{
+    cl_int errNum;
+    // Set # of work items in work group and total in 1 dimensional range
+    size_t localWorkSize = maxWorkGroupSize;
+    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+
+    errNum = clEnqueueNDRangeKernel(commandQueue, initializeKernel, 1, NULL, &globalWorkSize, &localWorkSize,
+                                    0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Create the kernels and buffers used by the frontier and delta-stepping variants
+///
+void createFrontierResources(DijkstraEngine *engine)
+{
+    cl_int errNum;
+    GraphData *graph = engine->graph;
+
+    engine->frontierRelaxKernel = clCreateKernel(engine->program, "OCL_SSSP_FRONTIER_RELAX", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->frontierCompactKernel = clCreateKernel(engine->program, "OCL_SSSP_FRONTIER_COMPACT", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->frontierUpdateKernel = clCreateKernel(engine->program, "OCL_SSSP_FRONTIER_UPDATE", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->scanBlocksKernel = clCreateKernel(engine->program, "scanBlocks", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->addBlockOffsetsKernel = clCreateKernel(engine->program, "addBlockOffsets", &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    // The scan needs a power of 2 work group size that the device accepts for it
+    size_t kernelWorkGroupSize;
+    errNum = clGetKernelWorkGroupInfo(engine->scanBlocksKernel, engine->deviceId, CL_KERNEL_WORK_GROUP_SIZE,
+                                      sizeof(size_t), &kernelWorkGroupSize, NULL);
+    checkError(errNum, CL_SUCCESS);
+    engine->scanWorkGroupSize = MAX_SCAN_WORK_GROUP_SIZE;
+    while (engine->scanWorkGroupSize > kernelWorkGroupSize || engine->scanWorkGroupSize > engine->maxWorkGroupSize)
+    {
+        engine->scanWorkGroupSize /= 2;
+    }
+    if (engine->scanWorkGroupSize < 2)
+    {
+        cerr << "ERROR: the device cannot run the frontier scan" << endl;
+        exit(1);
+    }
+
+    // A vertex is queued at most once per iteration, so each queue holds at most every vertex
+    for (int i = 0; i < 2; i++)
+    {
+        engine->frontierDevice[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * graph->vertexCount, NULL, &errNum);
+        checkError(errNum, CL_SUCCESS);
+    }
+    // Delta-stepping counts near and far claims separately, two counts per queued vertex
+    int maxScanCount = 2 * graph->vertexCount;
+    engine->claimedArrayDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * max(graph->edgeCount, 1), NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->claimCountArrayDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * maxScanCount, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->claimOffsetArrayDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * maxScanCount, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    // One level of block sums per factor of scanWorkGroupSize, down to a single block
+    int count = maxScanCount;
+    engine->scanLevels = 0;
+    do
+    {
+        count = (count + engine->scanWorkGroupSize - 1) / engine->scanWorkGroupSize;
+        engine->scanLevelDevice[engine->scanLevels] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * count, NULL, &errNum);
+        checkError(errNum, CL_SUCCESS);
+        engine->scanLevels++;
+    } while (count > 1);
+
+    errNum  = clSetKernelArg(engine->frontierRelaxKernel, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 1, sizeof(cl_mem), &engine->edgeArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 2, sizeof(cl_mem), &engine->weightArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 3, sizeof(cl_mem), &engine->maskArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 4, sizeof(cl_mem), &engine->costArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 5, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 6, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 7, sizeof(int), &graph->edgeCount);
+    // 8 and 9 set per iteration
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 10, sizeof(cl_mem), &engine->claimedArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 11, sizeof(cl_mem), &engine->claimCountArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierRelaxKernel, 12, sizeof(cl_mem), &engine->relaxationCountDevice);
+
+    errNum |= clSetKernelArg(engine->frontierCompactKernel, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierCompactKernel, 1, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->frontierCompactKernel, 2, sizeof(int), &graph->edgeCount);
+    // 3 and 4 set per iteration
+    errNum |= clSetKernelArg(engine->frontierCompactKernel, 5, sizeof(cl_mem), &engine->claimedArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierCompactKernel, 6, sizeof(cl_mem), &engine->claimOffsetArrayDevice);
+    // 7 set per iteration
+
+    errNum |= clSetKernelArg(engine->frontierUpdateKernel, 0, sizeof(cl_mem), &engine->maskArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierUpdateKernel, 1, sizeof(cl_mem), &engine->costArrayDevice);
+    errNum |= clSetKernelArg(engine->frontierUpdateKernel, 2, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    // 3 and 4 set per iteration
+
+    errNum |= clSetKernelArg(engine->scanBlocksKernel, 3, sizeof(int) * engine->scanWorkGroupSize, NULL);
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Release the kernels and buffers created by createFrontierResources()
+///
+void releaseFrontierResources(DijkstraEngine *engine)
+{
+    clReleaseKernel(engine->frontierRelaxKernel);
+    clReleaseKernel(engine->frontierCompactKernel);
+    clReleaseKernel(engine->frontierUpdateKernel);
+    clReleaseKernel(engine->scanBlocksKernel);
+    clReleaseKernel(engine->addBlockOffsetsKernel);
+
+    clReleaseMemObject(engine->frontierDevice[0]);
+    clReleaseMemObject(engine->frontierDevice[1]);
+    clReleaseMemObject(engine->claimedArrayDevice);
+    clReleaseMemObject(engine->claimCountArrayDevice);
+    clReleaseMemObject(engine->claimOffsetArrayDevice);
+    for (int level = 0; level < engine->scanLevels; level++)
+    {
+        clReleaseMemObject(engine->scanLevelDevice[level]);
+    }
+}
+
+///
+/// Create the kernels and buffers used only by the delta-stepping variant, on
+/// top of those from createFrontierResources()
+///
+void createDeltaResources(DijkstraEngine *engine)
+{
+    cl_int errNum;
+    GraphData *graph = engine->graph;
+
+    engine->deltaRelaxKernel = clCreateKernel(engine->program, "OCL_SSSP_DELTA_RELAX", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->deltaCompactKernel = clCreateKernel(engine->program, "OCL_SSSP_DELTA_COMPACT", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->deltaSplitCountKernel = clCreateKernel(engine->program, "OCL_SSSP_DELTA_SPLIT_COUNT", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->deltaSplitKernel = clCreateKernel(engine->program, "OCL_SSSP_DELTA_SPLIT", &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    // A vertex waits in the far pile at most once, so each pile holds at most every vertex
+    for (int i = 0; i < 2; i++)
+    {
+        engine->farDevice[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * graph->vertexCount, NULL, &errNum);
+        checkError(errNum, CL_SUCCESS);
+    }
+    engine->farMinCostDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int), NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    errNum  = clSetKernelArg(engine->deltaRelaxKernel, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 1, sizeof(cl_mem), &engine->edgeArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 2, sizeof(cl_mem), &engine->weightArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 3, sizeof(cl_mem), &engine->maskArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 4, sizeof(cl_mem), &engine->costArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 5, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 6, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 7, sizeof(int), &graph->edgeCount);
+    // 8, 9 and 10 set per iteration
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 11, sizeof(cl_mem), &engine->claimedArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 12, sizeof(cl_mem), &engine->claimCountArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 13, sizeof(cl_mem), &engine->farMinCostDevice);
+    errNum |= clSetKernelArg(engine->deltaRelaxKernel, 14, sizeof(cl_mem), &engine->relaxationCountDevice);
+
+    errNum |= clSetKernelArg(engine->deltaCompactKernel, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaCompactKernel, 1, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->deltaCompactKernel, 2, sizeof(int), &graph->edgeCount);
+    // 3 and 4 set per iteration
+    errNum |= clSetKernelArg(engine->deltaCompactKernel, 5, sizeof(cl_mem), &engine->claimedArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaCompactKernel, 6, sizeof(cl_mem), &engine->claimOffsetArrayDevice);
+    // 7, 8 and 9 set per iteration
+
+    errNum |= clSetKernelArg(engine->deltaSplitCountKernel, 0, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    // 1, 2 and 3 set per bucket
+    errNum |= clSetKernelArg(engine->deltaSplitCountKernel, 4, sizeof(cl_mem), &engine->claimCountArrayDevice);
+    errNum |= clSetKernelArg(engine->deltaSplitCountKernel, 5, sizeof(cl_mem), &engine->farMinCostDevice);
+
+    errNum |= clSetKernelArg(engine->deltaSplitKernel, 0, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    // 1, 2 and 3 set per bucket
+    errNum |= clSetKernelArg(engine->deltaSplitKernel, 4, sizeof(cl_mem), &engine->claimOffsetArrayDevice);
+    // 5 and 6 set per bucket
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Release the kernels and buffers created by createDeltaResources()
+///
+void releaseDeltaResources(DijkstraEngine *engine)
+{
+    clReleaseKernel(engine->deltaRelaxKernel);
+    clReleaseKernel(engine->deltaCompactKernel);
+    clReleaseKernel(engine->deltaSplitCountKernel);
+    clReleaseKernel(engine->deltaSplitKernel);
+
+    clReleaseMemObject(engine->farDevice[0]);
+    clReleaseMemObject(engine->farDevice[1]);
+    clReleaseMemObject(engine->farMinCostDevice);
+}
+
+///
+/// Create the kernels and buffers used only by the batched variant.  Unless set
+/// with setDijkstraBatchSize(), the batch is made large enough to fill the
+/// device BATCH_WAVES_PER_DEVICE times over, within MAX_BATCH_SOURCES and the
+/// device's largest allocation.
+///
+void createBatchResources(DijkstraEngine *engine)
+{
+    cl_int errNum;
+    GraphData *graph = engine->graph;
+
+    cl_uint computeUnits;
+    cl_ulong maxAllocSize;
+    errNum  = clGetDeviceInfo(engine->deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, NULL);
+    errNum |= clGetDeviceInfo(engine->deviceId, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAllocSize, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    if (defaultBatchSize > 0)
+    {
+        engine->batchSize = defaultBatchSize;
+    }
+    else
+    {
+        size_t deviceWorkItems = (size_t) computeUnits * engine->maxWorkGroupSize * BATCH_WAVES_PER_DEVICE;
+        engine->batchSize = (int) min((deviceWorkItems + engine->globalWorkSize - 1) / engine->globalWorkSize,
+                                      (size_t) MAX_BATCH_SOURCES);
+    }
+
+    // Slot offsets are ints in the kernels, and each array must fit one allocation
+    size_t vertexCount = max(graph->vertexCount, 1);
+    size_t maxSlots = min((size_t) INT_MAX / vertexCount, (size_t) (maxAllocSize / (sizeof(float) * vertexCount)));
+    engine->batchSize = (int) max(min((size_t) engine->batchSize, maxSlots), (size_t) 1);
+    cout << "BATCH_SIZE: " << engine->batchSize << endl;
+
+    size_t slotElements = (size_t) engine->batchSize * vertexCount;
+    engine->batchMaskArrayDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * slotElements, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->batchCostArrayDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(float) * slotElements, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->activeSlotsDevice = clCreateBuffer(engine->context, CL_MEM_READ_ONLY, sizeof(int) * engine->batchSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->newSlotsDevice = clCreateBuffer(engine->context, CL_MEM_READ_ONLY, sizeof(int) * engine->batchSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->newSourcesDevice = clCreateBuffer(engine->context, CL_MEM_READ_ONLY, sizeof(int) * engine->batchSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->batchLastChangeIterationDevice = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(int) * engine->batchSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    engine->batchFusedKernel = clCreateKernel(engine->program, "OCL_SSSP_BATCH_FUSED", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->initializeBatchSlotsKernel = clCreateKernel(engine->program, "initializeBatchSlots", &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    errNum  = clSetKernelArg(engine->batchFusedKernel, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 1, sizeof(cl_mem), &engine->edgeArrayDevice);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 2, sizeof(cl_mem), &engine->weightArrayDevice);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 3, sizeof(cl_mem), &engine->batchMaskArrayDevice);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 4, sizeof(cl_mem), &engine->batchCostArrayDevice);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 5, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 6, sizeof(int), &graph->edgeCount);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 7, sizeof(cl_mem), &engine->activeSlotsDevice);
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 8, sizeof(cl_mem), &engine->batchLastChangeIterationDevice);
+    // 9 set per iteration
+    errNum |= clSetKernelArg(engine->batchFusedKernel, 10, sizeof(cl_mem), &engine->relaxationCountDevice);
+
+    errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 0, sizeof(cl_mem), &engine->batchMaskArrayDevice);
+    errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 1, sizeof(cl_mem), &engine->batchCostArrayDevice);
+    errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 2, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 3, sizeof(cl_mem), &engine->newSlotsDevice);
+    errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 4, sizeof(cl_mem), &engine->newSourcesDevice);
+    errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 5, sizeof(cl_mem), &engine->batchLastChangeIterationDevice);
+    // 6 set per batch of new slots
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Release the kernels and buffers created by createBatchResources()
+///
+void releaseBatchResources(DijkstraEngine *engine)
+{
+    clReleaseKernel(engine->batchFusedKernel);
+    clReleaseKernel(engine->initializeBatchSlotsKernel);
+
+    clReleaseMemObject(engine->batchMaskArrayDevice);
+    clReleaseMemObject(engine->batchCostArrayDevice);
+    clReleaseMemObject(engine->activeSlotsDevice);
+    clReleaseMemObject(engine->newSlotsDevice);
+    clReleaseMemObject(engine->newSourcesDevice);
+    clReleaseMemObject(engine->batchLastChangeIterationDevice);
+}
+
+///
+/// Pick a delta-stepping bucket width for the graph: the largest edge weight
+/// divided by the average number of edges per vertex, the choice Meyer and
+/// Sanders analyse for random edge weights.
+///
+float chooseDelta(GraphData *graph)
+{
+    float maxWeight = 0.0f;
+    for (int i = 0; i < graph->edgeCount; i++)
+    {
+        maxWeight = max(maxWeight, graph->weightArray[i]);
+    }
+
+    float averageDegree = (float) graph->edgeCount / (float) max(graph->vertexCount, 1);
+    if (maxWeight <= 0.0f || averageDegree <= 0.0f)
+    {
+        return 1.0f;
+    }
+    return maxWeight / max(averageDegree, 1.0f);
+}
+
+///
+/// Exclusive prefix sum of the first count claim counts into the claim offsets.
+/// \return The buffer whose first element will hold the sum of all the counts
+///
+cl_mem scanClaimCounts(DijkstraEngine *engine, int count)
+{
+    cl_int errNum;
+    size_t localWorkSize = engine->scanWorkGroupSize;
+    cl_mem data[MAX_SCAN_LEVELS];
+    int counts[MAX_SCAN_LEVELS];
+    cl_mem input = engine->claimCountArrayDevice;
+    cl_mem output = engine->claimOffsetArrayDevice;
+    int level = 0;
+
+    // Scan each level in blocks, leaving the block totals in the next level up,
+    // until a level fits in one block; its total is the total of everything.
+    for (;;)
+    {
+        size_t globalWorkSize = roundWorkSizeUp(localWorkSize, count);
+        errNum  = clSetKernelArg(engine->scanBlocksKernel, 0, sizeof(cl_mem), &input);
+        errNum |= clSetKernelArg(engine->scanBlocksKernel, 1, sizeof(cl_mem), &output);
+        errNum |= clSetKernelArg(engine->scanBlocksKernel, 2, sizeof(cl_mem), &engine->scanLevelDevice[level]);
+        errNum |= clSetKernelArg(engine->scanBlocksKernel, 4, sizeof(int), &count);
+        errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->scanBlocksKernel, 1, 0, &globalWorkSize,
+                                         &localWorkSize, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        data[level] = output;
+        counts[level] = count;
+        count = (int) (globalWorkSize / localWorkSize);
+        if (count == 1)
+        {
+            break;
+        }
+        input = output = engine->scanLevelDevice[level];
+        level++;
+    }
+
+    // Then add each level's scanned block totals back into the level below.
+    for (int l = level - 1; l >= 0; l--)
+    {
+        size_t globalWorkSize = roundWorkSizeUp(localWorkSize, counts[l]);
+        errNum  = clSetKernelArg(engine->addBlockOffsetsKernel, 0, sizeof(cl_mem), &data[l]);
+        errNum |= clSetKernelArg(engine->addBlockOffsetsKernel, 1, sizeof(cl_mem), &engine->scanLevelDevice[l]);
+        errNum |= clSetKernelArg(engine->addBlockOffsetsKernel, 2, sizeof(int), &counts[l]);
+        errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->addBlockOffsetsKernel, 1, 0, &globalWorkSize,
+                                         &localWorkSize, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+    }
+
+    return engine->scanLevelDevice[level];
+}
+
+///
+/// Run OCL_SSSP_KERNEL1/2, or OCL_SSSP_FUSED for SSSP_FUSED_SWEEP, over every
+/// vertex until no cost changes.
+/// \return The number of iterations
+///
+int convergeMaskSweep(DijkstraEngine *engine)
+{
+    cl_int errNum;
+    cl_event readDone;
+
+    // The mask is empty after an iteration exactly when that iteration lowered no
+    // cost, so rather than reading back the whole mask array, we read only the
+    // number of the last iteration that changed anything.
+    int iteration = 0;
+    int lastChangeIteration = 0;
+    int asyncIterations = engine->expectedIterations;
+    while (lastChangeIteration == iteration)
+    {
+
+        // In order to improve performance, we run some number of iterations
+        // without reading the results.  This might result in running more iterations
+        // than necessary at times, but it will in most cases be faster because
+        // we are doing less stalling of the GPU waiting for results.  The first
+        // batch runs as many iterations as the queries so far have needed; if that
+        // is not enough, the batches start small and double.
+        for(int asyncIter = 0; asyncIter < asyncIterations; asyncIter++)
+        {
+            iteration++;
+
+            if (engine->algorithm == SSSP_FUSED_SWEEP)
+            {
+                // execute the one kernel
+                errNum = clSetKernelArg(engine->ssspFusedKernel, 8, sizeof(int), &iteration);
+                errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->ssspFusedKernel, 1, 0, &engine->globalWorkSize,
+                                                 &engine->localWorkSize, 0, NULL, NULL);
+                checkError(errNum, CL_SUCCESS);
+            }
+            else
+            {
+                // execute the kernel
+                errNum = clEnqueueNDRangeKernel(engine->commandQueue, engine->ssspKernel1, 1, 0, &engine->globalWorkSize,
+                                                &engine->localWorkSize, 0, NULL, NULL);
+                checkError(errNum, CL_SUCCESS);
+
+                errNum = clSetKernelArg(engine->ssspKernel2, 8, sizeof(int), &iteration);
+                errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->ssspKernel2, 1, 0, &engine->globalWorkSize,
+                                                 &engine->localWorkSize, 0, NULL, NULL);
+                checkError(errNum, CL_SUCCESS);
+            }
+        }
+        errNum = clEnqueueReadBuffer(engine->commandQueue, engine->lastChangeIterationDevice, CL_FALSE, 0, sizeof(int),
+                                     &lastChangeIteration, 0, NULL, &readDone);
+        checkError(errNum, CL_SUCCESS);
+        clWaitForEvents(1, &readDone);
+        clReleaseEvent(readDone);
+        engine->totalChecks++;
+
+        if (asyncIterations == engine->expectedIterations)
+        {
+            asyncIterations = max(engine->expectedIterations / 4, 1);
+        }
+        else
+        {
+            asyncIterations = min(2 * asyncIterations, MAX_ASYNCHRONOUS_ITERATIONS);
+        }
+    }
+
+    // The iteration after the last change is the one that finds the mask empty.
+    engine->expectedIterations = (3 * engine->expectedIterations + lastChangeIteration + 1 + 3) / 4;
+    return iteration;
+}
+
+///
+/// Run the frontier kernels from sourceVertex until the frontier is empty.  The
+/// size of each new frontier is read back to size the next launches, which also
+/// serves as the convergence check.
+/// \return The number of iterations
+///
+int convergeFrontier(DijkstraEngine *engine, int *sourceVertex)
+{
+    cl_int errNum;
+    int current = 0;
+    int frontierCount = 1;
+    int iteration = 0;
+
+    // The source starts as the whole frontier.  initializeBuffers leaves it marked,
+    // which is harmless: with non-negative weights its cost never drops again.
+    errNum = clEnqueueWriteBuffer(engine->commandQueue, engine->frontierDevice[current], CL_FALSE, 0, sizeof(int),
+                                  sourceVertex, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    while (frontierCount > 0)
+    {
+        iteration++;
+        size_t globalWorkSize = roundWorkSizeUp(engine->localWorkSize, frontierCount);
+
+        errNum  = clSetKernelArg(engine->frontierRelaxKernel, 8, sizeof(cl_mem), &engine->frontierDevice[current]);
+        errNum |= clSetKernelArg(engine->frontierRelaxKernel, 9, sizeof(int), &frontierCount);
+        errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->frontierRelaxKernel, 1, 0, &globalWorkSize,
+                                         &engine->localWorkSize, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        cl_mem total = scanClaimCounts(engine, frontierCount);
+
+        errNum  = clSetKernelArg(engine->frontierCompactKernel, 3, sizeof(cl_mem), &engine->frontierDevice[current]);
+        errNum |= clSetKernelArg(engine->frontierCompactKernel, 4, sizeof(int), &frontierCount);
+        errNum |= clSetKernelArg(engine->frontierCompactKernel, 7, sizeof(cl_mem), &engine->frontierDevice[1 - current]);
+        errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->frontierCompactKernel, 1, 0, &globalWorkSize,
+                                         &engine->localWorkSize, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        errNum = clEnqueueReadBuffer(engine->commandQueue, total, CL_TRUE, 0, sizeof(int), &frontierCount, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+        engine->totalChecks++;
+        current = 1 - current;
+
+        if (frontierCount > 0)
+        {
+            globalWorkSize = roundWorkSizeUp(engine->localWorkSize, frontierCount);
+            errNum  = clSetKernelArg(engine->frontierUpdateKernel, 3, sizeof(cl_mem), &engine->frontierDevice[current]);
+            errNum |= clSetKernelArg(engine->frontierUpdateKernel, 4, sizeof(int), &frontierCount);
+            errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->frontierUpdateKernel, 1, 0, &globalWorkSize,
+                                             &engine->localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+        }
+    }
+    return iteration;
+}
+
+///
+/// Run the delta-stepping kernels from sourceVertex until both the near queue
+/// and the far pile are empty.  Like convergeFrontier(), each pass reads back the
+/// sizes of the new queues, which also serves as the convergence check.
+/// \return The number of relax passes
+///
+int convergeDeltaStepping(DijkstraEngine *engine, int *sourceVertex)
+{
+    static const int noFarCost = INT_MAX;
+    cl_int errNum;
+    int current = 0;
+    int currentFar = 0;
+    int nearCount = 1;
+    int farCount = 0;
+    int iteration = 0;
+    float bucketEnd = engine->delta;
+
+    // The source starts as the whole near queue, marked as claimed by initializeBuffers.
+    errNum  = clEnqueueWriteBuffer(engine->commandQueue, engine->frontierDevice[current], CL_FALSE, 0, sizeof(int),
+                                   sourceVertex, 0, NULL, NULL);
+    errNum |= clEnqueueWriteBuffer(engine->commandQueue, engine->farMinCostDevice, CL_FALSE, 0, sizeof(int),
+                                   &noFarCost, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    for (;;)
+    {
+        // Relax the current bucket until it is settled, sending the vertices
+        // whose costs land beyond it to the far pile.
+        while (nearCount > 0)
+        {
+            iteration++;
+            size_t globalWorkSize = roundWorkSizeUp(engine->localWorkSize, nearCount);
+
+            errNum  = clSetKernelArg(engine->deltaRelaxKernel, 8, sizeof(cl_mem), &engine->frontierDevice[current]);
+            errNum |= clSetKernelArg(engine->deltaRelaxKernel, 9, sizeof(int), &nearCount);
+            errNum |= clSetKernelArg(engine->deltaRelaxKernel, 10, sizeof(float), &bucketEnd);
+            errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->deltaRelaxKernel, 1, 0, &globalWorkSize,
+                                             &engine->localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+
+            cl_mem total = scanClaimCounts(engine, 2 * nearCount);
+
+            errNum  = clSetKernelArg(engine->deltaCompactKernel, 3, sizeof(cl_mem), &engine->frontierDevice[current]);
+            errNum |= clSetKernelArg(engine->deltaCompactKernel, 4, sizeof(int), &nearCount);
+            errNum |= clSetKernelArg(engine->deltaCompactKernel, 7, sizeof(cl_mem), &engine->frontierDevice[1 - current]);
+            errNum |= clSetKernelArg(engine->deltaCompactKernel, 8, sizeof(cl_mem), &engine->farDevice[currentFar]);
+            errNum |= clSetKernelArg(engine->deltaCompactKernel, 9, sizeof(int), &farCount);
+            errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->deltaCompactKernel, 1, 0, &globalWorkSize,
+                                             &engine->localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+
+            // The near claims are the offset of the first far count; the queue is in
+            // order, so the blocking read of the total covers both.
+            int nearClaimed;
+            int claimed;
+            errNum  = clEnqueueReadBuffer(engine->commandQueue, engine->claimOffsetArrayDevice, CL_FALSE, sizeof(int) * nearCount,
+                                          sizeof(int), &nearClaimed, 0, NULL, NULL);
+            errNum |= clEnqueueReadBuffer(engine->commandQueue, total, CL_TRUE, 0, sizeof(int), &claimed, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+            engine->totalChecks++;
+            current = 1 - current;
+            nearCount = nearClaimed;
+            farCount += claimed - nearClaimed;
+
+            if (nearCount > 0)
+            {
+                globalWorkSize = roundWorkSizeUp(engine->localWorkSize, nearCount);
+                errNum  = clSetKernelArg(engine->frontierUpdateKernel, 3, sizeof(cl_mem), &engine->frontierDevice[current]);
+                errNum |= clSetKernelArg(engine->frontierUpdateKernel, 4, sizeof(int), &nearCount);
+                errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->frontierUpdateKernel, 1, 0, &globalWorkSize,
+                                                 &engine->localWorkSize, 0, NULL, NULL);
+                checkError(errNum, CL_SUCCESS);
+            }
+        }
+
+        if (farCount == 0)
+        {
+            break;
+        }
+
+        // Move to the bucket of the lowest cost that entered the far pile.  That
+        // cost may have dropped since, but never below the buckets already done,
+        // and at least that vertex moves to the near queue.
+        int farMinCost;
+        errNum = clEnqueueReadBuffer(engine->commandQueue, engine->farMinCostDevice, CL_TRUE, 0, sizeof(int),
+                                     &farMinCost, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+        if (farMinCost == INT_MAX)
+        {
+            bucketEnd = FLT_MAX;
+        }
+        else
+        {
+            float minCost;
+            memcpy(&minCost, &farMinCost, sizeof(float));
+            // The boundary is worked out in double, and is at least the next float
+            // above minCost, so a delta far below minCost's ulp still makes progress.
+            double boundary = (floor((double)minCost / engine->delta) + 1.0) * engine->delta;
+            bucketEnd = (boundary >= FLT_MAX) ? FLT_MAX : (float)boundary;
+            if (bucketEnd <= minCost)
+            {
+                bucketEnd = nextafterf(minCost, FLT_MAX);
+            }
+        }
+
+        size_t globalWorkSize = roundWorkSizeUp(engine->localWorkSize, farCount);
+        errNum  = clEnqueueWriteBuffer(engine->commandQueue, engine->farMinCostDevice, CL_FALSE, 0, sizeof(int),
+                                       &noFarCost, 0, NULL, NULL);
+        errNum |= clSetKernelArg(engine->deltaSplitCountKernel, 1, sizeof(cl_mem), &engine->farDevice[currentFar]);
+        errNum |= clSetKernelArg(engine->deltaSplitCountKernel, 2, sizeof(int), &farCount);
+        errNum |= clSetKernelArg(engine->deltaSplitCountKernel, 3, sizeof(float), &bucketEnd);
+        errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->deltaSplitCountKernel, 1, 0, &globalWorkSize,
+                                         &engine->localWorkSize, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        scanClaimCounts(engine, 2 * farCount);
+
+        errNum  = clSetKernelArg(engine->deltaSplitKernel, 1, sizeof(cl_mem), &engine->farDevice[currentFar]);
+        errNum |= clSetKernelArg(engine->deltaSplitKernel, 2, sizeof(int), &farCount);
+        errNum |= clSetKernelArg(engine->deltaSplitKernel, 3, sizeof(float), &bucketEnd);
+        errNum |= clSetKernelArg(engine->deltaSplitKernel, 5, sizeof(cl_mem), &engine->frontierDevice[current]);
+        errNum |= clSetKernelArg(engine->deltaSplitKernel, 6, sizeof(cl_mem), &engine->farDevice[1 - currentFar]);
+        errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->deltaSplitKernel, 1, 0, &globalWorkSize,
+                                         &engine->localWorkSize, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        // Every far vertex is counted once, as near or far, so the number moved
+        // to the near queue is all that needs reading back.
+        errNum = clEnqueueReadBuffer(engine->commandQueue, engine->claimOffsetArrayDevice, CL_TRUE, sizeof(int) * farCount,
+                                     sizeof(int), &nearCount, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+        engine->totalChecks++;
+        farCount -= nearCount;
+        currentFar = 1 - currentFar;
+
+        // The vertices leaving the far pile are still claimed; commit their costs.
+        if (nearCount > 0)
+        {
+            globalWorkSize = roundWorkSizeUp(engine->localWorkSize, nearCount);
+            errNum  = clSetKernelArg(engine->frontierUpdateKernel, 3, sizeof(cl_mem), &engine->frontierDevice[current]);
+            errNum |= clSetKernelArg(engine->frontierUpdateKernel, 4, sizeof(int), &nearCount);
+            errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->frontierUpdateKernel, 1, 0, &globalWorkSize,
+                                             &engine->localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+        }
+    }
+    return iteration;
+}
+
+///
+/// Answer numResults queries on an SSSP_BATCHED_SWEEP engine, running up to
+/// batchSize sources at once.  When a slot converges, its costs are read
+/// straight into outResultCosts, and it starts over from the next waiting
+/// source, so the batch stays full while sources remain.
+///
+void convergeBatch(DijkstraEngine *engine, int *sourceVertices, float *outResultCosts, int numResults)
+{
+    static const cl_uint noRelaxations = 0;
+    cl_int errNum;
+    GraphData *graph = engine->graph;
+    int batchSize = engine->batchSize;
+
+    // Result each slot is computing (-1 if idle), and the iteration it started at
+    int *slotResult = new int[batchSize];
+    int *slotStart = new int[batchSize];
+    int *activeSlots = new int[batchSize];
+    int *newSlots = new int[batchSize];
+    int *newSources = new int[batchSize];
+    int *lastChangeIteration = new int[batchSize];
+    for (int slot = 0; slot < batchSize; slot++)
+    {
+        slotResult[slot] = -1;
+    }
+
+    errNum = clEnqueueWriteBuffer(engine->commandQueue, engine->relaxationCountDevice, CL_FALSE, 0, sizeof(cl_uint),
+                                  &noRelaxations, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+    cl_uint relaxations = 0;
+    cl_uint countedRelaxations = 0;
+
+    int nextResult = 0;
+    int iteration = 0;
+    for (;;)
+    {
+        // Start the waiting sources in the idle slots
+        int newCount = 0;
+        for (int slot = 0; slot < batchSize && nextResult < numResults; slot++)
+        {
+            if (slotResult[slot] < 0)
+            {
+                slotResult[slot] = nextResult;
+                slotStart[slot] = iteration;
+                newSlots[newCount] = slot;
+                newSources[newCount] = sourceVertices[nextResult];
+                newCount++;
+                nextResult++;
+            }
+        }
+        if (newCount > 0)
+        {
+            size_t globalWorkSize[2] = { engine->globalWorkSize, (size_t) newCount };
+            size_t localWorkSize[2] = { engine->localWorkSize, 1 };
+            errNum  = clEnqueueWriteBuffer(engine->commandQueue, engine->newSlotsDevice, CL_TRUE, 0, sizeof(int) * newCount,
+                                           newSlots, 0, NULL, NULL);
+            errNum |= clEnqueueWriteBuffer(engine->commandQueue, engine->newSourcesDevice, CL_TRUE, 0, sizeof(int) * newCount,
+                                           newSources, 0, NULL, NULL);
+            errNum |= clSetKernelArg(engine->initializeBatchSlotsKernel, 6, sizeof(int), &iteration);
+            errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->initializeBatchSlotsKernel, 2, 0, globalWorkSize,
+                                             localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+        }
+
+        int activeCount = 0;
+        for (int slot = 0; slot < batchSize; slot++)
+        {
+            if (slotResult[slot] >= 0)
+            {
+                activeSlots[activeCount++] = slot;
+            }
+        }
+        if (activeCount == 0)
+        {
+            break;
+        }
+        errNum = clEnqueueWriteBuffer(engine->commandQueue, engine->activeSlotsDevice, CL_TRUE, 0, sizeof(int) * activeCount,
+                                      activeSlots, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        // Run a few iterations of every active slot between checks: a slot that
+        // converges early idles for at most that many cheap, masked-out sweeps.
+        size_t globalWorkSize[2] = { engine->globalWorkSize, (size_t) activeCount };
+        size_t localWorkSize[2] = { engine->localWorkSize, 1 };
+        int asyncIterations = max(engine->expectedIterations / 4, 1);
+        for (int asyncIter = 0; asyncIter < asyncIterations; asyncIter++)
+        {
+            iteration++;
+            errNum  = clSetKernelArg(engine->batchFusedKernel, 9, sizeof(int), &iteration);
+            errNum |= clEnqueueNDRangeKernel(engine->commandQueue, engine->batchFusedKernel, 2, 0, globalWorkSize,
+                                             localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+        }
+
+        errNum  = clEnqueueReadBuffer(engine->commandQueue, engine->relaxationCountDevice, CL_FALSE, 0, sizeof(cl_uint),
+                                      &relaxations, 0, NULL, NULL);
+        errNum |= clEnqueueReadBuffer(engine->commandQueue, engine->batchLastChangeIterationDevice, CL_TRUE, 0,
+                                      sizeof(int) * batchSize, lastChangeIteration, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+        engine->totalChecks++;
+
+        // Counted since the last check, so the 32-bit counter only has to hold one interval
+        engine->totalRelaxations += (cl_uint) (relaxations - countedRelaxations);
+        countedRelaxations = relaxations;
+
+        // A slot whose last change came before the last iteration has converged
+        for (int a = 0; a < activeCount; a++)
+        {
+            int slot = activeSlots[a];
+            if (lastChangeIteration[slot] < iteration)
+            {
+                errNum = clEnqueueReadBuffer(engine->commandQueue, engine->batchCostArrayDevice, CL_FALSE,
+                                             sizeof(float) * slot * graph->vertexCount, sizeof(float) * graph->vertexCount,
+                                             &outResultCosts[(size_t) slotResult[slot] * graph->vertexCount], 0, NULL, NULL);
+                checkError(errNum, CL_SUCCESS);
+
+                int needed = lastChangeIteration[slot] + 1 - slotStart[slot];
+                engine->totalIterations += needed;
+                engine->expectedIterations = (3 * engine->expectedIterations + needed + 3) / 4;
+                slotResult[slot] = -1;
+            }
+        }
+    }
+
+    // The result reads were queued without waiting
+    errNum = clFinish(engine->commandQueue);
+    checkError(errNum, CL_SUCCESS);
+
+    delete [] slotResult;
+    delete [] slotStart;
+    delete [] activeSlots;
+    delete [] newSlots;
+    delete [] newSources;
+    delete [] lastChangeIteration;
+}
+
+///
+/// Take the next sources from the queue: a share of those still waiting, so that
+/// early takes are large and the last ones small enough to finish together, but
+/// at least minCount of them.
+/// \return The number of sources taken, starting at *firstResult, or 0 once the
+///         queue is empty
+///
+int takeSources(SourceQueue *queue, int minCount, int *firstResult)
+{
+    pthread_mutex_lock(&queue->mutex);
+
+    int remaining = queue->numResults - queue->nextResult;
+    int count = min(max(remaining / (SOURCE_QUEUE_SHARE * queue->deviceCount), minCount), remaining);
+    *firstResult = queue->nextResult;
+    queue->nextResult += count;
+
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+///
+/// Worker thread for running the algorithm on one of the compute devices.  The
+/// engine is created once, then answers sources from the queue until it is empty.
+///
+void dijkstraThread(DevicePlan *plan)
+{
+    SourceQueue *queue = plan->queue;
+    plan->numResults = 0;
+
+    // If this device fails, the others are left to empty the queue
+    DijkstraEngine *engine = createDijkstraEngine( plan->context, plan->deviceId, plan->graph, defaultAlgorithm );
+    if (engine == NULL)
+    {
+        return;
+    }
+
+    // A batched engine is only kept busy by a full batch of sources
+    int minCount = (engine->algorithm == SSSP_BATCHED_SWEEP) ? engine->batchSize : 1;
+
+    int firstResult;
+    int count;
+    while ((count = takeSources(queue, minCount, &firstResult)) > 0)
+    {
+        runDijkstraQuery( engine, &queue->sourceVertices[firstResult],
+                          &queue->outResultCosts[(size_t) firstResult * plan->graph->vertexCount], count );
+        plan->numResults += count;
+    }
+
+    cout << "Computed '" << plan->numResults << "' results (" << engine->totalIterations << " iterations, "
+         << engine->totalChecks << " convergence checks, " << engine->totalRelaxations << " relaxations)" << endl;
+    releaseDijkstraEngine( engine );
+}
+
+///
+/// Run the algorithm on each of the given devices, in one thread per device, with
+/// all of them taking their sources from one shared queue.
+///
+void runDevicesFromQueue( cl_context *contexts, cl_device_id *devices, int deviceCount, GraphData *graph,
+                          int *sourceVertices, float *outResultCosts, int numResults )
+{
+    SourceQueue queue;
+    pthread_mutex_init(&queue.mutex, NULL);
+    queue.sourceVertices = sourceVertices;
+    queue.outResultCosts = outResultCosts;
+    queue.numResults = numResults;
+    queue.nextResult = 0;
+    queue.deviceCount = deviceCount;
+
+    DevicePlan *devicePlans = (DevicePlan*) malloc(sizeof(DevicePlan) * deviceCount);
+    pthread_t *threadIDs = (pthread_t*) malloc(sizeof(pthread_t) * deviceCount);
+
+    cout << "Computing '" << numResults << "' results on " << deviceCount << " devices." << endl;
+    for (int i = 0; i < deviceCount; i++)
+    {
+        devicePlans[i].context = contexts[i];
+        devicePlans[i].deviceId = devices[i];
+        devicePlans[i].graph = graph;
+        devicePlans[i].queue = &queue;
+        devicePlans[i].numResults = 0;
+    }
+
+    // Launch all the threads
+    for (int i = 0; i < deviceCount; i++)
+    {
+        pthread_create(&threadIDs[i], NULL, (void* (*)(void*))dijkstraThread, (void*)(devicePlans + i));
+    }
+
+    // Wait for the results from all threads
+    for (int i = 0; i < deviceCount; i++)
+    {
+        pthread_join(threadIDs[i], NULL);
+    }
+
+    if (queue.nextResult < numResults)
+    {
+        cerr << "ERROR: no device could compute the last " << (numResults - queue.nextResult) << " results" << endl;
+    }
+
+    pthread_mutex_destroy(&queue.mutex);
+    free (devicePlans);
+    free (threadIDs);
+}
+
+///
+/// Split the first CPU device of cpuContext into sub-devices of unitsPerSubDevice
+/// compute units each, and create a context for each of the first maxSubDevices
+/// of them.  The rest are released unused.
+/// \return The number of sub-devices created, or 0 if the device cannot be split
 ///
-void initializeOCLBuffers(cl_command_queue commandQueue, cl_kernel initializeKernel, GraphData *graph,
-                          size_t maxWorkGroupSize)
+int createCPUSubDevices( cl_context cpuContext, cl_uint unitsPerSubDevice, int maxSubDevices,
+                         cl_device_id *subDevices, cl_context *subContexts )
 {
+#ifdef CL_VERSION_1_2
     cl_int errNum;
-    // Set # of work items in work group and total in 1 dimensional range
-    size_t localWorkSize = maxWorkGroupSize;
-    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+    cl_device_id cpuDevice = getFirstDev(cpuContext);
+    cl_device_partition_property partition[3] = { CL_DEVICE_PARTITION_EQUALLY,
+                                                  (cl_device_partition_property) unitsPerSubDevice, 0 };
 
-    errNum = clEnqueueNDRangeKernel(commandQueue, initializeKernel, 1, NULL, &globalWorkSize, &localWorkSize,
-                                    0, NULL, NULL);
-    checkError(errNum, CL_SUCCESS);
+    cl_uint count;
+    errNum = clCreateSubDevices(cpuDevice, partition, 0, NULL, &count);
+    if (errNum != CL_SUCCESS || count == 0)
+    {
+        return 0;
+    }
+
+    cl_device_id *allSubDevices = new cl_device_id[count];
+    errNum = clCreateSubDevices(cpuDevice, partition, count, allSubDevices, NULL);
+    if (errNum != CL_SUCCESS)
+    {
+        delete [] allSubDevices;
+        return 0;
+    }
+
+    int created = 0;
+    for (cl_uint i = 0; i < count; i++)
+    {
+        if (created < maxSubDevices)
+        {
+            subContexts[created] = clCreateContext(0, 1, &allSubDevices[i], NULL, NULL, &errNum);
+            checkError(errNum, CL_SUCCESS);
+            subDevices[created++] = allSubDevices[i];
+        }
+        else
+        {
+            clReleaseDevice(allSubDevices[i]);
+        }
+    }
+
+    delete [] allSubDevices;
+    return created;
+#else
+    // Sub-devices need OpenCL 1.2
+    return 0;
+#endif
 }
 
 ///
-/// Worker thread for running the algorithm on one of the compute devices
+/// Release the sub-devices and contexts created by createCPUSubDevices()
 ///
-void dijkstraThread(DevicePlan *plan)
+void releaseCPUSubDevices( int count, cl_device_id *subDevices, cl_context *subContexts )
 {
-    runDijkstra( plan->context, plan->deviceId, plan->graph, plan->sourceVertices,
-                 plan->outResultCosts, plan->numResults );
+    for (int i = 0; i < count; i++)
+    {
+        clReleaseContext(subContexts[i]);
+#ifdef CL_VERSION_1_2
+        clReleaseDevice(subDevices[i]);
+#endif
+    }
 }
 
 ///
@@ -430,24 +1484,29 @@ void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
                         outResultCosts, numResults);
         }
     }
-    // For multiple results, prefer multi-GPU and fallback to CPU
+    // For multiple results, let every device take searches from a shared queue
     else
     {
-        // Prefer Multi-GPU if multiple GPUs are available
-        if (gpuContext != 0)
+        // The CPU used to slow down the threads feeding the GPUs when it ran
+        // alongside them.  The multi GPU+CPU version now leaves those threads a
+        // core each, and a slow device just takes fewer searches.
+        if (gpuContext != 0 && cpuContext != 0)
+        {
+            cout << "Dijkstra OpenCL: Running multi-GPU and CPU version." << endl;
+            runDijkstraMultiGPUandCPU( gpuContext, cpuContext, graph, sourceVertices,
+                                       outResultCosts, numResults );
+        }
+        else if (gpuContext != 0)
         {
             cout << "Dijkstra OpenCL: Running multi-GPU version." << endl;
             runDijkstraMultiGPU( gpuContext, graph, sourceVertices,
                                  outResultCosts, numResults );
         }
-        // For now, fallback to CPU in this case.  I have a multi GPU+CPU path
-        // but it does not seem to perform well because of the CPU overhead of
-        // running the GPU version slows down the CPU version.
         else
         {
-            cout << "Dijkstra OpenCL: Running multithreaded CPU version." << endl;
-            runDijkstra(cpuContext, getMaxFlopsDev(cpuContext), graph, sourceVertices,
-                        outResultCosts, numResults);
+            cout << "Dijkstra OpenCL: Running CPU sub-device version." << endl;
+            runDijkstraCPUSubDevices( cpuContext, graph, sourceVertices,
+                                      outResultCosts, numResults );
         }
     }
 
@@ -456,175 +1515,335 @@ void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
 }
 
 ///
-/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
-/// function will compute the shortest path distance from sourceVertices[n] ->
-/// endVertices[n] and store the cost in outResultCosts[n].  The number of results
-/// it will compute is given by numResults.
-///
-/// This function will run the algorithm on a single GPU.
+/// Create a Dijkstra engine for the graph on the given device.  This builds the
+/// program, creates the kernels and copies the graph to the device, which is all
+/// of the work that does not depend on the source vertex.
 ///
-/// \param gpuContext Current context, must be created by caller
-/// \param deviceId The device ID on which to run the kernel.  This can
-///                 be determined externally by the caller or the multi
-///                 GPU version will automatically split the work across
-///                 devices
+/// \param context Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernels
 /// \param graph Structure containing the vertex, edge, and weight arra
-///              for the input graph
-/// \param startVertices Indices into the vertex array from which to
-///                      start the search
-/// \param outResultsCosts A pre-allocated array where the results for
-///                        each shortest path search will be written
-/// \param numResults Should be the size of all three passed inarrays
+///              for the input graph.  It must stay valid, and unchanged,
+///              for the lifetime of the engine.
+/// \param algorithm Which kernels to run each iteration
+/// \return The engine, or NULL if the program could not be built
 ///
-void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
-                  int *sourceVertices, float *outResultCosts, int numResults)
+DijkstraEngine* createDijkstraEngine( cl_context context, cl_device_id deviceId, GraphData* graph,
+                                      SSSPAlgorithm algorithm )
 {
-    // Create command queue
     cl_int errNum;
-    cl_command_queue commandQueue;
-    commandQueue = clCreateCommandQueue( context, deviceId, 0, &errNum );
+    DijkstraEngine *engine = new DijkstraEngine;
+    engine->context = context;
+    engine->deviceId = deviceId;
+    engine->graph = graph;
+    engine->algorithm = algorithm;
+
+    // Create command queue
+    engine->commandQueue = clCreateCommandQueue( context, deviceId, 0, &errNum );
     checkError(errNum, CL_SUCCESS);
 
     // Program handle
-    cl_program program = loadAndBuildProgram( context, "dijkstra.cl" );
-    if (program <= 0 )
+    engine->program = loadAndBuildProgram( context, "dijkstra.cl" );
+    if (engine->program == NULL)
     {
-        return;
+        clReleaseCommandQueue(engine->commandQueue);
+        delete engine;
+        return NULL;
     }
 
     // Get the max workgroup size
-    size_t maxWorkGroupSize;
-    clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    errNum = clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &engine->maxWorkGroupSize, NULL);
     checkError(errNum, CL_SUCCESS);
-    cout << "MAX_WORKGROUP_SIZE: " << maxWorkGroupSize << endl;
-    cout << "Computing '" << numResults << "' results." << endl;
+    cout << "MAX_WORKGROUP_SIZE: " << engine->maxWorkGroupSize << endl;
 
     // Set # of work items in work group and total in 1 dimensional range
-    size_t localWorkSize = maxWorkGroupSize;
-    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
-
-    cl_mem vertexArrayDevice;
-    cl_mem edgeArrayDevice;
-    cl_mem weightArrayDevice;
-    cl_mem maskArrayDevice;
-    cl_mem costArrayDevice;
-    cl_mem updatingCostArrayDevice;
+    engine->localWorkSize = engine->maxWorkGroupSize;
+    engine->globalWorkSize = roundWorkSizeUp(engine->localWorkSize, graph->vertexCount);
 
     // Allocate buffers in Device memory
-    allocateOCLBuffers( context, commandQueue, graph, &vertexArrayDevice, &edgeArrayDevice, &weightArrayDevice,
-                        &maskArrayDevice, &costArrayDevice, &updatingCostArrayDevice, globalWorkSize);
+    allocateOCLBuffers( context, engine->commandQueue, graph, &engine->vertexArrayDevice, &engine->edgeArrayDevice,
+                        &engine->weightArrayDevice, &engine->maskArrayDevice, &engine->costArrayDevice,
+                        &engine->updatingCostArrayDevice, engine->globalWorkSize);
 
+    engine->lastChangeIterationDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    engine->relaxationCountDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
 
     // Create the Kernels
-    cl_kernel initializeBuffersKernel;
-    initializeBuffersKernel = clCreateKernel(program, "initializeBuffers", &errNum);
+    engine->initializeBuffersKernel = clCreateKernel(engine->program, "initializeBuffers", &errNum);
     checkError(errNum, CL_SUCCESS);
 
     // Set the args values and check for errors
-    errNum |= clSetKernelArg(initializeBuffersKernel, 0, sizeof(cl_mem), &maskArrayDevice);
-    errNum |= clSetKernelArg(initializeBuffersKernel, 1, sizeof(cl_mem), &costArrayDevice);
-    errNum |= clSetKernelArg(initializeBuffersKernel, 2, sizeof(cl_mem), &updatingCostArrayDevice);
-
-    // 3 set below in loop
-    errNum |= clSetKernelArg(initializeBuffersKernel, 4, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->initializeBuffersKernel, 0, sizeof(cl_mem), &engine->maskArrayDevice);
+    errNum |= clSetKernelArg(engine->initializeBuffersKernel, 1, sizeof(cl_mem), &engine->costArrayDevice);
+    errNum |= clSetKernelArg(engine->initializeBuffersKernel, 2, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+
+    // 3 set per query
+    errNum |= clSetKernelArg(engine->initializeBuffersKernel, 4, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->initializeBuffersKernel, 5, sizeof(cl_mem), &engine->lastChangeIterationDevice);
+    errNum |= clSetKernelArg(engine->initializeBuffersKernel, 6, sizeof(cl_mem), &engine->relaxationCountDevice);
     checkError(errNum, CL_SUCCESS);
 
     // Kernel 1
-    cl_kernel ssspKernel1;
-    ssspKernel1 = clCreateKernel(program, "OCL_SSSP_KERNEL1", &errNum);
+    engine->ssspKernel1 = clCreateKernel(engine->program, "OCL_SSSP_KERNEL1", &errNum);
     checkError(errNum, CL_SUCCESS);
-    errNum |= clSetKernelArg(ssspKernel1, 0, sizeof(cl_mem), &vertexArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 1, sizeof(cl_mem), &edgeArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 2, sizeof(cl_mem), &weightArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 3, sizeof(cl_mem), &maskArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 4, sizeof(cl_mem), &costArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 5, sizeof(cl_mem), &updatingCostArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 6, sizeof(int), &graph->vertexCount);
-    errNum |= clSetKernelArg(ssspKernel1, 7, sizeof(int), &graph->edgeCount);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 1, sizeof(cl_mem), &engine->edgeArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 2, sizeof(cl_mem), &engine->weightArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 3, sizeof(cl_mem), &engine->maskArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 4, sizeof(cl_mem), &engine->costArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 5, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 6, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 7, sizeof(int), &graph->edgeCount);
+    errNum |= clSetKernelArg(engine->ssspKernel1, 8, sizeof(cl_mem), &engine->relaxationCountDevice);
     checkError(errNum, CL_SUCCESS);
 
     // Kernel 2
-    cl_kernel ssspKernel2;
-    ssspKernel2 = clCreateKernel(program, "OCL_SSSP_KERNEL2", &errNum);
+    engine->ssspKernel2 = clCreateKernel(engine->program, "OCL_SSSP_KERNEL2", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 1, sizeof(cl_mem), &engine->edgeArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 2, sizeof(cl_mem), &engine->weightArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 3, sizeof(cl_mem), &engine->maskArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 4, sizeof(cl_mem), &engine->costArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 5, sizeof(cl_mem), &engine->updatingCostArrayDevice);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 6, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(engine->ssspKernel2, 7, sizeof(cl_mem), &engine->lastChangeIterationDevice);
+
+    // 8 set per iteration
     checkError(errNum, CL_SUCCESS);
-    errNum |= clSetKernelArg(ssspKernel2, 0, sizeof(cl_mem), &vertexArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel2, 1, sizeof(cl_mem), &edgeArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel2, 2, sizeof(cl_mem), &weightArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel2, 3, sizeof(cl_mem), &maskArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel2, 4, sizeof(cl_mem), &costArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel2, 5, sizeof(cl_mem), &updatingCostArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel2, 6, sizeof(int), &graph->vertexCount);
 
+    // Fused kernel
+    if (algorithm == SSSP_FUSED_SWEEP)
+    {
+        engine->ssspFusedKernel = clCreateKernel(engine->program, "OCL_SSSP_FUSED", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 0, sizeof(cl_mem), &engine->vertexArrayDevice);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 1, sizeof(cl_mem), &engine->edgeArrayDevice);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 2, sizeof(cl_mem), &engine->weightArrayDevice);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 3, sizeof(cl_mem), &engine->maskArrayDevice);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 4, sizeof(cl_mem), &engine->costArrayDevice);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 5, sizeof(int), &graph->vertexCount);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 6, sizeof(int), &graph->edgeCount);
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 7, sizeof(cl_mem), &engine->lastChangeIterationDevice);
+
+        // 8 set per iteration
+        errNum |= clSetKernelArg(engine->ssspFusedKernel, 9, sizeof(cl_mem), &engine->relaxationCountDevice);
+        checkError(errNum, CL_SUCCESS);
+    }
+
+    if (algorithm == SSSP_FRONTIER || algorithm == SSSP_DELTA_STEPPING)
+    {
+        createFrontierResources(engine);
+    }
+    if (algorithm == SSSP_BATCHED_SWEEP)
+    {
+        createBatchResources(engine);
+    }
+    if (algorithm == SSSP_DELTA_STEPPING)
+    {
+        createDeltaResources(engine);
+        engine->delta = (defaultDelta > 0.0f) ? defaultDelta : chooseDelta(graph);
+        cout << "DELTA: " << engine->delta << endl;
+    }
+
+    engine->expectedIterations = NUM_ASYNCHRONOUS_ITERATIONS;
+    engine->totalIterations = 0;
+    engine->totalChecks = 0;
+    engine->totalRelaxations = 0;
+
+    // Make sure the graph is on the device before the first query is timed
+    errNum = clFinish(engine->commandQueue);
     checkError(errNum, CL_SUCCESS);
 
-    int *maskArrayHost = (int*) malloc(sizeof(int) * graph->vertexCount);
+    return engine;
+}
+
+///
+/// Answer numResults shortest path queries on an engine created by
+/// createDijkstraEngine().  The costs from sourceVertices[n] to every vertex
+/// are stored in outResultCosts[n * graph->vertexCount].  Only the relaxation
+/// work runs here; the program and graph buffers are reused from the engine.
+///
+/// \param engine Engine created by createDijkstraEngine()
+/// \param startVertices Indices into the vertex array from which to
+///                      start the search
+/// \param outResultsCosts A pre-allocated array where the results for
+///                        each shortest path search will be written.
+///                        This must be sized numResults * graph->numVertices.
+/// \param numResults Should be the size of all three passed inarrays
+///
+void runDijkstraQuery( DijkstraEngine *engine, int *sourceVertices, float *outResultCosts, int numResults )
+{
+    cl_int errNum = CL_SUCCESS;
+    GraphData *graph = engine->graph;
+    cl_event readDone;
+
+    // The batched sweep takes all of the sources at once
+    if (engine->algorithm == SSSP_BATCHED_SWEEP)
+    {
+        convergeBatch(engine, sourceVertices, outResultCosts, numResults);
+        return;
+    }
 
     for ( int i = 0 ; i < numResults; i++ )
     {
 
-        errNum |= clSetKernelArg(initializeBuffersKernel, 3, sizeof(int), &sourceVertices[i]);
+        errNum |= clSetKernelArg(engine->initializeBuffersKernel, 3, sizeof(int), &sourceVertices[i]);
         checkError(errNum, CL_SUCCESS);
 
         // Initialize mask array to false, C and U to infiniti
-        initializeOCLBuffers( commandQueue, initializeBuffersKernel, graph, maxWorkGroupSize );
-
-        // Read mask array from device -> host
-        cl_event readDone;
-        errNum = clEnqueueReadBuffer( commandQueue, maskArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
-                                      maskArrayHost, 0, NULL, &readDone);
-        checkError(errNum, CL_SUCCESS);
-        clWaitForEvents(1, &readDone);
+        initializeOCLBuffers( engine->commandQueue, engine->initializeBuffersKernel, graph, engine->maxWorkGroupSize );
 
-        while(!maskArrayEmpty(maskArrayHost, graph->vertexCount))
+        int iteration;
+        if (engine->algorithm == SSSP_DELTA_STEPPING)
         {
-
-            // In order to improve performance, we run some number of iterations
-            // without reading the results.  This might result in running more iterations
-            // than necessary at times, but it will in most cases be faster because
-            // we are doing less stalling of the GPU waiting for results.
-            for(int asyncIter = 0; asyncIter < NUM_ASYNCHRONOUS_ITERATIONS; asyncIter++)
-            {
-                size_t localWorkSize = maxWorkGroupSize;
-                size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
-
-                // execute the kernel
-                errNum = clEnqueueNDRangeKernel(commandQueue, ssspKernel1, 1, 0, &globalWorkSize, &localWorkSize,
-                                               0, NULL, NULL);
-                checkError(errNum, CL_SUCCESS);
-
-                errNum = clEnqueueNDRangeKernel(commandQueue, ssspKernel2, 1, 0, &globalWorkSize, &localWorkSize,
-                                               0, NULL, NULL);
-                checkError(errNum, CL_SUCCESS);
-            }
-            errNum = clEnqueueReadBuffer(commandQueue, maskArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
-                                         maskArrayHost, 0, NULL, &readDone);
-            checkError(errNum, CL_SUCCESS);
-            clWaitForEvents(1, &readDone);
+            iteration = convergeDeltaStepping(engine, &sourceVertices[i]);
+        }
+        else if (engine->algorithm == SSSP_FRONTIER)
+        {
+            iteration = convergeFrontier(engine, &sourceVertices[i]);
+        }
+        else
+        {
+            iteration = convergeMaskSweep(engine);
         }
+        engine->totalIterations += iteration;
 
-        // Copy the result back
-        errNum = clEnqueueReadBuffer(commandQueue, costArrayDevice, CL_FALSE, 0, sizeof(float) * graph->vertexCount,
+        // Copy the result back, with the relaxation count (the queue is in order)
+        cl_uint relaxations;
+        errNum = clEnqueueReadBuffer(engine->commandQueue, engine->relaxationCountDevice, CL_FALSE, 0, sizeof(cl_uint),
+                                     &relaxations, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+        errNum = clEnqueueReadBuffer(engine->commandQueue, engine->costArrayDevice, CL_FALSE, 0, sizeof(float) * graph->vertexCount,
                                      &outResultCosts[i * graph->vertexCount], 0, NULL, &readDone);
         checkError(errNum, CL_SUCCESS);
         clWaitForEvents(1, &readDone);
+        clReleaseEvent(readDone);
+        engine->totalRelaxations += relaxations;
+    }
+}
+
+///
+/// Release everything held by an engine created by createDijkstraEngine().
+///
+void releaseDijkstraEngine( DijkstraEngine *engine )
+{
+    clReleaseMemObject(engine->vertexArrayDevice);
+    clReleaseMemObject(engine->edgeArrayDevice);
+    clReleaseMemObject(engine->weightArrayDevice);
+    clReleaseMemObject(engine->maskArrayDevice);
+    clReleaseMemObject(engine->costArrayDevice);
+    clReleaseMemObject(engine->updatingCostArrayDevice);
+    clReleaseMemObject(engine->lastChangeIterationDevice);
+    clReleaseMemObject(engine->relaxationCountDevice);
+
+    if (engine->algorithm == SSSP_FUSED_SWEEP)
+    {
+        clReleaseKernel(engine->ssspFusedKernel);
+    }
+    if (engine->algorithm == SSSP_FRONTIER || engine->algorithm == SSSP_DELTA_STEPPING)
+    {
+        releaseFrontierResources(engine);
+    }
+    if (engine->algorithm == SSSP_DELTA_STEPPING)
+    {
+        releaseDeltaResources(engine);
+    }
+    if (engine->algorithm == SSSP_BATCHED_SWEEP)
+    {
+        releaseBatchResources(engine);
     }
 
-    free (maskArrayHost);
+    clReleaseKernel(engine->initializeBuffersKernel);
+    clReleaseKernel(engine->ssspKernel1);
+    clReleaseKernel(engine->ssspKernel2);
+
+    clReleaseCommandQueue(engine->commandQueue);
+    clReleaseProgram(engine->program);
+    delete engine;
+}
+
+///
+/// Return the number of iterations run by all of the engine's queries so far.
+///
+long getDijkstraIterations( DijkstraEngine *engine )
+{
+    return engine->totalIterations;
+}
+
+///
+/// Return the number of edge relaxations done by all of the engine's queries so far.
+///
+long getDijkstraRelaxations( DijkstraEngine *engine )
+{
+    return engine->totalRelaxations;
+}
+
+///
+/// Select the algorithm used by runDijkstra(), runDijkstraOpenCL() and the multi
+/// device versions.
+///
+void setDijkstraAlgorithm( SSSPAlgorithm algorithm )
+{
+    defaultAlgorithm = algorithm;
+}
+
+///
+/// Set the bucket width of the SSSP_DELTA_STEPPING engines created from now on,
+/// or 0 to have each engine pick one from its graph.
+///
+void setDijkstraDelta( float delta )
+{
+    defaultDelta = delta;
+}
 
-    clReleaseMemObject(vertexArrayDevice);
-    clReleaseMemObject(edgeArrayDevice);
-    clReleaseMemObject(weightArrayDevice);
-    clReleaseMemObject(maskArrayDevice);
-    clReleaseMemObject(costArrayDevice);
-    clReleaseMemObject(updatingCostArrayDevice);
+///
+/// Set the number of sources the SSSP_BATCHED_SWEEP engines created from now on
+/// converge at once, or 0 to have each engine pick it from its device and graph.
+///
+void setDijkstraBatchSize( int batchSize )
+{
+    defaultBatchSize = batchSize;
+}
 
-    clReleaseKernel(initializeBuffersKernel);
-    clReleaseKernel(ssspKernel1);
-    clReleaseKernel(ssspKernel2);
+///
+/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
+/// function will compute the shortest path distance from sourceVertices[n] ->
+/// endVertices[n] and store the cost in outResultCosts[n].  The number of results
+/// it will compute is given by numResults.
+///
+/// This function will run the algorithm on a single GPU.  It sets up an engine
+/// for just this call; to answer queries continuously against the same graph,
+/// keep an engine from createDijkstraEngine() and call runDijkstraQuery() instead.
+///
+/// \param gpuContext Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernel.  This can
+///                 be determined externally by the caller or the multi
+///                 GPU version will automatically split the work across
+///                 devices
+/// \param graph Structure containing the vertex, edge, and weight arra
+///              for the input graph
+/// \param startVertices Indices into the vertex array from which to
+///                      start the search
+/// \param outResultsCosts A pre-allocated array where the results for
+///                        each shortest path search will be written
+/// \param numResults Should be the size of all three passed inarrays
+///
+void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
+                  int *sourceVertices, float *outResultCosts, int numResults)
+{
+    DijkstraEngine *engine = createDijkstraEngine( context, deviceId, graph, defaultAlgorithm );
+    if (engine == NULL)
+    {
+        return;
+    }
 
-    clReleaseCommandQueue(commandQueue);
-    clReleaseProgram(program);
-    cout << "Computed '" << numResults << "' results" << endl;
+    cout << "Computing '" << numResults << "' results." << endl;
+    runDijkstraQuery( engine, sourceVertices, outResultCosts, numResults );
+    cout << "Computed '" << numResults << "' results (" << engine->totalIterations << " iterations, "
+         << engine->totalChecks << " convergence checks, " << engine->totalRelaxations << " relaxations)" << endl;
+    releaseDijkstraEngine( engine );
 
 }
 
@@ -637,8 +1856,8 @@ void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available.  It will
-/// create N threads, one for each GPU, and chunk the workload up to perform
-/// (numResults / N) searches per GPU.
+/// create N threads, one for each GPU, which take their searches from a shared
+/// queue, so that a slower GPU does fewer of them rather than finishing last.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param graph Structure containing the vertex, edge, and weight arra
@@ -671,46 +1890,19 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
         return;
     }
 
-    DevicePlan *devicePlans = (DevicePlan*) malloc(sizeof(DevicePlan) * deviceCount);
-    pthread_t *threadIDs = (pthread_t*) malloc(sizeof(pthread_t) * deviceCount);
-
-    // Divide the workload out per device
-    int resultsPerDevice = numResults / deviceCount;
-
-    int offset = 0;
-
-    for (unsigned int i = 0; i < deviceCount; i++)
-    {
-        devicePlans[i].context = gpuContext;
-        devicePlans[i].deviceId = getDev(gpuContext, i);;
-        devicePlans[i].graph = graph;
-        devicePlans[i].sourceVertices = &sourceVertices[offset];
-        devicePlans[i].outResultCosts = &outResultCosts[offset * graph->vertexCount];
-        devicePlans[i].numResults = resultsPerDevice;
-
-        offset += resultsPerDevice;
-    }
-
-    // Add any remaining work to the last GPU
-    if (offset < numResults)
-    {
-        devicePlans[deviceCount - 1].numResults += (numResults - offset);
-    }
+    cl_context *contexts = (cl_context*) malloc(sizeof(cl_context) * deviceCount);
+    cl_device_id *devices = (cl_device_id*) malloc(sizeof(cl_device_id) * deviceCount);
 
-    // Launch all the threads
     for (unsigned int i = 0; i < deviceCount; i++)
     {
-        pthread_create(&threadIDs[i], NULL, (void* (*)(void*))dijkstraThread, (void*)(devicePlans + i));
+        contexts[i] = gpuContext;
+        devices[i] = getDev(gpuContext, i);
     }
 
-    // Wait for the results from all threads
-    for (unsigned int i = 0; i < deviceCount; i++)
-    {
-        pthread_join(threadIDs[i], NULL);
-    }
+    runDevicesFromQueue( contexts, devices, deviceCount, graph, sourceVertices, outResultCosts, numResults );
 
-    free (devicePlans);
-    free (threadIDs);
+    free (contexts);
+    free (devices);
 }
 
 ///
@@ -720,8 +1912,10 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available along with
-/// the CPU.  It will create N threads, one for each device, and chunk the workload up to perform
-/// (numResults / N) searches per device.
+/// the CPU.  It will create N threads, one for each device, which take their
+/// searches from a shared queue.  The threads driving the GPUs need CPU time of
+/// their own, so the CPU device is split to leave one compute unit per GPU free
+/// for them when OpenCL 1.2 sub-devices are available.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param cpuContext Current CPU context, must be created by caller
@@ -738,8 +1932,6 @@ void runDijkstraMultiGPUandCPU( cl_context gpuContext, cl_context cpuContext, Gr
                                 int *sourceVertices,
                                 float *outResultCosts, int numResults )
 {
-    float ratioCPUtoGPU = 2.26; // CPU seems to run it at 2.26X on GT120 GPU
-
     // Find out how many GPU's to compute on all available GPUs
     cl_int errNum;
     size_t deviceBytes;
@@ -766,70 +1958,100 @@ void runDijkstraMultiGPUandCPU( cl_context gpuContext, cl_context cpuContext, Gr
         return;
     }
 
-    cl_uint totalDeviceCount = gpuDeviceCount + cpuDeviceCount;
-
-    DevicePlan *devicePlans = (DevicePlan*) malloc(sizeof(DevicePlan) * totalDeviceCount);
-    pthread_t *threadIDs = (pthread_t*) malloc(sizeof(pthread_t) * totalDeviceCount);
-
-    int gpuResults = numResults / (ratioCPUtoGPU);
-    cout << "gpuResults: " << gpuResults;
-    int cpuResults = numResults - gpuResults;
-    cout << "cpuResults: " << cpuResults;
-
-    // Divide the workload out per device
-    int resultsPerGPU = gpuResults / totalDeviceCount;
+    // One CPU device, made smaller if it can be
+    cl_uint totalDeviceCount = gpuDeviceCount + 1;
 
-    int offset = 0;
+    cl_context *contexts = (cl_context*) malloc(sizeof(cl_context) * totalDeviceCount);
+    cl_device_id *devices = (cl_device_id*) malloc(sizeof(cl_device_id) * totalDeviceCount);
 
-    int curDevice = 0;
     for (unsigned int i = 0; i < gpuDeviceCount; i++)
     {
-        devicePlans[curDevice].context = gpuContext;
-        devicePlans[curDevice].deviceId = getDev(gpuContext, i);;
-        devicePlans[curDevice].graph = graph;
-        devicePlans[curDevice].sourceVertices = &sourceVertices[offset];
-        devicePlans[curDevice].outResultCosts = &outResultCosts[offset * graph->vertexCount];
-        devicePlans[curDevice].numResults = resultsPerGPU;
-
-        offset += resultsPerGPU;
-        curDevice++;
+        contexts[i] = gpuContext;
+        devices[i] = getDev(gpuContext, i);
     }
 
-    int resultsPerCPU = cpuResults;
+    // Running the CPU device on every core slows down the threads feeding the
+    // GPUs, so leave a core to each of them
+    cl_uint cpuUnits;
+    errNum = clGetDeviceInfo(getFirstDev(cpuContext), CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &cpuUnits, NULL);
+    checkError(errNum, CL_SUCCESS);
 
-    for (unsigned int i = 0; i < cpuDeviceCount; i++)
+    int subDeviceCount = 0;
+    if (cpuUnits > gpuDeviceCount)
     {
-        devicePlans[curDevice].context = cpuContext;
-        devicePlans[curDevice].deviceId = getDev(cpuContext, i);;
-        devicePlans[curDevice].graph = graph;
-        devicePlans[curDevice].sourceVertices = &sourceVertices[offset];
-        devicePlans[curDevice].outResultCosts = &outResultCosts[offset * graph->vertexCount];
-        devicePlans[curDevice].numResults = resultsPerCPU;
-
-        offset += resultsPerCPU;
-        curDevice++;
+        subDeviceCount = createCPUSubDevices( cpuContext, cpuUnits - gpuDeviceCount, 1,
+                                              &devices[gpuDeviceCount], &contexts[gpuDeviceCount] );
     }
-
-    // Add any remaining work to the last GPU
-    if (offset < numResults)
+    if (subDeviceCount == 0)
     {
-        devicePlans[totalDeviceCount - 1].numResults += (numResults - offset);
+        cout << "Running the CPU device on all " << cpuUnits << " compute units." << endl;
+        contexts[gpuDeviceCount] = cpuContext;
+        devices[gpuDeviceCount] = getFirstDev(cpuContext);
     }
-
-    // Launch all the threads
-    for (unsigned int i = 0; i < totalDeviceCount; i++)
+    else
     {
-        pthread_create(&threadIDs[i], NULL, (void* (*)(void*))dijkstraThread, (void*)(devicePlans + i));
+        cout << "Running the CPU device on " << (cpuUnits - gpuDeviceCount) << " of " << cpuUnits << " compute units." << endl;
     }
 
-    // Wait for the results from all threads
-    for (unsigned int i = 0; i < totalDeviceCount; i++)
+    runDevicesFromQueue( contexts, devices, totalDeviceCount, graph, sourceVertices, outResultCosts, numResults );
+
+    releaseCPUSubDevices( subDeviceCount, &devices[gpuDeviceCount], &contexts[gpuDeviceCount] );
+    free (contexts);
+    free (devices);
+}
+
+///
+/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
+/// function will compute the shortest path distance from sourceVertices[n] ->
+/// endVertices[n] and store the cost in outResultCosts[n].  The number of results
+/// it will compute is given by numResults.
+///
+/// This function will split the CPU device into sub-devices, and run the algorithm
+/// on each of them in its own thread, all taking their searches from a shared
+/// queue.  Each search then synchronizes only the cores of its sub-device at every
+/// iteration, rather than all of them.  Without OpenCL 1.2 sub-devices it runs on
+/// the whole CPU device.
+///
+/// \param cpuContext Current CPU context, must be created by caller
+/// \param graph Structure containing the vertex, edge, and weight arra
+///              for the input graph
+/// \param startVertices Indices into the vertex array from which to
+///                      start the search
+/// \param outResultsCosts A pre-allocated array where the results for
+///                        each shortest path search will be written
+/// \param numResults Should be the size of all three passed inarrays
+///
+void runDijkstraCPUSubDevices( cl_context cpuContext, GraphData* graph, int *sourceVertices,
+                               float *outResultCosts, int numResults )
+{
+    cl_int errNum;
+    cl_uint cpuUnits;
+    errNum = clGetDeviceInfo(getFirstDev(cpuContext), CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &cpuUnits, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    // No more sub-devices than there are searches to share
+    cl_uint unitsPerSubDevice = max((cl_uint) CPU_SUB_DEVICE_UNITS, cpuUnits / (cl_uint) max(numResults, 1));
+    unitsPerSubDevice = min(unitsPerSubDevice, cpuUnits);
+    int maxSubDevices = (int) (cpuUnits / unitsPerSubDevice);
+
+    cl_context *contexts = (cl_context*) malloc(sizeof(cl_context) * maxSubDevices);
+    cl_device_id *devices = (cl_device_id*) malloc(sizeof(cl_device_id) * maxSubDevices);
+
+    int subDeviceCount = createCPUSubDevices( cpuContext, unitsPerSubDevice, maxSubDevices, devices, contexts );
+    if (subDeviceCount == 0)
     {
-        pthread_join(threadIDs[i], NULL);
+        cout << "Could not split the CPU device, running on all " << cpuUnits << " compute units." << endl;
+        runDijkstra( cpuContext, getFirstDev(cpuContext), graph, sourceVertices, outResultCosts, numResults );
+    }
+    else
+    {
+        cout << "Running on " << subDeviceCount << " CPU sub-devices of " << unitsPerSubDevice << " compute units." << endl;
+        runDevicesFromQueue( contexts, devices, subDeviceCount, graph, sourceVertices, outResultCosts, numResults );
     }
 
-    free (devicePlans);
-    free (threadIDs);
+    releaseCPUSubDevices( subDeviceCount, devices, contexts );
+    free (contexts);
+    free (devices);
 }
 
 ///
@@ -61,6 +61,36 @@ typedef struct
 
 } GraphData;
 
+//
+//  Which kernels an engine runs each iteration
+//
+typedef enum
+{
+    // OCL_SSSP_KERNEL1/2, one work-item per vertex
+    SSSP_MASK_SWEEP,
+
+    // OCL_SSSP_FUSED, the same sweep in one kernel launch per iteration
+    SSSP_FUSED_SWEEP,
+
+    // Relax only a compacted queue of the vertices whose cost changed
+    SSSP_FRONTIER,
+
+    // Frontier relaxation in buckets of cost delta wide, lowest bucket first
+    SSSP_DELTA_STEPPING,
+
+    // OCL_SSSP_BATCH_FUSED, the fused sweep for several sources per launch
+    SSSP_BATCHED_SWEEP
+
+} SSSPAlgorithm;
+
+//
+//  A Dijkstra engine owns the command queue, the built program, the kernels and
+//  the device copy of one graph, so that repeated queries against that graph
+//  only pay for the relaxation work.  Its fields are private to
+//  oclDijkstraKernel.cpp.
+//
+struct DijkstraEngine;
+
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
 /// function will compute the shortest path distance from sourceVertices[n] ->
@@ -108,6 +138,71 @@ void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
 void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
                   int *sourceVertices, float *outResultCosts, int numResults );
 
+///
+/// Create a Dijkstra engine for the graph on the given device: build the
+/// program, create the kernels and copy the graph to the device.  The engine
+/// can then answer any number of queries with runDijkstraQuery().
+///
+/// \param context Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernels
+/// \param graph Structure containing the vertex, edge, and weight arra
+///              for the input graph.  It must stay valid, and unchanged,
+///              for the lifetime of the engine.
+/// \param algorithm Which kernels to run each iteration
+/// \return The engine, or NULL if the program could not be built
+///
+DijkstraEngine* createDijkstraEngine( cl_context context, cl_device_id deviceId, GraphData* graph,
+                                      SSSPAlgorithm algorithm );
+
+///
+/// Compute the shortest path distances from sourceVertices[n] to every vertex
+/// of the engine's graph and store them in outResultCosts[n * graph->vertexCount],
+/// for n < numResults.  Reuses the engine's program, kernels and buffers.
+///
+/// \param engine Engine created by createDijkstraEngine()
+/// \param startVertices Indices into the vertex array from which to
+///                      start the search
+/// \param outResultsCosts A pre-allocated array where the results for
+///                        each shortest path search will be written.
+///                        This must be sized numResults * graph->numVertices.
+/// \param numResults Should be the size of all three passed inarrays
+///
+void runDijkstraQuery( DijkstraEngine *engine, int *sourceVertices, float *outResultCosts, int numResults );
+
+///
+/// Release an engine created by createDijkstraEngine(), with everything it holds.
+///
+void releaseDijkstraEngine( DijkstraEngine *engine );
+
+///
+/// \return The number of iterations run by all of the engine's queries so far
+///
+long getDijkstraIterations( DijkstraEngine *engine );
+
+///
+/// \return The number of edge relaxations done by all of the engine's queries so far
+///
+long getDijkstraRelaxations( DijkstraEngine *engine );
+
+///
+/// Select the algorithm used by runDijkstra(), runDijkstraOpenCL() and the multi
+/// device versions.  The default is SSSP_MASK_SWEEP.
+///
+void setDijkstraAlgorithm( SSSPAlgorithm algorithm );
+
+///
+/// Set the bucket width of SSSP_DELTA_STEPPING engines created from now on.  A
+/// delta of 0, the default, picks one from each engine's graph.
+///
+void setDijkstraDelta( float delta );
+
+///
+/// Set the number of sources that SSSP_BATCHED_SWEEP engines created from now on
+/// converge at once.  A batch size of 0, the default, picks one from each
+/// engine's device and graph.
+///
+void setDijkstraBatchSize( int batchSize );
+
 
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
@@ -116,8 +211,8 @@ void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available.  It will
-/// create N threads, one for each GPU, and chunk the workload up to perform
-/// (numResults / N) searches per GPU.
+/// create N threads, one for each GPU, which take their searches from a shared
+/// queue, so that a slower GPU does fewer of them rather than finishing last.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param graph Structure containing the vertex, edge, and weight arra
@@ -140,8 +235,9 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available along with
-/// the CPU.  It will create N threads, one for each device, and chunk the workload up to perform
-/// (numResults / N) searches per device.
+/// the CPU.  It will create N threads, one for each device, which take their searches
+/// from a shared queue.  The CPU device is split to leave a core free for each
+/// thread feeding a GPU, when OpenCL 1.2 sub-devices are available.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param cpuContext Current CPU context, must be created by caller
@@ -158,6 +254,29 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
 void runDijkstraMultiGPUandCPU( cl_context gpuContext, cl_context cpuContext, GraphData* graph,
                                 int *sourceVertices, float *outResultCosts, int numResults );
 
+///
+/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
+/// function will compute the shortest path distance from sourceVertices[n] ->
+/// endVertices[n] and store the cost in outResultCosts[n].  The number of results
+/// it will compute is given by numResults.
+///
+/// This function will split the CPU into OpenCL 1.2 sub-devices and run the
+/// algorithm on each of them, in one thread per sub-device, all taking their
+/// searches from a shared queue.  Without sub-devices it runs on the whole CPU.
+///
+/// \param cpuContext Current CPU context, must be created by caller
+/// \param graph Structure containing the vertex, edge, and weight arra
+///              for the input graph
+/// \param startVertices Indices into the vertex array from which to
+///                      start the search
+/// \param outResultsCosts A pre-allocated array where the results for
+///                        each shortest path search will be written.
+///                        This must be sized numResults * graph->numVertices.
+/// \param numResults Should be the size of all three passed inarrays
+///
+void runDijkstraCPUSubDevices( cl_context cpuContext, GraphData* graph, int *sourceVertices,
+                               float *outResultCosts, int numResults );
+
 
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
@@ -0,0 +1,328 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* On-disk cache of the finished tiled matrix.                                       */
+/*                                                                                   */
+/* The cache file holds a header, the tiled buffer exactly as it is handed to        */
+/* OpenCL ("memsize" bytes, starting on a page boundary so that the mapped file can  */
+/* back a CL_MEM_USE_HOST_PTR buffer), followed by the slab start rows and the CSR   */
+/* arrays used for verification, and the row permutation if the matrix was           */
+/* reordered.  The file name is derived from a hash of every input that influences   */
+/* matrix_gen(), and the same inputs are stored in the header and compared on load,  */
+/* so a stale or foreign file is simply rebuilt.  The tuned tiling is compared but   */
+/* not hashed into the name, so retuning replaces the file rather than adding one.  */
+/* ================================================================================= */
+
+#define MATRIX_CACHE_MAGIC   "SPMVTILE"
+#define MATRIX_CACHE_VERSION 7
+#define MATRIX_CACHE_ALIGN   64
+
+typedef struct _matrix_cache_header {
+   matrix_cache_key key;
+   cl_uint nx, ny, non_zero, nx_pad, nyround;
+   cl_uint column_span, segcachesize, max_slabheight, gpu_wgsz, max_compute_units;
+   cl_uint num_header_packets, nslabs_round;
+   cl_uint kernel_type, symmetric;    /* symmetric: the CSR arrays and tiles hold one triangle */
+   cl_ulong memsize, datasize;
+   cl_ulong matrix_hash;              /* matrix_hash() of the CSR arrays, the tune database key */
+   cl_ulong tiles_offset;
+   cl_ulong slab_startrow_offset;
+   cl_ulong row_index_offset;
+   cl_ulong x_index_offset;
+   cl_ulong data_offset;
+   cl_ulong perm_offset;              /* 0 when the matrix was not reordered */
+   cl_ulong file_size;
+} matrix_cache_header;
+
+static cl_ulong fnv1a(cl_ulong hash, const void *data, size_t len)
+{
+   const unsigned char *p = (const unsigned char *) data;
+   size_t i;
+   for (i=0; i<len; ++i) {
+      hash ^= p[i];
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+static cl_ulong round_up(cl_ulong value, cl_ulong align)
+{
+   return (value + align - 1) / align * align;
+}
+
+static int write_fully(int fd, const void *data, size_t len)
+{
+   const char *p = (const char *) data;
+   while (len) {
+      ssize_t n = write(fd, p, len);
+      if (n <= 0) return -1;
+      p += n;
+      len -= (size_t) n;
+   }
+   return 0;
+}
+
+static int write_padding(int fd, cl_ulong *pos, cl_ulong target)
+{
+   static const char zeros[4096];
+   while (*pos < target) {
+      size_t n = (target - *pos < sizeof(zeros)) ? (size_t) (target - *pos) : sizeof(zeros);
+      if (write_fully(fd, zeros, n)) return -1;
+      *pos += n;
+   }
+   return 0;
+}
+
+/* ================================================================================= */
+/* Build the cache key and file name.  Must be called before matrix_gen(), because   */
+/* matrix_gen() overwrites some of its inputs (max_compute_units, gpu_wgsz).         */
+/* Returns 0 on success, -1 if the matrix file cannot be examined.                    */
+/* ================================================================================= */
+
+int matrix_cache_init(matrix_cache *mc, matrix_gen_struct *mgs, const char *cache_dir)
+{
+   struct stat statbuf;
+   char resolved[PATH_MAX];
+   char base[PATH_MAX];
+   cl_ulong hash;
+
+   memset(mc, 0, sizeof(matrix_cache));
+   memset(&statbuf, 0, sizeof(statbuf));
+   if (mgs->generate) {
+      /* A synthetic matrix is named by its spec, which determines it completely. */
+      snprintf(resolved, sizeof(resolved), "synthetic:%s", mgs->file_name);
+   }
+   else {
+      if (stat(mgs->file_name, &statbuf) != 0) return -1;
+      if (realpath(mgs->file_name, resolved) == NULL) return -1;
+   }
+
+   memcpy(mc->key.magic, MATRIX_CACHE_MAGIC, sizeof(mc->key.magic));
+   mc->key.version = MATRIX_CACHE_VERSION;
+   mc->key.packet_size = sizeof(packet);
+   mc->key.file_size = (cl_ulong) statbuf.st_size;
+   mc->key.file_mtime = (cl_long) statbuf.st_mtime;
+   mc->key.device_type = mgs->device_type;
+   mc->key.kernel_type = *(mgs->kernel_type);
+   mc->key.preferred_alignment = mgs->preferred_alignment;
+   mc->key.local_mem_size = mgs->local_mem_size;
+   mc->key.max_compute_units = *(mgs->max_compute_units);
+   mc->key.gpu_wgsz = (cl_uint) *(mgs->gpu_wgsz);
+   mc->key.kernel_wg_size = (cl_uint) mgs->kernel_wg_size;
+   mc->key.reorder = mgs->reorder;
+   mc->key.symmetric = (mgs->symmetric) ? *(mgs->symmetric) : 0;
+   mc->key.transition = mgs->transition;
+
+   hash = fnv1a(0xcbf29ce484222325ULL, resolved, strlen(resolved));
+   hash = fnv1a(hash, &mc->key, sizeof(matrix_cache_key));
+
+   strncpy(base, mgs->generate ? "synthetic" : resolved, sizeof(base) - 1);
+   base[sizeof(base) - 1] = '\0';
+   snprintf(mc->path, sizeof(mc->path), "%s/%s.%016llx.tiled", cache_dir, basename(base), (unsigned long long) hash);
+   return 0;
+}
+
+/* ================================================================================= */
+/* Read the matrix hash and chosen kernel type from a cache file that matches every  */
+/* part of the key but the tuning, so that the caller can look up the tuned tiling   */
+/* and put it in the key before matrix_cache_load().  Returns 1 if there is such a   */
+/* file, 0 otherwise.                                                                */
+/* ================================================================================= */
+
+int matrix_cache_peek(matrix_cache *mc, unsigned long long *hash, unsigned int *kernel_type)
+{
+   matrix_cache_header hdr;
+   ssize_t n;
+   int fd;
+
+   fd = open(mc->path, O_RDONLY);
+   if (fd < 0) return 0;
+   n = pread(fd, &hdr, sizeof(hdr), 0);
+   close(fd);
+   if (n != (ssize_t) sizeof(hdr)) return 0;
+
+   hdr.key.tune = mc->key.tune;
+   if (memcmp(&hdr.key, &mc->key, sizeof(matrix_cache_key)) != 0) return 0;
+   *hash = hdr.matrix_hash;
+   *kernel_type = hdr.kernel_type;
+   return 1;
+}
+
+/* ================================================================================= */
+/* Try to satisfy matrix_gen() from the cache.  On a hit, every output of            */
+/* matrix_gen() is set, the arrays point into a private read/write mapping of the    */
+/* cache file, and 1 is returned.  Returns 0 on a miss.                              */
+/* ================================================================================= */
+
+int matrix_cache_load(matrix_cache *mc, matrix_gen_struct *mgs)
+{
+   matrix_cache_header hdr;
+   struct stat statbuf;
+   int fd;
+
+   fd = open(mc->path, O_RDONLY);
+   if (fd < 0) return 0;
+
+   if ((fstat(fd, &statbuf) != 0) ||
+       (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) ||
+       (memcmp(&hdr.key, &mc->key, sizeof(matrix_cache_key)) != 0) ||
+       (hdr.file_size != (cl_ulong) statbuf.st_size) ||
+       (hdr.tiles_offset % getpagesize() != 0)) {
+      printf("ignoring stale matrix cache %s\n", mc->path);
+      close(fd);
+      return 0;
+   }
+
+   mc->map_size = (size_t) hdr.file_size;
+   mc->map = mmap(NULL, mc->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (mc->map == MAP_FAILED) {
+      mc->map = NULL;
+      return 0;
+   }
+
+   *(mgs->nx) = hdr.nx;
+   *(mgs->ny) = hdr.ny;
+   *(mgs->non_zero) = hdr.non_zero;
+   *(mgs->nx_pad) = hdr.nx_pad;
+   *(mgs->nyround) = hdr.nyround;
+   *(mgs->column_span) = hdr.column_span;
+   *(mgs->segcachesize) = hdr.segcachesize;
+   *(mgs->max_slabheight) = hdr.max_slabheight;
+   *(mgs->gpu_wgsz) = (int) hdr.gpu_wgsz;
+   *(mgs->max_compute_units) = hdr.max_compute_units;
+   *(mgs->num_header_packets) = hdr.num_header_packets;
+   *(mgs->nslabs_round) = hdr.nslabs_round;
+   *(mgs->memsize) = (size_t) hdr.memsize;
+   *(mgs->datasize) = (size_t) hdr.datasize;
+   *(mgs->kernel_type) = hdr.kernel_type;
+   if (mgs->symmetric) *(mgs->symmetric) = hdr.symmetric;
+
+   *(mgs->seg_workspace) = (packet *) ((char *) mc->map + hdr.tiles_offset);
+   *(mgs->matrix_header) = (slab_header *) *(mgs->seg_workspace);
+   *(mgs->slab_startrow) = (unsigned int *) ((char *) mc->map + hdr.slab_startrow_offset);
+   *(mgs->row_index_array) = (unsigned int *) ((char *) mc->map + hdr.row_index_offset);
+   *(mgs->x_index_array) = (unsigned int *) ((char *) mc->map + hdr.x_index_offset);
+   *(mgs->data_array) = (real *) ((char *) mc->map + hdr.data_offset);
+   if (mgs->perm) *(mgs->perm) = (hdr.perm_offset) ? (unsigned int *) ((char *) mc->map + hdr.perm_offset) : NULL;
+
+   printf("loaded tiled matrix from cache %s (%llu bytes)\n", mc->path, (unsigned long long) hdr.file_size);
+   return 1;
+}
+
+/* ================================================================================= */
+/* Write the outputs of a completed matrix_gen() call to the cache.  The file is     */
+/* written under a temporary name and renamed, so concurrent runs never observe a    */
+/* partially written cache.  Returns 0 on success, -1 on failure (not fatal).        */
+/* ================================================================================= */
+
+int matrix_cache_store(matrix_cache *mc, matrix_gen_struct *mgs)
+{
+   matrix_cache_header hdr;
+   char tmp_path[PATH_MAX + 16];
+   cl_ulong pos;
+   int fd;
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.key = mc->key;
+   hdr.nx = *(mgs->nx);
+   hdr.ny = *(mgs->ny);
+   hdr.non_zero = *(mgs->non_zero);
+   hdr.nx_pad = *(mgs->nx_pad);
+   hdr.nyround = *(mgs->nyround);
+   hdr.column_span = *(mgs->column_span);
+   hdr.segcachesize = *(mgs->segcachesize);
+   hdr.max_slabheight = *(mgs->max_slabheight);
+   hdr.gpu_wgsz = (cl_uint) *(mgs->gpu_wgsz);
+   hdr.max_compute_units = *(mgs->max_compute_units);
+   hdr.num_header_packets = *(mgs->num_header_packets);
+   hdr.nslabs_round = *(mgs->nslabs_round);
+   hdr.memsize = *(mgs->memsize);
+   hdr.datasize = *(mgs->datasize);
+   hdr.kernel_type = *(mgs->kernel_type);
+   hdr.symmetric = (mgs->symmetric) ? *(mgs->symmetric) : 0;
+   hdr.matrix_hash = matrix_hash(mgs);
+
+   hdr.tiles_offset = round_up(sizeof(hdr), (cl_ulong) getpagesize());
+   hdr.slab_startrow_offset = round_up(hdr.tiles_offset + hdr.memsize, MATRIX_CACHE_ALIGN);
+   hdr.row_index_offset = round_up(hdr.slab_startrow_offset + (hdr.nslabs_round + 1) * sizeof(unsigned int), MATRIX_CACHE_ALIGN);
+   hdr.x_index_offset = round_up(hdr.row_index_offset + (hdr.nyround + 1) * sizeof(unsigned int), MATRIX_CACHE_ALIGN);
+   hdr.data_offset = round_up(hdr.x_index_offset + (hdr.non_zero + 1) * sizeof(unsigned int), MATRIX_CACHE_ALIGN);
+   hdr.file_size = hdr.data_offset + hdr.non_zero * sizeof(real);
+   if (mgs->perm && *(mgs->perm)) {
+      hdr.perm_offset = round_up(hdr.file_size, MATRIX_CACHE_ALIGN);
+      hdr.file_size = hdr.perm_offset + hdr.ny * sizeof(unsigned int);
+   }
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.%d", mc->path, (int) getpid());
+   fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      printf("unable to create matrix cache %s\n", tmp_path);
+      return -1;
+   }
+
+   pos = 0;
+   if (write_fully(fd, &hdr, sizeof(hdr))) goto fail;
+   pos += sizeof(hdr);
+   if (write_padding(fd, &pos, hdr.tiles_offset)) goto fail;
+   /* Only "datasize" bytes are meaningful; the rest of "memsize" is zero slack. */
+   if (write_fully(fd, *(mgs->seg_workspace), (size_t) hdr.datasize)) goto fail;
+   pos += hdr.datasize;
+   if (write_padding(fd, &pos, hdr.slab_startrow_offset)) goto fail;
+   if (write_fully(fd, *(mgs->slab_startrow), (hdr.nslabs_round + 1) * sizeof(unsigned int))) goto fail;
+   pos += (hdr.nslabs_round + 1) * sizeof(unsigned int);
+   if (write_padding(fd, &pos, hdr.row_index_offset)) goto fail;
+   if (write_fully(fd, *(mgs->row_index_array), (hdr.nyround + 1) * sizeof(unsigned int))) goto fail;
+   pos += (hdr.nyround + 1) * sizeof(unsigned int);
+   if (write_padding(fd, &pos, hdr.x_index_offset)) goto fail;
+   if (write_fully(fd, *(mgs->x_index_array), (hdr.non_zero + 1) * sizeof(unsigned int))) goto fail;
+   pos += (hdr.non_zero + 1) * sizeof(unsigned int);
+   if (write_padding(fd, &pos, hdr.data_offset)) goto fail;
+   if (write_fully(fd, *(mgs->data_array), hdr.non_zero * sizeof(real))) goto fail;
+   pos += hdr.non_zero * sizeof(real);
+   if (hdr.perm_offset) {
+      if (write_padding(fd, &pos, hdr.perm_offset)) goto fail;
+      if (write_fully(fd, *(mgs->perm), hdr.ny * sizeof(unsigned int))) goto fail;
+   }
+
+   if (close(fd) != 0 || rename(tmp_path, mc->path) != 0) {
+      unlink(tmp_path);
+      printf("unable to write matrix cache %s\n", mc->path);
+      return -1;
+   }
+   printf("stored tiled matrix in cache %s (%llu bytes)\n", mc->path, (unsigned long long) hdr.file_size);
+   return 0;
+
+fail:
+   close(fd);
+   unlink(tmp_path);
+   printf("unable to write matrix cache %s\n", mc->path);
+   return -1;
+}
+
+/* ================================================================================= */
+/* Release the mapping established by matrix_cache_load().                           */
+/* ================================================================================= */
+
+void matrix_cache_release(matrix_cache *mc)
+{
+   if (mc->map) {
+      munmap(mc->map, mc->map_size);
+      mc->map = NULL;
+   }
+}
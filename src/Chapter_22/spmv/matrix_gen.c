@@ -9,187 +9,362 @@
 //
 
 
+#include <sys/resource.h>
 #include "spmv.h"
 
 /* ================================================================================= */
-/* Here is the routine which does the algorithm work in the host-based code.         */
+/* Kernel selection heuristic, for KERNEL_AUTO.                                      */
+/* The async-work-group-copy kernel is written for ACCELERATOR devices.  Elsewhere,  */
+/* SELL-C-sigma wins when its chunks are nearly full, because it has no per-packet   */
+/* control words and no local-memory accumulation; it is held to a stricter bar on   */
+/* the GPU, where the team-based load/store kernel already coalesces well.  Long,    */
+/* irregular rows favour the tiled format, whose packets cut them into 16-wide       */
+/* pieces instead of padding every row of a chunk to the longest one.                */
+/* ================================================================================= */
+
+unsigned int choose_kernel_type(const row_stats *stats, cl_device_type device_type)
+{
+   unsigned int kernel_type;
+   if (device_type == CL_DEVICE_TYPE_ACCELERATOR) {
+      kernel_type = KERNEL_AWGC;
+   }
+   else if (stats->sell_efficiency >= ((device_type == CL_DEVICE_TYPE_GPU) ? SELL_MIN_EFFICIENCY_GPU : SELL_MIN_EFFICIENCY_CPU)) {
+      kernel_type = KERNEL_SELL;
+   }
+   else {
+      kernel_type = KERNEL_LS;
+   }
+   printf("kernel heuristic selected the %s kernel\n", (kernel_type == KERNEL_SELL) ? "sell" : ((kernel_type == KERNEL_AWGC) ? "awgc" : "ls"));
+   return kernel_type;
+}
+
+/* ================================================================================= */
+/* Helpers for building the CSR arrays in place (see matrix_load()).                 */
+/* ================================================================================= */
+
+static void *grow_array(void *addr, size_t len, const char *addrstr)
+{
+   void *grown = realloc(addr, len);
+   if (grown == NULL) {
+      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) len, addrstr);
+      exit(EXIT_FAILURE);
+   }
+   return grown;
+}
+
+static void swap_pair(unsigned int *ix, real *data, unsigned int a, unsigned int b)
+{
+   unsigned int t = ix[a];
+   real d = data[a];
+   ix[a] = ix[b]; ix[b] = t;
+   data[a] = data[b]; data[b] = d;
+}
+
+static void swap_entry(unsigned int *ix, unsigned int *iy, real *data, unsigned int a, unsigned int b)
+{
+   unsigned int t = iy[a];
+   iy[a] = iy[b]; iy[b] = t;
+   swap_pair(ix, data, a, b);
+}
+
+/* Heapsort one row by column, carrying the values along; it needs no extra storage. */
+static void sift_down(unsigned int *ix, real *data, unsigned int root, unsigned int n)
+{
+   unsigned int child;
+   while ((child = 2 * root + 1) < n) {
+      if (child + 1 < n && ix[child + 1] > ix[child]) ++child;
+      if (ix[root] >= ix[child]) return;
+      swap_pair(ix, data, root, child);
+      root = child;
+   }
+}
+
+static void sort_row(unsigned int *ix, real *data, unsigned int n)
+{
+   unsigned int i;
+   for (i=n/2; i>0; --i) sift_down(ix, data, i-1, n);
+   for (i=n-1; i>0; --i) {
+      swap_pair(ix, data, 0, i);
+      sift_down(ix, data, 0, i);
+   }
+}
+
+/* For PageRank: entry (i, j) is a link from vertex j to vertex i, weighted by |value|  */
+/* (1 for a pattern matrix).  Each column is scaled to sum to 1; columns with no links */
+/* ("dangling" vertices) stay empty, and the PageRank driver redistributes their rank. */
+static void transition_matrix(unsigned int nx, unsigned int nnz, const unsigned int *x_index, real *data, unsigned int preferred_alignment)
+{
+   double *column_sum;
+   unsigned int i, dangling = 0;
+
+   MEMORY_ALLOC_CHECK(column_sum, ((nx ? nx : 1) * sizeof(double)), "column_sum")
+   for (i=0; i<nx; ++i) column_sum[i] = 0.0;
+   for (i=0; i<nnz; ++i) {
+      column_sum[x_index[i]] += fabs((double) data[i]);
+   }
+   for (i=0; i<nnz; ++i) {
+      data[i] = (real) (fabs((double) data[i]) / column_sum[x_index[i]]);
+   }
+   for (i=0; i<nx; ++i) {
+      dangling += (column_sum[i] == 0.0);
+   }
+   printf("transition matrix: columns normalized to sum to 1, %u dangling vertices\n", dangling);
+   free(column_sum);
+}
+
+/* Report the high-water mark of the process's resident memory. */
+void print_peak_memory(const char *stage)
+{
+   struct rusage usage;
+   if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+#ifdef __APPLE__
+   printf("peak memory after %s: %.1f MB\n", stage, (double) usage.ru_maxrss / 1048576.0);   /* bytes */
+#else
+   printf("peak memory after %s: %.1f MB\n", stage, (double) usage.ru_maxrss / 1024.0);      /* kilobytes */
+#endif
+}
+
+/* ================================================================================= */
+/* Here are the routines which do the algorithm work in the host-based code.         */
+/* matrix_load() reads the file into CSR arrays and picks the kernel if asked to;    */
+/* matrix_tile() builds the format that kernel reads.  The tuner (spmv_tune.c)       */
+/* calls matrix_tile() once per candidate on a single loaded matrix, so a failing    */
+/* matrix_tile() frees what it allocated and leaves those pointers NULL.             */
 /* ================================================================================= */
 
 int matrix_gen(matrix_gen_struct *mgs) {
+   int rc = matrix_load(mgs);
+   if (rc != 0) return rc;
+   if (mgs->reorder != REORDER_NONE && mgs->perm != NULL) {
+      matrix_reorder(mgs);
+   }
+   return matrix_tile(mgs);
+}
+
+int matrix_load(matrix_gen_struct *mgs) {
    unsigned int data_present, symmetric, preferred_alignment, preferred_alignment_by_elements;
-   FILE *inputMTX;
    unsigned int i, j;
+   int rc;
 
    preferred_alignment = mgs->preferred_alignment;
-   preferred_alignment_by_elements = preferred_alignment / sizeof(float);
+   preferred_alignment_by_elements = preferred_alignment / sizeof(real);
    if (preferred_alignment_by_elements < 16) preferred_alignment_by_elements = 16;
 
    /* =============================================================== */
-   /* Open Matrix File and read first lines of data.                  */
+   /* Read the raw data from the matrix file (see mtx_parse.c), or   */
+   /* generate it (see matrix_synth.c).  Explicit zeros are already   */
+   /* dropped, and indices are zero-based.                            */
    /* =============================================================== */
 
-   inputMTX = fopen((mgs->file_name), "r");
-   if (inputMTX == NULL) {
-      printf("Error opening maxtrix file %s\n", (mgs->file_name));
+   mtx_coo coo;
+   rc = (mgs->generate) ? mtx_generate(mgs->file_name, preferred_alignment, &coo)
+                        : mtx_parse(mgs->file_name, preferred_alignment, &coo);
+   if (rc != 0) {
       exit(EXIT_FAILURE);
    }
-   else {
-      char tmp[20], pattern_flag[20], symmetric_flag[20];
-      if (5 != fscanf(inputMTX, "%19s %19s %19s %19s %19s\n", tmp, tmp, tmp, pattern_flag, symmetric_flag)) {
-         fprintf(stderr, "error reading matrix market format header line\n");
-         exit(EXIT_FAILURE);
-      }
-      data_present = strcmp(pattern_flag, "pattern");
-      symmetric = strcmp(symmetric_flag, "general");
-      fscanf(inputMTX, "%d %d %d\n", (mgs->nx), (mgs->ny), (mgs->non_zero));
+   data_present = coo.data_present;
+   symmetric = coo.symmetric;
+
+   /* With half storage, a symmetric matrix keeps just the triangle in the file, and the */
+   /* LS_SYM kernel applies each off-diagonal entry to both of its rows.                 */
+   unsigned int half_storage = (mgs->symmetric != NULL && *(mgs->symmetric));
+   if (half_storage && !symmetric) {
+      printf("%s is not stored as a symmetric matrix; using full storage\n", mgs->file_name);
+      half_storage = 0;
+   }
+   if (half_storage) {
+      symmetric = 0;   /* nothing to mirror */
    }
+   if (mgs->symmetric != NULL) {
+      *(mgs->symmetric) = half_storage;
+   }
+   *(mgs->nx) = coo.nx;
+   *(mgs->ny) = coo.ny;
+   *(mgs->non_zero) = coo.non_zero;
 
    /* =============================================================== */
-   /* Create working storage for initial processing of matrix.        */
+   /* Count the entries of each row, check for anomalous data, and    */
+   /* fill in the values of pattern matrices.                         */
    /* =============================================================== */
 
-   unsigned int *count_array;
-   float **line_data_array;
-   unsigned int **line_x_index_array;
+   unsigned int *raw_ix = coo.ix;
+   unsigned int *raw_iy = coo.iy;
+   real *raw_data = coo.data;
+   unsigned int *row_index;
 
-   float *raw_data;
-   unsigned int *raw_ix;
-   unsigned int *raw_iy;
+   *(mgs->nyround) = (*(mgs->ny) + (preferred_alignment_by_elements - 1)) & (~(preferred_alignment_by_elements - 1));
 
-   MEMORY_ALLOC_CHECK(raw_ix, (*(mgs->non_zero) * sizeof (int)), "raw_ix") 
-   MEMORY_ALLOC_CHECK(raw_iy, (*(mgs->non_zero) * sizeof (int)), "raw_iy") 
-   MEMORY_ALLOC_CHECK(raw_data, (*(mgs->non_zero) * sizeof (float)), "raw_data") 
-   MEMORY_ALLOC_CHECK(line_data_array, (*(mgs->ny) * sizeof (float *)), "line_data_array") 
-   MEMORY_ALLOC_CHECK(line_x_index_array, (*(mgs->ny) * sizeof (int *)), "line_x_index_array") 
-   MEMORY_ALLOC_CHECK(count_array, (*(mgs->ny) * sizeof (int)), "count_array") 
-   for (i=0; i<*(mgs->ny); ++i) {
-      count_array[i] = 0;
-   }
+   if (*(mgs->nyround) < preferred_alignment_by_elements) *(mgs->nyround) = preferred_alignment_by_elements;
 
-   /* =============================================================== */
-   /* Read in the raw data from the matrix file.                      */
-   /* Check for anomalous data, and handle symmetric matrices.        */
-   /* =============================================================== */
+   MEMORY_ALLOC_CHECK(row_index, ((*(mgs->nyround)+1) * sizeof (int)), "row_index_array") 
+   for (i=0; i<=*(mgs->nyround); ++i) {
+      row_index[i] = 0;
+   }
 
-   unsigned int curry, actual_non_zero;
-   curry = actual_non_zero = 0;
-   unsigned int explicit_zero_count = 0;
+   unsigned int curry = (*(mgs->non_zero) > 0) ? raw_iy[0] : 0;
+   unsigned int diagonal_count = 0;
    for (i=0; i<*(mgs->non_zero); ++i) {
-      unsigned int ix, iy;
-      float data; 
-      fscanf(inputMTX, "%d %d\n", &ix, &iy);
-      if (i == 0) {
-         curry = iy-1;
-      }
-      if (data_present) {
-         double double_data;
-         fscanf(inputMTX, "%lf\n", &double_data);
-         data = (float) double_data;
+      unsigned int ix = raw_ix[i];
+      unsigned int iy = raw_iy[i];
+      diagonal_count += (ix == iy);
+      if (!data_present) {
+         raw_data[i] = (mgs->transition) ? (real) 1 : ((real) (rand() & 0x7fff)) * (real) 0.001 - (real) 15.0;
       }
-      else data = ((float) (rand() & 0x7fff)) * 0.001f - 15.0f;
-      if (data_present && data == 0.0) {
-         ++explicit_zero_count;
+      ++row_index[iy];
+      if (symmetric && (ix != iy)) {
+         ++row_index[ix];
       }
-      else {
-         --ix;
-         --iy;
-         raw_ix[actual_non_zero] = ix;
-         raw_iy[actual_non_zero] = iy;
-         raw_data[actual_non_zero] = data;
-         ++actual_non_zero;
-         ++count_array[iy];
-         if (symmetric && (ix != iy)) {
-            ++count_array[ix];
-         }
-         if (iy != curry) {
-            if (iy != curry+1) {
-               printf("gap in the input (non-invertible matrix): i = %d, iy = %d, curry = %d\n", actual_non_zero, iy, curry);
-            }
-            curry = iy;
+      if (iy != curry) {
+         if (iy != curry+1) {
+            printf("gap in the input (non-invertible matrix): i = %d, iy = %d, curry = %d\n", i+1, iy, curry);
          }
+         curry = iy;
       }
    }
-   if (explicit_zero_count) {
-      printf("explicit_zero_count = %d\n", explicit_zero_count);
-   }
-   *(mgs->non_zero) = actual_non_zero;
-
-   /* =============================================================== */
-   /* Create working storage for each row's data.                     */
-   /* =============================================================== */
-
-   for (i=0; i<*(mgs->ny); ++i) {
-      MEMORY_ALLOC_CHECK(line_data_array[i], (count_array[i] * sizeof (float)), "line_data_array[i]") 
-      MEMORY_ALLOC_CHECK(line_x_index_array[i], (count_array[i] * sizeof (int)), "line_x_index_array[i]") 
-      count_array[i] = 0;
-   }
-
-   /* Fill in each row (special handling for symmetric matrices). */
-   for (i=0; i<*(mgs->non_zero); ++i) {
-      line_data_array[raw_iy[i]][count_array[raw_iy[i]]] = raw_data[i];
-      line_x_index_array[raw_iy[i]][count_array[raw_iy[i]]] = raw_ix[i];
-      ++count_array[raw_iy[i]];
-      if (symmetric && (raw_ix[i] != raw_iy[i])) {
-         line_data_array[raw_ix[i]][count_array[raw_ix[i]]] = raw_data[i];
-         line_x_index_array[raw_ix[i]][count_array[raw_ix[i]]] = raw_iy[i];
-         ++count_array[raw_ix[i]];
-      }
+   if (coo.explicit_zero_count) {
+      printf("explicit_zero_count = %d\n", coo.explicit_zero_count);
    }
 
    /* The non_zero is now recalculated, as it will be larger if the matrix was symmetric. */
+   unsigned int stored = *(mgs->non_zero);
    *(mgs->non_zero) = 0;
    for (i=0; i<*(mgs->ny); ++i) {
-      *(mgs->non_zero) += count_array[i];
+      unsigned int count = row_index[i];
+      row_index[i] = *(mgs->non_zero);
+      *(mgs->non_zero) += count;
+   }
+   for (i=*(mgs->ny); i<=*(mgs->nyround); ++i) {
+      row_index[i] = *(mgs->non_zero);
    }
    double density = ((double) *(mgs->non_zero)) / ((double) *(mgs->nx) * (double) *(mgs->ny));
    printf("nx = %d, ny = %d, non_zero = %d, density = %f\n", *(mgs->nx), *(mgs->ny), *(mgs->non_zero), density);
-
-   *(mgs->nyround) = (*(mgs->ny) + (preferred_alignment_by_elements - 1)) & (~(preferred_alignment_by_elements - 1));
-
-   if (*(mgs->nyround) < preferred_alignment_by_elements) *(mgs->nyround) = preferred_alignment_by_elements;
+   if (half_storage) {
+      printf("symmetric half storage: %d entries stored for %d nonzeros\n", *(mgs->non_zero), 2 * *(mgs->non_zero) - diagonal_count);
+   }
 
    /* now that we know the size, we can prevent excessive segmentation of small matrices */
    unsigned int min_compute_units = (*(mgs->nyround) + preferred_alignment_by_elements - 1) / preferred_alignment_by_elements;
    if (*(mgs->max_compute_units) > min_compute_units) *(mgs->max_compute_units) = min_compute_units;
 
-   /* Release no-longer-needed arrays. */
-   free(raw_ix);
-   free(raw_iy);
-   free(raw_data);
-
    /* =============================================================== */
-   /* Create and load the actual CSR arrays.                          */
+   /* Turn the raw arrays into the CSR arrays in place.  A symmetric  */
+   /* matrix has its mirrored entries appended first; x_index_array   */
+   /* gets one spare entry, which matrix_tile() reads past each row.  */
+   /* Then every entry is swapped straight to its row's next free     */
+   /* slot, and rows that are not already in column order are sorted */
+   /* (matrix_tile() walks each row left to right).  No entry is held */
+   /* twice, so the load peaks at the raw arrays plus two row arrays. */
    /* =============================================================== */
 
-   MEMORY_ALLOC_CHECK(*(mgs->data_array), (*(mgs->non_zero) * sizeof (float)), "data_array") 
-
-   MEMORY_ALLOC_CHECK(*(mgs->x_index_array), ((*(mgs->non_zero)+1) * sizeof (int)), "x_index_array") 
-
-   MEMORY_ALLOC_CHECK(*(mgs->row_index_array), ((*(mgs->nyround)+1) * sizeof (int)), "row_index_array") 
+   raw_ix = grow_array(raw_ix, (*(mgs->non_zero)+1) * sizeof (int), "x_index_array");
+   if (*(mgs->non_zero) > stored) {
+      raw_iy = grow_array(raw_iy, *(mgs->non_zero) * sizeof (int), "raw_iy");
+      raw_data = grow_array(raw_data, *(mgs->non_zero) * sizeof (real), "data_array");
+      j = stored;
+      for (i=0; i<stored; ++i) {
+         if (raw_ix[i] != raw_iy[i]) {
+            raw_ix[j] = raw_iy[i];
+            raw_iy[j] = raw_ix[i];
+            raw_data[j] = raw_data[i];
+            ++j;
+         }
+      }
+   }
 
-   unsigned int index = 0;
+   unsigned int *row_fill;
+   MEMORY_ALLOC_CHECK(row_fill, ((*(mgs->ny) ? *(mgs->ny) : 1) * sizeof (int)), "row_fill") 
+   memcpy(row_fill, row_index, *(mgs->ny) * sizeof (int));
+   for (i=0; i<*(mgs->ny); ++i) {
+      while (row_fill[i] < row_index[i+1]) {
+         unsigned int here = row_fill[i];
+         unsigned int there;
+         if (raw_iy[here] == i) {
+            ++row_fill[i];
+            continue;
+         }
+         there = row_fill[raw_iy[here]]++;
+         swap_entry(raw_ix, raw_iy, raw_data, here, there);
+      }
+   }
+   free(row_fill);
+   free(raw_iy);
 
    for (i=0; i<*(mgs->ny); ++i) {
-      (*(mgs->row_index_array))[i] = index;
-      for (j=0; j<count_array[i]; ++j) {
-         (*(mgs->data_array))[index] = line_data_array[i][j];
-         (*(mgs->x_index_array))[index] = line_x_index_array[i][j];
-         ++index;
+      for (j=row_index[i]+1; j<row_index[i+1]; ++j) {
+         if (raw_ix[j] < raw_ix[j-1]) {
+            sort_row(&raw_ix[row_index[i]], &raw_data[row_index[i]], row_index[i+1] - row_index[i]);
+            break;
+         }
       }
    }
-   for (i=*(mgs->ny); i<=*(mgs->nyround); ++i) {
-      (*(mgs->row_index_array))[i] = *(mgs->non_zero);
+
+   *(mgs->row_index_array) = row_index;
+   *(mgs->x_index_array) = raw_ix;
+   *(mgs->data_array) = raw_data;
+   if (mgs->transition) {
+      transition_matrix(*(mgs->nx), *(mgs->non_zero), raw_ix, raw_data, preferred_alignment);
    }
+   print_peak_memory("matrix load");
 
-   for (i=0; i<*(mgs->ny); ++i) {
-      if (count_array[i]) {
-         free(line_data_array[i]);
-         free(line_x_index_array[i]);
+   /* ============================================================================= */
+   /* Gather row-length statistics, and let them pick the kernel if asked to.       */
+   /* The SELL-C-sigma format is built directly from the CSR arrays.                */
+   /* ============================================================================= */
+
+   sell_row_stats(*(mgs->row_index_array), *(mgs->ny), mgs->device_type, mgs->stats);
+   printf("row lengths: min = %u, max = %u, mean = %f, stddev = %f, SELL fill efficiency = %f\n", 
+          mgs->stats->min_row, mgs->stats->max_row, mgs->stats->mean_row, mgs->stats->stddev_row, mgs->stats->sell_efficiency);
+
+   if (*(mgs->kernel_type) == KERNEL_AUTO) {
+      *(mgs->kernel_type) = choose_kernel_type(mgs->stats, mgs->device_type);
+   }
+   return 0;
+}
+
+/* How many packets matrix_tile() emits for the slab of rows [row0, row1): for each group */
+/* of 16 rows and each column_span-wide section, as many as the group's longest piece.   */
+static unsigned int slab_packets(matrix_gen_struct *mgs, unsigned int row0, unsigned int row1)
+{
+   const unsigned int *row_index = *(mgs->row_index_array);
+   const unsigned int *x_index = *(mgs->x_index_array);
+   unsigned int span = *(mgs->column_span);
+   unsigned int curr[16];
+   unsigned int npackets, j, k, kk;
+
+   if (row_index[row0] == row_index[row1]) {
+      return (*(mgs->num_header_packets) > 0) ? *(mgs->num_header_packets) : 1;
+   }
+   npackets = *(mgs->num_header_packets);
+   for (k=row0; k<row1; k+=16) {
+      for (kk=0; kk<16; ++kk) curr[kk] = row_index[k+kk];
+      for (j=0; j<*(mgs->nx_pad); j+=span) {
+         unsigned int maxcount = 0;
+         for (kk=0; kk<16; ++kk) {
+            unsigned int count = 0;
+            while (curr[kk] < row_index[k+kk+1] && x_index[curr[kk]] < j+span) {
+               ++curr[kk];
+               ++count;
+            }
+            if (count > maxcount) maxcount = count;
+         }
+         npackets += maxcount;
       }
    }
-   free(line_data_array);
-   free(line_x_index_array);
-   free(count_array);
+   return npackets;
+}
+
+int matrix_tile(matrix_gen_struct *mgs) {
+   unsigned int preferred_alignment, preferred_alignment_by_elements;
+   unsigned int i, j;
+   const tune_params *tune = mgs->tune;
+
+   preferred_alignment = mgs->preferred_alignment;
+   preferred_alignment_by_elements = preferred_alignment / sizeof(real);
+   if (preferred_alignment_by_elements < 16) preferred_alignment_by_elements = 16;
+
+   if (*(mgs->kernel_type) == KERNEL_SELL) {
+      return sell_gen(mgs);
+   }
 
    /* ============================================================================= */
    /* Now that we have the CSR format of the matrix (in "row_index_array",          */
@@ -207,12 +382,15 @@ int matrix_gen(matrix_gen_struct *mgs) {
    /* (3) the tile width should not overwhelm local memory.     */
    /* The variable "column_span" holds this tile width.         */
 
-   if ((mgs->kernel_type) == KERNEL_AWGC) {
+   if (*(mgs->kernel_type) == KERNEL_AWGC) {
       *(mgs->column_span) = (mgs->local_mem_size) / 64;
    }
-   if ((mgs->kernel_type) == KERNEL_LS) {
+   if (*(mgs->kernel_type) == KERNEL_LS) {
       *(mgs->column_span) = 65536;
    }
+   if (tune && tune->column_span) {
+      *(mgs->column_span) = tune->column_span;
+   }
    if (*(mgs->column_span) > *(mgs->nx)) {
       *(mgs->column_span) = *(mgs->nx);
    }
@@ -232,8 +410,8 @@ int matrix_gen(matrix_gen_struct *mgs) {
    nslabs_base = *(mgs->max_compute_units);
    unsigned int nslabs = 0;
 
-   if ((mgs->kernel_type) == KERNEL_AWGC) {
-      slab_threshhold = ((7 * ((mgs->local_mem_size)/sizeof(float))) / 16) - 1;
+   if (*(mgs->kernel_type) == KERNEL_AWGC) {
+      slab_threshhold = ((7 * ((mgs->local_mem_size)/sizeof(real))) / 16) - 1;
       slab_threshhold &= ~(preferred_alignment_by_elements - 1);
       unsigned int expected_nslabs = *(mgs->nyround) / slab_threshhold;
       if (expected_nslabs < nslabs_base) {
@@ -243,6 +421,9 @@ int matrix_gen(matrix_gen_struct *mgs) {
       /* Decide how big the local cache for packet data should be, based on local memory considerations. */
       /* (Typically we will read in 16 or 32 packets at a time.)                                          */
       *(mgs->segcachesize) = (mgs->local_mem_size) / 8192;
+      if (tune && tune->segcachesize) {
+         *(mgs->segcachesize) = tune->segcachesize;
+      }
       while (*(mgs->segcachesize) & (*(mgs->segcachesize)-1)) {
          ++(*(mgs->segcachesize)); /* raise up to a power of 2 */
       }
@@ -291,6 +472,9 @@ int matrix_gen(matrix_gen_struct *mgs) {
    }
    else {
       if ((mgs->device_type) == CL_DEVICE_TYPE_GPU) {
+         if (tune && tune->wgsz) {
+            *(mgs->gpu_wgsz) = tune->wgsz;
+         }
          if (*(mgs->gpu_wgsz) > MAX_WGSZ) {
             printf("coercing gpu work group size to MAX WORK GROUP SIZE, which is %d\n", MAX_WGSZ);
             *(mgs->gpu_wgsz) = MAX_WGSZ;
@@ -324,7 +508,11 @@ int matrix_gen(matrix_gen_struct *mgs) {
       }
       else {
          nslabs = *(mgs->max_compute_units);
-         while (*(mgs->nyround) / nslabs >= ((mgs->local_mem_size)/sizeof(float))) nslabs *= 2;
+         if (tune && tune->slab_factor) {
+            nslabs *= tune->slab_factor;
+            while (nslabs > 1 && nslabs > *(mgs->nyround) / preferred_alignment_by_elements) nslabs /= 2;
+         }
+         while (*(mgs->nyround) / nslabs >= ((mgs->local_mem_size)/sizeof(real))) nslabs *= 2;
          MEMORY_ALLOC_CHECK((*(mgs->slab_startrow)), ((nslabs + 1) * sizeof (unsigned int)), "(mgs->slab_startrow)") 
          for (i=0; i<=nslabs; ++i) {
             (*(mgs->slab_startrow))[i] = (((*(mgs->nyround)/preferred_alignment_by_elements) * i) / nslabs) * preferred_alignment_by_elements;
@@ -365,22 +553,30 @@ int matrix_gen(matrix_gen_struct *mgs) {
    /* =============================================================== */
 
    /* each header packet holds information for 512 threads */
-   *(mgs->num_header_packets) = (((mgs->kernel_type) == KERNEL_AWGC) || ((mgs->device_type) != CL_DEVICE_TYPE_GPU)) ? 0 : (MAX_WGSZ+511)/512;
+   *(mgs->num_header_packets) = ((*(mgs->kernel_type) == KERNEL_AWGC) || ((mgs->device_type) != CL_DEVICE_TYPE_GPU)) ? 0 : (MAX_WGSZ+511)/512;
    
    /* This large loop does the bulk of the hard work to load the data into the packets. */
    int seg_index;
    unsigned int k;
-   /* The size of the array is admittedly derived using heuristics, but has been found satisfactory   */
-   /* for all matrices that have been run through this program during development.                    */
-   unsigned int temp_count;
-   temp_count = (*(mgs->non_zero) > 16) ? *(mgs->non_zero) : 16;
-   MEMORY_ALLOC_CHECK(*(mgs->seg_workspace), (temp_count/2) * sizeof(packet), "*seg_workspace") 
-   for (i = 0; i < temp_count>>1; ++i) {
-      for (j=0; j<16; ++j) { /* Pre-load input and output indices with flag saying "no data here". */
-         (*(mgs->seg_workspace))[i].input_offset_short[j] = (cl_ushort) 0;
-         (*(mgs->seg_workspace))[i].matdata[j] = 0.0f;
-      }
+   /* A counting pass over the slabs sizes the array exactly, so that it can be handed to OpenCL */
+   /* as the matrix buffer itself (see spmv.c), with nothing copied and nothing left over.      */
+   size_t total_packets = 0;
+   for (i=0; i<nslabs; ++i) {
+      total_packets += slab_packets(mgs, (*(mgs->slab_startrow))[i], (*(mgs->slab_startrow))[i+1]);
+   }
+   size_t header_bytes = ((3 * 4 * ((size_t) nslabs+1) + sizeof(packet)) / sizeof(packet)) * sizeof(packet);
+   /* Slab offsets are 32-bit packet indices. */
+   if (header_bytes / sizeof(packet) + total_packets + 32 > 0xffffffffULL) {
+      printf("matrix is too large for the tiled format (%llu packets)\n", (unsigned long long) total_packets);
+      free(row_start);
+      free(row_curr);
+      free(*(mgs->slab_startrow));
+      *(mgs->slab_startrow) = NULL;
+      return -1;
    }
+   size_t workspace_bytes = header_bytes + (total_packets + 32) * sizeof(packet);
+   MEMORY_ALLOC_CHECK(*(mgs->seg_workspace), workspace_bytes, "*seg_workspace") 
+   memset(*(mgs->seg_workspace), 0, workspace_bytes); /* Pre-load input and output indices with flag saying "no data here". */
    /* The entire matrix is split across the multiple devices, and as such, */
    /* We need to know, for each device, where do the slabs start and stop. */
    *(mgs->nslabs_round) = nslabs;
@@ -423,7 +619,7 @@ int matrix_gen(matrix_gen_struct *mgs) {
          for (j=0; j<=(*(mgs->slab_startrow))[i+1]-(*(mgs->slab_startrow))[i]; ++j) {
             row_start[j] = (*(mgs->row_index_array))[(*(mgs->slab_startrow))[i]+j];
          }
-         if (((mgs->device_type) != CL_DEVICE_TYPE_GPU) || ((mgs->kernel_type) == KERNEL_AWGC)) {
+         if (((mgs->device_type) != CL_DEVICE_TYPE_GPU) || (*(mgs->kernel_type) == KERNEL_AWGC)) {
             for (j=0; j<*(mgs->nx_pad); j+= *(mgs->column_span)) {
                unsigned int kk;
                for (k=0; k<(*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i]; k+= 16) {
@@ -522,6 +718,13 @@ int matrix_gen(matrix_gen_struct *mgs) {
                }
                if ((packet_offset > 65535) || (packet_count > 65535)) {
                   printf("eek!\n");
+                  free(row_start);
+                  free(row_curr);
+                  free(*(mgs->seg_workspace));
+                  free(*(mgs->slab_startrow));
+                  *(mgs->seg_workspace) = NULL;
+                  *(mgs->slab_startrow) = NULL;
+                  *(mgs->matrix_header) = NULL;
                   return(-1);
                }
                first_team_offset[k>>4] = packet_offset * 65536 + packet_count;
@@ -552,6 +755,7 @@ int matrix_gen(matrix_gen_struct *mgs) {
    (*(mgs->matrix_header))[current_slab].offset = (*(mgs->memsize))/sizeof(packet);
    (*(mgs->matrix_header))[current_slab].outindex = (*(mgs->slab_startrow))[*(mgs->nslabs_round)]-(*(mgs->slab_startrow))[0];
    (*(mgs->matrix_header))[current_slab].outspan = 0;
+   *(mgs->datasize) = (*(mgs->memsize));
 
    /* This loop records some statistics, and sets one final value into the packets. */
    for (i=0; i<*(mgs->nslabs_round); ++i) {
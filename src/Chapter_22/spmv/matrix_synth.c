@@ -0,0 +1,355 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <math.h>
+#include <time.h>
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Synthetic matrices, generated straight into the COO arrays mtx_parse() fills, so  */
+/* that the tiling and kernel paths can be exercised at any size without a file.     */
+/*                                                                                   */
+/* A spec is a kind, optionally followed by ':' and comma-separated key=value pairs: */
+/*                                                                                   */
+/*    band:n=1e6,bw=8           rows within bw of the diagonal                       */
+/*    stencil5:n=1e6            5-point Laplacian on a 2D grid of about n points     */
+/*    stencil7:n=1e6            7-point Laplacian on a 3D grid                       */
+/*    stencil27:n=1e6           27-point Laplacian on a 3D grid                      */
+/*    random:n=1e6,nnz=1e7      uniformly scattered columns, nnz/n per row           */
+/*    rmat:n=1e6,nnz=1.6e7      power-law (R-MAT) graph, with a=,b=,c= quadrant      */
+/*                              probabilities (default 0.57, 0.19, 0.19)             */
+/*                                                                                   */
+/* For band and random, density=d may be given instead of nnz (or bw); seed=s picks  */
+/* a different random matrix.  Entries are produced in row order with a diagonal in  */
+/* every row, so no row is empty.  The stencils carry their Laplacian values (they   */
+/* are SPD, and so suit --cg); the other kinds are patterns, whose values            */
+/* matrix_load() fills in just as it does for a "pattern" Matrix Market file.        */
+/* Band and stencil matrices are symmetric, and like a "symmetric" file, only their  */
+/* lower triangle is generated.                                                      */
+/* ================================================================================= */
+
+#define SYNTH_BAND      0
+#define SYNTH_STENCIL5  1
+#define SYNTH_STENCIL7  2
+#define SYNTH_STENCIL27 3
+#define SYNTH_RANDOM    4
+#define SYNTH_RMAT      5
+
+typedef struct _synth_spec {
+   unsigned int kind;
+   double n;
+   double nnz;
+   double density;
+   double bw;
+   double a, b, c;
+   unsigned long long seed;
+} synth_spec;
+
+static const char *synth_names[] = { "band", "stencil5", "stencil7", "stencil27", "random", "rmat" };
+
+/* splitmix64: small, fast, and good enough to place nonzeros. */
+static unsigned long long next_random(unsigned long long *state)
+{
+   unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+static double next_uniform(unsigned long long *state)
+{
+   return (double) (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int compare_uint(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+/* Sorts cols[0..len) and drops duplicates; returns the new length. */
+static unsigned int sort_unique(unsigned int *cols, unsigned int len)
+{
+   unsigned int i, k;
+   if (len < 2) return len;
+   qsort(cols, len, sizeof(unsigned int), compare_uint);
+   for (i=1, k=1; i<len; ++i) {
+      if (cols[i] != cols[k-1]) cols[k++] = cols[i];
+   }
+   return k;
+}
+
+static int parse_spec(const char *text, synth_spec *spec)
+{
+   const char *p;
+   unsigned int kind;
+   size_t len;
+
+   memset(spec, 0, sizeof(synth_spec));
+   spec->a = 0.57;
+   spec->b = 0.19;
+   spec->c = 0.19;
+   spec->seed = 1;
+
+   len = strcspn(text, ":");
+   for (kind=0; kind<sizeof(synth_names)/sizeof(synth_names[0]); ++kind) {
+      if (strlen(synth_names[kind]) == len && strncmp(text, synth_names[kind], len) == 0) break;
+   }
+   if (kind == sizeof(synth_names)/sizeof(synth_names[0])) {
+      printf("unknown synthetic matrix kind in '%s' (expected band, stencil5, stencil7, stencil27, random or rmat)\n", text);
+      return -1;
+   }
+   spec->kind = kind;
+
+   p = text + len;
+   while (*p != '\0') {
+      char key[16];
+      char *value_end;
+      double value;
+      size_t klen;
+
+      ++p;                                   /* skip ':' or ',' */
+      klen = strcspn(p, "=,");
+      if (p[klen] != '=' || klen == 0 || klen >= sizeof(key)) {
+         printf("malformed synthetic matrix parameter in '%s' (expected key=value)\n", text);
+         return -1;
+      }
+      memcpy(key, p, klen);
+      key[klen] = '\0';
+      value = strtod(p + klen + 1, &value_end);
+      if (value_end == p + klen + 1 || (*value_end != ',' && *value_end != '\0') || value < 0.0) {
+         printf("bad value for '%s' in '%s'\n", key, text);
+         return -1;
+      }
+      if (strcmp(key, "n") == 0) spec->n = value;
+      else if (strcmp(key, "nnz") == 0) spec->nnz = value;
+      else if (strcmp(key, "density") == 0) spec->density = value;
+      else if (strcmp(key, "bw") == 0) spec->bw = value;
+      else if (strcmp(key, "a") == 0) spec->a = value;
+      else if (strcmp(key, "b") == 0) spec->b = value;
+      else if (strcmp(key, "c") == 0) spec->c = value;
+      else if (strcmp(key, "seed") == 0) spec->seed = (unsigned long long) value;
+      else {
+         printf("unknown synthetic matrix parameter '%s' in '%s'\n", key, text);
+         return -1;
+      }
+      p = value_end;
+   }
+   if (spec->n < 1.0) spec->n = 10000.0;
+   if (spec->n > 4.0e9) {
+      printf("synthetic matrix of %.0f rows is too large\n", spec->n);
+      return -1;
+   }
+   if (spec->a + spec->b + spec->c > 1.0) {
+      printf("R-MAT probabilities a+b+c must not exceed 1\n");
+      return -1;
+   }
+   return 0;
+}
+
+/* Allocates the COO arrays for at most "capacity" entries. */
+static int coo_alloc(mtx_coo *coo, double capacity, unsigned int preferred_alignment)
+{
+   if (capacity >= 4294967295.0) {
+      printf("synthetic matrix would have %.0f entries; at most 2^32-1 are supported\n", capacity);
+      return -1;
+   }
+   MEMORY_ALLOC_CHECK(coo->ix, ((capacity > 0.0 ? (size_t) capacity : 1) * sizeof(int)), "raw_ix")
+   MEMORY_ALLOC_CHECK(coo->iy, ((capacity > 0.0 ? (size_t) capacity : 1) * sizeof(int)), "raw_iy")
+   MEMORY_ALLOC_CHECK(coo->data, ((capacity > 0.0 ? (size_t) capacity : 1) * sizeof(real)), "raw_data")
+   return 0;
+}
+
+static int gen_band(const synth_spec *spec, unsigned int n, mtx_coo *coo, unsigned int preferred_alignment)
+{
+   unsigned int i, j, bw;
+   double w = spec->bw;
+   if (spec->nnz > 0.0) w = (spec->nnz / n - 1.0) / 2.0;
+   else if (spec->density > 0.0) w = (spec->density * n - 1.0) / 2.0;
+   if (w < 0.0) w = 0.0;
+   bw = (w >= n) ? n - 1 : (unsigned int) (w + 0.5);
+
+   if (coo_alloc(coo, (double) n * (bw + 1.0), preferred_alignment)) return -1;
+   coo->symmetric = 1;
+   for (i=0; i<n; ++i) {
+      unsigned int lo = (i > bw) ? i - bw : 0;
+      for (j=lo; j<=i; ++j) {
+         coo->iy[coo->non_zero] = i;
+         coo->ix[coo->non_zero] = j;
+         ++coo->non_zero;
+      }
+   }
+   return 0;
+}
+
+/* Dirichlet Laplacian on a side^dims grid: the diagonal is the number of stencil */
+/* neighbours, and each neighbour inside the grid is -1.                          */
+static int gen_stencil(const synth_spec *spec, unsigned int dims, unsigned int full, unsigned int *np, mtx_coo *coo, unsigned int preferred_alignment)
+{
+   unsigned int side = (unsigned int) floor(pow(spec->n, 1.0 / dims) + 1e-9);
+   unsigned int points = full ? 27 : 2 * dims + 1;
+   unsigned int n, x, y, z, zmax;
+   int dx, dy, dz, dzmax;
+   if (side < 1) side = 1;
+   n = (dims == 2) ? side * side : side * side * side;
+   zmax = (dims == 2) ? 1 : side;
+   dzmax = (dims == 2) ? 0 : 1;
+   *np = n;
+
+   if (coo_alloc(coo, (double) n * (points / 2 + 1), preferred_alignment)) return -1;
+   coo->data_present = 1;
+   coo->symmetric = 1;
+   for (z=0; z<zmax; ++z) {
+      for (y=0; y<side; ++y) {
+         for (x=0; x<side; ++x) {
+            unsigned int row = (z * side + y) * side + x;
+            /* Offsets are visited in increasing column order, up to the diagonal. */
+            for (dz=-dzmax; dz<=dzmax; ++dz) {
+               for (dy=-1; dy<=1; ++dy) {
+                  for (dx=-1; dx<=1; ++dx) {
+                     int manhattan = abs(dx) + abs(dy) + abs(dz);
+                     if (!full && manhattan > 1) continue;
+                     if ((int) x + dx < 0 || (int) x + dx >= (int) side) continue;
+                     if ((int) y + dy < 0 || (int) y + dy >= (int) side) continue;
+                     if ((int) z + dz < 0 || (int) z + dz >= (int) zmax) continue;
+                     if (dz > 0 || (dz == 0 && (dy > 0 || (dy == 0 && dx > 0)))) continue;
+                     coo->iy[coo->non_zero] = row;
+                     coo->ix[coo->non_zero] = ((z + dz) * side + (y + dy)) * side + (x + dx);
+                     coo->data[coo->non_zero] = (manhattan == 0) ? (real) (points - 1) : (real) -1;
+                     ++coo->non_zero;
+                  }
+               }
+            }
+         }
+      }
+   }
+   return 0;
+}
+
+static int gen_random(const synth_spec *spec, unsigned int n, mtx_coo *coo, unsigned int preferred_alignment)
+{
+   double target = spec->nnz;
+   unsigned int i, j, per_row, extra;
+   unsigned long long state;
+   if (target <= 0.0) target = (spec->density > 0.0) ? spec->density * n * (double) n : 10.0 * n;
+   if (target > (double) n * n) target = (double) n * n;
+   per_row = (unsigned int) (target / n);
+   extra = (unsigned int) (target - (double) per_row * n);
+
+   /* Every row also gets its diagonal. */
+   if (coo_alloc(coo, target + n, preferred_alignment)) return -1;
+   for (i=0; i<n; ++i) {
+      unsigned int *cols = &coo->ix[coo->non_zero];
+      unsigned int len = per_row + (i < extra);
+      state = spec->seed * 0x100000001b3ULL + i;
+      for (j=0; j<len; ++j) {
+         cols[j] = (unsigned int) (next_random(&state) % n);
+      }
+      cols[len++] = i;
+      len = sort_unique(cols, len);
+      for (j=0; j<len; ++j) coo->iy[coo->non_zero + j] = i;
+      coo->non_zero += len;
+   }
+   return 0;
+}
+
+/* Recursive-matrix (R-MAT) edges: each edge picks a quadrant per level with */
+/* probabilities a, b, c and 1-a-b-c, giving a power-law degree distribution. */
+static int gen_rmat(const synth_spec *spec, unsigned int *np, mtx_coo *coo, unsigned int preferred_alignment)
+{
+   unsigned int scale = 0, n, i, e, nedges;
+   unsigned int *edge_row, *edge_col, *start;
+   unsigned long long state = spec->seed;
+   double target;
+
+   while (scale < 31 && (double) (1U << scale) < spec->n) ++scale;
+   n = 1U << scale;
+   *np = n;
+   target = (spec->nnz > 0.0) ? spec->nnz : 16.0 * n;
+   if (target >= 4294967295.0 - n) {
+      printf("synthetic matrix would have %.0f entries; at most 2^32-1 are supported\n", target + n);
+      return -1;
+   }
+   nedges = (unsigned int) target;
+
+   MEMORY_ALLOC_CHECK(edge_row, ((nedges ? nedges : 1) * sizeof(unsigned int)), "rmat rows")
+   MEMORY_ALLOC_CHECK(edge_col, ((nedges ? nedges : 1) * sizeof(unsigned int)), "rmat cols")
+   MEMORY_ALLOC_CHECK(start, ((n + 1) * sizeof(unsigned int)), "rmat row start")
+   memset(start, 0, (n + 1) * sizeof(unsigned int));
+   for (e=0; e<nedges; ++e) {
+      unsigned int row = 0, col = 0, level;
+      for (level=0; level<scale; ++level) {
+         double r = next_uniform(&state);
+         row <<= 1;
+         col <<= 1;
+         if (r >= spec->a + spec->b + spec->c) { row |= 1; col |= 1; }
+         else if (r >= spec->a + spec->b) row |= 1;
+         else if (r >= spec->a) col |= 1;
+      }
+      edge_row[e] = row;
+      edge_col[e] = col;
+      ++start[row + 1];
+   }
+
+   /* Bucket the edges by row (with room for each row's diagonal), then sort and merge each row. */
+   for (i=0; i<n; ++i) start[i+1] += start[i] + 1;
+   if (coo_alloc(coo, (double) start[n], preferred_alignment)) return -1;
+   for (i=0; i<n; ++i) coo->ix[start[i]++] = i;
+   for (e=0; e<nedges; ++e) coo->ix[start[edge_row[e]]++] = edge_col[e];
+   free(edge_row);
+   free(edge_col);
+
+   for (i=0; i<n; ++i) {
+      unsigned int first = (i == 0) ? 0 : start[i-1];
+      unsigned int len = sort_unique(&coo->ix[first], start[i] - first);
+      memmove(&coo->ix[coo->non_zero], &coo->ix[first], len * sizeof(unsigned int));
+      for (e=0; e<len; ++e) coo->iy[coo->non_zero + e] = i;
+      coo->non_zero += len;
+   }
+   free(start);
+   return 0;
+}
+
+/* ================================================================================= */
+/* Build the matrix described by "spec" (see above) into zero-based COO arrays.      */
+/* Returns 0 on success; on failure an error is printed and -1 is returned.          */
+/* ================================================================================= */
+
+int mtx_generate(const char *text, unsigned int preferred_alignment, mtx_coo *coo)
+{
+   synth_spec spec;
+   unsigned int n;
+   int rc;
+   struct timespec t0, t1;
+
+   memset(coo, 0, sizeof(mtx_coo));
+   if (parse_spec(text, &spec) != 0) return -1;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+
+   n = (unsigned int) spec.n;
+   switch (spec.kind) {
+      case SYNTH_BAND:      rc = gen_band(&spec, n, coo, preferred_alignment); break;
+      case SYNTH_STENCIL5:  rc = gen_stencil(&spec, 2, 0, &n, coo, preferred_alignment); break;
+      case SYNTH_STENCIL7:  rc = gen_stencil(&spec, 3, 0, &n, coo, preferred_alignment); break;
+      case SYNTH_STENCIL27: rc = gen_stencil(&spec, 3, 1, &n, coo, preferred_alignment); break;
+      case SYNTH_RANDOM:    rc = gen_random(&spec, n, coo, preferred_alignment); break;
+      default:              rc = gen_rmat(&spec, &n, coo, preferred_alignment); break;
+   }
+   if (rc != 0) return -1;
+   coo->nx = coo->ny = n;
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   printf("generated %s: %u x %u, %u entries in %.3f s\n", text, n, n, coo->non_zero,
+          (double) (t1.tv_sec - t0.tv_sec) + 1e-9 * (double) (t1.tv_nsec - t0.tv_nsec));
+   return 0;
+}
@@ -0,0 +1,358 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Parallel Matrix Market reader.                                                    */
+/*                                                                                   */
+/* The file is mapped into memory and the body (everything after the size line) is   */
+/* split into line-aligned chunks, one per thread.  A first pass counts the entries  */
+/* in every chunk, so that each thread knows where its entries belong, and a second  */
+/* pass scans the numbers with a hand-written parser directly into the COO arrays.   */
+/* Explicit zeros are dropped by each thread, and the surviving entries are then     */
+/* compacted in chunk order, so the result matches a sequential read of the file.    */
+/* ================================================================================= */
+
+#define MTX_MAX_THREADS 64
+#define MTX_MIN_CHUNK   (1 << 20)    /* Don't bother spawning a thread for less than 1 MB of text. */
+
+typedef struct _mtx_chunk {
+   const char *begin;
+   const char *end;
+   mtx_coo *coo;
+   unsigned int first;               /* index of this chunk's first entry in the COO arrays */
+   unsigned int lines;               /* number of entries found by the counting pass */
+   unsigned int kept;                /* number of entries remaining after explicit zeros are dropped */
+   unsigned int explicit_zero_count;
+   const char *bad_line;             /* first malformed line, if any */
+} mtx_chunk;
+
+static const double pow10_table[23] = {
+   1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+   while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+   return p;
+}
+
+static const char *next_line(const char *p, const char *end)
+{
+   const char *nl = (const char *) memchr(p, '\n', (size_t) (end - p));
+   return (nl == NULL) ? end : nl + 1;
+}
+
+/* A line holds an entry unless it is blank or a comment. */
+static int is_entry_line(const char *p, const char *end)
+{
+   p = skip_blanks(p, end);
+   return (p < end && *p != '\n' && *p != '%');
+}
+
+static const char *scan_uint(const char *p, const char *end, unsigned int *value)
+{
+   unsigned long long v = 0;
+   const char *start;
+   p = skip_blanks(p, end);
+   start = p;
+   while (p < end && *p >= '0' && *p <= '9') {
+      v = v * 10 + (unsigned int) (*p - '0');
+      ++p;
+   }
+   if (p == start || v > 0xffffffffULL) return NULL;
+   *value = (unsigned int) v;
+   return p;
+}
+
+static const char *scan_real(const char *p, const char *end, double *value)
+{
+   unsigned long long mantissa = 0;
+   int negative = 0, exponent = 0, digits = 0, significant = 0;
+
+   p = skip_blanks(p, end);
+   if (p < end && (*p == '-' || *p == '+')) {
+      negative = (*p == '-');
+      ++p;
+   }
+   for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+      if (significant < 19) {
+         mantissa = mantissa * 10 + (unsigned int) (*p - '0');
+         if (mantissa) ++significant;
+      }
+      else {
+         ++exponent;
+      }
+   }
+   if (p < end && *p == '.') {
+      for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+         if (significant < 19) {
+            mantissa = mantissa * 10 + (unsigned int) (*p - '0');
+            if (mantissa) ++significant;
+            --exponent;
+         }
+      }
+   }
+   if (digits == 0) {
+      /* Not a plain decimal number (e.g. "nan" or "inf"): let the C library deal with it. */
+      char tmp[64];
+      char *stop;
+      size_t len = 0;
+      while (p + len < end && len < sizeof(tmp) - 1 && p[len] != ' ' && p[len] != '\t' && p[len] != '\r' && p[len] != '\n') {
+         tmp[len] = p[len];
+         ++len;
+      }
+      tmp[len] = '\0';
+      *value = strtod(tmp, &stop);
+      if (stop == tmp) return NULL;
+      if (negative) *value = -*value;
+      return p + (stop - tmp);
+   }
+   if (p < end && (*p == 'e' || *p == 'E' || *p == 'd' || *p == 'D')) {
+      int exp_negative = 0, exp_value = 0;
+      ++p;
+      if (p < end && (*p == '-' || *p == '+')) {
+         exp_negative = (*p == '-');
+         ++p;
+      }
+      while (p < end && *p >= '0' && *p <= '9') {
+         if (exp_value < 10000) exp_value = exp_value * 10 + (*p - '0');
+         ++p;
+      }
+      exponent += exp_negative ? -exp_value : exp_value;
+   }
+
+   double v = (double) mantissa;
+   while (exponent > 22) { v *= 1e22; exponent -= 22; }
+   while (exponent < -22) { v /= 1e22; exponent += 22; }
+   v = (exponent >= 0) ? v * pow10_table[exponent] : v / pow10_table[-exponent];
+   *value = negative ? -v : v;
+   return p;
+}
+
+static void *count_chunk(void *arg)
+{
+   mtx_chunk *chunk = (mtx_chunk *) arg;
+   const char *p = chunk->begin;
+   chunk->lines = 0;
+   while (p < chunk->end) {
+      if (is_entry_line(p, chunk->end)) ++chunk->lines;
+      p = next_line(p, chunk->end);
+   }
+   return NULL;
+}
+
+static void *parse_chunk(void *arg)
+{
+   mtx_chunk *chunk = (mtx_chunk *) arg;
+   mtx_coo *coo = chunk->coo;
+   const char *p = chunk->begin;
+   unsigned int out = chunk->first;
+
+   chunk->kept = 0;
+   chunk->explicit_zero_count = 0;
+   chunk->bad_line = NULL;
+   while (p < chunk->end) {
+      const char *line = p;
+      const char *q;
+      unsigned int ix, iy;
+      double data = 0.0;
+
+      p = next_line(p, chunk->end);
+      if (!is_entry_line(line, p)) continue;
+
+      q = scan_uint(line, p, &ix);
+      if (q) q = scan_uint(q, p, &iy);
+      if (q && coo->data_present) q = scan_real(q, p, &data);
+      if (q == NULL || ix == 0 || iy == 0 || ix > coo->nx || iy > coo->ny) {
+         chunk->bad_line = line;
+         return NULL;
+      }
+      if (coo->data_present && (real) data == 0) {
+         ++chunk->explicit_zero_count;
+         continue;
+      }
+      coo->ix[out] = ix - 1;
+      coo->iy[out] = iy - 1;
+      coo->data[out] = (real) data;
+      ++out;
+      ++chunk->kept;
+   }
+   return NULL;
+}
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+/* Runs "fn" over every chunk, on its own thread when there is more than one chunk. */
+static void run_chunks(void *(*fn)(void *), mtx_chunk *chunk, int nchunks)
+{
+   pthread_t threads[MTX_MAX_THREADS];
+   int t;
+   if (nchunks == 1) {
+      fn(&chunk[0]);
+      return;
+   }
+   for (t=0; t<nchunks; ++t) {
+      if (pthread_create(&threads[t], NULL, fn, &chunk[t]) != 0) {
+         fn(&chunk[t]);
+         threads[t] = pthread_self();
+      }
+   }
+   for (t=0; t<nchunks; ++t) {
+      if (!pthread_equal(threads[t], pthread_self())) pthread_join(threads[t], NULL);
+   }
+}
+
+/* ================================================================================= */
+/* Read a Matrix Market coordinate file into zero-based COO arrays.                  */
+/* Returns 0 on success; on failure an error is printed and -1 is returned.          */
+/* ================================================================================= */
+
+int mtx_parse(const char *file_name, unsigned int preferred_alignment, mtx_coo *coo)
+{
+   struct stat statbuf;
+   const char *text, *end, *p;
+   char tmp[32], pattern_flag[32], symmetric_flag[32];
+   mtx_chunk chunk[MTX_MAX_THREADS];
+   int nchunks, t, fd;
+   unsigned int total, declared;
+   double start_time = seconds_now();
+
+   memset(coo, 0, sizeof(mtx_coo));
+   fd = open(file_name, O_RDONLY);
+   if (fd < 0 || fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+      printf("Error opening maxtrix file %s\n", file_name);
+      if (fd >= 0) close(fd);
+      return -1;
+   }
+   text = (const char *) mmap(NULL, (size_t) statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (text == MAP_FAILED) {
+      printf("Error mapping maxtrix file %s\n", file_name);
+      return -1;
+   }
+   madvise((void *) text, (size_t) statbuf.st_size, MADV_SEQUENTIAL);
+   end = text + statbuf.st_size;
+
+   /* ============================================================= */
+   /* Banner line, optional comment lines, and the size line.       */
+   /* ============================================================= */
+
+   p = next_line(text, end);
+   {
+      char banner[256];
+      size_t len = (size_t) (p - text) < sizeof(banner) - 1 ? (size_t) (p - text) : sizeof(banner) - 1;
+      memcpy(banner, text, len);
+      banner[len] = '\0';
+      if (5 != sscanf(banner, "%31s %31s %31s %31s %31s", tmp, tmp, tmp, pattern_flag, symmetric_flag)) {
+         fprintf(stderr, "error reading matrix market format header line\n");
+         munmap((void *) text, (size_t) statbuf.st_size);
+         return -1;
+      }
+   }
+   coo->data_present = strcmp(pattern_flag, "pattern");
+   coo->symmetric = strcmp(symmetric_flag, "general");
+
+   while (p < end && !is_entry_line(p, end)) p = next_line(p, end);
+   {
+      const char *q = scan_uint(p, end, &coo->nx);
+      if (q) q = scan_uint(q, end, &coo->ny);
+      if (q) q = scan_uint(q, end, &declared);
+      if (q == NULL) {
+         fprintf(stderr, "error reading matrix market size line\n");
+         munmap((void *) text, (size_t) statbuf.st_size);
+         return -1;
+      }
+      p = next_line(q, end);
+   }
+
+   /* ============================================================= */
+   /* Split the body into line-aligned chunks and count entries.    */
+   /* ============================================================= */
+
+   long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   nchunks = (int) ((end - p) / MTX_MIN_CHUNK) + 1;
+   if (nchunks > ncpu) nchunks = (int) ncpu;
+   if (nchunks > MTX_MAX_THREADS) nchunks = MTX_MAX_THREADS;
+   if (nchunks < 1) nchunks = 1;
+
+   for (t=0; t<nchunks; ++t) {
+      chunk[t].coo = coo;
+      chunk[t].begin = (t == 0) ? p : chunk[t-1].end;
+      if (t == nchunks - 1) {
+         chunk[t].end = end;
+      }
+      else {
+         const char *split = p + (size_t) ((end - p) / nchunks) * (size_t) (t + 1);
+         if (split < chunk[t].begin) split = chunk[t].begin;
+         chunk[t].end = next_line(split, end);
+      }
+   }
+   run_chunks(count_chunk, chunk, nchunks);
+
+   total = 0;
+   for (t=0; t<nchunks; ++t) {
+      chunk[t].first = total;
+      total += chunk[t].lines;
+   }
+   if (total != declared) {
+      printf("matrix file declares %u entries but contains %u\n", declared, total);
+   }
+
+   MEMORY_ALLOC_CHECK(coo->ix, ((total ? total : 1) * sizeof (int)), "raw_ix")
+   MEMORY_ALLOC_CHECK(coo->iy, ((total ? total : 1) * sizeof (int)), "raw_iy")
+   MEMORY_ALLOC_CHECK(coo->data, ((total ? total : 1) * sizeof (real)), "raw_data")
+
+   /* ============================================================= */
+   /* Parse every chunk in place, then close the gaps left by       */
+   /* dropped explicit zeros.                                       */
+   /* ============================================================= */
+
+   run_chunks(parse_chunk, chunk, nchunks);
+
+   for (t=0; t<nchunks; ++t) {
+      if (chunk[t].bad_line != NULL) {
+         const char *nl = next_line(chunk[t].bad_line, end);
+         printf("malformed matrix market entry: %.*s\n", (int) (nl - chunk[t].bad_line), chunk[t].bad_line);
+         munmap((void *) text, (size_t) statbuf.st_size);
+         free(coo->ix);
+         free(coo->iy);
+         free(coo->data);
+         return -1;
+      }
+      if (chunk[t].first != coo->non_zero) {
+         memmove(&coo->ix[coo->non_zero], &coo->ix[chunk[t].first], chunk[t].kept * sizeof(int));
+         memmove(&coo->iy[coo->non_zero], &coo->iy[chunk[t].first], chunk[t].kept * sizeof(int));
+         memmove(&coo->data[coo->non_zero], &coo->data[chunk[t].first], chunk[t].kept * sizeof(real));
+      }
+      coo->non_zero += chunk[t].kept;
+      coo->explicit_zero_count += chunk[t].explicit_zero_count;
+   }
+
+   munmap((void *) text, (size_t) statbuf.st_size);
+
+   double elapsed = seconds_now() - start_time;
+   printf("parsed %s: %.1f MB in %.3f s (%.1f MB/s, %d thread%s)\n", file_name, (double) statbuf.st_size / 1e6, elapsed,
+          (elapsed > 0.0) ? (double) statbuf.st_size / 1e6 / elapsed : 0.0, nchunks, (nchunks == 1) ? "" : "s");
+   return 0;
+}
@@ -0,0 +1,195 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Compressed packets for the LS kernel (--half).  A tiled matrix built by           */
+/* matrix_tile() is copied into "cpackets": the sixteen matrix values are stored as  */
+/* fp16 or bfloat16, and the control words only the AWGC kernel reads are dropped,   */
+/* so a packet takes 80 bytes instead of 128.  The slab layout is unchanged, apart   */
+/* from offsets now counting cpackets and the GPU team words being repacked into as  */
+/* many cpackets as they need.  SpMV streams the matrix once per product, so the     */
+/* smaller packets are a direct gain in throughput; the kernels widen each value to  */
+/* float and accumulate at full precision.                                           */
+/* ================================================================================= */
+
+typedef union _float_bits {
+   float f;
+   cl_uint u;
+} float_bits;
+
+/* Round to nearest even.  Magnitudes beyond the largest half (65504) saturate to it */
+/* rather than becoming infinities; those below the smallest subnormal become zero.  */
+static cl_ushort float_to_fp16(float f, unsigned int *saturated, unsigned int *flushed)
+{
+   float_bits v;
+   cl_uint sign, mag, h, rest;
+
+   v.f = f;
+   sign = (v.u >> 16) & 0x8000;
+   mag = v.u & 0x7fffffff;
+   if (mag >= 0x477ff000) {         /* 65520 and up would round to infinity */
+      ++*saturated;
+      return (cl_ushort) (sign | 0x7bff);
+   }
+   if (mag < 0x38800000) {          /* below 2^-14: a half subnormal, in units of 2^-24 (exact scaling) */
+      h = (cl_uint) lrintf(fabsf(f) * 16777216.0f);
+      if (h == 0 && mag != 0) ++*flushed;
+      return (cl_ushort) (sign | h);
+   }
+   h = ((((mag >> 23) - 127 + 15) << 10) | ((mag & 0x7fffff) >> 13));
+   rest = mag & 0x1fff;
+   if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) ++h;  /* a carry into the exponent is still correct */
+   return (cl_ushort) (sign | h);
+}
+
+static float fp16_to_float(cl_ushort h)
+{
+   float_bits v;
+   cl_uint exponent = (h >> 10) & 0x1f;
+   cl_uint mantissa = h & 0x3ff;
+
+   if (exponent == 0) {
+      v.f = ldexpf((float) mantissa, -24);
+   }
+   else {
+      v.u = ((exponent - 15 + 127) << 23) | (mantissa << 13);
+   }
+   v.u |= ((cl_uint) (h & 0x8000)) << 16;
+   return v.f;
+}
+
+/* bfloat16 is the top half of a float: round to nearest even, saturating as above. */
+static cl_ushort float_to_bf16(float f, unsigned int *saturated, unsigned int *flushed)
+{
+   float_bits v;
+   cl_uint rounded;
+
+   v.f = f;
+   rounded = v.u + 0x7fff + ((v.u >> 16) & 1);
+   if ((rounded & 0x7f800000) == 0x7f800000) {
+      ++*saturated;
+      return (cl_ushort) (((v.u >> 16) & 0x8000) | 0x7f7f);
+   }
+   if ((v.u & 0x7fffffff) != 0 && (rounded & 0x7fff0000) == 0) ++*flushed;
+   return (cl_ushort) (rounded >> 16);
+}
+
+static float bf16_to_float(cl_ushort b)
+{
+   float_bits v;
+   v.u = ((cl_uint) b) << 16;
+   return v.f;
+}
+
+static cl_ushort encode_value(real value, unsigned int format, unsigned int *saturated, unsigned int *flushed)
+{
+   return (format == PACKET_BF16) ? float_to_bf16((float) value, saturated, flushed) : float_to_fp16((float) value, saturated, flushed);
+}
+
+static real decode_value(cl_ushort bits, unsigned int format)
+{
+   return (real) ((format == PACKET_BF16) ? bf16_to_float(bits) : fp16_to_float(bits));
+}
+
+const char *packet_format_name(unsigned int format)
+{
+   switch (format) {
+      case PACKET_FP16: return "fp16";
+      case PACKET_BF16: return "bf16";
+   }
+   return REAL_NAME;
+}
+
+/* The value the compressed kernels see in place of "value". */
+real packet_value(real value, unsigned int format)
+{
+   unsigned int saturated = 0, flushed = 0;
+   if (format == PACKET_FULL) return value;
+   return decode_value(encode_value(value, format, &saturated, &flushed), format);
+}
+
+int packet_compress(matrix_gen_struct *mgs, unsigned int format, compressed_matrix *cm)
+{
+   unsigned int preferred_alignment = mgs->preferred_alignment; /* used by "MEMORY_ALLOC_CHECK" macro */
+   unsigned int nslabs = *(mgs->nslabs_round);
+   unsigned int num_header_packets = *(mgs->num_header_packets);
+   slab_header *hdr = *(mgs->matrix_header);
+   packet *seg = *(mgs->seg_workspace);
+   slab_header *chdr;
+   cpacket *cseg;
+   unsigned int team_words, header_cpackets, first, total, out, s, p, l;
+   unsigned int saturated = 0, flushed = 0;
+   double max_relative = 0.0, error_squared = 0.0, value_squared = 0.0;
+
+   /* One word per team of 16 work units, 512 work units per header packet. */
+   team_words = num_header_packets * (512 / 16);
+   header_cpackets = (team_words * sizeof(cl_uint) + sizeof(cpacket) - 1) / sizeof(cpacket);
+   first = (sizeof(slab_header) * (nslabs + 1) + sizeof(cpacket) - 1) / sizeof(cpacket);
+
+   total = first;
+   for (s=0; s<nslabs; ++s) {
+      unsigned int npackets = hdr[s+1].offset - hdr[s].offset;
+      total += header_cpackets + ((npackets > num_header_packets) ? npackets - num_header_packets : 0);
+   }
+   cm->datasize = (size_t) total * sizeof(cpacket);
+   cm->memsize = cm->datasize + 32 * sizeof(cpacket); /* the same read-past-end room matrix_gen leaves */
+   cm->num_header_packets = header_cpackets;
+   MEMORY_ALLOC_CHECK(cm->workspace, cm->memsize, "compressed seg_workspace")
+   memset(cm->workspace, 0, cm->memsize);
+   cseg = cm->workspace;
+   chdr = (slab_header *) cseg;
+
+   out = first;
+   for (s=0; s<nslabs; ++s) {
+      unsigned int npackets = hdr[s+1].offset - hdr[s].offset;
+      chdr[s].offset = out;
+      chdr[s].outindex = hdr[s].outindex;
+      chdr[s].outspan = hdr[s].outspan;
+      if (team_words) {
+         /* The team words hold packet counts and offsets, which are the same in either format. */
+         memcpy(&cseg[out], &seg[hdr[s].offset], team_words * sizeof(cl_uint));
+      }
+      out += header_cpackets;
+      for (p=hdr[s].offset+num_header_packets; p<hdr[s].offset+npackets; ++p, ++out) {
+         cseg[out].seg_input_offset = seg[p].seg_input_offset;
+         cseg[out].npackets_remaining = seg[p].npackets_remaining;
+         cseg[out].seg_output_offset = seg[p].seg_output_offset;
+         for (l=0; l<16; ++l) {
+            real value = seg[p].matdata[l];
+            cseg[out].input_offset_short[l] = seg[p].input_offset_short[l];
+            cseg[out].matdata[l] = encode_value(value, format, &saturated, &flushed);
+            if (value != 0) {
+               double error = fabs((double) value - (double) decode_value(cseg[out].matdata[l], format));
+               double relative = error / fabs((double) value);
+               if (relative > max_relative) max_relative = relative;
+               error_squared += error * error;
+               value_squared += (double) value * (double) value;
+            }
+         }
+      }
+   }
+   chdr[nslabs].offset = out;
+   chdr[nslabs].outindex = hdr[nslabs].outindex;
+   chdr[nslabs].outspan = 0;
+
+   printf("compressed packets (%s): %u bytes per packet instead of %u, matrix %llu -> %llu bytes\n",
+          packet_format_name(format), (unsigned int) sizeof(cpacket), (unsigned int) sizeof(packet),
+          (unsigned long long) *(mgs->datasize), (unsigned long long) cm->datasize);
+   printf("   value rounding error: max relative %le, |A - A'|/|A| (Frobenius) %le",
+          max_relative, (value_squared > 0.0) ? sqrt(error_squared / value_squared) : 0.0);
+   if (saturated || flushed) {
+      printf(", %u values saturated, %u flushed to zero", saturated, flushed);
+   }
+   printf("\n");
+   return 0;
+}
@@ -0,0 +1,282 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Optional symmetric reordering of a square matrix, between matrix_load() and       */
+/* matrix_tile().  Rows and columns are permuted together (B = P A P^T), so that     */
+/* nonzeros gather near the diagonal: each slab then touches fewer column_span-wide  */
+/* sections of the input vector, and packets fill up with fewer gaps.                */
+/*                                                                                   */
+/*    REORDER_RCM:     Reverse Cuthill-McKee on the pattern of A + A^T, started from */
+/*                     a pseudo-peripheral vertex of each connected component.       */
+/*    REORDER_DEGREE:  rows sorted by increasing degree (stable).                    */
+/*                                                                                   */
+/* On return *(mgs->perm) maps new indices to original ones: new row i is original   */
+/* row perm[i].  The caller gathers the input vector and scatters the output vector  */
+/* through it, so the reordering is invisible outside the kernel.                    */
+/* ================================================================================= */
+
+typedef struct _reorder_graph {
+   unsigned int n;
+   unsigned int *adj_start;     /* n+1 entries */
+   unsigned int *adj;           /* rows of A followed by rows of A^T, diagonal dropped */
+   unsigned int *degree;
+} reorder_graph;
+
+static const unsigned int *sort_degree; /* qsort has no context argument */
+
+static int compare_by_degree(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   if (sort_degree[x] != sort_degree[y]) return (sort_degree[x] < sort_degree[y]) ? -1 : 1;
+   return (x > y) - (x < y);
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+   unsigned long long x = *(const unsigned long long *) a;
+   unsigned long long y = *(const unsigned long long *) b;
+   return (x > y) - (x < y);
+}
+
+static void build_graph(const unsigned int *row_index, const unsigned int *x_index, unsigned int n, unsigned int preferred_alignment, reorder_graph *g)
+{
+   unsigned int i, j;
+   unsigned int *fill;
+
+   g->n = n;
+   MEMORY_ALLOC_CHECK(g->adj_start, ((n + 1) * sizeof(unsigned int)), "adj_start")
+   MEMORY_ALLOC_CHECK(g->degree, ((n ? n : 1) * sizeof(unsigned int)), "degree")
+   MEMORY_ALLOC_CHECK(fill, ((n ? n : 1) * sizeof(unsigned int)), "adj fill")
+   memset(g->degree, 0, n * sizeof(unsigned int));
+   for (i=0; i<n; ++i) {
+      for (j=row_index[i]; j<row_index[i+1]; ++j) {
+         if (x_index[j] == i) continue;
+         ++g->degree[i];
+         ++g->degree[x_index[j]];
+      }
+   }
+   g->adj_start[0] = 0;
+   for (i=0; i<n; ++i) {
+      g->adj_start[i+1] = g->adj_start[i] + g->degree[i];
+      fill[i] = g->adj_start[i];
+   }
+   MEMORY_ALLOC_CHECK(g->adj, ((g->adj_start[n] ? g->adj_start[n] : 1) * sizeof(unsigned int)), "adj")
+   for (i=0; i<n; ++i) {
+      for (j=row_index[i]; j<row_index[i+1]; ++j) {
+         unsigned int c = x_index[j];
+         if (c == i) continue;
+         g->adj[fill[i]++] = c;
+         g->adj[fill[c]++] = i;
+      }
+   }
+   free(fill);
+}
+
+/* Breadth-first search from "root", visiting neighbours in increasing degree order.   */
+/* Appends the visited vertices to "order" and returns the index where the last level */
+/* starts (the candidates for a pseudo-peripheral vertex).                            */
+static unsigned int bfs(reorder_graph *g, unsigned int root, unsigned char *visited, unsigned int *order, unsigned int *count)
+{
+   unsigned int head = *count;
+   unsigned int level_start = head;
+   unsigned int level_end;
+   unsigned int j;
+
+   order[(*count)++] = root;
+   visited[root] = 1;
+   while (head < *count) {
+      level_start = head;
+      level_end = *count;
+      for (; head < level_end; ++head) {
+         unsigned int v = order[head];
+         unsigned int first = *count;
+         for (j=g->adj_start[v]; j<g->adj_start[v+1]; ++j) {
+            unsigned int w = g->adj[j];
+            if (!visited[w]) {
+               visited[w] = 1;
+               order[(*count)++] = w;
+            }
+         }
+         sort_degree = g->degree;
+         qsort(&order[first], *count - first, sizeof(unsigned int), compare_by_degree);
+      }
+   }
+   return level_start;
+}
+
+static void rcm(reorder_graph *g, unsigned int *perm, unsigned int preferred_alignment)
+{
+   unsigned int n = g->n;
+   unsigned char *visited;
+   unsigned int *scratch;
+   unsigned int count = 0;
+   unsigned int i, j, pass;
+
+   MEMORY_ALLOC_CHECK(visited, (n ? n : 1), "visited")
+   MEMORY_ALLOC_CHECK(scratch, ((n ? n : 1) * sizeof(unsigned int)), "rcm scratch")
+   memset(visited, 0, n);
+
+   /* Components are taken in order of their lowest-degree unvisited vertex. */
+   unsigned int *by_degree;
+   MEMORY_ALLOC_CHECK(by_degree, ((n ? n : 1) * sizeof(unsigned int)), "by_degree")
+   for (i=0; i<n; ++i) by_degree[i] = i;
+   sort_degree = g->degree;
+   qsort(by_degree, n, sizeof(unsigned int), compare_by_degree);
+
+   for (i=0; i<n; ++i) {
+      unsigned int root = by_degree[i];
+      if (visited[root]) continue;
+
+      /* George-Liu: move the root to a low-degree vertex of the last BFS level, twice. */
+      for (pass=0; pass<2; ++pass) {
+         unsigned int scount = 0, last, best;
+         last = bfs(g, root, visited, scratch, &scount);
+         best = scratch[last];
+         for (j=last; j<scount; ++j) {
+            if (g->degree[scratch[j]] < g->degree[best]) best = scratch[j];
+         }
+         for (j=0; j<scount; ++j) visited[scratch[j]] = 0;
+         if (best == root) break;
+         root = best;
+      }
+      bfs(g, root, visited, perm, &count);
+   }
+
+   /* Reverse the Cuthill-McKee order. */
+   for (i=0; i<n/2; ++i) {
+      unsigned int t = perm[i];
+      perm[i] = perm[n-1-i];
+      perm[n-1-i] = t;
+   }
+   free(by_degree);
+   free(scratch);
+   free(visited);
+}
+
+static unsigned int bandwidth(const unsigned int *row_index, const unsigned int *x_index, unsigned int n)
+{
+   unsigned int i, j, bw = 0;
+   for (i=0; i<n; ++i) {
+      for (j=row_index[i]; j<row_index[i+1]; ++j) {
+         unsigned int d = (x_index[j] > i) ? x_index[j] - i : i - x_index[j];
+         if (d > bw) bw = d;
+      }
+   }
+   return bw;
+}
+
+int matrix_reorder(matrix_gen_struct *mgs)
+{
+   unsigned int mode = mgs->reorder;
+   unsigned int preferred_alignment = mgs->preferred_alignment; /* used by "MEMORY_ALLOC_CHECK" macro */
+   unsigned int n = *(mgs->ny);
+   unsigned int nnz = *(mgs->non_zero);
+   unsigned int *row_index = *(mgs->row_index_array);
+   unsigned int *x_index = *(mgs->x_index_array);
+   real *data = *(mgs->data_array);
+   unsigned int *perm, *iperm, *new_row_index, *new_x_index;
+   real *new_data;
+   unsigned int i, j, k;
+   reorder_graph g;
+
+   *(mgs->perm) = NULL;
+   if (mode == REORDER_NONE) return 0;
+   if (*(mgs->nx) != n) {
+      printf("reorder: matrix is %u x %u; symmetric reordering needs a square matrix, skipped\n", n, *(mgs->nx));
+      return 0;
+   }
+
+   build_graph(row_index, x_index, n, preferred_alignment, &g);
+   MEMORY_ALLOC_CHECK(perm, ((n ? n : 1) * sizeof(unsigned int)), "perm")
+   MEMORY_ALLOC_CHECK(iperm, ((n ? n : 1) * sizeof(unsigned int)), "iperm")
+   if (mode == REORDER_RCM) {
+      rcm(&g, perm, preferred_alignment);
+   }
+   else {
+      for (i=0; i<n; ++i) perm[i] = i;
+      sort_degree = g.degree;
+      qsort(perm, n, sizeof(unsigned int), compare_by_degree);
+   }
+   free(g.adj_start);
+   free(g.adj);
+   free(g.degree);
+   for (i=0; i<n; ++i) iperm[perm[i]] = i;
+
+   /* Build B = P A P^T, keeping the padding rows up to nyround empty. */
+   MEMORY_ALLOC_CHECK(new_row_index, ((*(mgs->nyround) + 1) * sizeof(unsigned int)), "row_index_array")
+   MEMORY_ALLOC_CHECK(new_x_index, ((nnz + 1) * sizeof(unsigned int)), "x_index_array")
+   MEMORY_ALLOC_CHECK(new_data, ((nnz ? nnz : 1) * sizeof(real)), "data_array")
+   k = 0;
+   for (i=0; i<n; ++i) {
+      unsigned int old = perm[i];
+      unsigned long long *pairs = (unsigned long long *) NULL;
+      unsigned int len = row_index[old+1] - row_index[old];
+      new_row_index[i] = k;
+      if (len) {
+         /* Sort each row by new column, carrying the value's index along in the low word. */
+         MEMORY_ALLOC_CHECK(pairs, (len * sizeof(unsigned long long)), "reorder row")
+         for (j=0; j<len; ++j) {
+            pairs[j] = ((unsigned long long) iperm[x_index[row_index[old] + j]] << 32) | (row_index[old] + j);
+         }
+         qsort(pairs, len, sizeof(unsigned long long), compare_uint64);
+         for (j=0; j<len; ++j) {
+            new_x_index[k] = (unsigned int) (pairs[j] >> 32);
+            new_data[k] = data[pairs[j] & 0xffffffffULL];
+            ++k;
+         }
+         free(pairs);
+      }
+   }
+   for (i=n; i<=*(mgs->nyround); ++i) new_row_index[i] = nnz;
+
+   printf("reorder (%s): bandwidth %u -> %u\n", (mode == REORDER_RCM) ? "rcm" : "degree",
+          bandwidth(row_index, x_index, n), bandwidth(new_row_index, new_x_index, n));
+
+   free(row_index);
+   free(x_index);
+   free(data);
+   free(iperm);
+   *(mgs->row_index_array) = new_row_index;
+   *(mgs->x_index_array) = new_x_index;
+   *(mgs->data_array) = new_data;
+   *(mgs->perm) = perm;
+
+   /* Row lengths moved; refresh the statistics the SELL builder and heuristic use. */
+   sell_row_stats(new_row_index, n, mgs->device_type, mgs->stats);
+   return 0;
+}
+
+/* ================================================================================= */
+/* How well a tiling packs the matrix: packets per nonzero (1/16 is perfect), and    */
+/* how many times a packet moves to a different section of the input vector than    */
+/* the packet before it in the same slab.                                            */
+/* ================================================================================= */
+
+void tiling_stats(matrix_gen_struct *mgs, double *packets_per_nonzero, unsigned int *input_reloads)
+{
+   slab_header *hdr = *(mgs->matrix_header);
+   packet *seg = *(mgs->seg_workspace);
+   unsigned int s, p, packets = 0, reloads = 0;
+
+   for (s=0; s<*(mgs->nslabs_round); ++s) {
+      unsigned int first = hdr[s].offset + *(mgs->num_header_packets);
+      for (p=first; p<hdr[s+1].offset; ++p) {
+         ++packets;
+         if (p == first || seg[p].seg_input_offset != seg[p-1].seg_input_offset) ++reloads;
+      }
+   }
+   *packets_per_nonzero = (*(mgs->non_zero)) ? (double) packets / (double) *(mgs->non_zero) : 0.0;
+   *input_reloads = reloads;
+}
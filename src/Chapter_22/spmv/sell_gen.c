@@ -0,0 +1,229 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Sliced ELLPACK (SELL-C-sigma) format.                                             */
+/*                                                                                   */
+/* Rows are grouped into "chunks" of C consecutive rows, and each chunk is stored    */
+/* column-major, padded to the length of its longest row, so that the C work items   */
+/* handling a chunk read consecutive words on every step.  To limit that padding,    */
+/* rows are first sorted by decreasing length inside windows of sigma rows, which    */
+/* keeps rows of similar length in the same chunk without destroying the locality    */
+/* of the input vector accesses.  The permutation is stored with the matrix, and     */
+/* the kernel writes each result straight to its original row.                       */
+/*                                                                                   */
+/* The buffer handed to OpenCL starts with a sell_header, followed by the arrays it  */
+/* points to (offsets are in 32-bit words from the start of the buffer).             */
+/* ================================================================================= */
+
+unsigned int sell_chunk_rows(cl_device_type device_type)
+{
+   return (device_type == CL_DEVICE_TYPE_GPU) ? SELL_C_GPU : SELL_C_CPU;
+}
+
+typedef struct _sell_sort_entry {
+   unsigned int row;
+   unsigned int length;
+} sell_sort_entry;
+
+static int compare_sort_entry(const void *a, const void *b)
+{
+   const sell_sort_entry *x = (const sell_sort_entry *) a;
+   const sell_sort_entry *y = (const sell_sort_entry *) b;
+   if (x->length != y->length) return (x->length < y->length) ? 1 : -1;  /* longest rows first */
+   return (x->row > y->row) - (x->row < y->row);                         /* stable within equal lengths */
+}
+
+/* Fill "perm" with the sigma-window sorted row order (padding slots get row index "ny"). */
+static void sell_permutation(const unsigned int *row_index_array, unsigned int ny, unsigned int nslots, unsigned int sigma, unsigned int *perm)
+{
+   sell_sort_entry *window;
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+   unsigned int base, i;
+
+   MEMORY_ALLOC_CHECK(window, (sigma * sizeof(sell_sort_entry)), "sell window")
+   for (base = 0; base < nslots; base += sigma) {
+      unsigned int n = (nslots - base < sigma) ? nslots - base : sigma;
+      for (i=0; i<n; ++i) {
+         unsigned int row = base + i;
+         window[i].row = (row < ny) ? row : ny;
+         window[i].length = (row < ny) ? row_index_array[row+1] - row_index_array[row] : 0;
+      }
+      qsort(window, n, sizeof(sell_sort_entry), compare_sort_entry);
+      for (i=0; i<n; ++i) {
+         perm[base + i] = window[i].row;
+      }
+   }
+   free(window);
+}
+
+/* ================================================================================= */
+/* Row-length statistics, including the fraction of SELL-C-sigma storage that would  */
+/* hold real data.  Used by matrix_gen() to choose a kernel when asked to.           */
+/* ================================================================================= */
+
+void sell_row_stats(const unsigned int *row_index_array, unsigned int ny, cl_device_type device_type, row_stats *stats)
+{
+   unsigned int C = sell_chunk_rows(device_type);
+   unsigned int sigma = C * SELL_SIGMA_CHUNKS;
+   unsigned int nslots = ((ny + C - 1) / C) * C;
+   unsigned int *perm;
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+   unsigned int i, j;
+   double sum = 0.0, sumsq = 0.0, stored = 0.0;
+
+   stats->min_row = 0xffffffff;
+   stats->max_row = 0;
+   for (i=0; i<ny; ++i) {
+      unsigned int len = row_index_array[i+1] - row_index_array[i];
+      if (len < stats->min_row) stats->min_row = len;
+      if (len > stats->max_row) stats->max_row = len;
+      sum += len;
+      sumsq += (double) len * (double) len;
+   }
+   if (ny == 0) stats->min_row = 0;
+   stats->mean_row = (ny) ? sum / ny : 0.0;
+   stats->stddev_row = (ny) ? sumsq / ny - stats->mean_row * stats->mean_row : 0.0;
+   stats->stddev_row = (stats->stddev_row > 0.0) ? sqrt(stats->stddev_row) : 0.0;
+
+   MEMORY_ALLOC_CHECK(perm, ((nslots ? nslots : 1) * sizeof(unsigned int)), "sell perm")
+   sell_permutation(row_index_array, ny, nslots, sigma, perm);
+   for (i=0; i<nslots; i+=C) {
+      unsigned int chunk_len = 0;
+      for (j=0; j<C; ++j) {
+         unsigned int row = perm[i+j];
+         unsigned int len = (row < ny) ? row_index_array[row+1] - row_index_array[row] : 0;
+         if (len > chunk_len) chunk_len = len;
+      }
+      stored += (double) chunk_len * C;
+   }
+   free(perm);
+   stats->sell_efficiency = (stored > 0.0) ? sum / stored : 1.0;
+}
+
+/* ================================================================================= */
+/* Build the SELL-C-sigma buffer from the CSR arrays, in place of the tiled format.  */
+/* Sets the same matrix_gen_struct outputs as the tiled builder, with each chunk     */
+/* playing the part of a slab.                                                       */
+/* ================================================================================= */
+
+int sell_gen(matrix_gen_struct *mgs)
+{
+   unsigned int preferred_alignment = mgs->preferred_alignment; /* used by "MEMORY_ALLOC_CHECK" macro */
+   unsigned int ny = *(mgs->ny);
+   unsigned int C = sell_chunk_rows(mgs->device_type);
+   unsigned int sigma = C * SELL_SIGMA_CHUNKS;
+   unsigned int nchunks = (ny + C - 1) / C;
+   unsigned int nslots = nchunks * C;
+   unsigned int *row_index_array = *(mgs->row_index_array);
+   unsigned int *x_index_array = *(mgs->x_index_array);
+   real *data_array = *(mgs->data_array);
+   unsigned int *perm, *chunk_len, *chunk_ptr;
+   unsigned int i, j, c;
+   unsigned long long elements, words;
+
+   if (nchunks == 0) nchunks = nslots = 1;
+
+   MEMORY_ALLOC_CHECK(perm, (nslots * sizeof(unsigned int)), "sell perm")
+   MEMORY_ALLOC_CHECK(chunk_len, (nchunks * sizeof(unsigned int)), "sell chunk_len")
+   MEMORY_ALLOC_CHECK(chunk_ptr, ((nchunks + 1) * sizeof(unsigned int)), "sell chunk_ptr")
+   sell_permutation(row_index_array, ny, nslots, sigma, perm);
+
+   elements = 0;
+   for (c=0; c<nchunks; ++c) {
+      chunk_len[c] = 0;
+      for (j=0; j<C; ++j) {
+         unsigned int row = perm[c*C + j];
+         unsigned int len = (row < ny) ? row_index_array[row+1] - row_index_array[row] : 0;
+         if (len > chunk_len[c]) chunk_len[c] = len;
+      }
+      chunk_ptr[c] = (unsigned int) elements;
+      elements += (unsigned long long) chunk_len[c] * C;
+   }
+   chunk_ptr[nchunks] = (unsigned int) elements;
+   if (elements > 0xffffffffULL) {
+      printf("matrix is too large for the SELL-C-sigma format\n");
+      free(perm);
+      free(chunk_len);
+      free(chunk_ptr);
+      return -1;
+   }
+
+   /* Lay out the buffer, keeping each array 64-byte aligned. */
+   sell_header hdr;
+   hdr.nchunks = nchunks;
+   hdr.chunk_rows = C;
+   hdr.sigma = sigma;
+   hdr.nrows = ny;
+   words = (sizeof(sell_header) / sizeof(cl_uint) + 15) & ~15ULL;
+   hdr.chunk_ptr_offset = (cl_uint) words;  words += (nchunks + 1 + 15) & ~15U;
+   hdr.chunk_len_offset = (cl_uint) words;  words += (nchunks + 15) & ~15U;
+   hdr.perm_offset      = (cl_uint) words;  words += (nslots + 15) & ~15U;
+   hdr.col_offset       = (cl_uint) words;  words += (elements + 15) & ~15ULL;
+   hdr.val_offset       = (cl_uint) words;  words += (elements * (sizeof(real) / sizeof(cl_uint)) + 15) & ~15ULL;
+   if (words > 0xffffffffULL / sizeof(cl_uint)) {
+      printf("matrix is too large for the SELL-C-sigma format\n");
+      free(perm);
+      free(chunk_len);
+      free(chunk_ptr);
+      return -1;
+   }
+
+   *(mgs->memsize) = (size_t) (((words * sizeof(cl_uint)) + sizeof(packet) - 1) / sizeof(packet) * sizeof(packet));
+   *(mgs->datasize) = *(mgs->memsize);
+   MEMORY_ALLOC_CHECK(*(mgs->seg_workspace), *(mgs->memsize), "*seg_workspace")
+   memset(*(mgs->seg_workspace), 0, *(mgs->memsize));
+   *(mgs->matrix_header) = (slab_header *) *(mgs->seg_workspace);
+
+   cl_uint *buf = (cl_uint *) *(mgs->seg_workspace);
+   memcpy(buf, &hdr, sizeof(hdr));
+   memcpy(&buf[hdr.chunk_ptr_offset], chunk_ptr, (nchunks + 1) * sizeof(cl_uint));
+   memcpy(&buf[hdr.chunk_len_offset], chunk_len, nchunks * sizeof(cl_uint));
+   memcpy(&buf[hdr.perm_offset], perm, nslots * sizeof(cl_uint));
+
+   /* Fill each chunk column-major; padding keeps column 0 and a zero value. */
+   cl_uint *col = &buf[hdr.col_offset];
+   real *val = (real *) &buf[hdr.val_offset];
+   for (c=0; c<nchunks; ++c) {
+      for (j=0; j<C; ++j) {
+         unsigned int row = perm[c*C + j];
+         if (row >= ny) continue;
+         unsigned int lb = row_index_array[row];
+         unsigned int len = row_index_array[row+1] - lb;
+         for (i=0; i<len; ++i) {
+            col[chunk_ptr[c] + i*C + j] = x_index_array[lb + i];
+            val[chunk_ptr[c] + i*C + j] = data_array[lb + i];
+         }
+      }
+   }
+
+   /* Describe the chunks as slabs, so that buffer sizing in the caller works unchanged. */
+   MEMORY_ALLOC_CHECK(*(mgs->slab_startrow), ((nchunks + 1) * sizeof(unsigned int)), "slab_startrow")
+   for (c=0; c<=nchunks; ++c) {
+      (*(mgs->slab_startrow))[c] = c * C;
+   }
+   *(mgs->nslabs_round) = nchunks;
+   *(mgs->max_slabheight) = C;
+   *(mgs->num_header_packets) = 0;
+   *(mgs->column_span) = 0;
+   *(mgs->segcachesize) = 0;
+   *(mgs->nx_pad) = (*(mgs->nx) + 15) & ~15U;
+
+   printf("SELL-C-sigma: C = %u, sigma = %u, %u chunks, fill efficiency = %f\n", C, sigma, nchunks,
+          (elements > 0) ? (double) *(mgs->non_zero) / (double) elements : 1.0);
+
+   free(perm);
+   free(chunk_len);
+   free(chunk_ptr);
+   return 0;
+}
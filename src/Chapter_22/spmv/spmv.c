@@ -19,8 +19,13 @@ void usage()
 {
    printf("\n");
    printf("Usage: spmv -f <matrixfile> [device_type] [kernel_type] [options]\n");
+   printf("       spmv -G <spec> [device_type] [kernel_type] [options]\n");
    printf("\n");
    printf("Note: <matrixfile> should include the relative path from this executable.\n");
+   printf("      This build computes in %s precision; spmv_double is the fp64 build.\n", REAL_NAME);
+   printf("      <spec> describes a synthetic matrix: kind[:key=value,...], where kind is band, stencil5,\n");
+   printf("      stencil7, stencil27, random or rmat, and keys are n, nnz, density, bw, seed, and a, b, c\n");
+   printf("      for rmat (e.g. 'stencil27:n=1e6' or 'rmat:n=1e6,nnz=1.6e7').\n");
    printf("\n");
    printf(" Device Type:\n");
    printf("\n");
@@ -32,15 +37,51 @@ void usage()
    printf("\n");
    printf("  -L, --ls           Use 'load-store' kernel to solve problem.\n");
    printf("  -A, --awgc         Use 'async-work-group-copy' kernel to solve problem.\n");
+   printf("  -S, --sell         Use 'sliced ELLPACK' (SELL-C-sigma) kernel to solve problem.\n");
+   printf("  -X, --auto         Choose among the above from the matrix's row-length statistics.\n");
    printf("\n");
    printf(" Options (all options default to 'not selected'):\n");
    printf("\n");
    printf("  -l, --lwgsize [n]  Specify local work group size for GPU use (coerced to power of 2).\n");
+   printf("  -C, --cachedir [d] Cache the tiled matrix in directory d, and reuse it on later runs.\n");
+   printf("  -b, --bench [n]    After verifying, time n runs of the kernel (after %d warmup runs).\n", BENCH_WARMUP);
+   printf("  -k, --nvec [k]     Multiply the matrix by k interleaved vectors in one pass (LS kernel only).\n");
+   printf("  -s, --stream [mb]  Stream the tiled matrix through two device buffers of at most mb megabytes each\n");
+   printf("                     (done automatically when the matrix exceeds the device's largest allocation).\n");
+   printf("  -M, --multi        Partition the slabs across every device of the selected type, balanced by nonzeros.\n");
+   printf("  -F, --fission [n]  Split the selected device into n sub-devices (OpenCL 1.2) and partition across those.\n");
+   printf("  -Y, --symmetric    Store one triangle of a symmetric matrix, and apply each entry to both rows (LS kernel only).\n");
+   printf("  -H, --half [f]     Store the matrix values as f, 'fp16' or 'bf16', in 80-byte packets (LS kernel only).\n");
+   printf("  -P, --persistent   Run persistent work groups that take slabs from an atomic counter (LS kernel only);\n");
+   printf("                     with --bench, the static one-group-per-slab kernel is timed too, for comparison.\n");
+   printf("  -R, --reorder [m]  Reorder a square matrix before tiling: m is 'rcm' (Reverse Cuthill-McKee) or 'degree'.\n");
+   printf("  -T, --tune         Time the legal tiling parameters for this device and kernel, and record the best.\n");
+   printf("  -D, --tunedb [f]   Tuning database, read on every run (default %s next to the executable).\n", TUNE_DB_DEFAULT);
+   printf("  -I, --cg [n]       Then solve A x = 1 by Conjugate Gradients, for at most n iterations (A must be SPD).\n");
+   printf("  -Q, --pagerank [n] Treat the matrix as a link graph (each nonzero links its column to its row), replace its\n");
+   printf("                     values by the column-normalized transition matrix, and run at most n PageRank iterations.\n");
+   printf("  -d, --damping [d]  Damping factor for --pagerank (default %g).\n", PAGERANK_DEFAULT_DAMPING);
+   printf("  -t, --tol [t]      Convergence tolerance on |r|/|b| for --cg, or on the L1 change for --pagerank (default %g).\n", CG_DEFAULT_TOLERANCE);
    printf("\n");
    printf("  -h, --help         Print this usage message.\n");
    printf("\n");
 }
 
+/* ===================================================================== */
+/* Printable name of each kernel type.                                   */
+/* ===================================================================== */
+
+static const char *kernel_label(cl_uint kernel_type)
+{
+   switch (kernel_type) {
+      case KERNEL_LS:   return "kernel_ls";
+      case KERNEL_AWGC: return "kernel_awgc";
+      case KERNEL_SELL: return "kernel_sell";
+      case KERNEL_AUTO: return "kernel_auto";
+   }
+   return "kernel_unknown";
+}
+
 /* ===================================================================== */
 /* Structures to help us determine available platforms and devices.      */
 /* ===================================================================== */
@@ -104,13 +145,62 @@ int main(int argc, char *argv[]) {
    static cl_uint kernel_type = KERNEL_DEFAULT;
    static int gpu_wgsz = MAX_WGSZ;
 
-   /* The external file containing the matrix data in Matrix Market format */
+   /* The external file containing the matrix data in Matrix Market format, */
+   /* or with --generate, the spec of a synthetic matrix (see matrix_synth.c). */
    static char *file_name;
+   static unsigned int generate = 0;
+
+   /* Optional directory holding cached tiled matrices. */
+   static char *cache_dir = NULL;
+
+   /* Number of timed kernel runs requested with --bench. */
+   static unsigned int bench_iterations = 0;
+
+   /* Number of input vectors multiplied per pass over the matrix (1 is plain SpMV). */
+   static unsigned int nvec = 1;
+
+   /* Per-buffer byte budget when streaming the matrix (--stream); 0 means keep it all resident. */
+   static size_t stream_budget = 0;
+
+   /* Row-partitioned run across every device of the selected type (--multi), or across */
+   /* sub-devices split off the selected device (--fission n).                          */
+   static int multi = 0;
+   static unsigned int fission = 0;
+
+   /* Half storage of symmetric matrices (--symmetric); cleared if the matrix turns out not to be stored that way. */
+   static unsigned int symmetric = 0;
+
+   /* Compressed packets holding fp16 or bfloat16 matrix values (--half). */
+   static unsigned int packet_format = PACKET_FULL;
+
+   /* Persistent work groups pulling slabs from a global counter (--persistent). */
+   static int persistent = 0;
+
+   /* Bandwidth-reducing reordering applied before tiling (--reorder). */
+   static unsigned int reorder = REORDER_NONE;
+
+   /* Tiling auto-tuner (--tune) and the database of its results. */
+   static int tune_mode = 0;
+   static char *tune_db = TUNE_DB_DEFAULT;
+
+   /* Iteration cap and tolerance for the optional Conjugate Gradient solve (--cg). */
+   static unsigned int cg_iterations = 0;
+   static double cg_tolerance = CG_DEFAULT_TOLERANCE;
+
+   /* Iteration cap and damping for the optional PageRank power iteration (--pagerank); --tol is shared. */
+   static unsigned int pagerank_iterations = 0;
+   static float pagerank_damping = PAGERANK_DEFAULT_DAMPING;
    
    /* These variables deal with the source file for the kernel, and the names of the kernels contained therein. */
    char kernel_source_file[8] = "spmv.cl";
    char kernel_name_LS[21]   = "tiled_spmv_kernel_LS";
    char kernel_name_AWGC[23] = "tiled_spmv_kernel_AWGC";
+   char kernel_name_SELL[17] = "sell_spmv_kernel";
+   char kernel_name_SPMM[21] = "tiled_spmm_kernel_LS";
+   char kernel_name_SYM[25]  = "tiled_spmv_kernel_LS_SYM";
+   char kernel_name_FP16[26] = "tiled_spmv_kernel_LS_FP16";
+   char kernel_name_BF16[26] = "tiled_spmv_kernel_LS_BF16";
+   char kernel_name_PERSISTENT[31] = "tiled_spmv_kernel_LS_PERSISTENT";
    char kernel_name[32];
    
    /* Basic "size of problem" variables. */
@@ -141,9 +231,28 @@ int main(int argc, char *argv[]) {
       {"gpu", no_argument, NULL, 'g'},
       {"ls", no_argument, NULL, 'L'},   
       {"awgc", no_argument, NULL, 'A'},   
+      {"sell", no_argument, NULL, 'S'},   
+      {"auto", no_argument, NULL, 'X'},   
       {"verify", no_argument, NULL, 'v'},
       {"lwgsize", required_argument, NULL, 'l'},
       {"filename", required_argument, NULL, 'f'},
+      {"generate", required_argument, NULL, 'G'},
+      {"cachedir", required_argument, NULL, 'C'},
+      {"bench", required_argument, NULL, 'b'},
+      {"nvec", required_argument, NULL, 'k'},
+      {"stream", required_argument, NULL, 's'},
+      {"multi", no_argument, NULL, 'M'},
+      {"fission", required_argument, NULL, 'F'},
+      {"symmetric", no_argument, NULL, 'Y'},
+      {"half", required_argument, NULL, 'H'},
+      {"persistent", no_argument, NULL, 'P'},
+      {"reorder", required_argument, NULL, 'R'},
+      {"tune", no_argument, NULL, 'T'},
+      {"tunedb", required_argument, NULL, 'D'},
+      {"cg", required_argument, NULL, 'I'},
+      {"tol", required_argument, NULL, 't'},
+      {"pagerank", required_argument, NULL, 'Q'},
+      {"damping", required_argument, NULL, 'd'},
       {NULL, 0, NULL, 0}
    };
    char *name;
@@ -157,7 +266,7 @@ int main(int argc, char *argv[]) {
    (void)chdir(dirname(argv[0]));
 
    while (1) {
-      opt = getopt_long(argc, argv, "hacgLAl:f:", long_options, &option_index);
+      opt = getopt_long(argc, argv, "hacgLASXl:f:G:C:b:k:s:MF:YH:PR:TD:I:t:Q:d:", long_options, &option_index);
 
       if (opt == -1) break;
 
@@ -181,6 +290,12 @@ int main(int argc, char *argv[]) {
       /* -A, --awgc */
       case 'A': kernel_type = KERNEL_AWGC; break;
 
+      /* -S, --sell */
+      case 'S': kernel_type = KERNEL_SELL; break;
+
+      /* -X, --auto */
+      case 'X': kernel_type = KERNEL_AUTO; break;
+
       /* -l, --lwgsize */
       case 'l': gpu_wgsz = atoi(optarg); break;
 
@@ -188,14 +303,131 @@ int main(int argc, char *argv[]) {
       case 'f':
          posix_memalign((void **) &file_name, 128, 1+strlen(optarg));
          strcpy(file_name, optarg);
+         generate = 0;
          break;
 
+      /* -G, --generate */
+      case 'G':
+         posix_memalign((void **) &file_name, 128, 1+strlen(optarg));
+         strcpy(file_name, optarg);
+         generate = 1;
+         break;
+
+      /* -C, --cachedir */
+      case 'C': cache_dir = optarg; break;
+
+      /* -b, --bench */
+      case 'b': bench_iterations = (unsigned int) atoi(optarg); break;
+
+      /* -k, --nvec */
+      case 'k': nvec = (unsigned int) atoi(optarg); break;
+
+      /* -s, --stream */
+      case 's': stream_budget = (size_t) (atof(optarg) * 1e6); break;
+
+      /* -M, --multi */
+      case 'M': multi = 1; break;
+
+      /* -F, --fission */
+      case 'F': fission = (unsigned int) atoi(optarg); break;
+
+      /* -Y, --symmetric */
+      case 'Y': symmetric = 1; break;
+
+      /* -H, --half */
+      case 'H':
+         if (strcmp(optarg, "fp16") == 0) packet_format = PACKET_FP16;
+         else if (strcmp(optarg, "bf16") == 0) packet_format = PACKET_BF16;
+         else {
+            printf("unknown packet format '%s' (expected 'fp16' or 'bf16')\n", optarg);
+            exit(EXIT_FAILURE);
+         }
+         break;
+
+      /* -P, --persistent */
+      case 'P': persistent = 1; break;
+
+      /* -R, --reorder */
+      case 'R':
+         if (strcmp(optarg, "rcm") == 0) reorder = REORDER_RCM;
+         else if (strcmp(optarg, "degree") == 0) reorder = REORDER_DEGREE;
+         else {
+            printf("unknown reordering '%s' (expected 'rcm' or 'degree')\n", optarg);
+            exit(EXIT_FAILURE);
+         }
+         break;
+
+      /* -T, --tune */
+      case 'T': tune_mode = 1; break;
+
+      /* -D, --tunedb */
+      case 'D': tune_db = optarg; break;
+
+      /* -I, --cg */
+      case 'I': cg_iterations = (unsigned int) atoi(optarg); break;
+
+      /* -t, --tol */
+      case 't': cg_tolerance = atof(optarg); break;
+
+      /* -Q, --pagerank */
+      case 'Q': pagerank_iterations = (unsigned int) atoi(optarg); break;
+
+      /* -d, --damping */
+      case 'd': pagerank_damping = (float) atof(optarg); break;
+
       case '?':
          printf("Try '%s --help' for more information.\n", name);
          exit(EXIT_FAILURE);
       }
    }
 
+   if (nvec == 0) {
+      printf("%s: --nvec must be at least 1.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (tune_mode && nvec > 1) {
+      printf("%s: --tune times the single-vector kernels; it cannot be combined with --nvec.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (symmetric && nvec > 1) {
+      printf("%s: --symmetric multiplies a single vector; it cannot be combined with --nvec.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (packet_format != PACKET_FULL && (nvec > 1 || symmetric)) {
+      printf("%s: --half has its own single-vector kernels; it cannot be combined with --nvec or --symmetric.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (packet_format != PACKET_FULL && tune_mode) {
+      printf("%s: --tune times full-precision packets; tune without --half, and the tiling it stores is used with --half too.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (persistent && (nvec > 1 || symmetric || packet_format != PACKET_FULL || multi || fission)) {
+      printf("%s: --persistent schedules the single-device LS kernel; it cannot be combined with --nvec, --symmetric,\n", name);
+      printf("--half, --multi or --fission.\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if (cg_iterations && nvec > 1) {
+      printf("%s: --cg solves with a single vector; it cannot be combined with --nvec.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (pagerank_iterations && (nvec > 1 || symmetric || cg_iterations || multi || fission)) {
+      printf("%s: --pagerank iterates a single vector through the whole matrix on one device; it cannot be combined\n", name);
+      printf("with --nvec, --symmetric, --cg, --multi or --fission.\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if (pagerank_damping < 0.0f || pagerank_damping >= 1.0f) {
+      printf("%s: --damping must be at least 0 and less than 1.\n", name);
+      exit(EXIT_FAILURE);
+   }
+
    if (optind != argc) {
       printf("%s: unrecognized option '%s'.\n", name, argv[optind]);
       printf("Try '%s --help' for more information.\n", name);
@@ -327,6 +559,104 @@ int main(int argc, char *argv[]) {
    if (kernel_type == KERNEL_DEFAULT) {
       kernel_type = (platform[pdex].device[ddex].type == CL_DEVICE_TYPE_ACCELERATOR) ? KERNEL_AWGC : KERNEL_LS;
    }
+   if (nvec > 1 && kernel_type != KERNEL_LS) {
+      printf("multiple vectors (--nvec %d) are only supported by the LS kernel; using it\n", nvec);
+      kernel_type = KERNEL_LS;
+   }
+   if (symmetric && kernel_type != KERNEL_LS) {
+      printf("symmetric half storage (--symmetric) is only supported by the LS kernel; using it\n");
+      kernel_type = KERNEL_LS;
+   }
+   if (packet_format != PACKET_FULL && kernel_type != KERNEL_LS) {
+      printf("compressed packets (--half) are only supported by the LS kernel; using it\n");
+      kernel_type = KERNEL_LS;
+   }
+   if (persistent && kernel_type != KERNEL_LS) {
+      printf("persistent work groups (--persistent) are only supported by the LS kernel; using it\n");
+      kernel_type = KERNEL_LS;
+   }
+
+#ifdef DOUBLE
+   /* ================================================================================== */
+   /* The double precision build needs fp64 on the device, and 64-bit atomics for the    */
+   /* symmetric kernel's compare-and-swap.                                               */
+   /* ================================================================================== */
+
+   {
+      char *extensions;
+      size_t extensions_size;
+      rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_EXTENSIONS, (size_t) 0, NULL, &extensions_size);
+      CHECK_RESULT("clGetDeviceInfo(size of CL_DEVICE_EXTENSIONS)")
+      MEMORY_ALLOC_CHECK(extensions, extensions_size + 1, "device extensions");
+      rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_EXTENSIONS, extensions_size, extensions, NULL);
+      CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_EXTENSIONS)")
+      extensions[extensions_size] = '\0';
+      if (strstr(extensions, "cl_khr_fp64") == NULL) {
+         printf("the selected device does not support double precision (cl_khr_fp64); use the single precision spmv build\n");
+         exit(EXIT_FAILURE);
+      }
+      if (symmetric && strstr(extensions, "cl_khr_int64_base_atomics") == NULL) {
+         printf("--symmetric in double precision needs cl_khr_int64_base_atomics, which the selected device lacks\n");
+         exit(EXIT_FAILURE);
+      }
+      free(extensions);
+   }
+   const char *build_options = "-DDOUBLE";
+#else
+   const char *build_options = "";
+#endif
+
+   /* ================================================================================== */
+   /* With --multi, gather every device of the selected type on its platform; with       */
+   /* --fission, split the selected device into sub-devices.                             */
+   /* ================================================================================== */
+
+   cl_device_id *multi_devices = NULL;
+   unsigned int num_multi_devices = 0;
+   cl_device_id *context_devices = &(platform[pdex].device[ddex].id);
+   cl_uint num_context_devices = 1;
+   if (fission > 1) {
+#ifdef CL_VERSION_1_2
+      cl_device_partition_property partition[3];
+      cl_uint units, count;
+      rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+      CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_MAX_COMPUTE_UNITS)")
+      partition[0] = CL_DEVICE_PARTITION_EQUALLY;
+      partition[1] = (units >= fission) ? units / fission : 1;
+      partition[2] = 0;
+      rc = clCreateSubDevices(platform[pdex].device[ddex].id, partition, 0, NULL, &count);
+      CHECK_RESULT("clCreateSubDevices(count)")
+      /* One spare slot: the context holds the parent device as well, for the main queue. */
+      MEMORY_ALLOC_CHECK(multi_devices, ((count + 1) * sizeof(cl_device_id)), "sub-devices")
+      rc = clCreateSubDevices(platform[pdex].device[ddex].id, partition, count, multi_devices, NULL);
+      CHECK_RESULT("clCreateSubDevices")
+      printf("split the device into %u sub-devices of %u compute units\n", count, (unsigned int) partition[1]);
+      num_multi_devices = count;
+      multi_devices[count] = platform[pdex].device[ddex].id;
+      context_devices = multi_devices;
+      num_context_devices = count + 1;
+#else
+      printf("%s: --fission needs OpenCL 1.2 (clCreateSubDevices).\n", name);
+      exit(EXIT_FAILURE);
+#endif
+   }
+   else if (multi) {
+      MEMORY_ALLOC_CHECK(multi_devices, (platform[pdex].num_devices * sizeof(cl_device_id)), "multi devices")
+      for (j=0; j<platform[pdex].num_devices; ++j) {
+         if (platform[pdex].device[j].type == platform[pdex].device[ddex].type) {
+            multi_devices[num_multi_devices++] = platform[pdex].device[j].id;
+         }
+      }
+      if (num_multi_devices < 2) {
+         printf("only one device of the selected type; --multi runs on it alone\n");
+         num_multi_devices = 0;
+      }
+      else {
+         printf("partitioning the matrix across %u devices\n", num_multi_devices);
+         context_devices = multi_devices;
+         num_context_devices = num_multi_devices;
+      }
+   }
 
    /* ================================================================================== */
    /* Create a context.                                                                  */
@@ -336,20 +666,34 @@ int main(int argc, char *argv[]) {
    properties[0] = CL_CONTEXT_PLATFORM;
    properties[1] = (const cl_context_properties) platform[pdex].id;
    properties[2] = 0;
-   platform[pdex].context = clCreateContext((const cl_context_properties *) properties, 1, &(platform[pdex].device[ddex].id), NULL, NULL, &rc);
+   platform[pdex].context = clCreateContext((const cl_context_properties *) properties, num_context_devices, context_devices, NULL, NULL, &rc);
    CHECK_RESULT("clCreateContext")
 
    /* ================================================================================== */
    /* Build the kernel, create the Command Queue, and print kernel/device info.          */
    /* ================================================================================== */
 
-   switch (kernel_type) {
+   /* With KERNEL_AUTO, the kernel that would be the default stands in until matrix_gen has chosen; */
+   /* its limits are close enough to drive the work group and local memory sizing.                  */
+   cl_uint built_kernel_type = kernel_type;
+   unsigned int built_symmetric = symmetric;
+   if (kernel_type == KERNEL_AUTO) {
+      built_kernel_type = (platform[pdex].device[ddex].type == CL_DEVICE_TYPE_ACCELERATOR) ? KERNEL_AWGC : KERNEL_LS;
+   }
+
+   switch (built_kernel_type) {
       case KERNEL_LS:
-      strcpy(kernel_name, kernel_name_LS);
+      strcpy(kernel_name, (nvec > 1) ? kernel_name_SPMM : (symmetric ? kernel_name_SYM : kernel_name_LS));
+      if (packet_format != PACKET_FULL) {
+         strcpy(kernel_name, (packet_format == PACKET_FP16) ? kernel_name_FP16 : kernel_name_BF16);
+      }
       break;
       case KERNEL_AWGC: 
       strcpy(kernel_name, kernel_name_AWGC);
       break;
+      case KERNEL_SELL: 
+      strcpy(kernel_name, kernel_name_SELL);
+      break;
    }
 
    char *kernel_source;
@@ -363,13 +707,14 @@ int main(int argc, char *argv[]) {
    CHECK_RESULT("clCreateProgramWithSource")
    free(kernel_source);
 
-   rc = clBuildProgram(platform[pdex].program, 1, &(platform[pdex].device[ddex].id), "", NULL, NULL);
+   rc = clBuildProgram(platform[pdex].program, num_context_devices, context_devices, build_options, NULL, NULL);
    CHECK_RESULT("clBuildProgram")
 
    platform[pdex].kernel = clCreateKernel(platform[pdex].program, kernel_name, &rc);
    CHECK_RESULT("clCreateKernel")
 
-   platform[pdex].device[ddex].ComQ = clCreateCommandQueue(platform[pdex].context, platform[pdex].device[ddex].id, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &rc);
+   platform[pdex].device[ddex].ComQ = clCreateCommandQueue(platform[pdex].context, platform[pdex].device[ddex].id, 
+                                                          CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | (bench_iterations ? CL_QUEUE_PROFILING_ENABLE : 0), &rc);
    CHECK_RESULT("clCreateCommandQueue")
 
    rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_NAME, (size_t) 0, NULL, (size_t *) &param_value_size_ret);
@@ -378,7 +723,13 @@ int main(int argc, char *argv[]) {
    rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_NAME, (size_t) param_value_size_ret, platform[pdex].device[ddex].name, (size_t *) NULL);
    CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_NAME)")
 
-   printf("We'll run kernel %s on device %s\n", ((kernel_type == KERNEL_LS) ? "kernel_ls" : "kernel_awgc"), platform[pdex].device[ddex].name); 
+   printf("We'll run kernel %s (%s precision) on device %s\n", kernel_label(kernel_type), REAL_NAME, platform[pdex].device[ddex].name); 
+   if (nvec > 1) {
+      printf("multiplying by %d interleaved vectors per pass\n", nvec);
+   }
+   if (packet_format != PACKET_FULL) {
+      printf("matrix values stored as %s in compressed packets\n", packet_format_name(packet_format));
+   }
 
    /* ================================================================================== */
    /* Determine device alignment, and whether "out-of-order" processing is supported.    */
@@ -414,19 +765,25 @@ int main(int argc, char *argv[]) {
 
    cl_uint max_compute_units;
    clGetDeviceInfo (platform[pdex].device[ddex].id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &max_compute_units, NULL); 
+   if (multi && num_multi_devices) {
+      max_compute_units *= num_multi_devices; /* so that every device gets as many slabs as it would alone */
+   }
 
    /* ================================================================================== */
    /* Set up parameter structure and call the function that builds the tiled matrix.     */
    /* ================================================================================== */
 
    matrix_gen_struct mgs;
-   unsigned int nslabs_round, memsize;
+   unsigned int nslabs_round;
+   size_t memsize, datasize;
+   row_stats stats;
    packet *seg_workspace;
    slab_header *matrix_header;
    unsigned int num_header_packets;
    unsigned int *row_index_array = NULL;
    unsigned int *x_index_array = NULL;
-   float *data_array = NULL;
+   real *data_array = NULL;
+   unsigned int *perm = NULL;
 
    mgs.matrix_header = &matrix_header;
    mgs.seg_workspace = &seg_workspace;
@@ -441,11 +798,12 @@ int main(int argc, char *argv[]) {
    mgs.ny = &ny;
    mgs.non_zero = &non_zero;
    mgs.file_name = (char *) file_name;
+   mgs.generate = generate;
    mgs.preferred_alignment = preferred_alignment;
    mgs.max_compute_units = &max_compute_units;
-   mgs.kernel_type = kernel_type;
+   mgs.kernel_type = &kernel_type;
    mgs.column_span = &column_span;
-   mgs.local_mem_size = (unsigned int) local_mem_size;
+   mgs.local_mem_size = (unsigned int) (local_mem_size / nvec); /* The SpMM kernel keeps nvec outputs per row. */
    mgs.segcachesize = &segcachesize;
    mgs.max_slabheight = &max_slabheight;
    mgs.device_type = platform[pdex].device[ddex].type,
@@ -453,8 +811,198 @@ int main(int argc, char *argv[]) {
    mgs.kernel_wg_size = kernel_wg_size;
    mgs.nslabs_round = &nslabs_round;
    mgs.memsize = &memsize;
+   mgs.datasize = &datasize;
+   mgs.stats = &stats;
+   mgs.tune = NULL;
+   mgs.reorder = reorder;
+   mgs.perm = &perm;
+   mgs.symmetric = &symmetric;
+   mgs.transition = (pagerank_iterations > 0);
+
+   /* Reuse a previously tiled copy of this matrix if one was cached for this device and kernel. */
+   matrix_cache cache;
+   memset(&cache, 0, sizeof(cache));
+   if (cache_dir != NULL && matrix_cache_init(&cache, &mgs, cache_dir) != 0) {
+      printf("unable to examine %s; matrix cache disabled\n", file_name);
+      cache_dir = NULL;
+   }
+
+   /* Tuning always re-tiles, so it bypasses (and afterwards refreshes) the cache.  Otherwise the */
+   /* tune database is consulted first: the cache key holds the tuned tiling, so a cached file    */
+   /* tiled before the database last changed for this matrix misses, and is rebuilt.              */
+   int loaded = 0;
+   int cache_hit = 0;
+   if (cache_dir != NULL && !tune_mode) {
+      unsigned long long cached_hash;
+      unsigned int cached_kernel_type;
+      if (matrix_cache_peek(&cache, &cached_hash, &cached_kernel_type)) {
+         tune_params cached_tune;
+         memset(&cached_tune, 0, sizeof(cached_tune));
+         tune_db_load(tune_db, platform[pdex].device[ddex].name, cached_hash, cached_kernel_type, &cached_tune);
+         cache.key.tune = cached_tune;
+      }
+      cache_hit = matrix_cache_load(&cache, &mgs);
+   }
+   if (!cache_hit) {
+      rc = matrix_load(&mgs);
+      loaded = 1;
+   }
+
+   if (nvec > 1 && (cl_ulong) max_slabheight * nvec * sizeof(real) > local_mem_size) {
+      printf("slabs of %d rows by %d vectors do not fit in %lld bytes of local memory; try a smaller --lwgsize or --nvec\n",
+             max_slabheight, nvec, (long long) local_mem_size);
+      exit(EXIT_FAILURE);
+   }
 
-   rc = matrix_gen(&mgs);
+   /* If matrix_gen chose a different kernel than the stand-in (or could not use half storage), switch to it now. */
+   if (kernel_type != built_kernel_type || symmetric != built_symmetric) {
+      switch (kernel_type) {
+         case KERNEL_LS:   strcpy(kernel_name, symmetric ? kernel_name_SYM : kernel_name_LS); break;
+         case KERNEL_AWGC: strcpy(kernel_name, kernel_name_AWGC); break;
+         case KERNEL_SELL: strcpy(kernel_name, kernel_name_SELL); break;
+      }
+      rc = clReleaseKernel(platform[pdex].kernel);
+      CHECK_RESULT("clReleaseKernel")
+      platform[pdex].kernel = clCreateKernel(platform[pdex].program, kernel_name, &rc);
+      CHECK_RESULT("clCreateKernel")
+      rc = clGetKernelWorkGroupInfo (platform[pdex].kernel, platform[pdex].device[ddex].id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), (void *) &kernel_wg_size, return_size);
+      CHECK_RESULT("clGetKernelWorkGroupInfo(CL_KERNEL_WORK_GROUP_SIZE)")
+      built_kernel_type = kernel_type;
+      built_symmetric = symmetric;
+      mgs.kernel_wg_size = kernel_wg_size;
+      printf("We'll run kernel %s (%s precision) on device %s\n", kernel_label(kernel_type), REAL_NAME, platform[pdex].device[ddex].name); 
+   }
+
+   /* Tile the freshly loaded matrix, with tuned parameters when there are any for this device and matrix. */
+   if (loaded) {
+      tune_params tuned;
+      unsigned long long hash;
+      double ppn_before = 0.0, ppn_after;
+      unsigned int reloads_before = 0, reloads_after;
+      int tiled_kernel = (kernel_type == KERNEL_LS || kernel_type == KERNEL_AWGC);
+      double fill_before = stats.sell_efficiency;
+
+      /* To report what the reordering buys, tile the matrix once in its original order first. */
+      if (reorder != REORDER_NONE) {
+         if (tiled_kernel) {
+            if (matrix_tile(&mgs) != 0) {
+               printf("%s: unable to tile %s\n", name, file_name);
+               exit(EXIT_FAILURE);
+            }
+            tiling_stats(&mgs, &ppn_before, &reloads_before);
+            free(slab_startrow);
+            free(seg_workspace);
+         }
+         matrix_reorder(&mgs);
+      }
+
+      hash = matrix_hash(&mgs);
+      memset(&tuned, 0, sizeof(tuned));
+      if (tune_mode) {
+         tune_struct ts;
+         ts.context = platform[pdex].context;
+         ts.device = platform[pdex].device[ddex].id;
+         ts.kernel = platform[pdex].kernel;
+         ts.mgs = &mgs;
+         if (spmv_tune(&ts, &tuned) == 0) {
+            tune_db_store(tune_db, platform[pdex].device[ddex].name, hash, kernel_type, &tuned, ts.best_seconds);
+            mgs.tune = &tuned;
+         }
+      }
+      else if (tune_db_load(tune_db, platform[pdex].device[ddex].name, hash, kernel_type, &tuned)) {
+         printf("using tuned tiling from %s\n", tune_db);
+         mgs.tune = &tuned;
+      }
+      int applied_tune = (mgs.tune != NULL);
+      rc = matrix_tile(&mgs);
+      if (rc != 0) {
+         printf("%s: unable to tile %s\n", name, file_name);
+         exit(EXIT_FAILURE);
+      }
+      mgs.tune = NULL;
+      if (perm != NULL) {
+         if (tiled_kernel) {
+            tiling_stats(&mgs, &ppn_after, &reloads_after);
+            printf("packets per nonzero: %f -> %f, input section reloads: %u -> %u\n", ppn_before, ppn_after, reloads_before, reloads_after);
+         }
+         else {
+            printf("SELL fill efficiency: %f -> %f\n", fill_before, stats.sell_efficiency);
+         }
+      }
+      if (cache_dir != NULL) {
+         memset(&cache.key.tune, 0, sizeof(cache.key.tune));
+         if (applied_tune) cache.key.tune = tuned;
+         matrix_cache_store(&cache, &mgs);
+      }
+   }
+
+   /* With --half, the kernel reads a compressed copy of the tiled matrix (the cache holds the full one). */
+   compressed_matrix compressed;
+   compressed.workspace = NULL;
+   if (packet_format != PACKET_FULL) {
+      packet_compress(&mgs, packet_format, &compressed);
+      memsize = compressed.memsize;
+      datasize = compressed.datasize;
+      num_header_packets = compressed.num_header_packets;
+      if (cache.map == NULL) {
+         /* Only the compressed copy goes to the device. */
+         free(seg_workspace);
+         seg_workspace = NULL;
+         matrix_header = NULL;
+      }
+   }
+   print_peak_memory("tiling");
+
+   /* =============================================================================================== */
+   /* Stream the matrix if asked to, or if it cannot be allocated in one piece.                       */
+   /* =============================================================================================== */
+
+   cl_ulong max_alloc_size, global_mem_size;
+   rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc_size, NULL);
+   CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE)")
+   rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem_size, NULL);
+   CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_GLOBAL_MEM_SIZE)")
+   if (stream_budget == 0 && memsize > max_alloc_size) {
+      /* Two buffers in flight, leaving room for the vectors. */
+      stream_budget = (max_alloc_size < global_mem_size / 4) ? max_alloc_size : global_mem_size / 4;
+      printf("tiled matrix (%llu bytes) exceeds the largest device allocation (%llu bytes); streaming it\n",
+             (unsigned long long) memsize, (unsigned long long) max_alloc_size);
+   }
+   if (stream_budget > max_alloc_size) stream_budget = max_alloc_size;
+   if (stream_budget) {
+      if (packet_format != PACKET_FULL) {
+         printf("streaming sends the full tiled matrix; it cannot be combined with --half\n");
+         exit(EXIT_FAILURE);
+      }
+      if (kernel_type == KERNEL_SELL) {
+         printf("streaming needs a tiled (LS or AWGC) kernel; the SELL format is not split into slabs\n");
+         exit(EXIT_FAILURE);
+      }
+      if (bench_iterations || cg_iterations || pagerank_iterations) {
+         printf("--bench, --cg and --pagerank need the whole matrix resident on the device; ignored while streaming\n");
+         bench_iterations = cg_iterations = pagerank_iterations = 0;
+      }
+      if (persistent) {
+         printf("--persistent hands out the slabs of one resident matrix; ignored while streaming\n");
+         persistent = 0;
+      }
+   }
+
+   /* With several devices, spmv_multi() does the timing itself: --bench sets its iteration count. */
+   unsigned int multi_iterations = 1;
+   if (num_multi_devices) {
+      if (stream_budget || kernel_type == KERNEL_SELL || packet_format != PACKET_FULL || symmetric) {
+         printf("partitioning across devices needs the full tiled matrix of the LS or AWGC kernel, resident;\n");
+         printf("it cannot be combined with streaming, --half, --symmetric or the SELL kernel\n");
+         exit(EXIT_FAILURE);
+      }
+      if (cg_iterations) {
+         printf("--cg runs on a single device; ignored with --multi or --fission\n");
+         cg_iterations = 0;
+      }
+      if (bench_iterations) multi_iterations = bench_iterations;
+      bench_iterations = 0;
+   }
 
    /* =============================================================================================== */
    /* Compute the local and global work group sizes.                                                  */
@@ -470,6 +1018,13 @@ int main(int argc, char *argv[]) {
       global_work_size[0] = nslabs_round;
       local_work_size[0] = 1;
    }
+   else if (kernel_type == KERNEL_SELL) {
+      /* One work item per row slot; each chunk of max_slabheight (= C) rows is shared by a work group. */
+      ndims = 1;
+      local_work_size[0] = max_slabheight;
+      while (local_work_size[0] > kernel_wg_size) local_work_size[0] /= 2;
+      global_work_size[0] = nslabs_round * max_slabheight;
+   }
    else {
       ndims = 2;
       team_size = (platform[pdex].device[ddex].type == CL_DEVICE_TYPE_GPU) ? 16 : 1;
@@ -493,16 +1048,16 @@ int main(int argc, char *argv[]) {
    }
 
    /* =============================================================================================== */
-   /* Our Tiled format is now complete, but still in "working storage".  We cannot allocate its       */
-   /* buffer in OpenCL until we know how big it is, and now, we finally know how big it is.  So, we   */
-   /* create the Input and Output arrays, and the final array to hold the Tiled Format of the Matrix. */
+   /* Our Tiled format is now complete, in an allocation sized exactly to it.  We create the Input    */
+   /* and Output arrays, and wrap that allocation as the final array holding the Tiled Format of the  */
+   /* Matrix, so the packets are written once and never copied on the host.                          */
    /* =============================================================================================== */
 
    /* Arrays to hold input and output data, and the finished tiled matrix data. */
-   float *input_array, *output_array, *output_array_verify;
-   unsigned int *tilebuffer;
+   real *input_array, *output_array;
+   double *output_array_verify;    /* reference result, accumulated in double precision */
    
-   MEMORY_ALLOC_CHECK(output_array_verify, (nyround * sizeof(float)), "output_array_verify") 
+   MEMORY_ALLOC_CHECK(output_array_verify, (nyround * nvec * sizeof(double)), "output_array_verify") 
    if (output_array_verify == NULL) {
       fprintf(stderr, "insufficient memory to perform this workload.\n"); fflush(stderr);
       exit(EXIT_FAILURE);
@@ -511,21 +1066,29 @@ int main(int argc, char *argv[]) {
    cl_mem input_buffer;
    cl_mem matrix_buffer;
    cl_mem output_buffer;
-   unsigned int input_buffer_size;
-   unsigned int matrix_buffer_size;
+   size_t input_buffer_size;
+   size_t matrix_buffer_size;
    /* Create the input and matrix buffer memory objects. */
-   input_buffer_size = (nx_pad * sizeof(float));
+   input_buffer_size = ((size_t) nx_pad * nvec * sizeof(real));
    input_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_ALLOC_HOST_PTR, input_buffer_size, NULL, &rc);
    CHECK_RESULT("clCreateBuffer(input_buffer)")
 
    matrix_buffer_size = memsize;
-   matrix_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_ALLOC_HOST_PTR, matrix_buffer_size, NULL, &rc);
-   CHECK_RESULT("clCreateBuffer(matrix_buffer)")
+   if (stream_budget) {
+      matrix_buffer = NULL; /* spmv_stream() allocates its own chunk buffers. */
+   }
+   else {
+      /* The tiled matrix was built in an aligned allocation of exactly this size (or the cache file */
+      /* is mapped page aligned), so OpenCL uses it in place instead of keeping a second copy.       */
+      matrix_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, matrix_buffer_size,
+                                     (compressed.workspace != NULL) ? (void *) compressed.workspace : (void *) seg_workspace, &rc);
+      CHECK_RESULT("clCreateBuffer(matrix_buffer)")
+   }
 
    cl_event events[2];
 
-   unsigned int output_buffer_size;
-   output_buffer_size = (slab_startrow[nslabs_round] - slab_startrow[0]) * sizeof(float);
+   size_t output_buffer_size;
+   output_buffer_size = (size_t) (slab_startrow[nslabs_round] - slab_startrow[0]) * nvec * sizeof(real);
    output_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_ALLOC_HOST_PTR, output_buffer_size, NULL, &rc);
    CHECK_RESULT("clCreateBuffer(output_buffer)")
 
@@ -533,7 +1096,7 @@ int main(int argc, char *argv[]) {
    /* Map these buffers to allocate pointers into these buffers that we can use to load them.         */
    /* =============================================================================================== */
 
-   input_array =       (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
+   input_array =       (real *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
                                                        input_buffer, 
                                                        CL_TRUE, 
                                                        CL_MAP_WRITE, 
@@ -545,19 +1108,7 @@ int main(int argc, char *argv[]) {
                                                        &rc);
    CHECK_RESULT("clEnqueueMapBuffer(input_array)")
 
-   tilebuffer = (unsigned int *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
-                                                       matrix_buffer, 
-                                                       CL_TRUE, 
-                                                       CL_MAP_WRITE, 
-                                                       0, 
-                                                       (size_t) matrix_buffer_size, 
-                                                       0, 
-                                                       NULL, 
-                                                       NULL, 
-                                                       &rc);
-   CHECK_RESULT("clEnqueueMapBuffer(tilebuffer)")
-
-   output_array =     (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
+   output_array =     (real *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
                                                       output_buffer, 
                                                       CL_TRUE, 
                                                       CL_MAP_WRITE, 
@@ -569,21 +1120,28 @@ int main(int argc, char *argv[]) {
                                                       &rc);
    CHECK_RESULT("clEnqueueMapBuffer(output_array)")
 
-   /* =============================================================================================== */
-   /* Copy the tiled matrix into the memory buffer, and then unmap it.                                */
-   /* =============================================================================================== */
-
-   memcpy(tilebuffer, seg_workspace, sizeof(packet) * (matrix_header[nslabs_round].offset));
-   rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, matrix_buffer, tilebuffer, 0, NULL, &events[0]);
-   CHECK_RESULT("clEnqueueUnmapMemObject(tilebuffer)")
-   clWaitForEvents(1, events);
-
    /* Load random data into the input array.                                         */
    /* The user can substitute initialization of real data at this point in the code. */
-   for (i=0; i<nx; ++i) {
-      float rval;
-      rval = ((float) (rand() & 0x7fff)) * 0.001f - 15.0f;
-      input_array[i] = rval;
+   /* With --nvec, element i of vector v is input_array[i*nvec + v].                 */
+   /* With --reorder, the data is made in the original order in input_user, then     */
+   /* gathered into the permuted order the tiled matrix expects.                     */
+   real *input_user = NULL, *output_user = NULL;
+   if (perm != NULL) {
+      MEMORY_ALLOC_CHECK(input_user, (nx * nvec * sizeof(real)), "input_user")
+      MEMORY_ALLOC_CHECK(output_user, (ny * nvec * sizeof(real)), "output_user")
+   }
+   for (i=0; i<nx*nvec; ++i) {
+      real rval;
+      rval = ((real) (rand() & 0x7fff)) * (real) 0.001 - (real) 15.0;
+      if (perm != NULL) input_user[i] = rval;
+      else input_array[i] = rval;
+   }
+   if (perm != NULL) {
+      for (i=0; i<nx; ++i) {
+         for (j=0; j<nvec; ++j) {
+            input_array[i * nvec + j] = input_user[perm[i] * nvec + j];
+         }
+      }
    }
 
    /* Zero out the output array.                                                             */
@@ -607,46 +1165,135 @@ int main(int argc, char *argv[]) {
    /* Execution: Multiplication of the input array times the Tiled Format of the Matrix.              */
    /* =============================================================================================== */
 
-   /* Run once to verifying correct answer, and computing a baseline number of repetitions for later performance measurements. */
+   /* Run once to verify the correct answer.  Performance measurements (--bench) are repeated runs made after verification. */
 
    rc = clSetKernelArg(platform[pdex].kernel, 0, sizeof(cl_mem), (const void *) &input_buffer);
    CHECK_RESULT("clSetKernelArg(0)")
    rc = clSetKernelArg(platform[pdex].kernel, 1, sizeof(cl_mem), (const void *) &output_buffer);
    CHECK_RESULT("clSetKernelArg(1)")
-   rc = clSetKernelArg(platform[pdex].kernel, 2, sizeof(cl_mem), (const void *) &matrix_buffer);
-   CHECK_RESULT("clSetKernelArg(2)")
-   rc = clSetKernelArg(platform[pdex].kernel, 3, sizeof(cl_uint), &column_span);
-   CHECK_RESULT("clSetKernelArg(3)")
-   rc = clSetKernelArg(platform[pdex].kernel, 4, sizeof(cl_uint), &max_slabheight);
-   CHECK_RESULT("clSetKernelArg(4)")
-
-   if (kernel_type == KERNEL_LS) {
+   if (stream_budget == 0) {
+      rc = clSetKernelArg(platform[pdex].kernel, 2, sizeof(cl_mem), (const void *) &matrix_buffer);
+      CHECK_RESULT("clSetKernelArg(2)")
+   }
+
+   if (kernel_type == KERNEL_SELL) {
+      /* The SELL kernel finds everything else in the header at the start of its matrix buffer. */
+   }
+   else if (kernel_type == KERNEL_LS) {
+      rc = clSetKernelArg(platform[pdex].kernel, 3, sizeof(cl_uint), &column_span);
+      CHECK_RESULT("clSetKernelArg(3)")
+      rc = clSetKernelArg(platform[pdex].kernel, 4, sizeof(cl_uint), &max_slabheight);
+      CHECK_RESULT("clSetKernelArg(4)")
       rc = clSetKernelArg(platform[pdex].kernel, 5, sizeof(cl_uint), &team_size);
       CHECK_RESULT("clSetKernelArg(5)")
       rc = clSetKernelArg(platform[pdex].kernel, 6, sizeof(cl_uint), &num_header_packets);
       CHECK_RESULT("clSetKernelArg(6)")
-      rc = clSetKernelArg(platform[pdex].kernel, 7, (size_t) (max_slabheight * sizeof(float)), (void *) NULL);
+      rc = clSetKernelArg(platform[pdex].kernel, 7, (size_t) (max_slabheight * nvec * sizeof(real)), (void *) NULL);
       CHECK_RESULT("clSetKernelArg(7)")
+      if (nvec > 1) {
+         rc = clSetKernelArg(platform[pdex].kernel, 8, sizeof(cl_uint), &nvec);
+         CHECK_RESULT("clSetKernelArg(8)")
+      }
    }
    else {
+      rc = clSetKernelArg(platform[pdex].kernel, 3, sizeof(cl_uint), &column_span);
+      CHECK_RESULT("clSetKernelArg(3)")
+      rc = clSetKernelArg(platform[pdex].kernel, 4, sizeof(cl_uint), &max_slabheight);
+      CHECK_RESULT("clSetKernelArg(4)")
       rc = clSetKernelArg(platform[pdex].kernel, 5, sizeof(cl_uint), &segcachesize);
       CHECK_RESULT("clSetKernelArg(5)")
       rc = clSetKernelArg(platform[pdex].kernel, 6, sizeof(cl_uint), &num_header_packets);
       CHECK_RESULT("clSetKernelArg(6)")
-      rc = clSetKernelArg(platform[pdex].kernel, 7, (size_t) (2 * column_span * sizeof(float)), (void *) NULL);
+      rc = clSetKernelArg(platform[pdex].kernel, 7, (size_t) (2 * column_span * sizeof(real)), (void *) NULL);
       CHECK_RESULT("clSetKernelArg(7)")
-      rc = clSetKernelArg(platform[pdex].kernel, 8, (size_t) (max_slabheight * sizeof(float)), (void *) NULL);
+      rc = clSetKernelArg(platform[pdex].kernel, 8, (size_t) (max_slabheight * sizeof(real)), (void *) NULL);
       CHECK_RESULT("clSetKernelArg(8)")
       rc = clSetKernelArg(platform[pdex].kernel, 9, (size_t) (segcachesize * sizeof(packet)), (void *) NULL);
       CHECK_RESULT("clSetKernelArg(9)")
    }
 
-   rc = clEnqueueNDRangeKernel(platform[pdex].device[ddex].ComQ, platform[pdex].kernel, ndims, NULL, global_work_size, local_work_size, 0, NULL, &events[0]);
-   CHECK_RESULT("clEnqueueNDRangeKernel")
+   /* With --persistent, a few work groups per compute unit replace the one-per-slab launch, and take */
+   /* their slabs from "slab_counter".  The static kernel is kept, for the --bench comparison.        */
+   cl_kernel static_kernel = NULL;
+   cl_mem slab_counter = NULL;
+   size_t static_global_work_size[3];
+   if (persistent) {
+      cl_uint device_compute_units, persistent_groups;
+      cl_uint counter_init[2] = {0, 0};
+      rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &device_compute_units, NULL);
+      CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_MAX_COMPUTE_UNITS)")
+      persistent_groups = device_compute_units * PERSISTENT_GROUPS_PER_CU;
+      if (persistent_groups > nslabs_round) persistent_groups = nslabs_round;
+
+      slab_counter = clCreateBuffer(platform[pdex].context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(counter_init), counter_init, &rc);
+      CHECK_RESULT("clCreateBuffer(slab_counter)")
+      static_kernel = platform[pdex].kernel;
+      platform[pdex].kernel = clCreateKernel(platform[pdex].program, kernel_name_PERSISTENT, &rc);
+      CHECK_RESULT("clCreateKernel(persistent)")
+      rc  = clSetKernelArg(platform[pdex].kernel, 0, sizeof(cl_mem), (const void *) &input_buffer);
+      rc |= clSetKernelArg(platform[pdex].kernel, 1, sizeof(cl_mem), (const void *) &output_buffer);
+      rc |= clSetKernelArg(platform[pdex].kernel, 2, sizeof(cl_mem), (const void *) &matrix_buffer);
+      rc |= clSetKernelArg(platform[pdex].kernel, 3, sizeof(cl_uint), &column_span);
+      rc |= clSetKernelArg(platform[pdex].kernel, 4, sizeof(cl_uint), &max_slabheight);
+      rc |= clSetKernelArg(platform[pdex].kernel, 5, sizeof(cl_uint), &team_size);
+      rc |= clSetKernelArg(platform[pdex].kernel, 6, sizeof(cl_uint), &num_header_packets);
+      rc |= clSetKernelArg(platform[pdex].kernel, 7, (size_t) (max_slabheight * sizeof(real)), (void *) NULL);
+      rc |= clSetKernelArg(platform[pdex].kernel, 8, sizeof(cl_mem), (const void *) &slab_counter);
+      rc |= clSetKernelArg(platform[pdex].kernel, 9, sizeof(cl_uint), &nslabs_round);
+      CHECK_RESULT("clSetKernelArg(persistent)")
+
+      for (i=0; i<ndims; ++i) static_global_work_size[i] = global_work_size[i];
+      global_work_size[1] = persistent_groups;
+      strcpy(kernel_name, kernel_name_PERSISTENT);
+      printf("persistent work groups: %u groups (%u per compute unit) share %u slabs\n", persistent_groups, PERSISTENT_GROUPS_PER_CU, nslabs_round);
+   }
+
+   if (stream_budget) {
+      stream_struct ss;
+      ss.context = platform[pdex].context;
+      ss.device = platform[pdex].device[ddex].id;
+      ss.kernel = platform[pdex].kernel;
+      ss.ndims = ndims;
+      ss.slab_dim = (kernel_type == KERNEL_AWGC) ? 0 : 1;
+      ss.global_work_size = global_work_size;
+      ss.local_work_size = local_work_size;
+      ss.matrix_header = matrix_header;
+      ss.seg_workspace = seg_workspace;
+      ss.nslabs = nslabs_round;
+      ss.budget = stream_budget;
+      if (spmv_stream(&ss, &events[0]) != 0) {
+         exit(EXIT_FAILURE);
+      }
+   }
+   else if (num_multi_devices) {
+      multi_struct ms;
+      ms.context = platform[pdex].context;
+      ms.devices = multi_devices;
+      ms.ndevices = num_multi_devices;
+      ms.kernel = platform[pdex].kernel;
+      ms.ndims = ndims;
+      ms.slab_dim = (kernel_type == KERNEL_AWGC) ? 0 : 1;
+      ms.global_work_size = global_work_size;
+      ms.local_work_size = local_work_size;
+      ms.matrix_header = matrix_header;
+      ms.seg_workspace = seg_workspace;
+      ms.nslabs = nslabs_round;
+      ms.row_index_array = row_index_array;
+      ms.slab_startrow = slab_startrow;
+      ms.row_bytes = nvec * sizeof(real);
+      ms.queue = platform[pdex].device[ddex].ComQ;
+      ms.output_buffer = output_buffer;
+      ms.iterations = multi_iterations;
+      spmv_multi(&ms, &events[0]);
+   }
+   else {
+      rc = clEnqueueNDRangeKernel(platform[pdex].device[ddex].ComQ, platform[pdex].kernel, ndims, NULL, global_work_size, local_work_size, 0, NULL, &events[0]);
+      CHECK_RESULT("clEnqueueNDRangeKernel")
+   }
 
    clWaitForEvents(1, events);
 
-   output_array = (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
+   output_array = (real *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
                                                   output_buffer, 
                                                   CL_TRUE, 
                                                   (CL_MAP_READ|CL_MAP_WRITE), 
@@ -658,7 +1305,7 @@ int main(int argc, char *argv[]) {
                                                   &rc);
    CHECK_RESULT("clEnqueueMapBuffer(output_array)")
 
-   input_array   = (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
+   input_array   = (real *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
                                                    input_buffer, 
                                                    CL_TRUE, 
                                                    (CL_MAP_READ|CL_MAP_WRITE), 
@@ -675,15 +1322,55 @@ int main(int argc, char *argv[]) {
    /* =============================================================== */
 
    rc = 0;
-   /* Run the trivial (reference) spmv calculation, using the data previously loaded into CSR format. */
-   for (i=0; i<ny; ++i) {
-      float t = 0;
-      unsigned int lb = row_index_array[i];
-      unsigned int ub = row_index_array[i+1];
-      for (j=lb; j<ub; ++j) {
-         t += data_array[j] * input_array[x_index_array[j]];
+   /* With --reorder, scatter the kernel's output back to the original row order and check it there. */
+   real *result_array = output_array;
+   if (perm != NULL) {
+      for (i=0; i<ny; ++i) {
+         for (j=0; j<nvec; ++j) {
+            output_user[perm[i] * nvec + j] = output_array[i * nvec + j];
+         }
+      }
+      result_array = output_user;
+   }
+
+   /* Run the reference spmv calculation on the host (see spmv_host.c), using the data previously      */
+   /* loaded into CSR format.  With --half it uses the values as rounded into the packets;            */
+   /* packet_compress() has reported the error that rounding introduced.  With --bench the same       */
+   /* product is timed, as the host baseline the device is compared against.                          */
+   real *reference_data = data_array;
+   if (packet_format != PACKET_FULL) {
+      MEMORY_ALLOC_CHECK(reference_data, ((non_zero ? non_zero : 1) * sizeof(real)), "reference_data")
+      for (j=0; j<non_zero; ++j) reference_data[j] = packet_value(data_array[j], packet_format);
+   }
+   host_spmv_struct hs;
+   double host_seconds = 0.0;
+   hs.row_index = row_index_array;
+   hs.x_index = x_index_array;
+   hs.data = reference_data;
+   hs.nrows = ny;
+   hs.ncols = nx;
+   hs.nvec = nvec;
+   hs.symmetric = symmetric;
+   hs.row_map = perm;
+   hs.input = input_array;
+   hs.output = output_array_verify;
+   host_spmv_init(&hs);
+   if (bench_iterations) {
+      host_seconds = host_spmv_time(&hs, (bench_iterations < HOST_BENCH_RUNS) ? bench_iterations : HOST_BENCH_RUNS);
+   }
+   else {
+      host_spmv(&hs);
+   }
+   if (reference_data != data_array) free(reference_data);
+
+   /* With half storage, each off-diagonal entry also stands for its mirror image. */
+   unsigned int diagonal_count = 0;
+   if (symmetric) {
+      for (i=0; i<ny; ++i) {
+         for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+            if (x_index_array[j] == i) ++diagonal_count;
+         }
       }
-      output_array_verify[i] = t;
    }
 
    /* Compare results of kernel computations against trivial calculation results. */
@@ -691,20 +1378,20 @@ int main(int argc, char *argv[]) {
    double diffsum;
    sum = 0.0;
    diffsum = 0.0;
-   for (i=0; i<ny; ++i) {
-      float a, b;
+   for (i=0; i<ny*nvec; ++i) {
+      double a, b;
       double abs_a, delta;
       a = output_array_verify[i];
-      b = output_array[i];
+      b = result_array[i];
       abs_a = ((double) a);
-      delta = (((double) a) - ((double) b));
+      delta = (double) (a - b);
       abs_a = (abs_a < 0.0) ? -abs_a : abs_a;
       delta = (delta < 0.0) ? -delta : delta;
       sum += abs_a;
       diffsum += delta;
    }
    printf("avg error = %le, ", diffsum / sum);
-   if (diffsum / sum > 0.0001) {
+   if (diffsum / sum > REAL_VERIFY_TOLERANCE) {
       rc = -1;
    }
 
@@ -720,6 +1407,192 @@ int main(int argc, char *argv[]) {
    rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, output_buffer, output_array, 0, NULL, NULL);
    CHECK_RESULT("clEnqueueUnmapMemObject(output)")
 
+   /* ================================================================ */
+   /* Optional benchmark, with the matrix still resident on the device. */
+   /* ================================================================ */
+
+   if (bench_iterations) {
+      bench_struct bs;
+      bench_result br;
+      char bench_label[48];
+      rc = clFinish(platform[pdex].device[ddex].ComQ);
+      CHECK_RESULT("clFinish")
+      bs.queue = platform[pdex].device[ddex].ComQ;
+      bs.kernel = platform[pdex].kernel;
+      bs.clear = NULL;
+      bs.ndims = ndims;
+      bs.global_work_size = global_work_size;
+      bs.local_work_size = local_work_size;
+      bs.warmup = BENCH_WARMUP;
+      bs.iterations = bench_iterations;
+      bs.flops = 2.0 * (double) (symmetric ? 2 * non_zero - diagonal_count : non_zero) * (double) nvec;
+      bs.bytes = (double) datasize;
+      snprintf(bench_label, sizeof(bench_label), "%s (%s)", kernel_name, REAL_NAME);
+      bs.label = bench_label;
+      /* LS_SYM adds into its output, so each timed product starts by clearing it. */
+      cl_kernel clear_kernel = NULL;
+      if (symmetric) {
+         cl_uint clear_length = (cl_uint) (output_buffer_size / sizeof(real));
+         clear_kernel = clCreateKernel(platform[pdex].program, "cg_clear", &rc);
+         CHECK_RESULT("clCreateKernel(cg_clear)")
+         rc  = clSetKernelArg(clear_kernel, 0, sizeof(cl_mem), &output_buffer);
+         rc |= clSetKernelArg(clear_kernel, 1, sizeof(cl_uint), &clear_length);
+         CHECK_RESULT("clSetKernelArg(cg_clear)")
+         bs.clear = clear_kernel;
+         bs.clear_global_work_size = CG_WGSZ * CG_MAX_GROUPS;
+      }
+      spmv_bench(&bs, &br);
+      if (clear_kernel != NULL) {
+         clReleaseKernel(clear_kernel);
+         bs.clear = NULL;
+      }
+      printf("host baseline (%u threads, %s): median %.3f ms, %.3f GFLOP/s; device speedup %.2fx\n",
+             hs.nthreads, host_spmv_isa(&hs), 1e3 * host_seconds, 1e-9 * bs.flops / host_seconds, host_seconds / br.median);
+
+      /* The same matrix through the static mapping: one work group per slab, whatever its cost. */
+      if (static_kernel != NULL) {
+         bench_result sbr;
+         bs.kernel = static_kernel;
+         bs.global_work_size = static_global_work_size;
+         snprintf(bench_label, sizeof(bench_label), "%s (%s)", kernel_name_LS, REAL_NAME);
+         spmv_bench(&bs, &sbr);
+         printf("persistent vs static: median %.3f ms vs %.3f ms, p95 %.3f ms vs %.3f ms, max %.3f ms vs %.3f ms (speedup %.2fx median, %.2fx p95)\n",
+                1e3 * br.median, 1e3 * sbr.median, 1e3 * br.p95, 1e3 * sbr.p95, 1e3 * br.max, 1e3 * sbr.max,
+                sbr.median / br.median, sbr.p95 / br.p95);
+      }
+   }
+
+   /* ================================================================ */
+   /* Optional CG solve, reusing the resident matrix and SpMV kernel.  */
+   /* ================================================================ */
+
+   if (cg_iterations) {
+      if (nx != ny) {
+         printf("cg: matrix is %d x %d; Conjugate Gradients needs a square matrix\n", ny, nx);
+      }
+      else {
+         cg_struct cs;
+         cg_result cr;
+         real *rhs, *solution;
+         double *residual;
+         rc = clFinish(platform[pdex].device[ddex].ComQ);
+         CHECK_RESULT("clFinish")
+         MEMORY_ALLOC_CHECK(rhs, (ny * sizeof(real)), "rhs")
+         MEMORY_ALLOC_CHECK(solution, (ny * sizeof(real)), "solution")
+         MEMORY_ALLOC_CHECK(residual, (ny * sizeof(double)), "residual")
+         for (i=0; i<ny; ++i) rhs[i] = 1;
+         cs.context = platform[pdex].context;
+         cs.device = platform[pdex].device[ddex].id;
+         cs.program = platform[pdex].program;
+         cs.spmv_kernel = platform[pdex].kernel;
+         cs.ndims = ndims;
+         cs.global_work_size = global_work_size;
+         cs.local_work_size = local_work_size;
+         cs.n = ny;
+         cs.input_length = nx_pad;
+         cs.output_length = (unsigned int) (output_buffer_size / sizeof(real));
+         cs.rhs = rhs;
+         cs.solution = solution;
+         cs.max_iterations = cg_iterations;
+         cs.tolerance = cg_tolerance;
+         cs.accumulate = symmetric;
+         spmv_cg(&cs, &cr);
+
+         /* Check the recurrence against the true residual, computed in double on the host. */
+         double rnorm = 0.0, bnorm = 0.0;
+         for (i=0; i<ny; ++i) {
+            double t = rhs[i];
+            for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+               t -= (double) data_array[j] * (double) solution[x_index_array[j]];
+            }
+            residual[i] = t;
+         }
+         if (symmetric) {
+            for (i=0; i<ny; ++i) {
+               for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+                  if (x_index_array[j] != i) residual[x_index_array[j]] -= (double) data_array[j] * (double) solution[i];
+               }
+            }
+         }
+         for (i=0; i<ny; ++i) {
+            rnorm += residual[i] * residual[i];
+            bnorm += (double) rhs[i] * (double) rhs[i];
+         }
+         printf("    true |b - Ax|/|b| = %le\n", sqrt(rnorm / bnorm));
+         free(rhs);
+         free(solution);
+         free(residual);
+      }
+   }
+
+   /* ================================================================ */
+   /* Optional PageRank, reusing the resident matrix and SpMV kernel.  */
+   /* ================================================================ */
+
+   if (pagerank_iterations) {
+      if (nx != ny) {
+         printf("pagerank: matrix is %d x %d; a link graph needs a square matrix\n", ny, nx);
+      }
+      else {
+         pagerank_struct ps;
+         pagerank_result pr;
+         real *rank;
+         double *step;
+         unsigned int top[PAGERANK_TOP], ntop = 0, k;
+         rc = clFinish(platform[pdex].device[ddex].ComQ);
+         CHECK_RESULT("clFinish")
+         MEMORY_ALLOC_CHECK(rank, (ny * sizeof(real)), "rank")
+         MEMORY_ALLOC_CHECK(step, (ny * sizeof(double)), "pagerank step")
+         ps.context = platform[pdex].context;
+         ps.device = platform[pdex].device[ddex].id;
+         ps.program = platform[pdex].program;
+         ps.spmv_kernel = platform[pdex].kernel;
+         ps.ndims = ndims;
+         ps.global_work_size = global_work_size;
+         ps.local_work_size = local_work_size;
+         ps.n = ny;
+         ps.input_length = nx_pad;
+         ps.output_length = (unsigned int) (output_buffer_size / sizeof(real));
+         ps.rank = rank;
+         ps.max_iterations = pagerank_iterations;
+         ps.tolerance = cg_tolerance;
+         ps.damping = pagerank_damping;
+         spmv_pagerank(&ps, &pr);
+
+         /* Check the ranks against one more power step, computed in double on the host. */
+         double total = 0.0, spread = 0.0, change = 0.0;
+         for (i=0; i<ny; ++i) {
+            double t = 0.0;
+            for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+               t += (double) data_array[j] * (double) rank[x_index_array[j]];
+            }
+            step[i] = pagerank_damping * t;
+            spread += step[i];
+            total += rank[i];
+         }
+         spread = (total - spread) / ny;
+         for (i=0; i<ny; ++i) {
+            change += fabs(step[i] + spread - (double) rank[i]);
+         }
+         printf("    sum of ranks = %.9f, host |P'x - x|_1 = %le\n", total, change);
+
+         /* The highest ranked vertices, numbered as in the matrix file (one-based). */
+         for (i=0; i<ny; ++i) {
+            if (ntop < PAGERANK_TOP) ++ntop;
+            else if (rank[i] <= rank[top[ntop-1]]) continue;
+            for (k=ntop-1; k>0 && rank[top[k-1]] < rank[i]; --k) top[k] = top[k-1];
+            top[k] = i;
+         }
+         printf("    top %u:", ntop);
+         for (k=0; k<ntop; ++k) {
+            printf(" %u (%.3le)", ((perm != NULL) ? perm[top[k]] : top[k]) + 1, (double) rank[top[k]]);
+         }
+         printf("\n");
+         free(rank);
+         free(step);
+      }
+   }
+
    rc = clFinish(platform[pdex].device[ddex].ComQ);
    CHECK_RESULT("clFinish")
 
@@ -729,10 +1602,18 @@ int main(int argc, char *argv[]) {
    CHECK_RESULT("clReleaseEvent(1)")
    rc = clReleaseMemObject(input_buffer);
    CHECK_RESULT("clReleaseMemObject(input)")
-   rc = clReleaseMemObject(matrix_buffer);
-   CHECK_RESULT("clReleaseMemObject(matrix)")
+   if (matrix_buffer) {
+      rc = clReleaseMemObject(matrix_buffer);
+      CHECK_RESULT("clReleaseMemObject(matrix)")
+   }
    rc = clReleaseMemObject(output_buffer);
    CHECK_RESULT("clReleaseMemObject(output)")
+   if (static_kernel != NULL) {
+      rc = clReleaseKernel(static_kernel);
+      CHECK_RESULT("clReleaseKernel(static)")
+      rc = clReleaseMemObject(slab_counter);
+      CHECK_RESULT("clReleaseMemObject(slab_counter)")
+   }
    rc = clReleaseCommandQueue(platform[pdex].device[ddex].ComQ);
    CHECK_RESULT("clReleaseCommandQueue")
    rc = clReleaseKernel(platform[pdex].kernel);
@@ -741,16 +1622,32 @@ int main(int argc, char *argv[]) {
    CHECK_RESULT("clReleaseProgram")
    rc = clReleaseContext(platform[pdex].context);
    CHECK_RESULT("clReleaseContext")
+   print_peak_memory("run");
 
    /* ============================= */
    /* Free up all allocated memory. */
    /* ============================= */
 
-   free(data_array);
-   free(x_index_array);
-   free(row_index_array);
-   free(slab_startrow);
-   free(seg_workspace);
+   if (cache.map) {
+      matrix_cache_release(&cache);
+   }
+   else {
+      free(data_array);
+      free(x_index_array);
+      free(row_index_array);
+      free(slab_startrow);
+      free(seg_workspace);
+      free(perm);
+   }
+   free(compressed.workspace);
+#ifdef CL_VERSION_1_2
+   if (fission > 1) {
+      for (i=0; i<num_multi_devices; ++i) clReleaseDevice(multi_devices[i]);
+   }
+#endif
+   free(multi_devices);
+   free(input_user);
+   free(output_user);
    free(output_array_verify);
    free(platform[pdex].device[ddex].name);
    for (i=0; i<num_platforms; ++i) free(platform[i].device);
@@ -21,7 +21,8 @@
 /*    "outindex": the index into the output vector where this slab's output is to begin               */
 /*    "outspan": the number of elements of the output vector which this slab is responsible for       */
 /*                                                                                                    */
-/* The actual data in the slab is organized into 16-element "packets", of length 128 bytes.           */
+/* The actual data in the slab is organized into 16-element "packets", of length 128 bytes            */
+/* (192 bytes when built with -DDOUBLE).                                                              */
 /* (see the definition of the "packet" struct below)                                                  */
 /* Each packet contains four "control words" used by the kernels, 16 two-byte indices into            */
 /* the input array, and sixteen floating point values from the matrix.                                */
@@ -34,7 +35,7 @@
 /*                                                                                                    */
 /* These four words are followed by four words of pad, reserved for future use.                       */
 /* Next come 16 short integers, containing offsets into the input vector.                             */
-/* Next come 16 floating point values, containing the actual matrix data.                             */
+/* Next come 16 floating point values ("real": float, or double with -DDOUBLE), the matrix data.      */
 /*                                                                                                    */
 /* Specific output offsets for each value are not needed, because the packets are created in          */
 /* a special format: each value is intended to update the output vector element subsequent to that    */
@@ -54,6 +55,16 @@
 /* developerWorks group. See https://www.ibm.com/developerworks/mydeveloperworks/groups               */
 /* ================================================================================================== */
 
+/* Precision of the matrix values and vectors; the host passes -DDOUBLE when built as spmv_double. */
+#ifdef DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double8 real8;
+#else
+typedef float real;
+typedef float8 real8;
+#endif
+
 /* These two structures are defined both in spmv.c and spmv.cl (using different variable types). */
 /* If you change something here, change it in the other file as well. */
 typedef struct _slab_header {
@@ -73,8 +84,8 @@ typedef struct _packet {
    uint pad4;
    ushort input_offset_short[16];
    union {
-      float8 matdataV8[2];
-      float matdata[16];
+      real8 matdataV8[2];
+      real matdata[16];
    } uf;
 } packet;
 
@@ -82,27 +93,27 @@ typedef struct _packet {
 /* Kernel using basic load/store mechanisms and local vars. This version is optimized for the GPU and CPU devices    */
 /* ================================================================================================================= */
 
-__kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to input memory object in global memory */
-                                   __global float *output,        /* pointer to output memory object in global memory */
-                                   __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
-                                   __private uint column_span,    /* size of fixed chunks of the input vector */
-                                   __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
-                                   __private uint team_size,      /* size of each "team" of local work units */
-                                   __private uint num_header_packets,
-                                   __local float *outputspace)    /* local buffer to hold computed output, to be written out at the end */
+static void tiled_spmv_slab(__global real *input,
+                            __global real *output,
+                            __global uint *matbuffer,
+                            uint slab,                     /* which slab header to process */
+                            uint slabspace,
+                            uint team_size,
+                            uint num_header_packets,
+                            __local real *outputspace)
 {
    uint i, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan; 
    __global slab_header *headptr;
-   __global float *work_input;
+   __global real *work_input;
    __global packet *gsegptr;      /* This is a "global pointer."  Compare to variable in other kernel called "lsegptr." */
    __global packet *gsegptr_stop; /* Computed to hold the address of the end of the work for this work unit.            */
-   __global float *outptr;
-   __local float *outptr16;
+   __global real *outptr;
+   __local real *outptr16;
 
    /* The local workgroup is interpreted as a set of "teams," each consisting of 1 or 16 work units. */
    /* This construction is frequently very useful on the GPU device.                                 */
 
-   headptr = ((__global slab_header *) matbuffer) + get_global_id(1);
+   headptr = ((__global slab_header *) matbuffer) + slab;
    outspan = headptr->outspan;
    outindex = headptr->outindex;
    n_teams = get_local_size(0)/team_size;  /* number of teams */
@@ -117,7 +128,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 #ifdef DOUBLE
       outputspace[i] = 0.0;     
 #else
-      outputspace[i] = 0.0f;     
+      outputspace[i] = 0;     
 #endif
    }
    barrier(CLK_LOCAL_MEM_FENCE);
@@ -170,6 +181,383 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
    }
 }
 
+__kernel void tiled_spmv_kernel_LS(__global real *input,         /* pointer to input memory object in global memory */
+                                   __global real *output,        /* pointer to output memory object in global memory */
+                                   __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
+                                   __private uint column_span,    /* size of fixed chunks of the input vector */
+                                   __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
+                                   __private uint team_size,      /* size of each "team" of local work units */
+                                   __private uint num_header_packets,
+                                   __local real *outputspace)    /* local buffer to hold computed output, to be written out at the end */
+{
+   tiled_spmv_slab(input, output, matbuffer, get_global_id(1), slabspace, team_size, num_header_packets, outputspace);
+}
+
+/* ================================================================================================================= */
+/* Persistent-work-group variant of the load/store kernel (--persistent).  Rather than one work group per slab, a    */
+/* fixed number of work groups each take the next slab from an atomic counter until the slabs run out, so that a     */
+/* few expensive slabs (skewed row lengths) no longer hold up the groups statically assigned behind them.            */
+/* slab_counter[0] is the next slab to hand out and slab_counter[1] counts the groups that have run out; the last    */
+/* group out clears both, so the kernel can be enqueued again without the host resetting the counter.                */
+/* The arguments are those of tiled_spmv_kernel_LS, followed by the counter and the number of slabs.                 */
+/* ================================================================================================================= */
+
+__kernel void tiled_spmv_kernel_LS_PERSISTENT(__global real *input,
+                                              __global real *output,
+                                              __global uint *matbuffer,
+                                              __private uint column_span,
+                                              __private uint slabspace,
+                                              __private uint team_size,
+                                              __private uint num_header_packets,
+                                              __local real *outputspace,
+                                              volatile __global uint *slab_counter,
+                                              __private uint nslabs)
+{
+   __local uint slab;
+
+   while (1) {
+      barrier(CLK_LOCAL_MEM_FENCE);   /* everyone has read the previous slab number, and written out its results */
+      if (get_local_id(0) == 0) {
+         slab = atomic_inc(&slab_counter[0]);
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if (slab >= nslabs) break;
+      tiled_spmv_slab(input, output, matbuffer, slab, slabspace, team_size, num_header_packets, outputspace);
+   }
+
+   if (get_local_id(0) == 0) {
+      mem_fence(CLK_GLOBAL_MEM_FENCE);
+      if (atomic_inc(&slab_counter[1]) == get_num_groups(1) - 1) {
+         atomic_xchg(&slab_counter[0], 0);
+         atomic_xchg(&slab_counter[1], 0);
+      }
+   }
+}
+
+/* ================================================================================================================= */
+/* Load/store kernels over compressed packets (see packet_compress.c).  Each 80-byte "cpacket" holds the sixteen     */
+/* matrix values as fp16 or bfloat16 bit patterns and drops the control words only the AWGC kernel reads; slab       */
+/* offsets count cpackets.  Values are widened to float as they are read, and accumulated at full precision.         */
+/* The arguments are those of tiled_spmv_kernel_LS, with num_header_packets counted in cpackets.                     */
+/* ================================================================================================================= */
+
+typedef struct _cpacket {
+   uint seg_input_offset;
+   uint npackets_remaining;
+   uint seg_output_offset;
+   uint pad;
+   ushort input_offset_short[16];
+   ushort matdata[16];
+} cpacket;
+
+static float cpacket_value(__global cpacket *p, uint lunit, uint bf16)
+{
+   if (bf16) return as_float(((uint) p->matdata[lunit]) << 16);
+   return vload_half(lunit, (__global half *) p->matdata);
+}
+
+static void tiled_spmv_compressed(__global real *input,
+                                  __global real *output,
+                                  __global uint *matbuffer,
+                                  uint slabspace,
+                                  uint team_size,
+                                  uint num_header_packets,
+                                  __local real *outputspace,
+                                  uint bf16)
+{
+   uint i, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan; 
+   __global slab_header *headptr;
+   __global real *work_input;
+   __global cpacket *gsegptr;
+   __global cpacket *gsegptr_stop;
+   __global real *outptr;
+   __local real *outptr16;
+
+   headptr = ((__global slab_header *) matbuffer) + get_global_id(1);
+   outspan = headptr->outspan;
+   outindex = headptr->outindex;
+   n_teams = get_local_size(0)/team_size;
+   gunit = get_local_id(0);
+   teamnum = gunit/team_size;
+   start = get_global_id(0);
+   span = get_global_size(0);
+
+   for (i = start; i < slabspace; i += span) {
+      outputspace[i] = 0;     
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   gsegptr = &(((__global cpacket *) matbuffer)[headptr->offset]);
+   outptr = &output[outindex];
+
+   if (team_size == 16) {
+      lunit = gunit % team_size;
+      __global uint *first_team_offset;
+      first_team_offset = (__global uint *) gsegptr;
+      int temp_offset, temp_packetcount;
+      temp_offset = first_team_offset[teamnum] / 65536;
+      temp_packetcount = first_team_offset[teamnum] % 65536;
+      gsegptr += num_header_packets + temp_offset;
+      for (i=0; i<temp_packetcount; ++i) {
+         outptr16 = &outputspace[gsegptr->seg_output_offset];
+         work_input = &input[gsegptr->seg_input_offset];
+         outptr16[lunit] += cpacket_value(gsegptr, lunit, bf16) * work_input[gsegptr->input_offset_short[lunit]];
+         ++gsegptr;
+      }
+   }
+   else {
+      gsegptr += num_header_packets;
+      npackets = gsegptr->npackets_remaining;
+      int stopdex  = ((teamnum + 1) * npackets) / n_teams;
+      int startdex = ((teamnum    ) * npackets) / n_teams;
+      gsegptr_stop = &gsegptr[stopdex];
+      gsegptr = &gsegptr[startdex];
+      while (gsegptr < gsegptr_stop) {
+         outptr16 = &outputspace[gsegptr->seg_output_offset];
+         work_input = &input[gsegptr->seg_input_offset];
+         for (lunit=0; lunit<16; ++lunit) {
+            outptr16[lunit] += cpacket_value(gsegptr, lunit, bf16) * work_input[gsegptr->input_offset_short[lunit]];
+         }
+         ++gsegptr;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (i=start; i<outspan; i+=span) {
+      outptr[i] = outputspace[i];
+   }
+}
+
+__kernel void tiled_spmv_kernel_LS_FP16(__global real *input,
+                                        __global real *output,
+                                        __global uint *matbuffer,
+                                        __private uint column_span,
+                                        __private uint slabspace,
+                                        __private uint team_size,
+                                        __private uint num_header_packets,
+                                        __local real *outputspace)
+{
+   tiled_spmv_compressed(input, output, matbuffer, slabspace, team_size, num_header_packets, outputspace, 0);
+}
+
+__kernel void tiled_spmv_kernel_LS_BF16(__global real *input,
+                                        __global real *output,
+                                        __global uint *matbuffer,
+                                        __private uint column_span,
+                                        __private uint slabspace,
+                                        __private uint team_size,
+                                        __private uint num_header_packets,
+                                        __local real *outputspace)
+{
+   tiled_spmv_compressed(input, output, matbuffer, slabspace, team_size, num_header_packets, outputspace, 1);
+}
+
+/* ================================================================================================================= */
+/* Symmetric variant of the load/store kernel.  The tiled matrix holds each off-diagonal pair of a symmetric matrix  */
+/* only once, so every off-diagonal value a[r][c] is applied twice: to output row r through the local buffer, as in */
+/* the LS kernel, and as a[c][r] to output row c, which may belong to any slab and so is added atomically in global */
+/* memory.  For the same reason the slab's own rows are added (not stored) into the output at the end, so the       */
+/* output vector must be zeroed before every launch.  The matrix must be square.                                    */
+/* ================================================================================================================= */
+
+/* OpenCL 1.1 has no floating point atomics; retry a compare-and-swap on the bits until no one else got in between. */
+/* The double build needs 64-bit compare-and-swap for that; without it the symmetric kernel is left out.           */
+#ifdef DOUBLE
+#ifdef cl_khr_int64_base_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#define HAVE_ATOMIC_ADD_REAL
+static void atomic_add_global_real(volatile __global real *addr, real value)
+{
+   union { ulong u; real f; } old_value, new_value;
+   do {
+      old_value.f = *addr;
+      new_value.f = old_value.f + value;
+   } while (atom_cmpxchg((volatile __global ulong *) addr, old_value.u, new_value.u) != old_value.u);
+}
+#endif
+#else
+#define HAVE_ATOMIC_ADD_REAL
+static void atomic_add_global_real(volatile __global real *addr, real value)
+{
+   union { uint u; real f; } old_value, new_value;
+   do {
+      old_value.f = *addr;
+      new_value.f = old_value.f + value;
+   } while (atomic_cmpxchg((volatile __global uint *) addr, old_value.u, new_value.u) != old_value.u);
+}
+#endif
+
+#ifdef HAVE_ATOMIC_ADD_REAL
+__kernel void tiled_spmv_kernel_LS_SYM(__global real *input,         /* pointer to input memory object in global memory */
+                                       __global real *output,        /* pointer to output memory object in global memory (zeroed) */
+                                       __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
+                                       __private uint column_span,    /* size of fixed chunks of the input vector */
+                                       __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
+                                       __private uint team_size,      /* size of each "team" of local work units */
+                                       __private uint num_header_packets,
+                                       __local real *outputspace)    /* local buffer to hold computed output, to be written out at the end */
+{
+   uint i, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan, row, col; 
+   real value;
+   __global slab_header *headptr;
+   __global packet *gsegptr;
+   __global packet *gsegptr_stop;
+   __global real *outptr;
+
+   headptr = ((__global slab_header *) matbuffer) + get_global_id(1);
+   outspan = headptr->outspan;
+   outindex = headptr->outindex;
+   n_teams = get_local_size(0)/team_size;
+   gunit = get_local_id(0);
+   teamnum = gunit/team_size;
+   start = get_global_id(0);
+   span = get_global_size(0);
+
+   for (i = start; i < slabspace; i += span) {
+      outputspace[i] = 0;     
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   gsegptr = &(((__global packet *) matbuffer)[headptr->offset]);
+   outptr = &output[outindex];
+
+   /* Empty lanes of a packet hold zero, so the value test also keeps them out of the global output. */
+   if (team_size == 16) {
+      lunit = gunit % team_size;
+      __global uint *first_team_offset;
+      first_team_offset = (__global uint *) gsegptr;
+      int temp_offset, temp_packetcount;
+      temp_offset = first_team_offset[teamnum] / 65536;
+      temp_packetcount = first_team_offset[teamnum] % 65536;
+      gsegptr += num_header_packets + temp_offset;
+      for (i=0; i<temp_packetcount; ++i) {
+         value = gsegptr->uf.matdata[lunit];
+         row = gsegptr->seg_output_offset + lunit;
+         col = gsegptr->seg_input_offset + gsegptr->input_offset_short[lunit];
+         outputspace[row] += value * input[col];
+         if (value != 0 && col != outindex + row) {
+            atomic_add_global_real(&output[col], value * input[outindex + row]);
+         }
+         ++gsegptr;
+      }
+   }
+   else {
+      gsegptr += num_header_packets;
+      npackets = gsegptr->npackets_remaining;
+      int stopdex  = ((teamnum + 1) * npackets) / n_teams;
+      int startdex = ((teamnum    ) * npackets) / n_teams;
+      gsegptr_stop = &gsegptr[stopdex];
+      gsegptr = &gsegptr[startdex];
+      while (gsegptr < gsegptr_stop) {
+         for (lunit=0; lunit<16; ++lunit) {
+            value = gsegptr->uf.matdata[lunit];
+            row = gsegptr->seg_output_offset + lunit;
+            col = gsegptr->seg_input_offset + gsegptr->input_offset_short[lunit];
+            outputspace[row] += value * input[col];
+            if (value != 0 && col != outindex + row) {
+               atomic_add_global_real(&output[col], value * input[outindex + row]);
+            }
+         }
+         ++gsegptr;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (i=start; i<outspan; i+=span) {
+      atomic_add_global_real(&outptr[i], outputspace[i]);
+   }
+}
+#endif
+
+/* ================================================================================================================= */
+/* Multi-vector (SpMM) variant of the load/store kernel.  It multiplies the matrix by "nvec" vectors at once, so    */
+/* each packet is read from global memory once, however many vectors there are.  The vectors are interleaved: the   */
+/* input holds element i of vector v at input[i*nvec + v], and the output is laid out the same way.                 */
+/* The local output buffer must hold slabspace*nvec values.                                                         */
+/* ================================================================================================================= */
+
+__kernel void tiled_spmm_kernel_LS(__global real *input,         /* pointer to interleaved input vectors in global memory */
+                                   __global real *output,        /* pointer to interleaved output vectors in global memory */
+                                   __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
+                                   __private uint column_span,    /* size of fixed chunks of the input vector */
+                                   __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
+                                   __private uint team_size,      /* size of each "team" of local work units */
+                                   __private uint num_header_packets,
+                                   __local real *outputspace,    /* local buffer to hold computed output, to be written out at the end */
+                                   __private uint nvec)           /* number of interleaved vectors */
+{
+   uint i, v, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan; 
+   __global slab_header *headptr;
+   __global real *work_input;
+   __global packet *gsegptr;
+   __global packet *gsegptr_stop;
+   __global real *outptr;
+   __local real *outptr16;
+
+   headptr = ((__global slab_header *) matbuffer) + get_global_id(1);
+   outspan = headptr->outspan * nvec;
+   outindex = headptr->outindex * nvec;
+   n_teams = get_local_size(0)/team_size;
+   gunit = get_local_id(0);
+   teamnum = gunit/team_size;
+   start = get_global_id(0);
+   span = get_global_size(0);
+
+   for (i = start; i < slabspace * nvec; i += span) {
+      outputspace[i] = 0;     
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   gsegptr = &(((__global packet *) matbuffer)[headptr->offset]);
+   outptr = &output[outindex];
+
+   /* The two clauses match those of tiled_spmv_kernel_LS; the innermost loop runs over the vectors, */
+   /* reusing the matrix value and input offset that were loaded once for the packet element.         */
+
+   if (team_size == 16) {
+      lunit = gunit % team_size;
+      __global uint *first_team_offset;
+      first_team_offset = (__global uint *) gsegptr;
+      int temp_offset, temp_packetcount;
+      temp_offset = first_team_offset[teamnum] / 65536;
+      temp_packetcount = first_team_offset[teamnum] % 65536;
+      gsegptr += num_header_packets + temp_offset;
+      for (i=0; i<temp_packetcount; ++i) {
+         real matval = gsegptr->uf.matdata[lunit];
+         outptr16 = &outputspace[(gsegptr->seg_output_offset + lunit) * nvec];
+         work_input = &input[(gsegptr->seg_input_offset + gsegptr->input_offset_short[lunit]) * nvec];
+         for (v=0; v<nvec; ++v) {
+            outptr16[v] += matval * work_input[v];
+         }
+         ++gsegptr;
+      }
+   }
+   else {
+      gsegptr += num_header_packets;
+      npackets = gsegptr->npackets_remaining;
+      int stopdex  = ((teamnum + 1) * npackets) / n_teams;
+      int startdex = ((teamnum    ) * npackets) / n_teams;
+      gsegptr_stop = &gsegptr[stopdex];
+      gsegptr = &gsegptr[startdex];
+      while (gsegptr < gsegptr_stop) {
+         for (lunit=0; lunit<16; ++lunit) {
+            real matval = gsegptr->uf.matdata[lunit];
+            outptr16 = &outputspace[(gsegptr->seg_output_offset + lunit) * nvec];
+            work_input = &input[(gsegptr->seg_input_offset + gsegptr->input_offset_short[lunit]) * nvec];
+            for (v=0; v<nvec; ++v) {
+               outptr16[v] += matval * work_input[v];
+            }
+         }
+         ++gsegptr;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (i=start; i<outspan; i+=span) {
+      outptr[i] = outputspace[i];
+   }
+}
+
 /* ================================================================================================== */
 /* Kernel using "async_work_group_copy".  This version is optimized for the ACCELERATOR device        */
 /* ================================================================================================== */
@@ -181,8 +569,8 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 /* =========================================================== */
 
 #define GET_INPUT(_inputspace_index, _input_offset) {                                                                 \
-   eventI[_inputspace_index] = async_work_group_copy((__local float8 *) &inputspace[column_span * _inputspace_index], \
-                                                     (const __global float8 *) &input[_input_offset],                 \
+   eventI[_inputspace_index] = async_work_group_copy((__local real8 *) &inputspace[column_span * _inputspace_index], \
+                                                     (const __global real8 *) &input[_input_offset],                 \
                                                      (size_t) (column_span>>3),                                       \
                                                      (event_t) 0);                                                    \
 }
@@ -207,7 +595,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 /* memory, do the following:                                 */
 /*    Snap a pointer to the beginning of the packet.         */
 /*    If it's time, grab a new batch of input data.          */
-/*    Snap pointers to the output and matrix float data.     */
+/*    Snap pointers to the output and matrix real data.     */
 /*    Spend 16 lines performing the scalar computations.     */
 /*    Perform two 8-way SIMD FMA operations.                 */
 /*    Update the index to the next packet.                   */
@@ -215,7 +603,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 /* ========================================================= */
 
 #define PROCESS_LOCAL_PACKET {                                                   \
-   float8 inV[2];                                                                \
+   real8 inV[2];                                                                \
    lsegptr = (__local struct _packet *) &lsegspace[lsegspace_index];             \
    if (lsegptr->seg_input_offset != curr_input_offset) {                         \
        curr_input_offset = lsegptr->seg_input_offset;                            \
@@ -225,7 +613,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
        wait_group_events(1, &eventI[inputspace_index]);                          \
    }                                                                             \
    work_input = &inputspace[column_span * inputspace_index];                     \
-   outputspaceV8 = (__local float8 *) &outputspace[lsegptr->seg_output_offset];  \
+   outputspaceV8 = (__local real8 *) &outputspace[lsegptr->seg_output_offset];  \
    inV[0].s0 = work_input[lsegptr->input_offset_short[ 0]];                      \
    inV[0].s1 = work_input[lsegptr->input_offset_short[ 1]];                      \
    inV[0].s2 = work_input[lsegptr->input_offset_short[ 2]];                      \
@@ -248,20 +636,20 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 }
 
 __kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
-   void tiled_spmv_kernel_AWGC(__global float *input,         /* pointer to input memory object in global memory */
-                               __global float *output,        /* pointer to output memory object in global memory */
+   void tiled_spmv_kernel_AWGC(__global real *input,         /* pointer to input memory object in global memory */
+                               __global real *output,        /* pointer to output memory object in global memory */
                                __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
                                __private uint column_span,    /* size of fixed chunks of the input vector */
                                __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
                                __private uint segcachesize,   /* number of tiled matrix packets which will fit in "outputspace" */
                                __private uint num_header_packets,
-                               __local float *inputspace,     /* local buffer to hold staged input vector data */
-                               __local float *outputspace,    /* local buffer to hold computed output, to be written out at the end */
+                               __local real *inputspace,     /* local buffer to hold staged input vector data */
+                               __local real *outputspace,    /* local buffer to hold computed output, to be written out at the end */
                                __local packet *lsegspace)     /* local buffer to hold staged tiled matrix packet data */
 {
    __global slab_header *headptr;
-   __local float *work_input;
-   __local float8 *outputspaceV8;
+   __local real *work_input;
+   __local real8 *outputspaceV8;
    int i, tempmax;
    event_t eventS[2], eventI[2], eventO;
 
@@ -291,7 +679,7 @@ __kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
    GET_PACKET(segcachesize/2)
    tempmax = (segcachesize < npackets) ? segcachesize : npackets;
    for (i=0; i<slabspace; ++i) {
-      outputspace[i] = 0.0f; /* zero out the output buffer */
+      outputspace[i] = 0; /* zero out the output buffer */
    }
 
    uint curr_input_offset = lsegptr->seg_input_offset;
@@ -331,8 +719,209 @@ __kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
 
    /* Now that processing is done, it's time to write out the final results for this slab. */
 
-   eventO = async_work_group_copy((__global float *) &output[headptr->outindex], (__const local float *) outputspace, (size_t) (headptr->outspan), (event_t) 0);
+   eventO = async_work_group_copy((__global real *) &output[headptr->outindex], (__const local real *) outputspace, (size_t) (headptr->outspan), (event_t) 0);
    wait_group_events(1, &eventO);
    wait_group_events(1, &eventI[1-inputspace_index]);
    wait_group_events(2, eventS);
 }
+
+/* ================================================================================================================= */
+/* Kernel for the sliced ELLPACK (SELL-C-sigma) format built by sell_gen.c, used when rows have similar lengths.    */
+/* One work item handles one row; the C rows of a chunk are stored column-major, so that on every step the work    */
+/* items of a chunk read consecutive words of col[] and val[].  Rows were permuted by length on the host, and each  */
+/* result is written back to its original row.                                                                      */
+/* ================================================================================================================= */
+
+/* This structure is defined both in spmv.h and spmv.cl.  If you change something here, change it there as well. */
+typedef struct _sell_header {
+   uint nchunks;
+   uint chunk_rows;
+   uint sigma;
+   uint nrows;
+   uint chunk_ptr_offset;
+   uint chunk_len_offset;
+   uint perm_offset;
+   uint col_offset;
+   uint val_offset;
+} sell_header;
+
+__kernel void sell_spmv_kernel(__global real *input,         /* pointer to input memory object in global memory */
+                               __global real *output,        /* pointer to output memory object in global memory */
+                               __global uint *matbuffer)      /* pointer to SELL-C-sigma matrix memory object in global memory */
+{
+   __global sell_header *hdr = (__global sell_header *) matbuffer;
+   uint gid = get_global_id(0);
+   uint C = hdr->chunk_rows;
+   uint chunk = gid / C;
+   uint lane = gid - chunk * C;
+   uint i, len, row;
+   __global uint *colptr;
+   __global real *valptr;
+   real sum = 0;
+
+   if (chunk >= hdr->nchunks) return;
+
+   len = matbuffer[hdr->chunk_len_offset + chunk];
+   colptr = &matbuffer[hdr->col_offset + matbuffer[hdr->chunk_ptr_offset + chunk] + lane];
+   valptr = ((__global real *) &matbuffer[hdr->val_offset]) + matbuffer[hdr->chunk_ptr_offset + chunk] + lane;
+
+   for (i = 0; i < len; ++i) {
+      sum += valptr[i * C] * input[colptr[i * C]];
+   }
+
+   row = matbuffer[hdr->perm_offset + gid];
+   if (row < hdr->nrows) {
+      output[row] = sum;
+   }
+}
+
+/* ================================================================================================================= */
+/* Vector kernels for the Conjugate Gradient solver in spmv_cg.c.  The scalars r.r and p.q live in a small buffer    */
+/* ("scalars") so that alpha and beta never need to travel to the host and back.                                   */
+/* ================================================================================================================= */
+
+/* First stage of a dot product: one partial sum per work group.  The local size must be a power of 2. */
+__kernel void cg_dot(__global const real *a,
+                     __global const real *b,
+                     __global real *partial,
+                     __local real *scratch,
+                     __private uint n)
+{
+   uint i, s, lid = get_local_id(0);
+   real sum = 0;
+
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      sum += a[i] * b[i];
+   }
+   scratch[lid] = sum;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for (s = get_local_size(0) / 2; s > 0; s >>= 1) {
+      if (lid < s) scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if (lid == 0) partial[get_group_id(0)] = scratch[0];
+}
+
+/* Second stage, run as a single work group: scalars[slot] = sum of the partial sums. */
+__kernel void cg_reduce(__global const real *partial,
+                        __global real *scalars,
+                        __local real *scratch,
+                        __private uint npartial,
+                        __private uint slot)
+{
+   uint i, s, lid = get_local_id(0);
+   real sum = 0;
+
+   for (i = lid; i < npartial; i += get_local_size(0)) {
+      sum += partial[i];
+   }
+   scratch[lid] = sum;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for (s = get_local_size(0) / 2; s > 0; s >>= 1) {
+      if (lid < s) scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if (lid == 0) scalars[slot] = scratch[0];
+}
+
+/* alpha = r.r / p.q;  x += alpha p;  r -= alpha q.  (p.q is always in scalars[2].) */
+__kernel void cg_update_xr(__global real *x,
+                           __global real *r,
+                           __global const real *p,
+                           __global const real *q,
+                           __global const real *scalars,
+                           __private uint rr_slot,
+                           __private uint n)
+{
+   uint i;
+   real pq = scalars[2];
+   real alpha = (pq != 0) ? scalars[rr_slot] / pq : 0;
+
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * q[i];
+   }
+}
+
+/* beta = r.r (new) / r.r (old);  p = r + beta p */
+__kernel void cg_update_p(__global real *p,
+                          __global const real *r,
+                          __global const real *scalars,
+                          __private uint rr_old_slot,
+                          __private uint rr_new_slot,
+                          __private uint n)
+{
+   uint i;
+   real rr_old = scalars[rr_old_slot];
+   real beta = (rr_old != 0) ? scalars[rr_new_slot] / rr_old : 0;
+
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      p[i] = r[i] + beta * p[i];
+   }
+}
+
+/* v = 0, before each product by the symmetric kernel, which adds into its output. */
+__kernel void cg_clear(__global real *v,
+                       __private uint n)
+{
+   uint i;
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      v[i] = 0;
+   }
+}
+
+/* ================================================================================================================= */
+/* PageRank power iteration (see spmv_pagerank.c).  Once the SpMV kernel has computed y = P x, P being the column-   */
+/* normalized transition matrix, x becomes damping * y plus an equal share of the remaining rank: the teleport, and  */
+/* whatever the dangling vertices (empty columns of P) lost.  Both come from sum(y), reduced by pagerank_sum and     */
+/* cg_reduce.  pagerank_update leaves one partial sum of |x_new - x| per work group, which cg_reduce turns into the  */
+/* L1 change of the ranks.                                                                                           */
+/* ================================================================================================================= */
+
+/* First stage of sum(a): one partial sum per work group.  The local size must be a power of 2. */
+__kernel void pagerank_sum(__global const real *a,
+                           __global real *partial,
+                           __local real *scratch,
+                           __private uint n)
+{
+   uint i, s, lid = get_local_id(0);
+   real sum = 0;
+
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      sum += a[i];
+   }
+   scratch[lid] = sum;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for (s = get_local_size(0) / 2; s > 0; s >>= 1) {
+      if (lid < s) scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if (lid == 0) partial[get_group_id(0)] = scratch[0];
+}
+
+/* x = damping * y + (1 - damping * sum(y)) / n, with sum(y) in scalars[0]; partial sums of |x_new - x|. */
+__kernel void pagerank_update(__global real *x,
+                              __global const real *y,
+                              __global const real *scalars,
+                              __global real *partial,
+                              __local real *scratch,
+                              __private real damping,
+                              __private uint n)
+{
+   uint i, s, lid = get_local_id(0);
+   real share = (1 - damping * scalars[0]) / n;
+   real delta = 0;
+
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      real next = damping * y[i] + share;
+      delta += fabs(next - x[i]);
+      x[i] = next;
+   }
+   scratch[lid] = delta;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for (s = get_local_size(0) / 2; s > 0; s >>= 1) {
+      if (lid < s) scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if (lid == 0) partial[get_group_id(0)] = scratch[0];
+}
@@ -16,6 +16,7 @@
 #include <libgen.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <math.h>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -26,9 +27,36 @@
 #define KERNEL_DEFAULT 0
 #define KERNEL_LS      1    /* The "load/store" kernel. */
 #define KERNEL_AWGC    2    /* The "async work group copy" kernel. */
+#define KERNEL_SELL    3    /* The sliced ELLPACK (SELL-C-sigma) kernel. */
+#define KERNEL_AUTO    4    /* Let matrix_gen choose from the row-length statistics. */
+
+#define REORDER_NONE   0    /* Matrix rows and columns in file order. */
+#define REORDER_RCM    1    /* Reverse Cuthill-McKee. */
+#define REORDER_DEGREE 2    /* Rows sorted by degree. */
+
+/* Precision of the matrix values and vectors.  Building with DOUBLE defined gives the fp64 */
+/* variant (the spmv_double target); the kernels are then compiled with -DDOUBLE to match.  */
+#ifdef DOUBLE
+typedef cl_double real;
+#define REAL_NAME "double"
+#define REAL_VERIFY_TOLERANCE 1e-10   /* average relative error allowed against the long double reference */
+#define CG_DEFAULT_TOLERANCE 1e-12    /* default --tol: near where fp64 rounding stalls |r|/|b| */
+#else
+typedef cl_float real;
+#define REAL_NAME "float"
+#define REAL_VERIFY_TOLERANCE 0.0001
+#define CG_DEFAULT_TOLERANCE 1e-5     /* default --tol: single precision limits how far |r|/|b| can usefully go */
+#endif
 
 #define MAX_WGSZ 1024       /* This constant should be a multiple of 512 */
 #define CPU_WGSZ 1          /* Work group size when running on a CPU (or an ACCELERATOR). */
+#define PERSISTENT_GROUPS_PER_CU 4  /* Work groups per compute unit for the --persistent LS kernel. */
+
+#define SELL_C_CPU 16                   /* SELL-C-sigma chunk height on CPUs and ACCELERATORs. */
+#define SELL_C_GPU 32                   /* SELL-C-sigma chunk height on GPUs. */
+#define SELL_SIGMA_CHUNKS 16            /* Rows are sorted by length in windows of this many chunks. */
+#define SELL_MIN_EFFICIENCY_CPU 0.75    /* Minimum SELL fill efficiency for KERNEL_AUTO to prefer SELL on a CPU. */
+#define SELL_MIN_EFFICIENCY_GPU 0.90    /* ... and on a GPU. */
 
 /* ============================================================================ */
 /* Macro to check success of each memory allocation.                            */
@@ -37,7 +65,7 @@
 #define MEMORY_ALLOC_CHECK(_addr, _len, _addrstr) {                                                             \
    posix_memalign((void **) &(_addr), preferred_alignment, _len);                                               \
    if ((_addr) == NULL) {                                                                                       \
-      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) (unsigned int) (_len), _addrstr); \
+      printf("Failed allocation of %llu bytes for %s\n", (unsigned long long) (_len), _addrstr);                \
       exit (EXIT_FAILURE);                                                                                      \
    }                                                                                                            \
 }
@@ -73,30 +101,72 @@ typedef struct _packet {
    cl_uint pad3;
    cl_uint pad4;
    cl_ushort input_offset_short[16]; /* which input values from the identified section of input vector is this packet using? */
-   float matdata[16];                /* the sixteen floating point matrix values encoded into this packet */
+   real matdata[16];                 /* the sixteen floating point matrix values encoded into this packet */
 } packet;
 
+/* Compressed packet read by the LS_FP16 and LS_BF16 kernels (see packet_compress.c); also defined in spmv.cl. */
+typedef struct _cpacket {
+   cl_uint seg_input_offset;
+   cl_uint npackets_remaining;
+   cl_uint seg_output_offset;
+   cl_uint pad;                      /* keeps the packet a multiple of 16 bytes */
+   cl_ushort input_offset_short[16];
+   cl_ushort matdata[16];            /* fp16 or bfloat16 bit patterns */
+} cpacket;
+
+/* The SELL-C-sigma buffer starts with this header.  Offsets are in 32-bit words. */
+/* It is also defined in spmv.cl; if you change something here, change it there too. */
+typedef struct _sell_header {
+   cl_uint nchunks;                  /* number of chunks of "chunk_rows" rows */
+   cl_uint chunk_rows;               /* C */
+   cl_uint sigma;                    /* rows are sorted by length within windows of sigma rows */
+   cl_uint nrows;                    /* rows of the matrix; permuted slots beyond this are padding */
+   cl_uint chunk_ptr_offset;         /* nchunks+1 element offsets of each chunk in col[] and val[] */
+   cl_uint chunk_len_offset;         /* nchunks padded row lengths */
+   cl_uint perm_offset;              /* nchunks*C original row numbers of each slot */
+   cl_uint col_offset;               /* column indices, column-major within each chunk */
+   cl_uint val_offset;               /* matrix values, laid out like col[] */
+} sell_header;
+
+/* Row-length statistics gathered by matrix_gen. */
+typedef struct _row_stats {
+   unsigned int min_row;
+   unsigned int max_row;
+   double mean_row;
+   double stddev_row;
+   double sell_efficiency;           /* fraction of SELL-C-sigma storage holding real data */
+} row_stats;
+
 /* ============================================================================ */
 /* Communication structure between tiled matrix algorithm code and OpenCL code. */
 /* ============================================================================ */
 
+/* Overrides of matrix_gen's tiling rules, found by --tune (zero keeps the rule). */
+typedef struct _tune_params {
+   unsigned int column_span;         /* AWGC: tile width, in input vector elements */
+   unsigned int segcachesize;        /* AWGC: packets staged in local memory at a time */
+   unsigned int slab_factor;         /* LS on CPU/ACCELERATOR: slabs per compute unit */
+   int wgsz;                         /* LS on GPU: work group size, which is also the slab height */
+} tune_params;
+
 typedef struct _matrix_gen_struct {
    slab_header **matrix_header;
    packet **seg_workspace;
    unsigned int *num_header_packets;
    unsigned int **row_index_array;
    unsigned int **x_index_array;
-   float **data_array;
+   real **data_array;
    unsigned int *nx_pad;
    unsigned int *nyround;
    unsigned int **slab_startrow; 
    unsigned int *nx;
    unsigned int *ny;
    unsigned int *non_zero;
-   char *file_name;
+   char *file_name;                   /* Matrix Market file, or a synthetic matrix spec when "generate" is set */
+   unsigned int generate;             /* build the matrix with mtx_generate() (see matrix_synth.c) */
    unsigned int preferred_alignment;
    unsigned int *max_compute_units;
-   unsigned int kernel_type;
+   unsigned int *kernel_type;         /* KERNEL_AUTO is replaced by the kernel matrix_gen chose */
    unsigned int *column_span;
    unsigned int local_mem_size;
    unsigned int *segcachesize;
@@ -105,11 +175,305 @@ typedef struct _matrix_gen_struct {
    int *gpu_wgsz;
    size_t kernel_wg_size;
    unsigned int *nslabs_round;
-   unsigned int *memsize;
+   size_t *memsize;
+   size_t *datasize;                  /* bytes at the start of seg_workspace holding matrix data (memsize adds slack) */
+   row_stats *stats;
+   const tune_params *tune;           /* NULL to use the built-in tiling rules */
+   unsigned int reorder;              /* REORDER_* mode for matrix_reorder */
+   unsigned int **perm;               /* set by matrix_reorder: new index -> original index, or NULL */
+   unsigned int *symmetric;           /* in: keep one triangle of a symmetric matrix; out: whether that was done */
+   unsigned int transition;           /* replace the values by the column-normalized transition matrix (--pagerank) */
 } matrix_gen_struct;
 
+/* ============================================================================ */
+/* Raw coordinate data read from a Matrix Market file (see mtx_parse.c), or    */
+/* generated from a synthetic matrix spec (see matrix_synth.c).                 */
+/* ============================================================================ */
+
+typedef struct _mtx_coo {
+   unsigned int nx;
+   unsigned int ny;
+   unsigned int non_zero;             /* number of entries kept (explicit zeros are dropped) */
+   unsigned int explicit_zero_count;
+   unsigned int data_present;         /* zero for "pattern" matrices, whose data array is left for the caller to fill */
+   unsigned int symmetric;            /* non-zero unless the matrix is "general" */
+   unsigned int *ix;                  /* zero-based column index of each entry */
+   unsigned int *iy;                  /* zero-based row index of each entry */
+   real *data;
+} mtx_coo;
+
+int mtx_parse(const char *, unsigned int, mtx_coo *);
+int mtx_generate(const char *, unsigned int, mtx_coo *);
+
 /* ============================================================================ */
 /* template for the function call to the code which builds the tiled matrix.    */
 /* ============================================================================ */
 
 int matrix_gen(matrix_gen_struct *);
+int matrix_load(matrix_gen_struct *);
+int matrix_tile(matrix_gen_struct *);
+void print_peak_memory(const char *);
+
+/* Bandwidth-reducing reordering (see reorder.c). */
+int matrix_reorder(matrix_gen_struct *);
+void tiling_stats(matrix_gen_struct *, double *, unsigned int *);
+unsigned int choose_kernel_type(const row_stats *, cl_device_type);
+
+/* SELL-C-sigma builder (see sell_gen.c). */
+unsigned int sell_chunk_rows(cl_device_type);
+void sell_row_stats(const unsigned int *, unsigned int, cl_device_type, row_stats *);
+int sell_gen(matrix_gen_struct *);
+
+/* ============================================================================ */
+/* Compressed copy of a tiled matrix for the LS kernel (see packet_compress.c). */
+/* ============================================================================ */
+
+#define PACKET_FULL 0                 /* packets as built by matrix_tile */
+#define PACKET_FP16 1                 /* matrix values rounded to IEEE half precision */
+#define PACKET_BF16 2                 /* matrix values rounded to bfloat16 */
+
+typedef struct _compressed_matrix {
+   cpacket *workspace;                /* slab headers, then cpackets, laid out like seg_workspace */
+   size_t memsize;                    /* bytes allocated, including read-past-end room */
+   size_t datasize;                   /* bytes holding matrix data */
+   unsigned int num_header_packets;   /* cpackets of team words at the start of each slab */
+} compressed_matrix;
+
+int packet_compress(matrix_gen_struct *, unsigned int, compressed_matrix *);
+real packet_value(real, unsigned int);
+const char *packet_format_name(unsigned int);
+
+/* ============================================================================ */
+/* On-disk cache of the tiled matrix, keyed by the inputs to matrix_gen().      */
+/* ============================================================================ */
+
+typedef struct _matrix_cache_key {
+   char magic[8];
+   cl_uint version;
+   cl_uint packet_size;
+   cl_ulong file_size;                /* size and modification time of the matrix file */
+   cl_long file_mtime;
+   cl_ulong device_type;
+   cl_uint kernel_type;
+   cl_uint preferred_alignment;
+   cl_uint local_mem_size;            /* determines column_span and segcachesize */
+   cl_uint max_compute_units;
+   cl_uint gpu_wgsz;
+   cl_uint kernel_wg_size;
+   cl_uint reorder;
+   cl_uint symmetric;                 /* half storage was requested */
+   cl_uint transition;                /* values were replaced by the transition matrix */
+   tune_params tune;                  /* tiling overrides applied from the tune database (not in the file name) */
+} matrix_cache_key;
+
+typedef struct _matrix_cache {
+   matrix_cache_key key;
+   char path[4096];
+   void *map;                         /* non-NULL when the matrix_gen outputs live in a mapping of the cache file */
+   size_t map_size;
+} matrix_cache;
+
+int matrix_cache_init(matrix_cache *, matrix_gen_struct *, const char *);
+int matrix_cache_peek(matrix_cache *, unsigned long long *, unsigned int *);
+int matrix_cache_load(matrix_cache *, matrix_gen_struct *);
+int matrix_cache_store(matrix_cache *, matrix_gen_struct *);
+void matrix_cache_release(matrix_cache *);
+
+/* ============================================================================ */
+/* Repeated-run kernel benchmark (see spmv_bench.c).                            */
+/* ============================================================================ */
+
+#define BENCH_WARMUP 5                /* untimed launches before the timed ones */
+
+typedef struct _bench_struct {
+   cl_command_queue queue;            /* must have CL_QUEUE_PROFILING_ENABLE */
+   cl_kernel kernel;                  /* with all arguments already set */
+   cl_kernel clear;                   /* NULL, or cg_clear on the output, for kernels that add into it */
+   size_t clear_global_work_size;
+   cl_uint ndims;
+   size_t *global_work_size;
+   size_t *local_work_size;
+   unsigned int warmup;
+   unsigned int iterations;
+   double flops;                      /* floating point operations per launch */
+   double bytes;                      /* matrix bytes streamed per launch */
+   const char *label;
+} bench_struct;
+
+typedef struct _bench_result {
+   double min, median, p95, max;      /* kernel times in seconds */
+} bench_result;
+
+int spmv_bench(bench_struct *, bench_result *);
+
+/* ============================================================================ */
+/* Conjugate Gradient solver with the matrix resident on the device             */
+/* (see spmv_cg.c).                                                             */
+/* ============================================================================ */
+
+#define CG_WGSZ       256             /* work group size of the reduction kernels (lowered to fit the device) */
+#define CG_MAX_GROUPS 256             /* upper bound on partial sums from the first reduction stage */
+
+typedef struct _cg_struct {
+   cl_context context;
+   cl_device_id device;
+   cl_program program;                /* program holding the cg_* kernels */
+   cl_kernel spmv_kernel;             /* arguments 2 and up already set; 0 and 1 are the input and output vectors */
+   cl_uint ndims;
+   size_t *global_work_size;
+   size_t *local_work_size;
+   unsigned int n;                    /* order of the (square) system */
+   unsigned int input_length;         /* elements the SpMV kernel may read from its input (nx_pad) */
+   unsigned int output_length;        /* elements the SpMV kernel may write to its output */
+   const real *rhs;                   /* n elements */
+   real *solution;                    /* n elements, written on return */
+   unsigned int max_iterations;
+   double tolerance;                  /* stop when |r| / |b| falls to this */
+   int accumulate;                    /* the SpMV kernel adds into its output (symmetric half storage) */
+} cg_struct;
+
+typedef struct _cg_result {
+   unsigned int iterations;
+   int converged;
+   double residual;                   /* final |r| / |b|, as computed by the recurrence */
+   double seconds;                    /* wall time of the iteration loop */
+} cg_result;
+
+int spmv_cg(cg_struct *, cg_result *);
+
+/* ============================================================================ */
+/* PageRank power iteration with the transition matrix resident on the device   */
+/* (see spmv_pagerank.c).  The reductions have the same shape as CG's.          */
+/* ============================================================================ */
+
+#define PAGERANK_DEFAULT_DAMPING 0.85
+#define PAGERANK_TOP 10               /* highest ranked vertices printed */
+
+typedef struct _pagerank_struct {
+   cl_context context;
+   cl_device_id device;
+   cl_program program;                /* program holding the pagerank_* and cg_reduce kernels */
+   cl_kernel spmv_kernel;             /* arguments 2 and up already set; 0 and 1 are the input and output vectors */
+   cl_uint ndims;
+   size_t *global_work_size;
+   size_t *local_work_size;
+   unsigned int n;                    /* number of vertices */
+   unsigned int input_length;         /* elements the SpMV kernel may read from its input (nx_pad) */
+   unsigned int output_length;        /* elements the SpMV kernel may write to its output */
+   real *rank;                        /* n elements, written on return */
+   unsigned int max_iterations;
+   double tolerance;                  /* stop when the L1 change of the ranks falls to this */
+   float damping;
+} pagerank_struct;
+
+typedef struct _pagerank_result {
+   unsigned int iterations;
+   int converged;
+   double delta;                      /* L1 change of the ranks in the last iteration */
+   double seconds;                    /* wall time of the iteration loop */
+} pagerank_result;
+
+int spmv_pagerank(pagerank_struct *, pagerank_result *);
+
+/* ============================================================================ */
+/* Out-of-core streaming of the tiled matrix, a group of slabs at a time        */
+/* (see spmv_stream.c).                                                         */
+/* ============================================================================ */
+
+typedef struct _stream_struct {
+   cl_context context;
+   cl_device_id device;
+   cl_kernel kernel;                  /* LS or AWGC, with every argument but 2 (the matrix buffer) set */
+   cl_uint ndims;
+   cl_uint slab_dim;                  /* dimension of the NDRange that indexes slabs */
+   size_t *global_work_size;
+   size_t *local_work_size;
+   slab_header *matrix_header;        /* the complete tiled matrix, as built by matrix_gen */
+   packet *seg_workspace;
+   unsigned int nslabs;
+   size_t budget;                     /* largest matrix buffer to allocate, in bytes */
+} stream_struct;
+
+int spmv_stream(stream_struct *, cl_event *);
+unsigned int chunk_header(const slab_header *, unsigned int, unsigned int, int, slab_header *);
+size_t chunk_bytes(const slab_header *, unsigned int, unsigned int);
+
+/* ============================================================================ */
+/* Row-partitioned SpMV across several devices of one context                   */
+/* (see spmv_multi.c).                                                          */
+/* ============================================================================ */
+
+typedef struct _multi_struct {
+   cl_context context;                /* holds every device below */
+   cl_device_id *devices;
+   unsigned int ndevices;
+   cl_kernel kernel;                  /* LS or AWGC, with every argument but 1 and 2 (output and matrix) set */
+   cl_uint ndims;
+   cl_uint slab_dim;                  /* dimension of the NDRange that indexes slabs */
+   size_t *global_work_size;
+   size_t *local_work_size;
+   slab_header *matrix_header;        /* the complete tiled matrix, as built by matrix_gen */
+   packet *seg_workspace;
+   unsigned int nslabs;
+   const unsigned int *row_index_array; /* with slab_startrow, gives the nonzeros of each slab */
+   const unsigned int *slab_startrow;
+   size_t row_bytes;                  /* output bytes per matrix row (nvec values) */
+   cl_command_queue queue;            /* queue on which to gather the output ... */
+   cl_mem output_buffer;              /* ... into this buffer */
+   unsigned int iterations;           /* timed launches on every device */
+} multi_struct;
+
+int spmv_multi(multi_struct *, cl_event *);
+
+/* ============================================================================ */
+/* Tiling auto-tuner and its database (see spmv_tune.c).                        */
+/* ============================================================================ */
+
+#define TUNE_ITERATIONS 20            /* timed launches per candidate (after 2 warmup launches) */
+#define TUNE_DB_DEFAULT "spmv_tune.db"
+
+typedef struct _tune_struct {
+   cl_context context;
+   cl_device_id device;
+   cl_kernel kernel;                  /* the LS or AWGC kernel to time */
+   matrix_gen_struct *mgs;            /* with the matrix already loaded by matrix_load() */
+   double best_seconds;               /* set by spmv_tune: median kernel time of the winner */
+} tune_struct;
+
+unsigned long long matrix_hash(matrix_gen_struct *);
+int tune_db_load(const char *, const char *, unsigned long long, unsigned int, tune_params *);
+int tune_db_store(const char *, const char *, unsigned long long, unsigned int, const tune_params *, double);
+int spmv_tune(tune_struct *, tune_params *);
+
+/* ============================================================================ */
+/* Multithreaded CSR SpMV on the host: the verification reference, and the      */
+/* baseline the device is measured against (see spmv_host.c).                   */
+/* ============================================================================ */
+
+#define HOST_MAX_THREADS   64
+#define HOST_MIN_NONZEROS  (1 << 16)  /* Don't bother spawning a thread for fewer nonzeros than this. */
+#define HOST_BENCH_RUNS    10         /* timed host products with --bench (fewer if --bench asks for fewer) */
+
+#define HOST_SCALAR 0                 /* inner loops of host_spmv() */
+#define HOST_AVX2   1                 /* 8-wide gathers (float), 4-wide (double) */
+#define HOST_AVX512 2                 /* 16-wide gathers (float), 8-wide (double) */
+
+typedef struct _host_spmv_struct {
+   const unsigned int *row_index;     /* CSR matrix, as left by matrix_load() (and matrix_reorder()) */
+   const unsigned int *x_index;
+   const real *data;
+   unsigned int nrows;
+   unsigned int ncols;
+   unsigned int nvec;
+   unsigned int symmetric;            /* apply each off-diagonal entry to its mirror image too */
+   const unsigned int *row_map;       /* output row of each matrix row, or NULL */
+   const real *input;                 /* nvec interleaved values per column */
+   double *output;                    /* nvec interleaved values per output row */
+   unsigned int nthreads;             /* set by host_spmv_init() */
+   unsigned int isa;                  /* set by host_spmv_init(): HOST_SCALAR, HOST_AVX2 or HOST_AVX512 */
+} host_spmv_struct;
+
+void host_spmv_init(host_spmv_struct *);
+void host_spmv(host_spmv_struct *);
+double host_spmv_time(host_spmv_struct *, unsigned int);
+const char *host_spmv_isa(const host_spmv_struct *);
@@ -0,0 +1,95 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Repeated-run benchmark of an already configured kernel.                           */
+/* The command queue must have been created with CL_QUEUE_PROFILING_ENABLE.  Each    */
+/* launch waits for the previous one, so an out-of-order queue cannot overlap runs   */
+/* that write to the same output buffer, and only device execution time (from the    */
+/* event's START to END timestamps) is counted.  A kernel that adds into its output  */
+/* (symmetric half storage) is preceded by a clear of that output, as a real product */
+/* needs, and each time then runs from the clear's START to the kernel's END.        */
+/* ================================================================================= */
+
+static int compare_double(const void *a, const void *b)
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+   return (x > y) - (x < y);
+}
+
+static double profiled_seconds(cl_event event)
+{
+   cl_int rc;
+   cl_ulong start, end;
+   rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+   CHECK_RESULT("clGetEventProfilingInfo(CL_PROFILING_COMMAND_START)")
+   rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+   CHECK_RESULT("clGetEventProfilingInfo(CL_PROFILING_COMMAND_END)")
+   return 1.0e-9 * (double) (end - start);
+}
+
+int spmv_bench(bench_struct *bs, bench_result *result)
+{
+   cl_int rc;
+   cl_event event, cleared;
+   cl_ulong start, end;
+   unsigned int i;
+   double *times;
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+
+   MEMORY_ALLOC_CHECK(times, (bs->iterations * sizeof(double)), "times")
+
+   for (i=0; i<bs->warmup + bs->iterations; ++i) {
+      if (bs->clear != NULL) {
+         rc = clEnqueueNDRangeKernel(bs->queue, bs->clear, 1, NULL, &bs->clear_global_work_size, NULL, 0, NULL, &cleared);
+         CHECK_RESULT("clEnqueueNDRangeKernel(bench clear)")
+      }
+      rc = clEnqueueNDRangeKernel(bs->queue, bs->kernel, bs->ndims, NULL, bs->global_work_size, bs->local_work_size,
+                                  (bs->clear != NULL) ? 1 : 0, (bs->clear != NULL) ? &cleared : NULL, &event);
+      CHECK_RESULT("clEnqueueNDRangeKernel(bench)")
+      rc = clWaitForEvents(1, &event);
+      CHECK_RESULT("clWaitForEvents(bench)")
+      if (i >= bs->warmup) {
+         if (bs->clear != NULL) {
+            rc = clGetEventProfilingInfo(cleared, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+            CHECK_RESULT("clGetEventProfilingInfo(CL_PROFILING_COMMAND_START)")
+            rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+            CHECK_RESULT("clGetEventProfilingInfo(CL_PROFILING_COMMAND_END)")
+            times[i - bs->warmup] = 1.0e-9 * (double) (end - start);
+         }
+         else {
+            times[i - bs->warmup] = profiled_seconds(event);
+         }
+      }
+      if (bs->clear != NULL) clReleaseEvent(cleared);
+      clReleaseEvent(event);
+   }
+
+   qsort(times, bs->iterations, sizeof(double), compare_double);
+   result->min = times[0];
+   result->max = times[bs->iterations - 1];
+   result->median = (bs->iterations & 1) ? times[bs->iterations / 2] : 0.5 * (times[bs->iterations / 2 - 1] + times[bs->iterations / 2]);
+   i = (unsigned int) ((95 * (unsigned long long) bs->iterations + 99) / 100);
+   result->p95 = times[(i > 0) ? i - 1 : 0];
+   free(times);
+
+   printf("bench %s: %u iterations after %u warmup%s\n", bs->label, bs->iterations, bs->warmup,
+          (bs->clear != NULL) ? ", each including the output clear" : "");
+   printf("   kernel time  min %.3f ms, median %.3f ms, p95 %.3f ms, max %.3f ms\n",
+          1e3 * result->min, 1e3 * result->median, 1e3 * result->p95, 1e3 * result->max);
+   printf("   GFLOP/s      %.3f (median), %.3f (best)\n", 1e-9 * bs->flops / result->median, 1e-9 * bs->flops / result->min);
+   printf("   matrix GB/s  %.3f (median), %.3f (best) over %.1f MB of packets\n",
+          1e-9 * bs->bytes / result->median, 1e-9 * bs->bytes / result->min, 1e-6 * bs->bytes);
+   return 0;
+}
@@ -0,0 +1,226 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <time.h>
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Conjugate Gradient solve of A x = b, for a symmetric positive definite A that is  */
+/* already tiled and resident in the SpMV kernel's matrix buffer.                    */
+/*                                                                                   */
+/* All vectors live on the device for the whole solve.  Each iteration runs the      */
+/* SpMV kernel (q = A p), then the cg_* kernels from spmv.cl for the two dot         */
+/* products and the vector updates.  The scalars (r.r and p.q) stay in a small       */
+/* device buffer, from which the update kernels compute alpha and beta themselves,   */
+/* so the only data read back per iteration is the new r.r, used for the             */
+/* convergence test.  r.r alternates between two slots so that cg_update_p can       */
+/* read both the old and the new value.                                              */
+/*                                                                                   */
+/* An in-order queue of our own orders the kernels, so no events are needed.  When   */
+/* the SpMV kernel adds into its output (symmetric half storage), cg_clear zeroes q  */
+/* before each product.                                                              */
+/* ================================================================================= */
+
+#define CG_RR0 0   /* scalar slots */
+#define CG_RR1 1
+#define CG_PQ  2
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+typedef struct _cg_kernels {
+   cl_command_queue queue;
+   cl_kernel dot, reduce, update_xr, update_p, clear;
+   cl_mem partial, scalars;
+   size_t wgsz, ngroups;
+   cl_uint n;
+} cg_kernels;
+
+/* scalars[slot] = a . b, in two stages: one partial sum per work group, then one work group adds those up. */
+static void cg_dot(cg_kernels *k, cl_mem a, cl_mem b, cl_uint slot)
+{
+   cl_int rc;
+   size_t global = k->wgsz * k->ngroups;
+   cl_uint npartial = (cl_uint) k->ngroups;
+
+   rc = clSetKernelArg(k->dot, 0, sizeof(cl_mem), &a);
+   CHECK_RESULT("clSetKernelArg(cg_dot, 0)")
+   rc = clSetKernelArg(k->dot, 1, sizeof(cl_mem), &b);
+   CHECK_RESULT("clSetKernelArg(cg_dot, 1)")
+   rc = clEnqueueNDRangeKernel(k->queue, k->dot, 1, NULL, &global, &k->wgsz, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(cg_dot)")
+
+   rc = clSetKernelArg(k->reduce, 3, sizeof(cl_uint), &npartial);
+   CHECK_RESULT("clSetKernelArg(cg_reduce, 3)")
+   rc = clSetKernelArg(k->reduce, 4, sizeof(cl_uint), &slot);
+   CHECK_RESULT("clSetKernelArg(cg_reduce, 4)")
+   rc = clEnqueueNDRangeKernel(k->queue, k->reduce, 1, NULL, &k->wgsz, &k->wgsz, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(cg_reduce)")
+}
+
+int spmv_cg(cg_struct *cs, cg_result *result)
+{
+   cl_int rc;
+   cg_kernels k;
+   cl_mem x, r, p, q;
+   real *init;
+   real rr;
+   double bnorm, t0;
+   size_t length, update_global, kernel_wg_size;
+   cl_uint q_length;
+   unsigned int i, it;
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+
+   k.n = cs->n;
+   k.queue = clCreateCommandQueue(cs->context, cs->device, 0, &rc);
+   CHECK_RESULT("clCreateCommandQueue(cg)")
+   k.dot = clCreateKernel(cs->program, "cg_dot", &rc);
+   CHECK_RESULT("clCreateKernel(cg_dot)")
+   k.reduce = clCreateKernel(cs->program, "cg_reduce", &rc);
+   CHECK_RESULT("clCreateKernel(cg_reduce)")
+   k.update_xr = clCreateKernel(cs->program, "cg_update_xr", &rc);
+   CHECK_RESULT("clCreateKernel(cg_update_xr)")
+   k.update_p = clCreateKernel(cs->program, "cg_update_p", &rc);
+   CHECK_RESULT("clCreateKernel(cg_update_p)")
+   k.clear = clCreateKernel(cs->program, "cg_clear", &rc);
+   CHECK_RESULT("clCreateKernel(cg_clear)")
+
+   /* The reductions use power-of-2 work groups that the device accepts for both stages. */
+   k.wgsz = CG_WGSZ;
+   rc = clGetKernelWorkGroupInfo(k.dot, cs->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_wg_size, NULL);
+   CHECK_RESULT("clGetKernelWorkGroupInfo(cg_dot)")
+   while (k.wgsz > kernel_wg_size) k.wgsz /= 2;
+   rc = clGetKernelWorkGroupInfo(k.reduce, cs->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_wg_size, NULL);
+   CHECK_RESULT("clGetKernelWorkGroupInfo(cg_reduce)")
+   while (k.wgsz > kernel_wg_size) k.wgsz /= 2;
+   k.ngroups = (cs->n + k.wgsz - 1) / k.wgsz;
+   if (k.ngroups > CG_MAX_GROUPS) k.ngroups = CG_MAX_GROUPS;
+   if (k.ngroups == 0) k.ngroups = 1;
+
+   /* Every vector is long enough to serve as either SpMV argument.  The padding beyond n */
+   /* starts out zero and is never touched by the update kernels, so it stays zero.       */
+   length = cs->n;
+   if (length < cs->input_length) length = cs->input_length;
+   if (length < cs->output_length) length = cs->output_length;
+   q_length = (cl_uint) length;
+   MEMORY_ALLOC_CHECK(init, (length * sizeof(real)), "cg init")
+   memset(init, 0, length * sizeof(real));
+
+   x = clCreateBuffer(cs->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, length * sizeof(real), init, &rc);
+   CHECK_RESULT("clCreateBuffer(cg x)")
+   q = clCreateBuffer(cs->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, length * sizeof(real), init, &rc);
+   CHECK_RESULT("clCreateBuffer(cg q)")
+   memcpy(init, cs->rhs, cs->n * sizeof(real));
+   r = clCreateBuffer(cs->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, length * sizeof(real), init, &rc);
+   CHECK_RESULT("clCreateBuffer(cg r)")
+   p = clCreateBuffer(cs->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, length * sizeof(real), init, &rc);
+   CHECK_RESULT("clCreateBuffer(cg p)")
+   free(init);
+   k.partial = clCreateBuffer(cs->context, CL_MEM_READ_WRITE, CG_MAX_GROUPS * sizeof(real), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(cg partial)")
+   k.scalars = clCreateBuffer(cs->context, CL_MEM_READ_WRITE, 4 * sizeof(real), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(cg scalars)")
+
+   /* Arguments that do not change from one iteration to the next. */
+   rc  = clSetKernelArg(k.dot, 2, sizeof(cl_mem), &k.partial);
+   rc |= clSetKernelArg(k.dot, 3, k.wgsz * sizeof(real), NULL);
+   rc |= clSetKernelArg(k.dot, 4, sizeof(cl_uint), &k.n);
+   rc |= clSetKernelArg(k.reduce, 0, sizeof(cl_mem), &k.partial);
+   rc |= clSetKernelArg(k.reduce, 1, sizeof(cl_mem), &k.scalars);
+   rc |= clSetKernelArg(k.reduce, 2, k.wgsz * sizeof(real), NULL);
+   rc |= clSetKernelArg(k.update_xr, 0, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(k.update_xr, 1, sizeof(cl_mem), &r);
+   rc |= clSetKernelArg(k.update_xr, 2, sizeof(cl_mem), &p);
+   rc |= clSetKernelArg(k.update_xr, 3, sizeof(cl_mem), &q);
+   rc |= clSetKernelArg(k.update_xr, 4, sizeof(cl_mem), &k.scalars);
+   rc |= clSetKernelArg(k.update_xr, 6, sizeof(cl_uint), &k.n);
+   rc |= clSetKernelArg(k.update_p, 0, sizeof(cl_mem), &p);
+   rc |= clSetKernelArg(k.update_p, 1, sizeof(cl_mem), &r);
+   rc |= clSetKernelArg(k.update_p, 2, sizeof(cl_mem), &k.scalars);
+   rc |= clSetKernelArg(k.update_p, 5, sizeof(cl_uint), &k.n);
+   rc |= clSetKernelArg(k.clear, 0, sizeof(cl_mem), &q);
+   rc |= clSetKernelArg(k.clear, 1, sizeof(cl_uint), &q_length);
+   rc |= clSetKernelArg(cs->spmv_kernel, 0, sizeof(cl_mem), &p);
+   rc |= clSetKernelArg(cs->spmv_kernel, 1, sizeof(cl_mem), &q);
+   CHECK_RESULT("clSetKernelArg(cg)")
+   update_global = k.wgsz * k.ngroups;
+
+   /* x = 0, so r = p = b, and r.r = b.b */
+   cg_dot(&k, r, r, CG_RR0);
+   rc = clEnqueueReadBuffer(k.queue, k.scalars, CL_TRUE, CG_RR0 * sizeof(real), sizeof(real), &rr, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueReadBuffer(cg rr)")
+   bnorm = sqrt((double) rr);
+   result->residual = (bnorm > 0.0) ? 1.0 : 0.0;
+   result->converged = (bnorm == 0.0);
+
+   t0 = seconds_now();
+   for (it = 0; it < cs->max_iterations && !result->converged; ++it) {
+      cl_uint rr_old = (it & 1) ? CG_RR1 : CG_RR0;
+      cl_uint rr_new = (it & 1) ? CG_RR0 : CG_RR1;
+
+      /* q = A p */
+      if (cs->accumulate) {
+         rc = clEnqueueNDRangeKernel(k.queue, k.clear, 1, NULL, &update_global, &k.wgsz, 0, NULL, NULL);
+         CHECK_RESULT("clEnqueueNDRangeKernel(cg_clear)")
+      }
+      rc = clEnqueueNDRangeKernel(k.queue, cs->spmv_kernel, cs->ndims, NULL, cs->global_work_size, cs->local_work_size, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(cg spmv)")
+
+      /* alpha = r.r / p.q;  x += alpha p;  r -= alpha q */
+      cg_dot(&k, p, q, CG_PQ);
+      rc = clSetKernelArg(k.update_xr, 5, sizeof(cl_uint), &rr_old);
+      CHECK_RESULT("clSetKernelArg(cg_update_xr, 5)")
+      rc = clEnqueueNDRangeKernel(k.queue, k.update_xr, 1, NULL, &update_global, &k.wgsz, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(cg_update_xr)")
+
+      /* beta = r.r (new) / r.r (old);  p = r + beta p */
+      cg_dot(&k, r, r, rr_new);
+      rc = clSetKernelArg(k.update_p, 3, sizeof(cl_uint), &rr_old);
+      CHECK_RESULT("clSetKernelArg(cg_update_p, 3)")
+      rc = clSetKernelArg(k.update_p, 4, sizeof(cl_uint), &rr_new);
+      CHECK_RESULT("clSetKernelArg(cg_update_p, 4)")
+      rc = clEnqueueNDRangeKernel(k.queue, k.update_p, 1, NULL, &update_global, &k.wgsz, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(cg_update_p)")
+
+      /* The one value read back each iteration. */
+      rc = clEnqueueReadBuffer(k.queue, k.scalars, CL_TRUE, rr_new * sizeof(real), sizeof(real), &rr, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueReadBuffer(cg rr)")
+      result->residual = sqrt((double) rr) / bnorm;
+      result->converged = (result->residual <= cs->tolerance);
+   }
+   result->seconds = seconds_now() - t0;
+   result->iterations = it;
+
+   rc = clEnqueueReadBuffer(k.queue, x, CL_TRUE, 0, cs->n * sizeof(real), cs->solution, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueReadBuffer(cg x)")
+
+   printf("cg: %s after %u iterations, |r|/|b| = %le\n", (result->converged ? "converged" : "stopped"), result->iterations, result->residual);
+   printf("    %.3f ms per iteration (%.3f s total)\n",
+          (result->iterations ? 1e3 * result->seconds / result->iterations : 0.0), result->seconds);
+
+   cl_mem release[6] = {x, r, p, q, k.partial, k.scalars};
+   for (i=0; i<6; ++i) {
+      rc = clReleaseMemObject(release[i]);
+      CHECK_RESULT("clReleaseMemObject(cg)")
+   }
+   clReleaseKernel(k.dot);
+   clReleaseKernel(k.reduce);
+   clReleaseKernel(k.update_xr);
+   clReleaseKernel(k.update_p);
+   clReleaseKernel(k.clear);
+   rc = clReleaseCommandQueue(k.queue);
+   CHECK_RESULT("clReleaseCommandQueue(cg)")
+   return 0;
+}
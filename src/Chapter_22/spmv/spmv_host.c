@@ -0,0 +1,249 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "spmv.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HOST_HAVE_X86_PATHS 1
+#endif
+
+/* ================================================================================= */
+/* CSR SpMV on the host, y = A x, with the rows split among threads so that each     */
+/* gets about the same number of nonzeros.  Within a row, the AVX2 and AVX-512 paths */
+/* gather 8 or 16 (float) or 4 or 8 (double) input values at once; the one to use is */
+/* picked at run time from what the processor supports.  Every path accumulates in   */
+/* double, so in single precision the products themselves are exact.                 */
+/*                                                                                   */
+/* With symmetric half storage, the mirror images of the off-diagonal entries are    */
+/* scattered into y afterwards, on one thread: they would race otherwise.            */
+/* ================================================================================= */
+
+typedef double (*row_function)(const unsigned int *, const real *, unsigned int, const real *, unsigned int, unsigned int);
+
+typedef struct _host_chunk {
+   host_spmv_struct *hs;
+   row_function row;
+   unsigned int row0, row1;
+} host_chunk;
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+   return (x > y) - (x < y);
+}
+
+/* Sum over one row of a[j] * x[xi[j] * nvec + v]. */
+static double row_scalar(const unsigned int *xi, const real *a, unsigned int len, const real *x, unsigned int nvec, unsigned int v)
+{
+   double t = 0.0;
+   unsigned int j;
+   for (j=0; j<len; ++j) t += (double) a[j] * (double) x[xi[j] * nvec + v];
+   return t;
+}
+
+#ifdef HOST_HAVE_X86_PATHS
+
+__attribute__((target("avx2,fma")))
+static double row_avx2(const unsigned int *xi, const real *a, unsigned int len, const real *x, unsigned int nvec, unsigned int v)
+{
+   double lanes[4];
+   unsigned int j = 0;
+#ifdef DOUBLE
+   __m256d acc = _mm256_setzero_pd();
+   __m128i scale = _mm_set1_epi32((int) nvec), offset = _mm_set1_epi32((int) v);
+   for (; j+4<=len; j+=4) {
+      __m128i index = _mm_add_epi32(_mm_mullo_epi32(_mm_loadu_si128((const __m128i *) &xi[j]), scale), offset);
+      acc = _mm256_fmadd_pd(_mm256_loadu_pd(&a[j]), _mm256_i32gather_pd(x, index, 8), acc);
+   }
+#else
+   __m256d acc = _mm256_setzero_pd(), acc_high = _mm256_setzero_pd();
+   __m256i scale = _mm256_set1_epi32((int) nvec), offset = _mm256_set1_epi32((int) v);
+   for (; j+8<=len; j+=8) {
+      __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *) &xi[j]), scale), offset);
+      __m256 av = _mm256_loadu_ps(&a[j]);
+      __m256 xv = _mm256_i32gather_ps(x, index, 4);
+      acc = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(av)), _mm256_cvtps_pd(_mm256_castps256_ps128(xv)), acc);
+      acc_high = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(av, 1)), _mm256_cvtps_pd(_mm256_extractf128_ps(xv, 1)), acc_high);
+   }
+   acc = _mm256_add_pd(acc, acc_high);
+#endif
+   _mm256_storeu_pd(lanes, acc);
+   return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + row_scalar(&xi[j], &a[j], len - j, x, nvec, v);
+}
+
+__attribute__((target("avx512f")))
+static double row_avx512(const unsigned int *xi, const real *a, unsigned int len, const real *x, unsigned int nvec, unsigned int v)
+{
+   unsigned int j = 0;
+#ifdef DOUBLE
+   __m512d acc = _mm512_setzero_pd();
+   __m256i scale = _mm256_set1_epi32((int) nvec), offset = _mm256_set1_epi32((int) v);
+   for (; j+8<=len; j+=8) {
+      __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *) &xi[j]), scale), offset);
+      acc = _mm512_fmadd_pd(_mm512_loadu_pd(&a[j]), _mm512_i32gather_pd(index, x, 8), acc);
+   }
+#else
+   __m512d acc = _mm512_setzero_pd(), acc_high = _mm512_setzero_pd();
+   __m512i scale = _mm512_set1_epi32((int) nvec), offset = _mm512_set1_epi32((int) v);
+   for (; j+16<=len; j+=16) {
+      __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_loadu_si512((const void *) &xi[j]), scale), offset);
+      __m512 av = _mm512_loadu_ps(&a[j]);
+      __m512 xv = _mm512_i32gather_ps(index, x, 4);
+      acc = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(av)), _mm512_cvtps_pd(_mm512_castps512_ps256(xv)), acc);
+      acc_high = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(av), 1))),
+                                 _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(xv), 1))), acc_high);
+   }
+   acc = _mm512_add_pd(acc, acc_high);
+#endif
+   return _mm512_reduce_add_pd(acc) + row_scalar(&xi[j], &a[j], len - j, x, nvec, v);
+}
+
+#endif
+
+static row_function select_row_function(unsigned int isa)
+{
+#ifdef HOST_HAVE_X86_PATHS
+   if (isa == HOST_AVX512) return row_avx512;
+   if (isa == HOST_AVX2) return row_avx2;
+#endif
+   return row_scalar;
+}
+
+static void *host_rows(void *arg)
+{
+   host_chunk *chunk = (host_chunk *) arg;
+   host_spmv_struct *hs = chunk->hs;
+   unsigned int i, v;
+
+   for (i=chunk->row0; i<chunk->row1; ++i) {
+      unsigned int lb = hs->row_index[i];
+      unsigned int len = hs->row_index[i+1] - lb;
+      unsigned int out = ((hs->row_map != NULL) ? hs->row_map[i] : i) * hs->nvec;
+      for (v=0; v<hs->nvec; ++v) {
+         hs->output[out + v] = chunk->row(&hs->x_index[lb], &hs->data[lb], len, hs->input, hs->nvec, v);
+      }
+   }
+   return NULL;
+}
+
+void host_spmv_init(host_spmv_struct *hs)
+{
+   long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   unsigned int nnz = hs->row_index[hs->nrows] - hs->row_index[0];
+
+   hs->nthreads = nnz / HOST_MIN_NONZEROS + 1;
+   if (ncpu > 0 && hs->nthreads > (unsigned int) ncpu) hs->nthreads = (unsigned int) ncpu;
+   if (hs->nthreads > HOST_MAX_THREADS) hs->nthreads = HOST_MAX_THREADS;
+   if (hs->nthreads > hs->nrows) hs->nthreads = hs->nrows ? hs->nrows : 1;
+
+   /* The gathers take signed 32-bit indices. */
+   hs->isa = HOST_SCALAR;
+#ifdef HOST_HAVE_X86_PATHS
+   if ((unsigned long long) hs->ncols * hs->nvec <= INT_MAX) {
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")) hs->isa = HOST_AVX512;
+      else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) hs->isa = HOST_AVX2;
+   }
+#endif
+}
+
+const char *host_spmv_isa(const host_spmv_struct *hs)
+{
+   switch (hs->isa) {
+      case HOST_AVX2: return "avx2";
+      case HOST_AVX512: return "avx512";
+   }
+   return "scalar";
+}
+
+void host_spmv(host_spmv_struct *hs)
+{
+   host_chunk chunk[HOST_MAX_THREADS];
+   pthread_t threads[HOST_MAX_THREADS];
+   unsigned int nthreads = hs->nthreads ? hs->nthreads : 1;
+   unsigned int first = hs->row_index[0];
+   unsigned int nnz = hs->row_index[hs->nrows] - first;
+   unsigned int t, i, j, v;
+
+   /* Cut the rows where the running nonzero count passes t/nthreads of the total. */
+   for (t=0, i=0; t<nthreads; ++t) {
+      unsigned long long target = ((unsigned long long) nnz * (t + 1)) / nthreads;
+      chunk[t].hs = hs;
+      chunk[t].row = select_row_function(hs->isa);
+      chunk[t].row0 = i;
+      while (i < hs->nrows && hs->row_index[i] - first < target) ++i;
+      if (t == nthreads - 1) i = hs->nrows;
+      chunk[t].row1 = i;
+   }
+
+   if (nthreads == 1) {
+      host_rows(&chunk[0]);
+   }
+   else {
+      for (t=0; t<nthreads; ++t) {
+         if (pthread_create(&threads[t], NULL, host_rows, &chunk[t]) != 0) {
+            host_rows(&chunk[t]);
+            threads[t] = pthread_self();
+         }
+      }
+      for (t=0; t<nthreads; ++t) {
+         if (!pthread_equal(threads[t], pthread_self())) pthread_join(threads[t], NULL);
+      }
+   }
+
+   if (hs->symmetric) {
+      for (i=0; i<hs->nrows; ++i) {
+         for (j=hs->row_index[i]; j<hs->row_index[i+1]; ++j) {
+            unsigned int col = hs->x_index[j];
+            unsigned int out;
+            if (col == i) continue;
+            out = ((hs->row_map != NULL) ? hs->row_map[col] : col) * hs->nvec;
+            for (v=0; v<hs->nvec; ++v) {
+               hs->output[out + v] += (double) hs->data[j] * (double) hs->input[i * hs->nvec + v];
+            }
+         }
+      }
+   }
+}
+
+/* Median time of "runs" products, after one untimed product to warm the caches. */
+double host_spmv_time(host_spmv_struct *hs, unsigned int runs)
+{
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+   double *times, t;
+   unsigned int r;
+
+   if (runs == 0) runs = 1;
+   MEMORY_ALLOC_CHECK(times, (runs * sizeof(double)), "host times")
+   host_spmv(hs);
+   for (r=0; r<runs; ++r) {
+      double t0 = seconds_now();
+      host_spmv(hs);
+      times[r] = seconds_now() - t0;
+   }
+   qsort(times, runs, sizeof(double), compare_double);
+   t = (runs & 1) ? times[runs / 2] : 0.5 * (times[runs / 2 - 1] + times[runs / 2]);
+   free(times);
+   return t;
+}
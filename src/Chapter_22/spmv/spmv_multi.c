@@ -0,0 +1,186 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <time.h>
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Row-partitioned SpMV on several devices at once (--multi, --fission).             */
+/*                                                                                   */
+/* The slabs are split into one run of consecutive slabs per device, with the cuts   */
+/* placed to balance nonzeros.  Each device gets its own matrix buffer, built like a */
+/* streaming chunk (see chunk_header() in spmv_stream.c) but with the output indices */
+/* rebased too, so it writes a private output buffer covering just its rows.  The    */
+/* input vector buffer is shared.  The kernels run concurrently on one queue per     */
+/* device; afterwards the output regions are read back and gathered into the one    */
+/* output buffer the rest of spmv.c uses.                                            */
+/* ================================================================================= */
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+   return (x > y) - (x < y);
+}
+
+static double median(double *v, unsigned int n)
+{
+   qsort(v, n, sizeof(double), compare_double);
+   return (n & 1) ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+static unsigned int slab_nonzeros(const multi_struct *ms, unsigned int s)
+{
+   return ms->row_index_array[ms->slab_startrow[s]] - ms->row_index_array[ms->slab_startrow[0]];
+}
+
+int spmv_multi(multi_struct *ms, cl_event *done)
+{
+   cl_int rc;
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+   unsigned int ndevices = ms->ndevices;
+   unsigned int total = slab_nonzeros(ms, ms->nslabs);
+   unsigned int *first;
+   cl_command_queue *queue;
+   cl_mem *matbuf, *outbuf;
+   cl_event *computed;
+   double *kernel_times, *wall_times;
+   slab_header *staging;
+   char *gathered;
+   size_t global_work_size[3];
+   unsigned int d, k, it;
+
+   if (ndevices > ms->nslabs) ndevices = ms->nslabs;
+
+   /* Cut the slabs where the running nonzero count passes d/ndevices of the total. */
+   MEMORY_ALLOC_CHECK(first, ((ndevices + 1) * sizeof(unsigned int)), "multi first")
+   first[0] = 0;
+   for (d=1, k=0; d<ndevices; ++d) {
+      unsigned long long target = ((unsigned long long) total * d) / ndevices;
+      while (k < ms->nslabs && slab_nonzeros(ms, k) < target) ++k;
+      if (k <= first[d-1]) k = first[d-1] + 1;
+      if (k > ms->nslabs - (ndevices - d)) k = ms->nslabs - (ndevices - d);
+      first[d] = k;
+   }
+   first[ndevices] = ms->nslabs;
+
+   MEMORY_ALLOC_CHECK(queue, (ndevices * sizeof(cl_command_queue)), "multi queues")
+   MEMORY_ALLOC_CHECK(matbuf, (ndevices * sizeof(cl_mem)), "multi matrix buffers")
+   MEMORY_ALLOC_CHECK(outbuf, (ndevices * sizeof(cl_mem)), "multi output buffers")
+   MEMORY_ALLOC_CHECK(computed, (ndevices * sizeof(cl_event)), "multi events")
+   MEMORY_ALLOC_CHECK(kernel_times, ((ndevices * ms->iterations) * sizeof(double)), "multi kernel times")
+   MEMORY_ALLOC_CHECK(wall_times, (ms->iterations * sizeof(double)), "multi wall times")
+   MEMORY_ALLOC_CHECK(staging, ((ms->nslabs + 1) * sizeof(slab_header)), "multi header")
+
+   /* Load each device's share of the matrix. */
+   for (d=0; d<ndevices; ++d) {
+      unsigned int s0 = first[d], s1 = first[d+1];
+      unsigned int base = ms->matrix_header[s0].offset;
+      unsigned int rows = ms->matrix_header[s1].outindex - ms->matrix_header[s0].outindex;
+      unsigned int hp;
+
+      queue[d] = clCreateCommandQueue(ms->context, ms->devices[d], CL_QUEUE_PROFILING_ENABLE, &rc);
+      CHECK_RESULT("clCreateCommandQueue(multi)")
+      matbuf[d] = clCreateBuffer(ms->context, CL_MEM_READ_ONLY, chunk_bytes(ms->matrix_header, s0, s1), NULL, &rc);
+      CHECK_RESULT("clCreateBuffer(multi matrix)")
+      outbuf[d] = clCreateBuffer(ms->context, CL_MEM_READ_WRITE, (rows ? rows : 1) * ms->row_bytes, NULL, &rc);
+      CHECK_RESULT("clCreateBuffer(multi output)")
+
+      hp = chunk_header(ms->matrix_header, s0, s1, 1, staging);
+      rc = clEnqueueWriteBuffer(queue[d], matbuf[d], CL_TRUE, 0, (s1 - s0 + 1) * sizeof(slab_header), staging, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueWriteBuffer(multi header)")
+      rc = clEnqueueWriteBuffer(queue[d], matbuf[d], CL_TRUE, hp * sizeof(packet), (ms->matrix_header[s1].offset - base) * sizeof(packet),
+                                &ms->seg_workspace[base], 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueWriteBuffer(multi packets)")
+   }
+   for (k=0; k<ms->ndims; ++k) global_work_size[k] = ms->global_work_size[k];
+
+   /* Launch on every device, then wait for all of them. */
+   for (it=0; it<ms->iterations; ++it) {
+      double t0 = seconds_now();
+      for (d=0; d<ndevices; ++d) {
+         /* Kernel arguments are captured at enqueue time, so one kernel serves every device. */
+         rc = clSetKernelArg(ms->kernel, 1, sizeof(cl_mem), &outbuf[d]);
+         CHECK_RESULT("clSetKernelArg(multi 1)")
+         rc = clSetKernelArg(ms->kernel, 2, sizeof(cl_mem), &matbuf[d]);
+         CHECK_RESULT("clSetKernelArg(multi 2)")
+         global_work_size[ms->slab_dim] = first[d+1] - first[d];
+         rc = clEnqueueNDRangeKernel(queue[d], ms->kernel, ms->ndims, NULL, global_work_size, ms->local_work_size, 0, NULL, &computed[d]);
+         CHECK_RESULT("clEnqueueNDRangeKernel(multi)")
+         clFlush(queue[d]);
+      }
+      rc = clWaitForEvents(ndevices, computed);
+      CHECK_RESULT("clWaitForEvents(multi)")
+      wall_times[it] = seconds_now() - t0;
+      for (d=0; d<ndevices; ++d) {
+         cl_ulong start, end;
+         rc = clGetEventProfilingInfo(computed[d], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+         CHECK_RESULT("clGetEventProfilingInfo(multi start)")
+         rc = clGetEventProfilingInfo(computed[d], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+         CHECK_RESULT("clGetEventProfilingInfo(multi end)")
+         kernel_times[d * ms->iterations + it] = 1e-9 * (double) (end - start);
+         clReleaseEvent(computed[d]);
+      }
+   }
+
+   /* Gather the output regions, and hand them to the caller's output buffer. */
+   MEMORY_ALLOC_CHECK(gathered, ((ms->matrix_header[ms->nslabs].outindex + 1) * ms->row_bytes), "multi gathered output")
+   for (d=0; d<ndevices; ++d) {
+      unsigned int row0 = ms->matrix_header[first[d]].outindex;
+      unsigned int rows = ms->matrix_header[first[d+1]].outindex - row0;
+      if (rows == 0) continue;
+      rc = clEnqueueReadBuffer(queue[d], outbuf[d], CL_TRUE, 0, rows * ms->row_bytes, gathered + row0 * ms->row_bytes, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueReadBuffer(multi output)")
+   }
+   rc = clEnqueueWriteBuffer(ms->queue, ms->output_buffer, CL_TRUE, 0, ms->matrix_header[ms->nslabs].outindex * ms->row_bytes, gathered, 0, NULL, done);
+   CHECK_RESULT("clEnqueueWriteBuffer(multi gathered output)")
+
+   /* Per-device and overall timing. */
+   double slowest = 0.0, sum = 0.0;
+   printf("multi: %u devices, %u iterations\n", ndevices, ms->iterations);
+   for (d=0; d<ndevices; ++d) {
+      char name[256];
+      unsigned int nnz = slab_nonzeros(ms, first[d+1]) - slab_nonzeros(ms, first[d]);
+      double t = median(&kernel_times[d * ms->iterations], ms->iterations);
+      name[0] = '\0';
+      clGetDeviceInfo(ms->devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+      printf("   device %u (%s): slabs %u-%u, %u nonzeros (%.1f%%), kernel %.3f ms median, %.3f GFLOP/s\n",
+             d, name, first[d], first[d+1] - 1, nnz, (total ? 100.0 * nnz / total : 0.0), 1e3 * t, 2e-9 * nnz / t);
+      if (t > slowest) slowest = t;
+      sum += t;
+   }
+   double wall = median(wall_times, ms->iterations);
+   printf("   all devices: %.3f ms median per product, %.3f GFLOP/s, slowest/mean kernel time %.3f\n",
+          1e3 * wall, 2e-9 * total / wall, (sum > 0.0) ? slowest * ndevices / sum : 1.0);
+
+   for (d=0; d<ndevices; ++d) {
+      clReleaseMemObject(matbuf[d]);
+      clReleaseMemObject(outbuf[d]);
+      clReleaseCommandQueue(queue[d]);
+   }
+   free(gathered);
+   free(staging);
+   free(wall_times);
+   free(kernel_times);
+   free(computed);
+   free(outbuf);
+   free(matbuf);
+   free(queue);
+   free(first);
+   return 0;
+}
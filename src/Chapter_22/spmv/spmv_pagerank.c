@@ -0,0 +1,166 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <time.h>
+#include "spmv.h"
+
+/* ================================================================================= */
+/* PageRank by power iteration, with the column-normalized transition matrix P       */
+/* already tiled and resident in the SpMV kernel's matrix buffer (matrix_load()      */
+/* builds P when mgs->transition is set).                                            */
+/*                                                                                   */
+/* The rank vector x starts uniform, and each iteration runs the SpMV kernel         */
+/* (y = P x), then pagerank_sum and cg_reduce for sum(y), then pagerank_update,      */
+/* which applies the damping and the teleport in place and leaves partial sums of    */
+/* the L1 change, reduced by cg_reduce once more.  Only that one scalar is read      */
+/* back per iteration, for the convergence test.  As in spmv_cg.c, an in-order       */
+/* queue of our own orders the kernels, so no events are needed.                     */
+/* ================================================================================= */
+
+#define PR_SUM   0   /* scalar slots */
+#define PR_DELTA 1
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+int spmv_pagerank(pagerank_struct *ps, pagerank_result *result)
+{
+   cl_int rc;
+   cl_command_queue queue;
+   cl_kernel sum, update, reduce;
+   cl_mem x, y, partial, scalars;
+   real *init;
+   real delta, damping = (real) ps->damping;
+   double t0;
+   size_t length, wgsz, ngroups, global, kernel_wg_size;
+   cl_uint n = ps->n, npartial, slot;
+   unsigned int i, it;
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+
+   queue = clCreateCommandQueue(ps->context, ps->device, 0, &rc);
+   CHECK_RESULT("clCreateCommandQueue(pagerank)")
+   sum = clCreateKernel(ps->program, "pagerank_sum", &rc);
+   CHECK_RESULT("clCreateKernel(pagerank_sum)")
+   update = clCreateKernel(ps->program, "pagerank_update", &rc);
+   CHECK_RESULT("clCreateKernel(pagerank_update)")
+   reduce = clCreateKernel(ps->program, "cg_reduce", &rc);
+   CHECK_RESULT("clCreateKernel(cg_reduce)")
+
+   /* The reductions use power-of-2 work groups that the device accepts for every stage. */
+   cl_kernel reductions[3] = {sum, update, reduce};
+   wgsz = CG_WGSZ;
+   for (i=0; i<3; ++i) {
+      rc = clGetKernelWorkGroupInfo(reductions[i], ps->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_wg_size, NULL);
+      CHECK_RESULT("clGetKernelWorkGroupInfo(pagerank)")
+      while (wgsz > kernel_wg_size) wgsz /= 2;
+   }
+   ngroups = (ps->n + wgsz - 1) / wgsz;
+   if (ngroups > CG_MAX_GROUPS) ngroups = CG_MAX_GROUPS;
+   if (ngroups == 0) ngroups = 1;
+   global = wgsz * ngroups;
+   npartial = (cl_uint) ngroups;
+
+   /* x holds 1/n in its first n elements; the padding beyond n stays zero. */
+   length = ps->n;
+   if (length < ps->input_length) length = ps->input_length;
+   if (length < ps->output_length) length = ps->output_length;
+   MEMORY_ALLOC_CHECK(init, (length * sizeof(real)), "pagerank init")
+   memset(init, 0, length * sizeof(real));
+   y = clCreateBuffer(ps->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, length * sizeof(real), init, &rc);
+   CHECK_RESULT("clCreateBuffer(pagerank y)")
+   for (i=0; i<ps->n; ++i) init[i] = (real) 1 / (real) ps->n;
+   x = clCreateBuffer(ps->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, length * sizeof(real), init, &rc);
+   CHECK_RESULT("clCreateBuffer(pagerank x)")
+   free(init);
+   partial = clCreateBuffer(ps->context, CL_MEM_READ_WRITE, CG_MAX_GROUPS * sizeof(real), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(pagerank partial)")
+   scalars = clCreateBuffer(ps->context, CL_MEM_READ_WRITE, 2 * sizeof(real), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(pagerank scalars)")
+
+   /* Arguments that do not change from one iteration to the next: x is updated in place. */
+   rc  = clSetKernelArg(sum, 0, sizeof(cl_mem), &y);
+   rc |= clSetKernelArg(sum, 1, sizeof(cl_mem), &partial);
+   rc |= clSetKernelArg(sum, 2, wgsz * sizeof(real), NULL);
+   rc |= clSetKernelArg(sum, 3, sizeof(cl_uint), &n);
+   rc |= clSetKernelArg(update, 0, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(update, 1, sizeof(cl_mem), &y);
+   rc |= clSetKernelArg(update, 2, sizeof(cl_mem), &scalars);
+   rc |= clSetKernelArg(update, 3, sizeof(cl_mem), &partial);
+   rc |= clSetKernelArg(update, 4, wgsz * sizeof(real), NULL);
+   rc |= clSetKernelArg(update, 5, sizeof(real), &damping);
+   rc |= clSetKernelArg(update, 6, sizeof(cl_uint), &n);
+   rc |= clSetKernelArg(reduce, 0, sizeof(cl_mem), &partial);
+   rc |= clSetKernelArg(reduce, 1, sizeof(cl_mem), &scalars);
+   rc |= clSetKernelArg(reduce, 2, wgsz * sizeof(real), NULL);
+   rc |= clSetKernelArg(reduce, 3, sizeof(cl_uint), &npartial);
+   rc |= clSetKernelArg(ps->spmv_kernel, 0, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(ps->spmv_kernel, 1, sizeof(cl_mem), &y);
+   CHECK_RESULT("clSetKernelArg(pagerank)")
+
+   result->delta = 1.0;
+   result->converged = 0;
+   t0 = seconds_now();
+   for (it = 0; it < ps->max_iterations && !result->converged; ++it) {
+      /* y = P x */
+      rc = clEnqueueNDRangeKernel(queue, ps->spmv_kernel, ps->ndims, NULL, ps->global_work_size, ps->local_work_size, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(pagerank spmv)")
+
+      /* scalars[PR_SUM] = sum(y) */
+      rc = clEnqueueNDRangeKernel(queue, sum, 1, NULL, &global, &wgsz, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(pagerank_sum)")
+      slot = PR_SUM;
+      rc = clSetKernelArg(reduce, 4, sizeof(cl_uint), &slot);
+      CHECK_RESULT("clSetKernelArg(cg_reduce, 4)")
+      rc = clEnqueueNDRangeKernel(queue, reduce, 1, NULL, &wgsz, &wgsz, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(cg_reduce)")
+
+      /* x = damping y + (1 - damping sum(y)) / n;  scalars[PR_DELTA] = |x_new - x| */
+      rc = clEnqueueNDRangeKernel(queue, update, 1, NULL, &global, &wgsz, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(pagerank_update)")
+      slot = PR_DELTA;
+      rc = clSetKernelArg(reduce, 4, sizeof(cl_uint), &slot);
+      CHECK_RESULT("clSetKernelArg(cg_reduce, 4)")
+      rc = clEnqueueNDRangeKernel(queue, reduce, 1, NULL, &wgsz, &wgsz, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(cg_reduce)")
+
+      /* The one value read back each iteration. */
+      rc = clEnqueueReadBuffer(queue, scalars, CL_TRUE, PR_DELTA * sizeof(real), sizeof(real), &delta, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueReadBuffer(pagerank delta)")
+      result->delta = (double) delta;
+      result->converged = (result->delta <= ps->tolerance);
+   }
+   result->seconds = seconds_now() - t0;
+   result->iterations = it;
+
+   rc = clEnqueueReadBuffer(queue, x, CL_TRUE, 0, ps->n * sizeof(real), ps->rank, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueReadBuffer(pagerank x)")
+
+   printf("pagerank: %s after %u iterations (damping %.3f), L1 change %le\n",
+          (result->converged ? "converged" : "stopped"), result->iterations, ps->damping, result->delta);
+   printf("    %.3f ms per iteration (%.3f s total)\n",
+          (result->iterations ? 1e3 * result->seconds / result->iterations : 0.0), result->seconds);
+
+   cl_mem release[4] = {x, y, partial, scalars};
+   for (i=0; i<4; ++i) {
+      rc = clReleaseMemObject(release[i]);
+      CHECK_RESULT("clReleaseMemObject(pagerank)")
+   }
+   clReleaseKernel(sum);
+   clReleaseKernel(update);
+   clReleaseKernel(reduce);
+   rc = clReleaseCommandQueue(queue);
+   CHECK_RESULT("clReleaseCommandQueue(pagerank)")
+   return 0;
+}
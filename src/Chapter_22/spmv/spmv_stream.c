@@ -0,0 +1,170 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include <time.h>
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Out-of-core SpMV for tiled matrices that do not fit in one device allocation.     */
+/*                                                                                   */
+/* Consecutive slabs are grouped into "chunks" whose packets fit within a byte       */
+/* budget.  Each chunk is uploaded into one of two ping-pong matrix buffers with a   */
+/* header of its own, in which the slab offsets are rebased to the chunk; the        */
+/* "outindex" fields are left alone, so every chunk writes straight into the full    */
+/* output vector.  Uploads go through a second queue, so chunk N+1 is transferred    */
+/* while chunk N computes.  The packets are written directly from seg_workspace;     */
+/* only the small chunk headers are staged.                                          */
+/* ================================================================================= */
+
+#define STREAM_SLACK_PACKETS 32   /* matches the read-past-end room matrix_gen leaves */
+
+static double seconds_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+/* Header packets for a chunk of n slabs (same rounding as matrix_gen). */
+static unsigned int header_packets(unsigned int n)
+{
+   return (3 * 4 * (n + 1)) / sizeof(packet) + 1;
+}
+
+/* Build the header of a buffer holding slabs s0 to s1-1 alone: the slab offsets are rebased to the */
+/* chunk, and with "output_base" set, so are the output indices.  Returns the packets it occupies,  */
+/* which is where the chunk's packets (from seg_workspace[matrix_header[s0].offset]) must follow.   */
+unsigned int chunk_header(const slab_header *matrix_header, unsigned int s0, unsigned int s1, int output_base, slab_header *chunk)
+{
+   unsigned int hp = header_packets(s1 - s0);
+   unsigned int base = matrix_header[s0].offset;
+   unsigned int outbase = output_base ? matrix_header[s0].outindex : 0;
+   unsigned int k;
+
+   for (k=0; k<=s1-s0; ++k) {
+      chunk[k].offset = matrix_header[s0 + k].offset - base + hp;
+      chunk[k].outindex = matrix_header[s0 + k].outindex - outbase;
+      chunk[k].outspan = matrix_header[s0 + k].outspan;
+   }
+   return hp;
+}
+
+size_t chunk_bytes(const slab_header *matrix_header, unsigned int s0, unsigned int s1)
+{
+   return sizeof(packet) * ((size_t) header_packets(s1 - s0) + (matrix_header[s1].offset - matrix_header[s0].offset) + STREAM_SLACK_PACKETS);
+}
+
+int spmv_stream(stream_struct *ss, cl_event *done)
+{
+   cl_int rc;
+   cl_command_queue compute_queue, upload_queue;
+   cl_mem matbuf[2];
+   slab_header *staging[2];
+   cl_event uploaded[2] = {NULL, NULL};
+   cl_event computed[2] = {NULL, NULL};
+   unsigned int *chunk_start;
+   unsigned int nchunks, c, s0, s1, k;
+   size_t max_bytes, total_bytes;
+   size_t global_work_size[3];
+   unsigned int preferred_alignment = 64; /* used by "MEMORY_ALLOC_CHECK" macro */
+   double t0;
+
+   /* Group the slabs into chunks, greedily. */
+   MEMORY_ALLOC_CHECK(chunk_start, ((ss->nslabs + 1) * sizeof(unsigned int)), "chunk_start")
+   nchunks = 0;
+   max_bytes = 0;
+   s0 = 0;
+   while (s0 < ss->nslabs) {
+      s1 = s0 + 1;
+      if (chunk_bytes(ss->matrix_header, s0, s1) > ss->budget) {
+         printf("stream: slab %u alone needs %llu bytes, more than the %llu byte budget\n",
+                s0, (unsigned long long) chunk_bytes(ss->matrix_header, s0, s1), (unsigned long long) ss->budget);
+         free(chunk_start);
+         return -1;
+      }
+      while (s1 < ss->nslabs && chunk_bytes(ss->matrix_header, s0, s1 + 1) <= ss->budget) ++s1;
+      if (chunk_bytes(ss->matrix_header, s0, s1) > max_bytes) max_bytes = chunk_bytes(ss->matrix_header, s0, s1);
+      chunk_start[nchunks++] = s0;
+      s0 = s1;
+   }
+   chunk_start[nchunks] = ss->nslabs;
+
+   compute_queue = clCreateCommandQueue(ss->context, ss->device, 0, &rc);
+   CHECK_RESULT("clCreateCommandQueue(stream compute)")
+   upload_queue = clCreateCommandQueue(ss->context, ss->device, 0, &rc);
+   CHECK_RESULT("clCreateCommandQueue(stream upload)")
+   for (k=0; k<2; ++k) {
+      matbuf[k] = clCreateBuffer(ss->context, CL_MEM_READ_ONLY, max_bytes, NULL, &rc);
+      CHECK_RESULT("clCreateBuffer(stream matrix)")
+      MEMORY_ALLOC_CHECK(staging[k], (header_packets(ss->nslabs) * sizeof(packet)), "stream header")
+   }
+   for (k=0; k<ss->ndims; ++k) global_work_size[k] = ss->global_work_size[k];
+
+   t0 = seconds_now();
+   total_bytes = 0;
+   for (c=0; c<nchunks; ++c) {
+      unsigned int slot = c & 1;
+      unsigned int n;
+      unsigned int hp;
+      unsigned int base;
+      cl_event header_written;
+      s0 = chunk_start[c];
+      s1 = chunk_start[c+1];
+      n = s1 - s0;
+      base = ss->matrix_header[s0].offset;
+
+      /* The staging header and matrix buffer of this slot were last used two chunks ago. */
+      if (uploaded[slot]) {
+         clWaitForEvents(1, &uploaded[slot]);
+         clReleaseEvent(uploaded[slot]);
+      }
+      hp = chunk_header(ss->matrix_header, s0, s1, 0, staging[slot]);
+
+      rc = clEnqueueWriteBuffer(upload_queue, matbuf[slot], CL_FALSE, 0, (n + 1) * sizeof(slab_header), staging[slot],
+                                (computed[slot] ? 1 : 0), (computed[slot] ? &computed[slot] : NULL), &header_written);
+      CHECK_RESULT("clEnqueueWriteBuffer(stream header)")
+      rc = clEnqueueWriteBuffer(upload_queue, matbuf[slot], CL_FALSE, hp * sizeof(packet), (ss->matrix_header[s1].offset - base) * sizeof(packet),
+                                &ss->seg_workspace[base], 0, NULL, &uploaded[slot]);
+      CHECK_RESULT("clEnqueueWriteBuffer(stream packets)")
+      clReleaseEvent(header_written);
+      clFlush(upload_queue);
+      total_bytes += (n + 1) * sizeof(slab_header) + (ss->matrix_header[s1].offset - base) * sizeof(packet);
+
+      /* Kernel arguments are captured at enqueue time, so the matrix buffer can change per chunk. */
+      rc = clSetKernelArg(ss->kernel, 2, sizeof(cl_mem), &matbuf[slot]);
+      CHECK_RESULT("clSetKernelArg(stream 2)")
+      global_work_size[ss->slab_dim] = n;
+      if (computed[slot]) clReleaseEvent(computed[slot]);
+      rc = clEnqueueNDRangeKernel(compute_queue, ss->kernel, ss->ndims, NULL, global_work_size, ss->local_work_size, 1, &uploaded[slot], &computed[slot]);
+      CHECK_RESULT("clEnqueueNDRangeKernel(stream)")
+      clFlush(compute_queue);
+   }
+
+   rc = clFinish(compute_queue);
+   CHECK_RESULT("clFinish(stream)")
+   t0 = seconds_now() - t0;
+   printf("streamed %u chunks (buffers of %.1f MB, budget %.1f MB): %.3f s, %.2f GB/s uploaded\n",
+          nchunks, 1e-6 * max_bytes, 1e-6 * ss->budget, t0, 1e-9 * total_bytes / t0);
+
+   /* Hand back the last kernel's event, so the caller can wait on it like a single launch. */
+   *done = computed[(nchunks - 1) & 1];
+   computed[(nchunks - 1) & 1] = NULL;
+   for (k=0; k<2; ++k) {
+      if (computed[k]) clReleaseEvent(computed[k]);
+      if (uploaded[k]) clReleaseEvent(uploaded[k]);
+      clReleaseMemObject(matbuf[k]);
+      free(staging[k]);
+   }
+   clReleaseCommandQueue(upload_queue);
+   clReleaseCommandQueue(compute_queue);
+   free(chunk_start);
+   return 0;
+}
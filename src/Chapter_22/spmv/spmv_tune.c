@@ -0,0 +1,279 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Auto-tuner for the tiling parameters that matrix_gen otherwise derives from fixed */
+/* rules.  Each candidate re-tiles the already loaded CSR matrix (matrix_tile), is   */
+/* uploaded, and is timed with spmv_bench; the fastest median wins.                  */
+/*                                                                                   */
+/* The space swept depends on the kernel and device:                                 */
+/*    LS, GPU:          work group size (= slab height), 16 up to the kernel limit   */
+/*    LS, CPU/ACCEL:    slabs per compute unit, 1 to 16                              */
+/*    AWGC:             column_span at 1, 1/2, 1/4 of the rule, times segcachesize   */
+/*                      at 1, 2, 4 times the rule (all fit in local memory)          */
+/* The GPU team size stays 16, the width of a packet, and the CPU work group size    */
+/* stays CPU_WGSZ: work units on a CPU share their slab's local output buffer, so    */
+/* more than one would race.                                                         */
+/*                                                                                   */
+/* Results are kept in a text database, one line per tuning:                         */
+/*    <matrix hash> <kernel type> <column_span> <segcachesize> <slab_factor> <wgsz>  */
+/*    <median seconds> <device name>                                                 */
+/* The last line matching the device, matrix and kernel wins.                        */
+/* ================================================================================= */
+
+#define TUNE_MAX_CANDIDATES 16
+#define TUNE_NO_FIT        -1.0   /* time_candidate(): the tiling needs more local memory than the device has */
+#define TUNE_TILE_FAILED   -2.0   /* time_candidate(): matrix_tile() could not tile the matrix this way */
+
+/* FNV-1a over the CSR arrays, so the hash follows the matrix contents rather than the file. */
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t len)
+{
+   const unsigned char *p = (const unsigned char *) data;
+   size_t i;
+   for (i=0; i<len; ++i) {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+unsigned long long matrix_hash(matrix_gen_struct *mgs)
+{
+   unsigned long long h = 14695981039346656037ULL;
+   h = fnv1a(h, mgs->nx, sizeof(unsigned int));
+   h = fnv1a(h, mgs->ny, sizeof(unsigned int));
+   h = fnv1a(h, *(mgs->row_index_array), (*(mgs->ny) + 1) * sizeof(unsigned int));
+   h = fnv1a(h, *(mgs->x_index_array), *(mgs->non_zero) * sizeof(unsigned int));
+   h = fnv1a(h, *(mgs->data_array), *(mgs->non_zero) * sizeof(real));
+   return h;
+}
+
+int tune_db_load(const char *path, const char *device_name, unsigned long long hash, unsigned int kernel_type, tune_params *params)
+{
+   FILE *fp;
+   char line[1024];
+   int found = 0;
+
+   fp = fopen(path, "r");
+   if (fp == NULL) return 0;
+   while (fgets(line, sizeof(line), fp)) {
+      unsigned long long h;
+      unsigned int kt;
+      tune_params p;
+      double seconds;
+      int name_pos = 0;
+      if (sscanf(line, "%llx %u %u %u %u %d %lf %n", &h, &kt, &p.column_span, &p.segcachesize, &p.slab_factor, &p.wgsz, &seconds, &name_pos) < 7 || name_pos == 0) continue;
+      line[strcspn(line, "\n")] = '\0';
+      if (h == hash && kt == kernel_type && strcmp(&line[name_pos], device_name) == 0) {
+         *params = p;
+         found = 1;
+      }
+   }
+   fclose(fp);
+   return found;
+}
+
+int tune_db_store(const char *path, const char *device_name, unsigned long long hash, unsigned int kernel_type, const tune_params *params, double seconds)
+{
+   FILE *fp;
+
+   fp = fopen(path, "a");
+   if (fp == NULL) {
+      printf("unable to write tuning database %s\n", path);
+      return -1;
+   }
+   fprintf(fp, "%016llx %u %u %u %u %d %.9f %s\n", hash, kernel_type, params->column_span, params->segcachesize,
+           params->slab_factor, params->wgsz, seconds, device_name);
+   fclose(fp);
+   return 0;
+}
+
+static unsigned int round_pow2(unsigned int v)
+{
+   while (v & (v - 1)) ++v;
+   return v;
+}
+
+/* Tile, upload and time one candidate.  Returns the median kernel time, TUNE_NO_FIT or TUNE_TILE_FAILED. */
+static double time_candidate(tune_struct *ts, cl_command_queue queue, const tune_params *cand, char *label)
+{
+   cl_int rc;
+   matrix_gen_struct *mgs = ts->mgs;
+   cl_mem input_buffer, output_buffer, matrix_buffer;
+   real *ones;
+   size_t global_work_size[2], local_work_size[2];
+   cl_uint ndims, team_size;
+   unsigned int i, output_length;
+   unsigned long long local_bytes;
+   bench_struct bs;
+   bench_result br;
+   unsigned int preferred_alignment = mgs->preferred_alignment; /* used by "MEMORY_ALLOC_CHECK" macro */
+
+   /* cand lives in spmv_tune()'s frame, so it must not stay in mgs->tune either way. */
+   mgs->tune = cand;
+   rc = matrix_tile(mgs);
+   mgs->tune = NULL;
+   if (rc != 0) return TUNE_TILE_FAILED;
+
+   if (*(mgs->kernel_type) == KERNEL_AWGC) {
+      local_bytes = 2ULL * *(mgs->column_span) * sizeof(real) + *(mgs->max_slabheight) * sizeof(real) + *(mgs->segcachesize) * sizeof(packet);
+   }
+   else {
+      local_bytes = *(mgs->max_slabheight) * sizeof(real);
+   }
+   if (local_bytes > mgs->local_mem_size) {
+      free(*(mgs->slab_startrow));
+      free(*(mgs->seg_workspace));
+      return TUNE_NO_FIT;
+   }
+
+   MEMORY_ALLOC_CHECK(ones, (*(mgs->nx_pad) * sizeof(real)), "tune input")
+   for (i=0; i<*(mgs->nx_pad); ++i) ones[i] = (i < *(mgs->nx)) ? (real) 1 : (real) 0;
+   output_length = (*(mgs->slab_startrow))[*(mgs->nslabs_round)] - (*(mgs->slab_startrow))[0];
+
+   input_buffer = clCreateBuffer(ts->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, *(mgs->nx_pad) * sizeof(real), ones, &rc);
+   CHECK_RESULT("clCreateBuffer(tune input)")
+   output_buffer = clCreateBuffer(ts->context, CL_MEM_WRITE_ONLY, output_length * sizeof(real), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(tune output)")
+   matrix_buffer = clCreateBuffer(ts->context, CL_MEM_READ_ONLY, *(mgs->memsize), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(tune matrix)")
+   rc = clEnqueueWriteBuffer(queue, matrix_buffer, CL_TRUE, 0, *(mgs->datasize), *(mgs->seg_workspace), 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueWriteBuffer(tune matrix)")
+   free(ones);
+
+   /* Work sizes and arguments follow the same rules as spmv.c. */
+   rc  = clSetKernelArg(ts->kernel, 0, sizeof(cl_mem), &input_buffer);
+   rc |= clSetKernelArg(ts->kernel, 1, sizeof(cl_mem), &output_buffer);
+   rc |= clSetKernelArg(ts->kernel, 2, sizeof(cl_mem), &matrix_buffer);
+   rc |= clSetKernelArg(ts->kernel, 3, sizeof(cl_uint), mgs->column_span);
+   rc |= clSetKernelArg(ts->kernel, 4, sizeof(cl_uint), mgs->max_slabheight);
+   if (*(mgs->kernel_type) == KERNEL_AWGC) {
+      ndims = 1;
+      global_work_size[0] = *(mgs->nslabs_round);
+      local_work_size[0] = 1;
+      rc |= clSetKernelArg(ts->kernel, 5, sizeof(cl_uint), mgs->segcachesize);
+      rc |= clSetKernelArg(ts->kernel, 6, sizeof(cl_uint), mgs->num_header_packets);
+      rc |= clSetKernelArg(ts->kernel, 7, (size_t) (2 * *(mgs->column_span) * sizeof(real)), NULL);
+      rc |= clSetKernelArg(ts->kernel, 8, (size_t) (*(mgs->max_slabheight) * sizeof(real)), NULL);
+      rc |= clSetKernelArg(ts->kernel, 9, (size_t) (*(mgs->segcachesize) * sizeof(packet)), NULL);
+   }
+   else {
+      ndims = 2;
+      team_size = (mgs->device_type == CL_DEVICE_TYPE_GPU) ? 16 : 1;
+      global_work_size[1] = *(mgs->nslabs_round);
+      local_work_size[1] = 1;
+      global_work_size[0] = local_work_size[0] = (mgs->device_type == CL_DEVICE_TYPE_GPU) ? (size_t) *(mgs->gpu_wgsz) : CPU_WGSZ;
+      rc |= clSetKernelArg(ts->kernel, 5, sizeof(cl_uint), &team_size);
+      rc |= clSetKernelArg(ts->kernel, 6, sizeof(cl_uint), mgs->num_header_packets);
+      rc |= clSetKernelArg(ts->kernel, 7, (size_t) (*(mgs->max_slabheight) * sizeof(real)), NULL);
+   }
+   CHECK_RESULT("clSetKernelArg(tune)")
+
+   bs.queue = queue;
+   bs.kernel = ts->kernel;
+   bs.clear = NULL;
+   bs.ndims = ndims;
+   bs.global_work_size = global_work_size;
+   bs.local_work_size = local_work_size;
+   bs.warmup = 2;
+   bs.iterations = TUNE_ITERATIONS;
+   bs.flops = 2.0 * (double) *(mgs->non_zero);
+   bs.bytes = (double) *(mgs->datasize);
+   bs.label = label;
+   spmv_bench(&bs, &br);
+
+   clReleaseMemObject(input_buffer);
+   clReleaseMemObject(output_buffer);
+   clReleaseMemObject(matrix_buffer);
+   free(*(mgs->slab_startrow));
+   free(*(mgs->seg_workspace));
+   return br.median;
+}
+
+int spmv_tune(tune_struct *ts, tune_params *best)
+{
+   cl_int rc;
+   cl_command_queue queue;
+   matrix_gen_struct *mgs = ts->mgs;
+   tune_params cand[TUNE_MAX_CANDIDATES];
+   unsigned int ncand = 0;
+   unsigned int i, j;
+   double best_time = -1.0;
+   char label[128];
+   int saved_wgsz = *(mgs->gpu_wgsz);  /* matrix_tile adjusts it for every candidate */
+
+   /* Enumerate the candidates. */
+   memset(cand, 0, sizeof(cand));
+   if (*(mgs->kernel_type) == KERNEL_AWGC) {
+      unsigned int span_rule = round_pow2(mgs->local_mem_size / 64);
+      unsigned int seg_rule = round_pow2(mgs->local_mem_size / 8192);
+      if (span_rule == 0) span_rule = 1;
+      if (seg_rule == 0) seg_rule = 1;
+      for (i=0; i<3; ++i) {
+         for (j=0; j<3; ++j) {
+            if ((span_rule >> i) < 8) continue;  /* the kernel copies the input in float8 pieces */
+            cand[ncand].column_span = span_rule >> i;
+            cand[ncand].segcachesize = seg_rule << j;
+            ++ncand;
+         }
+      }
+   }
+   else if (*(mgs->kernel_type) == KERNEL_LS && mgs->device_type == CL_DEVICE_TYPE_GPU) {
+      int wgsz;
+      for (wgsz = 16; wgsz <= MAX_WGSZ && (size_t) wgsz <= mgs->kernel_wg_size && ncand < TUNE_MAX_CANDIDATES; wgsz *= 2) {
+         cand[ncand++].wgsz = wgsz;
+      }
+   }
+   else if (*(mgs->kernel_type) == KERNEL_LS) {
+      for (i=1; i<=16; i*=2) {
+         cand[ncand++].slab_factor = i;
+      }
+   }
+   else {
+      printf("tune: the %s kernel has no tiling parameters to tune\n", (*(mgs->kernel_type) == KERNEL_SELL) ? "sell" : "selected");
+      return -1;
+   }
+
+   queue = clCreateCommandQueue(ts->context, ts->device, CL_QUEUE_PROFILING_ENABLE, &rc);
+   CHECK_RESULT("clCreateCommandQueue(tune)")
+
+   for (i=0; i<ncand; ++i) {
+      double t;
+      sprintf(label, "tune column_span=%u segcachesize=%u slab_factor=%u wgsz=%d",
+              cand[i].column_span, cand[i].segcachesize, cand[i].slab_factor, cand[i].wgsz);
+      t = time_candidate(ts, queue, &cand[i], label);
+      if (t == TUNE_TILE_FAILED) {
+         printf("%s: tiling failed, skipped\n", label);
+         continue;
+      }
+      if (t == TUNE_NO_FIT) {
+         printf("%s: does not fit in local memory, skipped\n", label);
+         continue;
+      }
+      if (best_time < 0.0 || t < best_time) {
+         best_time = t;
+         *best = cand[i];
+      }
+   }
+   clReleaseCommandQueue(queue);
+   *(mgs->gpu_wgsz) = saved_wgsz;
+
+   if (best_time < 0.0) {
+      printf("tune: no candidate could be tiled and fit on this device\n");
+      return -1;
+   }
+   printf("tune: best is column_span=%u segcachesize=%u slab_factor=%u wgsz=%d at %.3f ms (median)\n",
+          best->column_span, best->segcachesize, best->slab_factor, best->wgsz, 1e3 * best_time);
+   ts->best_seconds = best_time;
+   return 0;
+}